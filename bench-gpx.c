@@ -0,0 +1,240 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures how long it takes to load a large synthetic GPX file,
+ * both when it has to be parsed and when the points are in the
+ * cache.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "flt-gpx.h"
+#include "flt-util.h"
+
+#define DEFAULT_N_POINTS 1000000
+
+struct config {
+        int n_points;
+        int n_runs;
+};
+
+static bool
+parse_positive_int(const char *str, int *value_out)
+{
+        errno = 0;
+
+        char *tail;
+
+        long value = strtol(str, &tail, 10);
+
+        if (value <= 0 || value > INT_MAX || errno || *tail)
+                return false;
+
+        *value_out = value;
+
+        return true;
+}
+
+static bool
+process_options(int argc, char **argv, struct config *config)
+{
+        config->n_points = DEFAULT_N_POINTS;
+        config->n_runs = 3;
+
+        while (true) {
+                switch (getopt(argc, argv, "-n:r:")) {
+                case 'n':
+                        if (!parse_positive_int(optarg, &config->n_points)) {
+                                fprintf(stderr,
+                                        "invalid number of points: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'r':
+                        if (!parse_positive_int(optarg, &config->n_runs)) {
+                                fprintf(stderr,
+                                        "invalid number of runs: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case -1:
+                        return true;
+
+                default:
+                        fprintf(stderr,
+                                "usage: bench-gpx [-n <points>] "
+                                "[-r <runs>]\n");
+                        return false;
+                }
+        }
+}
+
+static bool
+write_gpx(FILE *out, int n_points)
+{
+        /* Start at 2022-08-11T14:54:00Z */
+        time_t start_time = 1660229640;
+
+        fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+              "<gpx version=\"1.1\" creator=\"bench-gpx\" "
+              "xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+              " <trk>\n"
+              "  <trkseg>\n",
+              out);
+
+        for (int i = 0; i < n_points; i++) {
+                time_t t = start_time + i;
+                struct tm *tm = gmtime(&t);
+
+                fprintf(out,
+                        "   <trkpt lat=\"%.7f\" lon=\"%.7f\">\n"
+                        "    <ele>%.1f</ele>\n"
+                        "    <time>%04i-%02i-%02iT%02i:%02i:%02iZ</time>\n"
+                        "    <speed>%.3f</speed>\n"
+                        "   </trkpt>\n",
+                        45.7 + i * 1e-6,
+                        4.8 + (i % 1000) * 1e-5,
+                        170.0 + (i % 200) / 10.0,
+                        tm->tm_year + 1900,
+                        tm->tm_mon + 1,
+                        tm->tm_mday,
+                        tm->tm_hour,
+                        tm->tm_min,
+                        tm->tm_sec,
+                        (i % 100) / 10.0);
+        }
+
+        fputs("  </trkseg>\n"
+              " </trk>\n"
+              "</gpx>\n",
+              out);
+
+        return !ferror(out);
+}
+
+static double
+get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool
+time_load(const char *filename, double *time_out)
+{
+        struct flt_error *error = NULL;
+        const struct flt_gpx_point *points;
+        size_t n_points;
+
+        double start = get_time();
+
+        if (!flt_gpx_parse(filename, &points, &n_points, &error)) {
+                fprintf(stderr, "%s\n", error->message);
+                flt_error_free(error);
+                return false;
+        }
+
+        *time_out = get_time() - start;
+
+        flt_gpx_free_points(points);
+
+        return true;
+}
+
+static bool
+run_benchmark(const struct config *config,
+              const char *filename,
+              const char *cache_filename)
+{
+        double parse_time = 0.0, cached_time = 0.0;
+
+        for (int i = 0; i < config->n_runs; i++) {
+                double t;
+
+                unlink(cache_filename);
+
+                if (!time_load(filename, &t))
+                        return false;
+
+                parse_time += t;
+
+                if (!time_load(filename, &t))
+                        return false;
+
+                cached_time += t;
+        }
+
+        printf("points: %i\n"
+               "parse: %.3f ms\n"
+               "cached: %.3f ms\n",
+               config->n_points,
+               parse_time * 1000.0 / config->n_runs,
+               cached_time * 1000.0 / config->n_runs);
+
+        return true;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct config config;
+
+        if (!process_options(argc, argv, &config))
+                return EXIT_FAILURE;
+
+        char filename[] = "/tmp/bench-gpx-XXXXXX.gpx";
+        int fd = mkstemps(filename, 4 /* suffixlen */);
+
+        if (fd == -1) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                return EXIT_FAILURE;
+        }
+
+        FILE *out = fdopen(fd, "w");
+        bool ret = write_gpx(out, config.n_points);
+
+        if (fclose(out) == EOF || !ret) {
+                fprintf(stderr, "error writing %s\n", filename);
+                unlink(filename);
+                return EXIT_FAILURE;
+        }
+
+        char *cache_filename = flt_strconcat(filename, ".flt-cache", NULL);
+
+        ret = run_benchmark(&config, filename, cache_filename);
+
+        unlink(cache_filename);
+        unlink(filename);
+        flt_free(cache_filename);
+
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
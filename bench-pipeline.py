@@ -0,0 +1,457 @@
+#!/usr/bin/python3
+
+# Flootay – a video overlay generator
+# Copyright (C) 2022  Neil Roberts
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Builds a reference project of synthetic clips, GPX traces and
+# commentary and times each stage of making a film from it with
+# speedy. The report can be saved as JSON and compared with a
+# previous run.
+
+import datetime
+import getopt
+import json
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+SOURCE_DIR = os.path.dirname(os.path.abspath(sys.argv[0]))
+SPEEDY = os.path.join(SOURCE_DIR, "speedy.py")
+RUN_FFMPEG = os.path.join(SOURCE_DIR, "build", "run-ffmpeg")
+
+SCRIPT_FILENAME = "bench.script"
+BUILD_FILENAME = "build.sh"
+STATS_FILENAME = "pipe-stats.txt"
+# The film is kept out of the way of speedy which looks at every MP4
+# in the directory
+OUTPUT_FILENAME = os.path.join("output", "bench.mp4")
+PROBE_CACHE_FILENAME = ".flootay-probe"
+
+FPS = 30
+WIDTH = 1920
+HEIGHT = 1080
+COMMENTARY_LENGTH = 3
+# Bytes per second of the s24le stereo sound from generate-sound
+SOUND_BYTES_PER_SECOND = 48000 * 2 * 3
+# Bytes per pixel of the pixel formats that flootay can write
+PIXEL_FORMAT_SIZES = {"yuva420p": 2.5, "bgra": 4}
+
+REPORT_VERSION = 1
+
+class Config:
+    def __init__(self):
+        self.directory = None
+        self.n_clips = 3
+        self.clip_length = 30
+        self.n_runs = 3
+        self.report_file = None
+        self.compare_file = None
+
+def usage():
+    print("usage: bench-pipeline.py [-d <dir>] [-n <clips>] "
+          "[-l <seconds>] [-r <runs>] [-o <report>] [-c <old-report>]",
+          file=sys.stderr)
+    sys.exit(1)
+
+def parse_positive_int(value):
+    try:
+        result = int(value)
+    except ValueError:
+        usage()
+
+    if result <= 0:
+        usage()
+
+    return result
+
+def process_options():
+    config = Config()
+
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "d:n:l:r:o:c:")
+    except getopt.GetoptError as e:
+        print(e, file=sys.stderr)
+        usage()
+
+    if len(args) > 0:
+        usage()
+
+    for opt, value in opts:
+        if opt == "-d":
+            config.directory = value
+        elif opt == "-n":
+            config.n_clips = parse_positive_int(value)
+        elif opt == "-l":
+            config.clip_length = parse_positive_int(value)
+        elif opt == "-r":
+            config.n_runs = parse_positive_int(value)
+        elif opt == "-o":
+            config.report_file = value
+        elif opt == "-c":
+            config.compare_file = value
+
+    if config.directory is None:
+        config.directory = "bench-pipeline-{}x{}".format(config.n_clips,
+                                                         config.clip_length)
+
+    return config
+
+def run_ffmpeg_quietly(args):
+    subprocess.run(["ffmpeg", "-hide_banner", "-loglevel", "error", "-y"] +
+                   args,
+                   check=True)
+
+def write_clip(filename, length):
+    run_ffmpeg_quietly(["-f", "lavfi",
+                        "-i", "testsrc2=size={}x{}:rate={}:duration={}".format(
+                            WIDTH, HEIGHT, FPS, length),
+                        "-f", "lavfi",
+                        "-i", "sine=frequency=220:duration={}".format(length),
+                        "-c:v", "libx264",
+                        "-preset", "ultrafast",
+                        "-c:a", "aac",
+                        filename])
+
+def write_gpx(filename, start_time, length, first_point):
+    with open(filename, "wt", encoding="utf-8") as f:
+        print("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+              "<gpx version=\"1.1\" "
+              "xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+              "<trk><trkseg>",
+              file=f)
+
+        for i in range(length + 1):
+            point_num = first_point + i
+            t = start_time + datetime.timedelta(seconds=i)
+            # Roughly 8m/s towards the north east over a gentle hill
+            print(("<trkpt lat=\"{:.6f}\" lon=\"{:.6f}\">"
+                   "<ele>{:.1f}</ele>"
+                   "<time>{}</time>"
+                   "</trkpt>").format(45.7 + point_num * 5e-5,
+                                      4.8 + point_num * 7e-5,
+                                      170 + (point_num % 60) * 0.5,
+                                      t.strftime("%Y-%m-%dT%H:%M:%SZ")),
+                  file=f)
+
+        print("</trkseg></trk>\n</gpx>", file=f)
+
+def write_project(config):
+    os.makedirs(config.directory, exist_ok=True)
+
+    commentary = os.path.join(config.directory, "commentary.flac")
+
+    if not os.path.exists(commentary):
+        run_ffmpeg_quietly(["-f", "lavfi",
+                            "-i", "sine=frequency=440:duration={}".format(
+                                COMMENTARY_LENGTH),
+                            "-ac", "1",
+                            commentary])
+
+    start_time = datetime.datetime(2023, 6, 1, 10, 0, 0)
+    logo = os.path.join(SOURCE_DIR, "biclou-lyon-logo.svg")
+    lines = ["elevation", "distance", "dial", "time"]
+
+    for clip_num in range(config.n_clips):
+        clip = "clip-{}.mp4".format(clip_num)
+        clip_path = os.path.join(config.directory, clip)
+
+        if not os.path.exists(clip_path):
+            write_clip(clip_path, config.clip_length)
+
+        # speedy picks up a GPX file with the same name as each clip
+        write_gpx(os.path.splitext(clip_path)[0] + ".gpx",
+                  start_time +
+                  datetime.timedelta(seconds=clip_num * config.clip_length),
+                  config.clip_length,
+                  clip_num * config.clip_length)
+
+        middle = config.clip_length / 2
+
+        lines.extend([clip,
+                      "{} +1".format(middle),
+                      "{} {} {}".format(middle,
+                                        config.clip_length / 4,
+                                        logo),
+                      "{} commentary.flac".format(middle / 2)])
+
+    with open(os.path.join(config.directory, SCRIPT_FILENAME),
+              "wt",
+              encoding="utf-8") as f:
+        for line in lines:
+            print(line, file=f)
+
+def time_command(args, stdout=subprocess.DEVNULL):
+    start = time.monotonic()
+    subprocess.run(args, stdout=stdout, check=True)
+    return time.monotonic() - start
+
+def time_output(args):
+    """Runs the command and counts the bytes that it writes"""
+    start = time.monotonic()
+
+    n_bytes = 0
+
+    with subprocess.Popen(args, stdout=subprocess.PIPE) as proc:
+        while True:
+            data = proc.stdout.read1(1 << 20)
+            if len(data) == 0:
+                break
+            n_bytes += len(data)
+
+    if proc.returncode != 0:
+        raise subprocess.CalledProcessError(proc.returncode, args)
+
+    return time.monotonic() - start, n_bytes
+
+def get_overlay_frame_size(filename):
+    with open(filename, "rt", encoding="utf-8") as f:
+        first_line = f.readline().split()
+
+    # The first line is the shebang with the -f option for flootay
+    for arg in first_line[1:]:
+        if arg.startswith("-f"):
+            return int(WIDTH * HEIGHT * PIXEL_FORMAT_SIZES[arg[2:]])
+
+    return int(WIDTH * HEIGHT * PIXEL_FORMAT_SIZES["bgra"])
+
+def get_ffmpeg_args():
+    with open(BUILD_FILENAME, "rt", encoding="utf-8") as f:
+        lines = [line for line in f if len(line.strip()) > 0]
+
+    # The film is made by the last command and the first argument is
+    # run-ffmpeg
+    args = shlex.split(lines[-1])[1:]
+
+    return args[0:1] + ["-y"] + args[1:-1]
+
+def read_pipe_stats():
+    processes = {}
+
+    with open(STATS_FILENAME, "rt", encoding="utf-8") as f:
+        for line in f:
+            if line.startswith("#"):
+                continue
+
+            parts = line.rstrip("\n").split("\t")
+            process = {"elapsed": float(parts[1]),
+                       "user": float(parts[2]),
+                       "system": float(parts[3])}
+
+            if parts[5] != "-":
+                process["full"] = float(parts[5])
+                process["empty"] = float(parts[6])
+
+            processes[os.path.basename(parts[0])] = process
+
+    return processes
+
+def median_run(runs):
+    """Returns the run with the median time"""
+    runs = sorted(runs, key=lambda run: run["time"])
+    return runs[len(runs) // 2]
+
+def add_rate(stage, amount_name, amount, rate_name):
+    stage[amount_name] = amount
+    stage[rate_name] = amount / stage["time"] if stage["time"] > 0 else 0
+
+def bench_probe(config):
+    def run():
+        # Remove the cache so that every file is probed again
+        if os.path.exists(PROBE_CACHE_FILENAME):
+            os.unlink(PROBE_CACHE_FILENAME)
+
+        with open(BUILD_FILENAME, "wb") as f:
+            t = time_command([SPEEDY, SCRIPT_FILENAME], stdout=f)
+
+        return {"time": t}
+
+    stage = median_run([run() for _ in range(config.n_runs)])
+    # Each clip and the commentary are probed
+    add_rate(stage, "files", config.n_clips + 1, "files_per_second")
+
+    return stage
+
+def bench_overlay(config, filename):
+    def run():
+        t, n_bytes = time_output(["./" + filename])
+        return {"time": t,
+                "frames": n_bytes // get_overlay_frame_size(filename)}
+
+    stage = median_run([run() for _ in range(config.n_runs)])
+    add_rate(stage, "frames", stage["frames"], "fps")
+
+    return stage
+
+def bench_sound(config):
+    def run():
+        t, n_bytes = time_output(["./sound.sh"])
+        return {"time": t, "n_bytes": n_bytes}
+
+    stage = median_run([run() for _ in range(config.n_runs)])
+    add_rate(stage,
+             "seconds",
+             stage.pop("n_bytes") / SOUND_BYTES_PER_SECOND,
+             "speed")
+
+    return stage
+
+def bench_pipeline(config, n_frames):
+    ffmpeg_args = get_ffmpeg_args()
+
+    os.makedirs(os.path.dirname(OUTPUT_FILENAME), exist_ok=True)
+
+    def run():
+        t = time_command([RUN_FFMPEG, "-s", STATS_FILENAME] +
+                         ffmpeg_args +
+                         [OUTPUT_FILENAME])
+        return {"time": t, "processes": read_pipe_stats()}
+
+    stage = median_run([run() for _ in range(config.n_runs)])
+    add_rate(stage, "frames", n_frames, "fps")
+
+    return stage
+
+def bench_no_encode(config, n_frames):
+    # The same command but with the video passed to the null muxer
+    # without encoding it, so the difference from the full pipeline
+    # is the time spent in the encoder
+    ffmpeg_args = (get_ffmpeg_args() +
+                   ["-c:v", "wrapped_avframe",
+                    "-c:a", "pcm_s16le",
+                    "-f", "null",
+                    "-"])
+
+    def run():
+        return {"time": time_command([RUN_FFMPEG] + ffmpeg_args)}
+
+    stage = median_run([run() for _ in range(config.n_runs)])
+    add_rate(stage, "frames", n_frames, "fps")
+
+    return stage
+
+def get_git_version():
+    try:
+        return subprocess.check_output(["git", "-C", SOURCE_DIR,
+                                        "describe",
+                                        "--always",
+                                        "--dirty"],
+                                       stderr=subprocess.DEVNULL,
+                                       text=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def run_benchmark(config):
+    write_project(config)
+
+    old_dir = os.getcwd()
+    os.chdir(config.directory)
+
+    try:
+        stages = {"probe": bench_probe(config)}
+
+        overlays = sorted(fn for fn in os.listdir()
+                          if fn.startswith("overlay") and fn.endswith(".flt"))
+
+        for filename in overlays:
+            stages[filename] = bench_overlay(config, filename)
+
+        if os.path.exists("sound.sh"):
+            stages["sound"] = bench_sound(config)
+
+        # The main overlay has a frame for every frame of the film
+        n_frames = stages["overlay.flt"]["frames"]
+
+        stages["pipeline"] = bench_pipeline(config, n_frames)
+        stages["no_encode"] = bench_no_encode(config, n_frames)
+    finally:
+        os.chdir(old_dir)
+
+    return {"version": REPORT_VERSION,
+            "date": datetime.datetime.now().isoformat(timespec="seconds"),
+            "git": get_git_version(),
+            "project": {"clips": config.n_clips,
+                        "clip_length": config.clip_length,
+                        "runs": config.n_runs},
+            "stages": stages}
+
+def get_metrics(report):
+    """Flattens the numbers in the report to a list of name/value pairs"""
+    metrics = []
+
+    for stage_name, stage in report["stages"].items():
+        for key, value in stage.items():
+            if key == "processes":
+                for process_name, process in value.items():
+                    for process_key, process_value in process.items():
+                        metrics.append(("{}/{}/{}".format(stage_name,
+                                                          process_name,
+                                                          process_key),
+                                        process_value))
+            else:
+                metrics.append(("{}/{}".format(stage_name, key), value))
+
+    return metrics
+
+def print_report(report, old_report=None):
+    if old_report is None:
+        old_metrics = {}
+    else:
+        if old_report["project"] != report["project"]:
+            print("warning: the reports are for different projects",
+                  file=sys.stderr)
+        old_metrics = dict(get_metrics(old_report))
+
+    for name, value in get_metrics(report):
+        line = "{:<40} {:>12.3f}".format(name, value)
+
+        old_value = old_metrics.get(name)
+
+        if old_value is not None:
+            line += " {:>12.3f}".format(old_value)
+            if old_value != 0:
+                line += " {:>+8.1f}%".format((value - old_value) /
+                                             old_value * 100)
+
+        print(line)
+
+def main():
+    config = process_options()
+
+    if config.compare_file is None:
+        old_report = None
+    else:
+        with open(config.compare_file, "rt", encoding="utf-8") as f:
+            old_report = json.load(f)
+
+        if old_report.get("version") != REPORT_VERSION:
+            print("{}: unsupported report version".format(
+                config.compare_file),
+                  file=sys.stderr)
+            sys.exit(1)
+
+    report = run_benchmark(config)
+
+    if config.report_file is not None:
+        with open(config.report_file, "wt", encoding="utf-8") as f:
+            json.dump(report, f, indent=2)
+            print(file=f)
+
+    print_report(report, old_report)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,792 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Renders synthetic scenes with the renderer and reports how fast
+ * they are. Each scene mostly uses one type of object so that its
+ * time per frame shows the cost of that type. The results are printed
+ * as one JSON object per line so that they can be compared between
+ * builds.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <cairo.h>
+
+#include "flt-scene.h"
+#include "flt-renderer.h"
+#include "flt-parse-stdio.h"
+#include "flt-util.h"
+#include "test-temp-dir.h"
+
+#define DEFAULT_N_FRAMES 300
+#define FPS 30
+#define VIDEO_WIDTH 1920
+#define VIDEO_HEIGHT 1080
+
+/* The GPX time at the start of the video */
+#define GPX_START_TIME 1660229640
+
+/* The renderer always draws the map at this zoom level */
+#define MAP_ZOOM 17
+#define N_SHAPES 8
+
+struct config {
+        int n_frames;
+        int scale;
+        const char *only_scene;
+};
+
+struct scene_info {
+        const char *name;
+        void (* write)(FILE *out, const struct config *config);
+};
+
+static atomic_ulong n_allocations;
+
+/* Count the allocations done by everything in the process, including
+ * cairo and librsvg, by wrapping the allocator from glibc. This covers
+ * malloc, calloc, realloc and the aligned allocators. The obsolete
+ * valloc and pvalloc aren’t counted.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *
+malloc(size_t size)
+{
+        atomic_fetch_add_explicit(&n_allocations, 1, memory_order_relaxed);
+        return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+        atomic_fetch_add_explicit(&n_allocations, 1, memory_order_relaxed);
+        return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+        atomic_fetch_add_explicit(&n_allocations, 1, memory_order_relaxed);
+        return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+        atomic_fetch_add_explicit(&n_allocations, 1, memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+        atomic_fetch_add_explicit(&n_allocations, 1, memory_order_relaxed);
+        return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+        if (alignment % sizeof (void *) != 0 ||
+            (alignment & (alignment - 1)) != 0)
+                return EINVAL;
+
+        atomic_fetch_add_explicit(&n_allocations, 1, memory_order_relaxed);
+
+        void *ptr = __libc_memalign(alignment, size);
+
+        if (ptr == NULL)
+                return ENOMEM;
+
+        *memptr = ptr;
+
+        return 0;
+}
+
+static bool
+parse_positive_int(const char *str, int *value_out)
+{
+        errno = 0;
+
+        char *tail;
+
+        long value = strtol(str, &tail, 10);
+
+        if (value <= 0 || value > INT_MAX || errno || *tail)
+                return false;
+
+        *value_out = value;
+
+        return true;
+}
+
+static bool
+process_options(int argc, char **argv, struct config *config)
+{
+        config->n_frames = DEFAULT_N_FRAMES;
+        config->scale = 1;
+        config->only_scene = NULL;
+
+        while (true) {
+                switch (getopt(argc, argv, "-f:s:o:")) {
+                case 'f':
+                        if (!parse_positive_int(optarg, &config->n_frames)) {
+                                fprintf(stderr,
+                                        "invalid number of frames: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 's':
+                        if (!parse_positive_int(optarg, &config->scale)) {
+                                fprintf(stderr,
+                                        "invalid scale: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'o':
+                        config->only_scene = optarg;
+                        break;
+
+                case -1:
+                        return true;
+
+                default:
+                        fprintf(stderr,
+                                "usage: bench-render [-f <frames>] "
+                                "[-s <scale>] [-o <scene>]\n");
+                        return false;
+                }
+        }
+}
+
+static double
+get_duration(const struct config *config)
+{
+        return config->n_frames / (double) FPS;
+}
+
+static void
+get_gpx_position(int point_num, double *lat, double *lon)
+{
+        /* Roughly 8m/s towards the north east */
+        *lat = 45.7 + point_num * 5e-5;
+        *lon = 4.8 + point_num * 7e-5;
+}
+
+static int
+get_n_gpx_points(const struct config *config)
+{
+        /* A long trace so that the lookups don’t stay in a small
+         * part of the file.
+         */
+        return MAX(100000 * config->scale, get_duration(config) + 2);
+}
+
+static bool
+write_gpx(const char *filename, int n_points)
+{
+        FILE *out = fopen(filename, "w");
+
+        if (out == NULL)
+                return false;
+
+        fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+              "<gpx version=\"1.1\" creator=\"bench-render\" "
+              "xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+              " <trk>\n"
+              "  <trkseg>\n",
+              out);
+
+        for (int i = 0; i < n_points; i++) {
+                time_t t = GPX_START_TIME + i;
+                struct tm *tm = gmtime(&t);
+                double lat, lon;
+
+                get_gpx_position(i, &lat, &lon);
+
+                fprintf(out,
+                        "   <trkpt lat=\"%.7f\" lon=\"%.7f\">\n"
+                        "    <ele>%.1f</ele>\n"
+                        "    <time>%04i-%02i-%02iT%02i:%02i:%02iZ</time>\n"
+                        "    <speed>%.3f</speed>\n"
+                        "   </trkpt>\n",
+                        lat, lon,
+                        170.0 + (i % 200) / 10.0,
+                        tm->tm_year + 1900,
+                        tm->tm_mon + 1,
+                        tm->tm_mday,
+                        tm->tm_hour,
+                        tm->tm_min,
+                        tm->tm_sec,
+                        (i % 100) / 10.0);
+        }
+
+        fputs("  </trkseg>\n"
+              " </trk>\n"
+              "</gpx>\n",
+              out);
+
+        bool ret = !ferror(out);
+
+        return fclose(out) != EOF && ret;
+}
+
+static bool
+write_file(const char *filename, const char *contents)
+{
+        FILE *out = fopen(filename, "w");
+
+        if (out == NULL)
+                return false;
+
+        fputs(contents, out);
+
+        bool ret = !ferror(out);
+
+        return fclose(out) != EOF && ret;
+}
+
+static bool
+write_svgs(void)
+{
+        if (!write_file("dial.svg",
+                        "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                        "width=\"100\" height=\"100\">"
+                        "<circle cx=\"50\" cy=\"50\" r=\"48\" "
+                        "fill=\"#ffffff\" stroke=\"#000000\" "
+                        "stroke-width=\"4\"/></svg>\n") ||
+            !write_file("needle.svg",
+                        "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                        "width=\"100\" height=\"100\">"
+                        "<path d=\"M 48 50 L 50 5 L 52 50 Z\" "
+                        "fill=\"#ff0000\"/></svg>\n"))
+                return false;
+
+        for (int i = 0; i < N_SHAPES; i++) {
+                char filename[32];
+                char contents[256];
+
+                snprintf(filename, sizeof filename, "shape-%i.svg", i);
+                snprintf(contents, sizeof contents,
+                         "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                         "width=\"64\" height=\"64\">"
+                         "<rect x=\"4\" y=\"4\" width=\"56\" height=\"56\" "
+                         "rx=\"%i\" fill=\"#%06x\"/></svg>\n",
+                         i * 4,
+                         0x204080 * (i + 1) & 0xffffff);
+
+                if (!write_file(filename, contents))
+                        return false;
+        }
+
+        return true;
+}
+
+static void
+lat_lon_to_tile(double lat, double lon, int *x, int *y)
+{
+        double n = 1 << MAP_ZOOM;
+        double lat_rad = lat * M_PI / 180.0;
+
+        *x = floor((lon + 180.0) / 360.0 * n);
+        *y = floor((1.0 - asinh(tan(lat_rad)) / M_PI) / 2.0 * n);
+}
+
+/* Puts tiles for the start of the GPX trace straight into the tile
+ * cache directory so that the map never needs the network.
+ */
+static bool
+write_map_tiles(const struct config *config)
+{
+        int x1, y1, x2, y2;
+        double lat, lon;
+
+        get_gpx_position(0, &lat, &lon);
+        lat_lon_to_tile(lat, lon, &x1, &y2);
+        get_gpx_position(get_duration(config) + 1, &lat, &lon);
+        lat_lon_to_tile(lat, lon, &x2, &y1);
+
+        if (mkdir("map-tiles", 0777) == -1)
+                return false;
+
+        cairo_surface_t *surface =
+                cairo_image_surface_create(CAIRO_FORMAT_RGB24, 256, 256);
+        bool ret = true;
+
+        for (int y = y1 - 2; y <= y2 + 2; y++) {
+                for (int x = x1 - 2; x <= x2 + 2; x++) {
+                        cairo_t *cr = cairo_create(surface);
+
+                        cairo_set_source_rgb(cr,
+                                             (x & 1) ? 0.9 : 0.8,
+                                             (y & 1) ? 0.9 : 0.8,
+                                             0.7);
+                        cairo_paint(cr);
+                        cairo_set_source_rgb(cr, 0.5, 0.5, 0.5);
+                        cairo_rectangle(cr, 120.0, 0.0, 16.0, 256.0);
+                        cairo_fill(cr);
+                        cairo_destroy(cr);
+
+                        char filename[64];
+
+                        snprintf(filename, sizeof filename,
+                                 "map-tiles/%i-%i-%i.png",
+                                 MAP_ZOOM, x, y);
+
+                        if (cairo_surface_write_to_png(surface, filename) !=
+                            CAIRO_STATUS_SUCCESS) {
+                                ret = false;
+                                goto out;
+                        }
+                }
+        }
+
+out:
+        cairo_surface_destroy(surface);
+
+        return ret;
+}
+
+static void
+write_header(FILE *out)
+{
+        fprintf(out,
+                "video_width %i\n"
+                "video_height %i\n"
+                /* Fail instead of downloading if a tile is missing */
+                "map_url_base \"file:///nonexistent\"\n",
+                VIDEO_WIDTH,
+                VIDEO_HEIGHT);
+}
+
+static void
+write_gpx_key_frames(FILE *out, const struct config *config)
+{
+        double duration = get_duration(config);
+
+        fprintf(out,
+                "        key_frame 0 { timestamp %i }\n"
+                "        key_frame %f { timestamp %f }\n",
+                GPX_START_TIME,
+                duration,
+                GPX_START_TIME + duration);
+}
+
+static void
+write_rectangles(FILE *out, const struct config *config)
+{
+        double duration = get_duration(config);
+        int n_objects = 50 * config->scale;
+
+        for (int i = 0; i < n_objects; i++) {
+                fprintf(out,
+                        "rectangle {\n"
+                        "        color 0x%06x\n",
+                        i * 0x010203 & 0xffffff);
+
+                /* A key frame every 0.1 seconds */
+                for (int k = 0; k * 0.1 <= duration; k++) {
+                        int x = (i * 37 + k * 3) % (VIDEO_WIDTH - 100);
+                        int y = (i * 23 + k * 2) % (VIDEO_HEIGHT - 100);
+
+                        fprintf(out,
+                                "        key_frame %.1f "
+                                "{ x1 %i y1 %i x2 %i y2 %i }\n",
+                                k * 0.1,
+                                x, y, x + 40 + i % 60, y + 30 + i % 50);
+                }
+
+                fputs("}\n", out);
+        }
+}
+
+static void
+write_svg_objects(FILE *out, const struct config *config)
+{
+        double duration = get_duration(config);
+        int n_objects = 40 * config->scale;
+
+        for (int i = 0; i < n_objects; i++) {
+                fprintf(out,
+                        "svg {\n"
+                        "        file \"shape-%i.svg\"\n",
+                        i % N_SHAPES);
+
+                for (int k = 0; k <= duration; k++) {
+                        int x = (i * 47 + k * 31) % (VIDEO_WIDTH - 100);
+                        int y = (i * 29 + k * 17) % (VIDEO_HEIGHT - 100);
+                        int size = 32 + (i % 4) * 32;
+
+                        fprintf(out,
+                                "        key_frame %i "
+                                "{ x1 %i y1 %i x2 %i y2 %i }\n",
+                                k,
+                                x, y, x + size, y + size);
+                }
+
+                fputs("}\n", out);
+        }
+}
+
+static void
+write_dial(FILE *out, const struct config *config)
+{
+        fputs("gpx {\n"
+              "        file \"track.gpx\"\n"
+              "        speed {\n"
+              "                dial \"dial.svg\"\n"
+              "                needle \"needle.svg\"\n"
+              "                width 300 height 300 full_speed 50\n"
+              "        }\n",
+              out);
+        write_gpx_key_frames(out, config);
+        fputs("}\n", out);
+}
+
+static void
+write_map(FILE *out, const struct config *config)
+{
+        fputs("gpx {\n"
+              "        file \"track.gpx\"\n"
+              "        map { }\n",
+              out);
+        write_gpx_key_frames(out, config);
+        fputs("}\n", out);
+}
+
+static void
+write_gpx_readouts(FILE *out, const struct config *config)
+{
+        fputs("gpx {\n"
+              "        file \"track.gpx\"\n"
+              "        speed { }\n"
+              "        elevation { }\n"
+              "        distance { }\n",
+              out);
+        write_gpx_key_frames(out, config);
+        fputs("}\n", out);
+}
+
+static void
+write_text_objects(FILE *out, const struct config *config)
+{
+        double duration = get_duration(config);
+
+        for (int i = 0; i < config->scale; i++) {
+                fprintf(out,
+                        "text {\n"
+                        "        text \"Text %i\" top left\n"
+                        "        key_frame 0 { }\n"
+                        "        key_frame %f { }\n"
+                        "}\n"
+                        "score {\n"
+                        "        label \"Score\" top right\n",
+                        i,
+                        duration);
+
+                for (int k = 0; k <= duration; k++)
+                        fprintf(out, "        key_frame %i { v %i }\n", k, k);
+
+                fprintf(out,
+                        "}\n"
+                        "time {\n"
+                        "        bottom left\n"
+                        "        key_frame 0 { time 0 }\n"
+                        "        key_frame %f { time %f }\n"
+                        "}\n"
+                        "curve {\n"
+                        "        key_frame 0 {\n"
+                        "                x1 100 y1 100 x2 600 y2 900\n"
+                        "                x3 1200 y3 100 x4 1800 y4 900\n"
+                        "                t 0\n"
+                        "        }\n"
+                        "        key_frame %f { t 1 }\n"
+                        "}\n",
+                        duration,
+                        duration,
+                        duration);
+        }
+}
+
+static const struct scene_info
+scenes[] = {
+        { "rectangles", write_rectangles },
+        { "svgs", write_svg_objects },
+        { "dial", write_dial },
+        { "map", write_map },
+        { "gpx", write_gpx_readouts },
+        { "text", write_text_objects },
+};
+
+static double
+get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+get_max_rss(void)
+{
+        struct rusage usage;
+
+        if (getrusage(RUSAGE_SELF, &usage) == -1)
+                return -1;
+
+        return usage.ru_maxrss;
+}
+
+static size_t
+count_key_frames(const struct flt_scene *scene, size_t *n_objects_out)
+{
+        const struct flt_scene_object *object;
+        size_t n_key_frames = 0, n_objects = 0;
+
+        flt_list_for_each(object, &scene->objects, link) {
+                n_key_frames += flt_list_length(&object->key_frames);
+                n_objects++;
+        }
+
+        *n_objects_out = n_objects;
+
+        return n_key_frames;
+}
+
+static struct flt_scene *
+load_scene(const struct scene_info *info,
+           const struct config *config)
+{
+        char *filename = flt_strconcat(info->name, ".flt", NULL);
+        FILE *out = fopen(filename, "w");
+        struct flt_scene *scene = NULL;
+
+        if (out == NULL) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                goto out;
+        }
+
+        write_header(out);
+        info->write(out, config);
+
+        if (fclose(out) == EOF) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                goto out;
+        }
+
+        struct flt_error *error = NULL;
+
+        scene = flt_scene_new();
+
+        if (!flt_parse_stdio_from_file(scene, filename, &error)) {
+                fprintf(stderr, "%s: %s\n", info->name, error->message);
+                flt_error_free(error);
+                flt_scene_free(scene);
+                scene = NULL;
+        }
+
+out:
+        flt_free(filename);
+
+        return scene;
+}
+
+static bool
+run_scene(const struct scene_info *info,
+          const struct config *config)
+{
+        double load_start = get_time();
+        struct flt_scene *scene = load_scene(info, config);
+
+        if (scene == NULL)
+                return false;
+
+        double load_time = get_time() - load_start;
+
+        cairo_surface_t *surface =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                           scene->video_width,
+                                           scene->video_height);
+        cairo_t *cr = cairo_create(surface);
+        struct flt_renderer *renderer = flt_renderer_new(scene);
+        cairo_rectangle_int_t damage = { .width = 0, .height = 0 };
+        int n_drawn = 0;
+        bool ret = true;
+
+        /* Render the first frame outside of the timing so that the
+         * one-off setup such as loading the tiles and rasterising the
+         * SVGs doesn’t count.
+         */
+        struct flt_error *error = NULL;
+
+        if (flt_renderer_render(renderer, cr, 0.0, &error) ==
+            FLT_RENDERER_RESULT_ERROR)
+                goto error;
+
+        unsigned long start_allocations = atomic_load(&n_allocations);
+        double start_time = get_time();
+
+        for (int i = 0; i < config->n_frames; i++) {
+                if (damage.width > 0 && damage.height > 0) {
+                        cairo_save(cr);
+                        cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+                        cairo_rectangle(cr,
+                                        damage.x, damage.y,
+                                        damage.width, damage.height);
+                        cairo_fill(cr);
+                        cairo_restore(cr);
+                }
+
+                switch (flt_renderer_render(renderer,
+                                            cr,
+                                            i / (double) FPS,
+                                            &error)) {
+                case FLT_RENDERER_RESULT_ERROR:
+                        goto error;
+                case FLT_RENDERER_RESULT_EMPTY:
+                        break;
+                case FLT_RENDERER_RESULT_OK:
+                        n_drawn++;
+                        break;
+                }
+
+                flt_renderer_get_damage(renderer, &damage);
+                cairo_surface_flush(surface);
+        }
+
+        double render_time = get_time() - start_time;
+        unsigned long n_frame_allocations =
+                atomic_load(&n_allocations) - start_allocations;
+        size_t n_objects;
+        size_t n_key_frames = count_key_frames(scene, &n_objects);
+
+        printf("{\"scene\": \"%s\", "
+               "\"objects\": %zu, "
+               "\"key_frames\": %zu, "
+               "\"frames\": %i, "
+               "\"drawn_frames\": %i, "
+               "\"load_ms\": %.3f, "
+               "\"ms_per_frame\": %.4f, "
+               "\"fps\": %.1f, "
+               "\"allocs_per_frame\": %.2f, "
+               "\"max_rss_kb\": %li}\n",
+               info->name,
+               n_objects,
+               n_key_frames,
+               config->n_frames,
+               n_drawn,
+               load_time * 1000.0,
+               render_time * 1000.0 / config->n_frames,
+               config->n_frames / render_time,
+               n_frame_allocations / (double) config->n_frames,
+               get_max_rss());
+
+        goto out;
+
+error:
+        fprintf(stderr, "%s: %s\n", info->name, error->message);
+        flt_error_free(error);
+        ret = false;
+
+out:
+        flt_renderer_free(renderer);
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+        flt_scene_free(scene);
+
+        return ret;
+}
+
+static bool
+write_resources(const struct config *config)
+{
+        if (!write_gpx("track.gpx", get_n_gpx_points(config)) ||
+            !write_svgs() ||
+            !write_map_tiles(config)) {
+                fprintf(stderr, "error writing the test files\n");
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+run_benchmarks(void *user_data)
+{
+        const struct config *config = user_data;
+
+        if (!write_resources(config))
+                return false;
+
+        bool found = false;
+
+        for (int i = 0; i < FLT_N_ELEMENTS(scenes); i++) {
+                if (config->only_scene &&
+                    strcmp(config->only_scene, scenes[i].name))
+                        continue;
+
+                found = true;
+
+                if (!run_scene(scenes + i, config))
+                        return false;
+
+                fflush(stdout);
+        }
+
+        if (!found) {
+                fprintf(stderr, "unknown scene: %s\n", config->only_scene);
+                return false;
+        }
+
+        return true;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct config config;
+
+        if (!process_options(argc, argv, &config))
+                return EXIT_FAILURE;
+
+        bool ret = test_temp_dir_run("bench-render", run_benchmarks, &config);
+
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -24,13 +24,42 @@
 #include <assert.h>
 
 #include "flt-util.h"
+#include "flt-list.h"
 #include "flt-scene.h"
 #include "flt-parse-stdio.h"
 #include "flt-renderer.h"
+#include "flt-svg-cache.h"
+#include "flt-resource-cache.h"
+#include "flt-composite.h"
 
 struct flootay {
         struct flt_scene *scene;
+        /* Files loaded by the scripts. These are kept so that
+         * reloading a script only needs to load the files that have
+         * changed.
+         */
+        struct flt_resource_cache *resources;
+        /* Rasterised SVGs shared by all of the contexts */
+        struct flt_svg_cache *svg_cache;
+        /* Used by the functions that don’t take a context */
+        struct flootay_context *default_context;
+        /* List of all the contexts so that their renderers can be
+         * switched to a new scene when a script is loaded.
+         */
+        struct flt_list contexts;
+        char *error_message;
+};
+
+struct flootay_context {
+        struct flt_list link;
+        struct flootay *flootay;
+        /* Created on the first render after loading a script */
         struct flt_renderer *renderer;
+        /* Surface used by flootay_context_render_frame and the part
+         * of it that needs to be cleared before the next render.
+         */
+        cairo_surface_t *frame_surface;
+        cairo_rectangle_int_t frame_damage;
         char *error_message;
 };
 
@@ -39,42 +68,50 @@ flootay_new(void)
 {
         struct flootay *flootay = flt_calloc(sizeof *flootay);
 
+        flt_list_init(&flootay->contexts);
+        flootay->svg_cache = flt_svg_cache_new(FLT_SVG_CACHE_DEFAULT_SIZE);
+
         return flootay;
 }
 
 static void
-free_error(struct flootay *flootay)
+set_error_message(char **error_message,
+                  const char *message)
 {
-        flt_free(flootay->error_message);
-        flootay->error_message = NULL;
+        flt_free(*error_message);
+        *error_message = flt_strdup(message);
 }
 
-static void
-free_renderer(struct flootay *flootay)
+const char *
+flootay_get_error(struct flootay *flootay)
 {
-        if (flootay->renderer) {
-                flt_renderer_free(flootay->renderer);
-                flootay->renderer = NULL;
-        }
+        return flootay->error_message;
+}
 
-        if (flootay->scene) {
-                flt_scene_free(flootay->scene);
-                flootay->scene = NULL;
-        }
+const char *
+flootay_context_get_error(struct flootay_context *context)
+{
+        return context->error_message;
 }
 
-static void
-set_error(struct flootay *flootay,
-          const char *message)
+struct flootay_context *
+flootay_context_new(struct flootay *flootay)
 {
-        free_error(flootay);
-        flootay->error_message = flt_strdup(message);
+        struct flootay_context *context = flt_calloc(sizeof *context);
+
+        context->flootay = flootay;
+        flt_list_insert(flootay->contexts.prev, &context->link);
+
+        return context;
 }
 
-const char *
-flootay_get_error(struct flootay *flootay)
+static struct flootay_context *
+get_default_context(struct flootay *flootay)
 {
-        return flootay->error_message;
+        if (flootay->default_context == NULL)
+                flootay->default_context = flootay_context_new(flootay);
+
+        return flootay->default_context;
 }
 
 bool
@@ -82,42 +119,69 @@ flootay_load_script(struct flootay *flootay,
                     const char *base_dir,
                     FILE *file)
 {
+        if (flootay->resources == NULL)
+                flootay->resources = flt_resource_cache_new();
+
+        flt_resource_cache_begin_load(flootay->resources);
+
         struct flt_scene *scene = flt_scene_new();
         struct flt_error *error = NULL;
 
+        scene->resource_cache = flootay->resources;
+
         if (!flt_parse_stdio(scene, base_dir, file, &error)) {
-                set_error(flootay, error->message);
+                set_error_message(&flootay->error_message, error->message);
                 flt_error_free(error);
                 flt_scene_free(scene);
                 return false;
         }
 
-        free_renderer(flootay);
+        /* Keep the renderers so that their caches survive the reload */
+        struct flootay_context *context;
+
+        flt_list_for_each(context, &flootay->contexts, link) {
+                if (context->renderer)
+                        flt_renderer_set_scene(context->renderer, scene);
+        }
+
+        if (flootay->scene)
+                flt_scene_free(flootay->scene);
 
         flootay->scene = scene;
-        flootay->renderer = flt_renderer_new(scene);
+
+        /* Free the files that only the old scene was using */
+        flt_resource_cache_purge(flootay->resources);
 
         return true;
 }
 
 enum flootay_render_result
-flootay_render(struct flootay *flootay,
-               cairo_t *cr,
-               double timestamp)
+flootay_context_render(struct flootay_context *context,
+                       cairo_t *cr,
+                       double timestamp)
 {
-        if (flootay->renderer == NULL) {
-                set_error(flootay, "render called before loading a script");
-                return false;
+        struct flootay *flootay = context->flootay;
+
+        if (flootay->scene == NULL) {
+                set_error_message(&context->error_message,
+                                  "render called before loading a script");
+                return FLOOTAY_RENDER_RESULT_ERROR;
+        }
+
+        if (context->renderer == NULL) {
+                context->renderer =
+                        flt_renderer_new_with_svg_cache(flootay->scene,
+                                                        flootay->svg_cache);
         }
 
         struct flt_error *error = NULL;
 
-        switch (flt_renderer_render(flootay->renderer,
+        switch (flt_renderer_render(context->renderer,
                                     cr,
                                     timestamp,
                                     &error)) {
         case FLT_RENDERER_RESULT_ERROR:
-                set_error(flootay, error->message);
+                set_error_message(&context->error_message, error->message);
                 flt_error_free(error);
                 return FLOOTAY_RENDER_RESULT_ERROR;
 
@@ -133,11 +197,342 @@ flootay_render(struct flootay *flootay,
         return FLOOTAY_RENDER_RESULT_EMPTY;
 }
 
+/* Copies the error of the default context so that it can be fetched
+ * with flootay_get_error.
+ */
+static enum flootay_render_result
+handle_default_result(struct flootay *flootay,
+                      enum flootay_render_result result)
+{
+        if (result == FLOOTAY_RENDER_RESULT_ERROR) {
+                set_error_message(&flootay->error_message,
+                                  flootay->default_context->error_message);
+        }
+
+        return result;
+}
+
+enum flootay_render_result
+flootay_render(struct flootay *flootay,
+               cairo_t *cr,
+               double timestamp)
+{
+        struct flootay_context *context = get_default_context(flootay);
+
+        return handle_default_result(flootay,
+                                     flootay_context_render(context,
+                                                            cr,
+                                                            timestamp));
+}
+
+static void
+ensure_frame_surface(struct flootay_context *context, int width, int height)
+{
+        if (context->frame_surface) {
+                if (cairo_image_surface_get_width(context->frame_surface) ==
+                    width &&
+                    cairo_image_surface_get_height(context->frame_surface) ==
+                    height)
+                        return;
+
+                cairo_surface_destroy(context->frame_surface);
+        }
+
+        /* A new image surface is already cleared */
+        context->frame_surface =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+        context->frame_damage.width = 0;
+        context->frame_damage.height = 0;
+}
+
+static void
+clip_damage(cairo_rectangle_int_t *damage,
+            int width, int height,
+            bool align_chroma)
+{
+        int x1 = MAX(damage->x, 0);
+        int y1 = MAX(damage->y, 0);
+        int x2 = MIN(damage->x + damage->width, width);
+        int y2 = MIN(damage->y + damage->height, height);
+
+        if (align_chroma) {
+                /* Align to the chroma blocks */
+                x1 &= ~1;
+                y1 &= ~1;
+                x2 = MIN((x2 + 1) & ~1, width);
+                y2 = MIN((y2 + 1) & ~1, height);
+        }
+
+        if (x2 <= x1 || y2 <= y1) {
+                damage->width = damage->height = 0;
+        } else {
+                damage->x = x1;
+                damage->y = y1;
+                damage->width = x2 - x1;
+                damage->height = y2 - y1;
+        }
+}
+
+static void
+composite_damage(struct flootay_context *context,
+                 const struct flootay_frame *frame,
+                 const cairo_rectangle_int_t *damage)
+{
+        cairo_surface_t *surface = context->frame_surface;
+
+        cairo_surface_flush(surface);
+
+        int src_stride = cairo_image_surface_get_stride(surface);
+        const uint8_t *src = (cairo_image_surface_get_data(surface) +
+                              damage->y * src_stride +
+                              damage->x * 4);
+
+        switch (frame->format) {
+        case FLOOTAY_PIXEL_FORMAT_RGBA:
+        case FLOOTAY_PIXEL_FORMAT_BGRA:
+                flt_composite_rgba(frame->planes[0] +
+                                   damage->y * frame->strides[0] +
+                                   damage->x * 4,
+                                   frame->strides[0],
+                                   src, src_stride,
+                                   damage->width, damage->height,
+                                   frame->format ==
+                                   FLOOTAY_PIXEL_FORMAT_BGRA);
+                break;
+
+        case FLOOTAY_PIXEL_FORMAT_YUV420P:
+                flt_composite_yuv420p(frame->planes, frame->strides,
+                                      frame->colorspace ==
+                                      FLOOTAY_COLORSPACE_BT709 ?
+                                      FLT_COMPOSITE_COLORSPACE_BT709 :
+                                      FLT_COMPOSITE_COLORSPACE_BT601,
+                                      src, src_stride,
+                                      damage->x, damage->y,
+                                      damage->width, damage->height);
+                break;
+        }
+}
+
+/* Renders into the frame surface of the context after clearing what
+ * was drawn by the last render. The damage is clipped to the surface.
+ */
+static enum flootay_render_result
+render_frame_surface(struct flootay_context *context,
+                     int width, int height,
+                     bool align_chroma,
+                     double timestamp,
+                     cairo_rectangle_int_t *damage_out)
+{
+        ensure_frame_surface(context, width, height);
+
+        cairo_t *cr = cairo_create(context->frame_surface);
+
+        /* Clear whatever was drawn by the last render */
+        if (context->frame_damage.width > 0) {
+                cairo_save(cr);
+                cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+                cairo_rectangle(cr,
+                                context->frame_damage.x,
+                                context->frame_damage.y,
+                                context->frame_damage.width,
+                                context->frame_damage.height);
+                cairo_fill(cr);
+                cairo_restore(cr);
+                context->frame_damage.width = 0;
+                context->frame_damage.height = 0;
+        }
+
+        enum flootay_render_result ret = flootay_context_render(context,
+                                                                cr,
+                                                                timestamp);
+
+        cairo_destroy(cr);
+
+        if (ret != FLOOTAY_RENDER_RESULT_OK) {
+                /* A render that failed partway through might have
+                 * already drawn something so the whole surface is
+                 * cleared next time.
+                 */
+                if (ret == FLOOTAY_RENDER_RESULT_ERROR) {
+                        context->frame_damage.x = 0;
+                        context->frame_damage.y = 0;
+                        context->frame_damage.width = width;
+                        context->frame_damage.height = height;
+                }
+
+                damage_out->x = damage_out->y = 0;
+                damage_out->width = damage_out->height = 0;
+                return ret;
+        }
+
+        flootay_context_get_damage(context, damage_out);
+        clip_damage(damage_out, width, height, align_chroma);
+
+        context->frame_damage = *damage_out;
+
+        return ret;
+}
+
+enum flootay_render_result
+flootay_context_render_frame(struct flootay_context *context,
+                             const struct flootay_frame *frame,
+                             double timestamp)
+{
+        cairo_rectangle_int_t damage;
+
+        enum flootay_render_result ret =
+                render_frame_surface(context,
+                                     frame->width, frame->height,
+                                     frame->format ==
+                                     FLOOTAY_PIXEL_FORMAT_YUV420P,
+                                     timestamp,
+                                     &damage);
+
+        if (ret == FLOOTAY_RENDER_RESULT_OK && damage.width > 0)
+                composite_damage(context, frame, &damage);
+
+        return ret;
+}
+
+static double
+get_batch_timestamp(double start_time,
+                    double frame_rate,
+                    size_t frame_num)
+{
+        /* Calculated from the start each time so that rounding
+         * errors don’t build up over a long batch.
+         */
+        return start_time + frame_num / frame_rate;
+}
+
+bool
+flootay_context_render_frames(struct flootay_context *context,
+                              const struct flootay_frame *frames,
+                              size_t n_frames,
+                              double start_time,
+                              double frame_rate,
+                              enum flootay_render_result *results)
+{
+        for (size_t i = 0; i < n_frames; i++) {
+                double timestamp = get_batch_timestamp(start_time,
+                                                       frame_rate,
+                                                       i);
+
+                results[i] = flootay_context_render_frame(context,
+                                                          frames + i,
+                                                          timestamp);
+
+                if (results[i] == FLOOTAY_RENDER_RESULT_ERROR)
+                        return false;
+        }
+
+        return true;
+}
+
+bool
+flootay_context_render_batch(struct flootay_context *context,
+                             int width, int height,
+                             double start_time,
+                             double frame_rate,
+                             size_t n_frames,
+                             flootay_batch_cb cb,
+                             void *user_data)
+{
+        for (size_t i = 0; i < n_frames; i++) {
+                struct flootay_batch_frame batch_frame = {
+                        .frame_num = i,
+                        .timestamp = get_batch_timestamp(start_time,
+                                                         frame_rate,
+                                                         i),
+                };
+
+                batch_frame.result =
+                        render_frame_surface(context,
+                                             width, height,
+                                             false, /* align_chroma */
+                                             batch_frame.timestamp,
+                                             &batch_frame.damage);
+
+                if (batch_frame.result == FLOOTAY_RENDER_RESULT_ERROR)
+                        return false;
+
+                cairo_surface_flush(context->frame_surface);
+
+                if (!cb(&batch_frame, context->frame_surface, user_data))
+                        break;
+        }
+
+        return true;
+}
+
+enum flootay_render_result
+flootay_render_frame(struct flootay *flootay,
+                     const struct flootay_frame *frame,
+                     double timestamp)
+{
+        struct flootay_context *context = get_default_context(flootay);
+
+        return handle_default_result(flootay,
+                                     flootay_context_render_frame(context,
+                                                                  frame,
+                                                                  timestamp));
+}
+
+void
+flootay_context_get_damage(struct flootay_context *context,
+                           cairo_rectangle_int_t *damage)
+{
+        if (context->renderer == NULL) {
+                damage->x = damage->y = 0;
+                damage->width = damage->height = 0;
+                return;
+        }
+
+        flt_renderer_get_damage(context->renderer, damage);
+}
+
+void
+flootay_get_damage(struct flootay *flootay,
+                   cairo_rectangle_int_t *damage)
+{
+        flootay_context_get_damage(get_default_context(flootay), damage);
+}
+
+void
+flootay_context_free(struct flootay_context *context)
+{
+        if (context->renderer)
+                flt_renderer_free(context->renderer);
+
+        if (context->frame_surface)
+                cairo_surface_destroy(context->frame_surface);
+
+        if (context->flootay->default_context == context)
+                context->flootay->default_context = NULL;
+
+        flt_list_remove(&context->link);
+        flt_free(context->error_message);
+        flt_free(context);
+}
+
 void
 flootay_free(struct flootay *flootay)
 {
-        free_renderer(flootay);
-        free_error(flootay);
+        struct flootay_context *context, *tmp;
+
+        flt_list_for_each_safe(context, tmp, &flootay->contexts, link) {
+                flootay_context_free(context);
+        }
+
+        if (flootay->scene)
+                flt_scene_free(flootay->scene);
+
+        flt_free(flootay->error_message);
+
+        if (flootay->resources)
+                flt_resource_cache_free(flootay->resources);
+
+        flt_svg_cache_free(flootay->svg_cache);
 
         flt_free(flootay);
 }
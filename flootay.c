@@ -16,191 +16,1792 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* For vmsplice and F_SETPIPE_SZ */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <math.h>
 #include <stdbool.h>
 #include <cairo.h>
 #include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 
 #include "flt-util.h"
+#include "flt-buffer.h"
 #include "flt-scene.h"
 #include "flt-renderer.h"
+#include "flt-parser.h"
 #include "flt-parse-stdio.h"
+#include "flt-scene-binary.h"
+#include "flt-unpremultiply.h"
+#include "flt-composite.h"
+#include "flt-list.h"
+#include "flt-profile.h"
+
+#define DEFAULT_FPS 30
+
+/* Maximum number of rendered frames per thread that can be waiting
+ * to be written when rendering with multiple threads.
+ */
+#define QUEUED_FRAMES_PER_THREAD 2
+
+/* Maximum number of iovecs to use in each call to writev or
+ * vmsplice.
+ */
+#define OUTPUT_IOVECS 256
+
+/* Size to try to set the output pipe to */
+#define OUTPUT_PIPE_SIZE (1024 * 1024)
+
+/* Maximum number of extra frame buffers that can be waiting for the
+ * reader to consume their pages from the output pipe. If there are
+ * more than this the frames are copied instead.
+ */
+#define MAX_SPLICED_BUFFERS 4
+
+#define MAX_PLANES 4
+
+enum pixel_format {
+        PIXEL_FORMAT_RGBA,
+        /* Premultiplied BGRA, which is what cairo uses on
+         * little-endian machines. This can be uploaded as is to a
+         * GPU.
+         */
+        PIXEL_FORMAT_BGRA,
+        /* Premultiplied YUV with alpha as used by ffmpeg */
+        PIXEL_FORMAT_YUVA420P,
+};
+
+struct script {
+        /* NULL if the script is read from stdin */
+        const char *filename;
+        /* The contents of stdin. This is read once up front so that
+         * each thread can parse its own copy of the scene.
+         */
+        struct flt_buffer data;
+};
+
+struct config {
+        int n_threads;
+        int fps;
+        /* Range of time to render. end_time is negative to render
+         * until the end of the scene.
+         */
+        double start_time, end_time;
+        /* Size in bytes or zero to use the default */
+        size_t tile_cache_size;
+        enum pixel_format pixel_format;
+        /* If set, the scene is written here as a compiled scene
+         * instead of being rendered.
+         */
+        const char *compile_output;
+        /* Array of struct script */
+        struct flt_buffer scripts;
+#ifdef FLT_ENABLE_PROFILE
+        bool print_stats;
+        /* If set, a trace of the timed calls is written here */
+        const char *trace_file;
+#endif
+};
+
+struct plane {
+        int width, height;
+        int bytes_per_pixel;
+        /* The plane is subsampled by 1 << shift in both directions */
+        int shift;
+        /* The start of the plane within the blank frame */
+        const uint8_t *blank;
+};
+
+/* How a frame is written to the output */
+struct frame_layout {
+        enum pixel_format format;
+        int width, height;
+        int n_planes;
+        struct plane planes[MAX_PLANES];
+        size_t frame_size;
+        /* A read-only anonymous mapping containing one blank frame.
+         * For RGBA all of its pages are the kernel’s shared zero page
+         * so writing from it doesn’t need to touch any real memory.
+         * The contents never change so it can be spliced into the
+         * output pipe any number of times.
+         */
+        void *blank;
+};
+
+/* A frame buffer whose pages were spliced into the output pipe. It
+ * can’t be modified until the reader has consumed them.
+ */
+struct spliced_buffer {
+        struct flt_list link;
+        uint8_t *data;
+        /* Position in the output stream after the last byte */
+        uint64_t end;
+};
+
+struct output {
+        /* True if stdout is a pipe and the data can be given to it
+         * with vmsplice instead of being copied.
+         */
+        bool use_splice;
+        /* Whether the current frame is being spliced */
+        bool splice_frame;
+        /* Whether any of the current frame was actually spliced. This
+         * can be false even if splice_frame was set if the pipe
+         * didn’t support it.
+         */
+        bool frame_spliced;
+        /* Total number of bytes written */
+        uint64_t written;
+        size_t frame_size;
+        /* List of struct spliced_buffer, oldest first */
+        struct flt_list spliced_buffers;
+        int n_spliced_buffers;
+        int n_iov;
+        struct iovec iov[OUTPUT_IOVECS];
+};
+
+/* The last frame that was written, so that it can be written again
+ * without rendering if the next frame would be the same.
+ */
+struct last_frame {
+        bool valid;
+        /* The signature from the renderer */
+        uint64_t signature;
+        /* The converted data. If spliced is true this is in the last
+         * spliced buffer, otherwise it belongs to whoever wrote the
+         * frame and is kept until the next frame is written.
+         */
+        const uint8_t *data;
+        bool spliced;
+        cairo_rectangle_int_t damage;
+};
+
+struct frame_renderer {
+        const struct frame_layout *layout;
+        int fps;
+        struct flt_scene *scene;
+        cairo_surface_t *surface;
+        cairo_t *cr;
+        struct flt_renderer *renderer;
+        /* The part of the surface that was drawn to by the last
+         * frame, clipped to the surface. Everything outside of it is
+         * clear.
+         */
+        cairo_rectangle_int_t damage;
+        /* Buffer for the converted damaged pixels */
+        uint8_t *converted;
+};
+
+struct blank_frames {
+        int fps;
+        /* Sorted list of times when something might be drawn */
+        size_t n_intervals;
+        struct flt_scene_interval *intervals;
+};
+
+struct frame_slot {
+        /* True if a thread has finished rendering the frame into this
+         * slot and it is waiting to be written.
+         */
+        bool ready;
+        /* True if the frame is the same as the one before so it
+         * wasn’t rendered.
+         */
+        bool repeat;
+        enum flt_renderer_result result;
+        struct flt_error *error;
+        /* The part of the frame that isn’t transparent */
+        cairo_rectangle_int_t damage;
+        /* Converted data for the damaged rectangle */
+        uint8_t *data;
+};
+
+struct render_thread {
+        pthread_t thread;
+        struct render_queue *queue;
+        struct frame_renderer renderer;
+};
+
+struct render_queue {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
 
-#define FPS 30
+        /* Range of frames to render */
+        int start_frame, end_frame;
+        const struct blank_frames *blank_frames;
+        /* The next frame that a thread should pick up. This is never
+         * a frame that is known to be blank.
+         */
+        int next_frame;
+        /* The next frame that the writer is waiting for */
+        int write_frame;
+        bool quit;
+
+        int n_slots;
+        struct frame_slot *slots;
+};
 
 static bool
-write_row(const void *data, int width)
+init_blank_frame(struct frame_layout *layout)
 {
-        size_t wrote = fwrite(data, 1, width * 4, stdout);
+        bool is_zero = layout->format != PIXEL_FORMAT_YUVA420P;
 
-        if (wrote != width * 4) {
+        layout->blank = mmap(NULL, /* addr */
+                             layout->frame_size,
+                             is_zero ? PROT_READ : PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS,
+                             -1, /* fd */
+                             0 /* offset */);
+
+        if (layout->blank == MAP_FAILED) {
                 fprintf(stderr,
-                        "error writing frame: %s\n",
+                        "error mapping blank frame: %s\n",
                         strerror(errno));
                 return false;
         }
 
+        uint8_t *p = layout->blank;
+
+        for (int i = 0; i < layout->n_planes; i++) {
+                struct plane *plane = layout->planes + i;
+                size_t plane_size = ((size_t) plane->width *
+                                     plane->height *
+                                     plane->bytes_per_pixel);
+
+                /* The chroma planes are grey */
+                if (layout->format == PIXEL_FORMAT_YUVA420P &&
+                    (i == 1 || i == 2))
+                        memset(p, 128, plane_size);
+
+                plane->blank = p;
+                p += plane_size;
+        }
+
+        if (!is_zero)
+                mprotect(layout->blank, layout->frame_size, PROT_READ);
+
         return true;
 }
 
 static bool
-write_surface(cairo_surface_t *surface)
+init_frame_layout(struct frame_layout *layout,
+                  enum pixel_format format,
+                  int width, int height)
+{
+        int chroma_width = (width + 1) / 2;
+        int chroma_height = (height + 1) / 2;
+
+        layout->format = format;
+        layout->width = width;
+        layout->height = height;
+
+        switch (format) {
+        case PIXEL_FORMAT_RGBA:
+        case PIXEL_FORMAT_BGRA:
+                layout->n_planes = 1;
+                layout->planes[0] = (struct plane) { width, height, 4, 0 };
+                break;
+
+        case PIXEL_FORMAT_YUVA420P:
+                layout->n_planes = 4;
+                layout->planes[0] = (struct plane) { width, height, 1, 0 };
+                for (int i = 1; i <= 2; i++) {
+                        layout->planes[i] = (struct plane) {
+                                chroma_width, chroma_height, 1, 1,
+                        };
+                }
+                layout->planes[3] = layout->planes[0];
+                break;
+        }
+
+        layout->frame_size = 0;
+
+        for (int i = 0; i < layout->n_planes; i++) {
+                const struct plane *plane = layout->planes + i;
+
+                layout->frame_size += ((size_t) plane->width *
+                                       plane->height *
+                                       plane->bytes_per_pixel);
+        }
+
+        return init_blank_frame(layout);
+}
+
+static void
+destroy_frame_layout(struct frame_layout *layout)
+{
+        munmap(layout->blank, layout->frame_size);
+}
+
+/* Frame buffers are allocated with mmap so that if their pages are
+ * still referenced by the output pipe when they are freed they won’t
+ * be reused for something else.
+ */
+static uint8_t *
+alloc_frame_buffer(size_t size)
+{
+        void *data = mmap(NULL, /* addr */
+                          size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, /* fd */
+                          0 /* offset */);
+
+        if (data == MAP_FAILED)
+                flt_fatal("Memory exhausted");
+
+        return data;
+}
+
+static void
+free_frame_buffer(uint8_t *data, size_t size)
+{
+        munmap(data, size);
+}
+
+static void
+init_output(struct output *out, size_t frame_size)
+{
+        struct stat statbuf;
+
+        out->use_splice = (fstat(STDOUT_FILENO, &statbuf) == 0 &&
+                           S_ISFIFO(statbuf.st_mode));
+        out->splice_frame = false;
+        out->frame_spliced = false;
+        out->written = 0;
+        out->frame_size = frame_size;
+        flt_list_init(&out->spliced_buffers);
+        out->n_spliced_buffers = 0;
+        out->n_iov = 0;
+
+        /* A bigger pipe means fewer context switches with the
+         * reader. It doesn’t matter if this fails.
+         */
+        if (out->use_splice)
+                fcntl(STDOUT_FILENO, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+}
+
+static void
+destroy_output(struct output *out)
+{
+        struct spliced_buffer *sb, *tmp;
+
+        flt_list_for_each_safe(sb, tmp, &out->spliced_buffers, link) {
+                free_frame_buffer(sb->data, out->frame_size);
+                flt_free(sb);
+        }
+}
+
+static bool
+write_iovecs(struct output *out)
 {
-        int width = cairo_image_surface_get_width(surface);
-        int height = cairo_image_surface_get_height(surface);
-        int stride = cairo_image_surface_get_stride(surface);
-        uint8_t *data = cairo_image_surface_get_data(surface);
+        struct iovec *iov = out->iov;
+        int n_iov = out->n_iov;
 
-        for (int y = 0; y < height; y++) {
-                uint32_t *row = (uint32_t *) (data + y * stride);
-                uint8_t *out_pix = data;
+        out->n_iov = 0;
 
-                for (int x = 0; x < width; x++) {
-                        uint32_t value = row[x];
+        while (n_iov > 0) {
+                ssize_t wrote;
 
-                        uint8_t a = value >> 24;
-                        uint8_t r = (value >> 16) & 0xff;
-                        uint8_t g = (value >> 8) & 0xff;
-                        uint8_t b = value & 0xff;
+                if (out->splice_frame)
+                        wrote = vmsplice(STDOUT_FILENO, iov, n_iov, 0);
+                else
+                        wrote = writev(STDOUT_FILENO, iov, n_iov);
 
-                        if (a > 0) {
-                                /* unpremultiply */
-                                r = r * 255 / a;
-                                g = g * 255 / a;
-                                b = b * 255 / a;
+                if (wrote == -1) {
+                        if (errno == EINTR)
+                                continue;
+
+                        /* Fall back to copying if the pipe can’t be
+                         * spliced into.
+                         */
+                        if (out->splice_frame &&
+                            (errno == EINVAL || errno == ENOSYS)) {
+                                out->use_splice = false;
+                                out->splice_frame = false;
+                                continue;
                         }
 
-                        *(out_pix++) = r;
-                        *(out_pix++) = g;
-                        *(out_pix++) = b;
-                        *(out_pix++) = a;
+                        fprintf(stderr,
+                                "error writing frame: %s\n",
+                                strerror(errno));
+                        return false;
                 }
 
-                if (!write_row(data, width))
-                        return false;
+                out->written += wrote;
+
+                if (out->splice_frame)
+                        out->frame_spliced = true;
+
+                while (n_iov > 0 && wrote >= iov->iov_len) {
+                        wrote -= iov->iov_len;
+                        iov++;
+                        n_iov--;
+                }
+
+                if (n_iov > 0) {
+                        iov->iov_base = (uint8_t *) iov->iov_base + wrote;
+                        iov->iov_len -= wrote;
+                }
         }
 
         return true;
 }
 
 static bool
-write_blank_surface(cairo_surface_t *surface)
+output_flush(struct output *out)
 {
-        /* This assumes the surface is all zeroes so we don’t need to
-         * unpremultiply.
-         */
-        int width = cairo_image_surface_get_width(surface);
-        int height = cairo_image_surface_get_height(surface);
-        const void *data = cairo_image_surface_get_data(surface);
+        FLT_PROFILE_BEGIN(start);
 
-        for (int y = 0; y < height; y++) {
-                if (!write_row(data, width))
-                        return false;
+        bool ret = write_iovecs(out);
+
+        FLT_PROFILE_END(start, FLT_PROFILE_WRITE);
+
+        return ret;
+}
+
+/* Queues data to be written. The data must stay valid until the
+ * frame is finished, or until the reader has consumed it if the frame
+ * is being spliced.
+ */
+static bool
+output_add(struct output *out, const void *data, size_t size)
+{
+        if (size == 0)
+                return true;
+
+        if (out->n_iov > 0) {
+                struct iovec *last = out->iov + out->n_iov - 1;
+
+                if ((const uint8_t *) last->iov_base + last->iov_len ==
+                    data) {
+                        last->iov_len += size;
+                        return true;
+                }
         }
 
+        if (out->n_iov >= OUTPUT_IOVECS && !output_flush(out))
+                return false;
+
+        out->iov[out->n_iov].iov_base = (void *) data;
+        out->iov[out->n_iov].iov_len = size;
+        out->n_iov++;
+
         return true;
 }
 
-int
-main(int argc, char **argv)
+/* Returns a frame buffer that isn’t referenced by the pipe anymore,
+ * or NULL if there isn’t one and too many are already allocated.
+ */
+static uint8_t *
+get_free_frame_buffer(struct output *out)
 {
-        struct flt_scene *scene = flt_scene_new();
-        int ret = EXIT_SUCCESS;
+        if (!flt_list_empty(&out->spliced_buffers)) {
+                struct spliced_buffer *sb =
+                        flt_container_of(out->spliced_buffers.next,
+                                         struct spliced_buffer,
+                                         link);
+                int unread;
 
-        if (argc <= 1) {
-                fprintf(stderr, "usage: <script-file>…\n");
-                ret = EXIT_FAILURE;
-                goto out;
+                if (ioctl(STDOUT_FILENO, FIONREAD, &unread) == 0 &&
+                    out->written - unread >= sb->end) {
+                        uint8_t *data = sb->data;
+
+                        flt_list_remove(&sb->link);
+                        flt_free(sb);
+                        out->n_spliced_buffers--;
+
+                        return data;
+                }
         }
 
-        for (int i = 1; i < argc; i++) {
-                struct flt_error *error = NULL;
-                bool load_ret;
+        if (out->n_spliced_buffers >= MAX_SPLICED_BUFFERS)
+                return NULL;
 
-                if (!strcmp(argv[i], "-")) {
-                        load_ret = flt_parse_stdio(scene,
-                                                   NULL, /* base_dir */
-                                                   stdin,
-                                                   &error);
-                } else {
-                        load_ret = flt_parse_stdio_from_file(scene,
-                                                             argv[i],
-                                                             &error);
+        return alloc_frame_buffer(out->frame_size);
+}
+
+/* Starts writing a frame whose data is in a frame buffer. Returns a
+ * buffer to replace it with if the data is going to be spliced, or
+ * NULL if it will be copied.
+ */
+static uint8_t *
+output_begin_frame(struct output *out)
+{
+        uint8_t *replacement = NULL;
+
+        if (out->use_splice)
+                replacement = get_free_frame_buffer(out);
+
+        out->splice_frame = replacement != NULL;
+        out->frame_spliced = false;
+
+        return replacement;
+}
+
+static bool
+output_end_frame(struct output *out,
+                 uint8_t **data,
+                 uint8_t *replacement)
+{
+        bool ret = output_flush(out);
+
+        if (replacement == NULL)
+                return ret;
+
+        if (out->frame_spliced) {
+                struct spliced_buffer *sb = flt_alloc(sizeof *sb);
+
+                sb->data = *data;
+                sb->end = out->written;
+                flt_list_insert(out->spliced_buffers.prev, &sb->link);
+                out->n_spliced_buffers++;
+
+                *data = replacement;
+        } else {
+                /* The data was copied after falling back to writev
+                 * so the buffer can be kept.
+                 */
+                free_frame_buffer(replacement, out->frame_size);
+        }
+
+        return ret;
+}
+
+/* Gets the part of a plane covered by the damage. The damage should
+ * already be aligned to the subsampling.
+ */
+static void
+get_plane_rect(const struct plane *plane,
+               const cairo_rectangle_int_t *damage,
+               cairo_rectangle_int_t *rect)
+{
+        int round = (1 << plane->shift) - 1;
+
+        rect->x = damage->x >> plane->shift;
+        rect->y = damage->y >> plane->shift;
+        rect->width = (((damage->x + damage->width + round) >> plane->shift) -
+                       rect->x);
+        rect->height = (((damage->y + damage->height + round) >>
+                         plane->shift) -
+                        rect->y);
+}
+
+static bool
+write_blank_rows(struct output *out,
+                 const struct plane *plane,
+                 int y, int n_rows)
+{
+        size_t row_size = plane->width * plane->bytes_per_pixel;
+
+        return output_add(out,
+                          plane->blank + y * row_size,
+                          n_rows * row_size);
+}
+
+static bool
+write_damaged_row(struct output *out,
+                  const struct plane *plane,
+                  const uint8_t *data,
+                  const cairo_rectangle_int_t *rect)
+{
+        int bpp = plane->bytes_per_pixel;
+        int right = plane->width - rect->x - rect->width;
+
+        return (output_add(out, plane->blank, rect->x * bpp) &&
+                output_add(out, data, rect->width * bpp) &&
+                output_add(out, plane->blank, right * bpp));
+}
+
+/* Converts the damaged part of the surface to the output format. The
+ * data for each plane is packed one after the other.
+ */
+static void
+convert_surface(const struct frame_renderer *fr, uint8_t *out)
+{
+        const struct frame_layout *layout = fr->layout;
+        const cairo_rectangle_int_t *damage = &fr->damage;
+        int stride = cairo_image_surface_get_stride(fr->surface);
+        const uint8_t *data = (cairo_image_surface_get_data(fr->surface) +
+                               damage->y * stride +
+                               damage->x * 4);
+
+        if (damage->width <= 0 || damage->height <= 0)
+                return;
+
+        switch (layout->format) {
+        case PIXEL_FORMAT_RGBA:
+                for (int y = 0; y < damage->height; y++) {
+                        flt_unpremultiply_row((const uint32_t *)
+                                              (data + y * stride),
+                                              out + y * damage->width * 4,
+                                              damage->width);
                 }
+                break;
 
-                if (!load_ret) {
-                        fprintf(stderr, "%s\n", error->message);
-                        flt_error_free(error);
-                        ret = EXIT_FAILURE;
-                        goto out;
+        case PIXEL_FORMAT_BGRA:
+                for (int y = 0; y < damage->height; y++) {
+                        const uint32_t *src =
+                                (const uint32_t *) (data + y * stride);
+                        uint8_t *dst = out + y * damage->width * 4;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                        memcpy(dst, src, damage->width * 4);
+#else
+                        for (int x = 0; x < damage->width; x++) {
+                                *(dst++) = src[x];
+                                *(dst++) = src[x] >> 8;
+                                *(dst++) = src[x] >> 16;
+                                *(dst++) = src[x] >> 24;
+                        }
+#endif
                 }
-        }
+                break;
 
-        cairo_surface_t *surface =
-                cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-                                           scene->video_width,
-                                           scene->video_height);
-        cairo_t *cr = cairo_create(surface);
-        bool surface_is_clear = false;
+        case PIXEL_FORMAT_YUVA420P: {
+                uint8_t *planes[4];
+                int strides[4];
 
-        int n_frames = ceil(flt_scene_get_max_timestamp(scene) * FPS);
+                for (int i = 0; i < 4; i++) {
+                        cairo_rectangle_int_t rect;
 
-        struct flt_renderer *renderer = flt_renderer_new(scene);
+                        get_plane_rect(layout->planes + i, damage, &rect);
 
-        for (int frame_num = 0; frame_num < n_frames; frame_num++) {
-                struct flt_error *error = NULL;
+                        planes[i] = out;
+                        strides[i] = rect.width;
+                        out += rect.width * rect.height;
+                }
+
+                flt_composite_to_yuva420p(planes, strides,
+                                          FLT_COMPOSITE_COLORSPACE_BT601,
+                                          data, stride,
+                                          damage->width, damage->height);
+                break;
+        }
+        }
+}
+
+static bool
+write_frame_rows(const struct frame_layout *layout,
+                 struct output *out,
+                 const uint8_t *data,
+                 const cairo_rectangle_int_t *damage)
+{
+        bool ret = true;
 
-                if (!surface_is_clear) {
-                        cairo_save(cr);
-                        cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.0);
-                        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-                        cairo_paint(cr);
-                        cairo_restore(cr);
+        for (int i = 0; i < layout->n_planes && ret; i++) {
+                const struct plane *plane = layout->planes + i;
 
-                        surface_is_clear = true;
+                if (damage->width <= 0 || damage->height <= 0) {
+                        ret = write_blank_rows(out, plane, 0, plane->height);
+                        continue;
                 }
 
-                switch (flt_renderer_render(renderer,
-                                            cr,
-                                            frame_num / (double) FPS,
-                                            &error)) {
-                case FLT_RENDERER_RESULT_ERROR:
-                        fprintf(stderr, "%s\n", error->message);
-                        flt_error_free(error);
-                        ret = EXIT_FAILURE;
-                        goto render_out;
+                cairo_rectangle_int_t rect;
 
-                case FLT_RENDERER_RESULT_EMPTY:
-                        cairo_surface_flush(surface);
+                get_plane_rect(plane, damage, &rect);
 
-                        if (!write_blank_surface(surface)) {
-                                ret = EXIT_FAILURE;
-                                goto render_out;
-                        }
+                if (!write_blank_rows(out, plane, 0, rect.y)) {
+                        ret = false;
                         break;
+                }
 
-                case FLT_RENDERER_RESULT_OK:
-                        surface_is_clear = false;
-
-                        cairo_surface_flush(surface);
+                size_t row_size = rect.width * plane->bytes_per_pixel;
 
-                        if (!write_surface(surface)) {
-                                ret = EXIT_FAILURE;
-                                goto render_out;
+                for (int y = 0; y < rect.height; y++) {
+                        if (!write_damaged_row(out, plane, data, &rect)) {
+                                ret = false;
+                                break;
                         }
-                        break;
+
+                        data += row_size;
                 }
+
+                if (ret) {
+                        int y = rect.y + rect.height;
+
+                        ret = write_blank_rows(out,
+                                               plane,
+                                               y,
+                                               plane->height - y);
+                }
+        }
+
+        return ret;
+}
+
+/* Writes a frame from converted data in a frame buffer. The buffer
+ * might be replaced with a different one if the data was given to
+ * the pipe. The frame is recorded in last so that it can be
+ * repeated.
+ */
+static bool
+write_converted_frame(const struct frame_layout *layout,
+                      struct output *out,
+                      uint8_t **data_ptr,
+                      const cairo_rectangle_int_t *damage,
+                      struct last_frame *last)
+{
+        uint8_t *replacement = output_begin_frame(out);
+        const uint8_t *data = *data_ptr;
+        bool ret = write_frame_rows(layout, out, data, damage);
+
+        if (!output_end_frame(out, data_ptr, replacement))
+                ret = false;
+
+        last->valid = true;
+        last->data = data;
+        last->spliced = out->frame_spliced;
+        last->damage = *damage;
+
+        return ret;
+}
+
+/* Writes the last frame again */
+static bool
+write_repeated_frame(const struct frame_layout *layout,
+                     struct output *out,
+                     const struct last_frame *last)
+{
+        /* The pages of a spliced buffer can be given to the pipe
+         * again because they don’t change until it is recycled.
+         */
+        out->splice_frame = last->spliced && out->use_splice;
+
+        bool ret = (write_frame_rows(layout, out, last->data, &last->damage) &&
+                    output_flush(out));
+
+        if (last->spliced) {
+                /* Keep the buffer until the reader has consumed the
+                 * repeat as well.
+                 */
+                struct spliced_buffer *sb =
+                        flt_container_of(out->spliced_buffers.prev,
+                                         struct spliced_buffer,
+                                         link);
+
+                sb->end = out->written;
         }
 
-render_out:
-        cairo_surface_destroy(surface);
-        cairo_destroy(cr);
+        return ret;
+}
 
-        flt_renderer_free(renderer);
+static bool
+write_surface(struct frame_renderer *fr,
+              struct output *out,
+              struct last_frame *last)
+{
+        FLT_PROFILE_BEGIN(convert_start);
 
-out:
-        flt_scene_free(scene);
+        convert_surface(fr, fr->converted);
+
+        FLT_PROFILE_END(convert_start, FLT_PROFILE_CONVERT);
+
+        return write_converted_frame(fr->layout,
+                                     out,
+                                     &fr->converted,
+                                     &fr->damage,
+                                     last);
+}
+
+static void
+init_blank_frames(struct blank_frames *bf,
+                  const struct flt_scene *scene,
+                  int fps)
+{
+        bf->fps = fps;
+        bf->n_intervals = flt_scene_get_active_intervals(scene,
+                                                         &bf->intervals);
+}
+
+static void
+destroy_blank_frames(struct blank_frames *bf)
+{
+        flt_free(bf->intervals);
+}
+
+/* Returns the number of frames starting from frame_num that are
+ * known to be blank without having to render them.
+ */
+static int
+count_blank_frames(const struct blank_frames *bf,
+                   int frame_num,
+                   int end_frame)
+{
+        double fps = bf->fps;
+        double timestamp = frame_num / fps;
+        size_t min = 0, max = bf->n_intervals;
+
+        /* Find the first interval that ends after the timestamp */
+        while (min < max) {
+                size_t mid = (min + max) / 2;
+
+                if (bf->intervals[mid].end <= timestamp)
+                        min = mid + 1;
+                else
+                        max = mid;
+        }
+
+        if (min >= bf->n_intervals)
+                return end_frame - frame_num;
+
+        double start = bf->intervals[min].start;
+
+        if (start <= timestamp)
+                return 0;
+
+        /* Find the first frame that is within the interval, making
+         * sure to use the same calculation as when rendering.
+         */
+        int next_frame = MIN(ceil(start * fps), end_frame);
+
+        while (next_frame > frame_num && (next_frame - 1) / fps >= start)
+                next_frame--;
+        while (next_frame < end_frame && next_frame / fps < start)
+                next_frame++;
+
+        return next_frame - frame_num;
+}
+
+static bool
+write_blank_frames(const struct frame_layout *layout,
+                   struct output *out,
+                   int n_frames)
+{
+        /* The blank frame never changes so it can always be
+         * spliced.
+         */
+        out->splice_frame = out->use_splice;
+
+        for (int i = 0; i < n_frames; i++) {
+                if (!output_add(out, layout->blank, layout->frame_size))
+                        return false;
+        }
+
+        return output_flush(out);
+}
+
+static bool
+read_stdin(struct flt_buffer *buffer)
+{
+        while (true) {
+                flt_buffer_ensure_size(buffer, buffer->length + 1024);
+
+                size_t got = fread(buffer->data + buffer->length,
+                                   1,
+                                   buffer->size - buffer->length,
+                                   stdin);
+
+                buffer->length += got;
+
+                if (got == 0) {
+                        if (ferror(stdin)) {
+                                fprintf(stderr,
+                                        "error reading stdin: %s\n",
+                                        strerror(errno));
+                                return false;
+                        }
+
+                        return true;
+                }
+        }
+}
+
+static struct flt_scene *
+load_scene(const struct config *config)
+{
+        struct flt_scene *scene = flt_scene_new();
+        const struct script *scripts =
+                (const struct script *) config->scripts.data;
+        size_t n_scripts = config->scripts.length / sizeof (struct script);
+
+        for (size_t i = 0; i < n_scripts; i++) {
+                struct flt_error *error = NULL;
+                bool load_ret;
+
+                const struct flt_buffer *data = &scripts[i].data;
+
+                if (scripts[i].filename == NULL &&
+                    flt_scene_binary_detect(data->data, data->length)) {
+                        load_ret = flt_scene_binary_load(scene,
+                                                         data->data,
+                                                         data->length,
+                                                         &error);
+                } else if (scripts[i].filename == NULL) {
+                        load_ret = flt_parser_parse_memory(scene,
+                                                           data->data,
+                                                           data->length,
+                                                           NULL, /* base_dir */
+                                                           &error);
+                } else {
+                        load_ret = flt_parse_stdio_from_file(scene,
+                                                             scripts[i].
+                                                             filename,
+                                                             &error);
+                }
+
+                if (!load_ret) {
+                        fprintf(stderr, "%s\n", error->message);
+                        flt_error_free(error);
+                        flt_scene_free(scene);
+                        return NULL;
+                }
+        }
+
+        return scene;
+}
+
+static void
+init_frame_renderer(struct frame_renderer *fr,
+                    const struct config *config,
+                    const struct frame_layout *layout,
+                    struct flt_scene *scene)
+{
+        fr->layout = layout;
+        fr->fps = config->fps;
+        fr->scene = scene;
+        fr->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                 scene->video_width,
+                                                 scene->video_height);
+        fr->cr = cairo_create(fr->surface);
+        fr->renderer = flt_renderer_new(scene);
+        if (config->tile_cache_size > 0) {
+                flt_renderer_set_map_tile_cache_size(fr->renderer,
+                                                     config->tile_cache_size);
+        }
+        /* New image surfaces are already cleared */
+        fr->damage.x = fr->damage.y = 0;
+        fr->damage.width = fr->damage.height = 0;
+        fr->converted = alloc_frame_buffer(layout->frame_size);
+}
+
+static void
+destroy_frame_renderer(struct frame_renderer *fr)
+{
+        cairo_destroy(fr->cr);
+        cairo_surface_destroy(fr->surface);
+        flt_renderer_free(fr->renderer);
+        flt_scene_free(fr->scene);
+        free_frame_buffer(fr->converted, fr->layout->frame_size);
+}
+
+static void
+prefetch_map_tiles(struct frame_renderer *fr)
+{
+        struct flt_error *error = NULL;
+
+        /* If this fails then the renderer will try again to download
+         * the tiles when it needs them so it’s not fatal.
+         */
+        if (!flt_renderer_prefetch_map_tiles(fr->renderer, &error)) {
+                fprintf(stderr, "warning: %s\n", error->message);
+                flt_error_free(error);
+        }
+}
+
+/* Clips the damage to the frame. If the format is subsampled the
+ * damage is also expanded to cover whole chroma samples.
+ */
+static void
+clip_damage(cairo_rectangle_int_t *damage,
+            const struct frame_layout *layout)
+{
+        int x1 = MAX(damage->x, 0);
+        int y1 = MAX(damage->y, 0);
+        int x2 = MIN(damage->x + damage->width, layout->width);
+        int y2 = MIN(damage->y + damage->height, layout->height);
+
+        if (layout->format == PIXEL_FORMAT_YUVA420P) {
+                x1 &= ~1;
+                y1 &= ~1;
+                x2 = MIN((x2 + 1) & ~1, layout->width);
+                y2 = MIN((y2 + 1) & ~1, layout->height);
+        }
+
+        if (x2 <= x1 || y2 <= y1) {
+                damage->x = damage->y = 0;
+                damage->width = damage->height = 0;
+        } else {
+                damage->x = x1;
+                damage->y = y1;
+                damage->width = x2 - x1;
+                damage->height = y2 - y1;
+        }
+}
+
+static enum flt_renderer_result
+render_frame(struct frame_renderer *fr,
+             int frame_num,
+             struct flt_error **error)
+{
+        if (fr->damage.width > 0 && fr->damage.height > 0) {
+                cairo_save(fr->cr);
+                cairo_set_source_rgba(fr->cr, 0.0, 0.0, 0.0, 0.0);
+                cairo_set_operator(fr->cr, CAIRO_OPERATOR_SOURCE);
+                cairo_rectangle(fr->cr,
+                                fr->damage.x, fr->damage.y,
+                                fr->damage.width, fr->damage.height);
+                cairo_fill(fr->cr);
+                cairo_restore(fr->cr);
+        }
+
+        enum flt_renderer_result result =
+                flt_renderer_render(fr->renderer,
+                                    fr->cr,
+                                    frame_num / (double) fr->fps,
+                                    error);
+
+        flt_renderer_get_damage(fr->renderer, &fr->damage);
+        clip_damage(&fr->damage, fr->layout);
+
+        cairo_surface_flush(fr->surface);
+
+        return result;
+}
+
+static bool
+render_serial(struct frame_renderer *fr,
+              const struct blank_frames *bf,
+              struct output *out,
+              int start_frame,
+              int end_frame)
+{
+        struct last_frame last = { .valid = false };
+
+        for (int frame_num = start_frame; frame_num < end_frame; frame_num++) {
+                struct flt_error *error = NULL;
+                int n_blank = count_blank_frames(bf, frame_num, end_frame);
+
+                if (n_blank > 0) {
+                        if (!write_blank_frames(fr->layout, out, n_blank))
+                                return false;
+
+                        last.valid = false;
+                        frame_num += n_blank - 1;
+                        continue;
+                }
+
+                uint64_t signature =
+                        flt_renderer_get_signature(fr->renderer,
+                                                   frame_num /
+                                                   (double) fr->fps);
+
+                if (last.valid && last.signature == signature) {
+                        if (!write_repeated_frame(fr->layout, out, &last))
+                                return false;
+                        continue;
+                }
+
+                switch (render_frame(fr, frame_num, &error)) {
+                case FLT_RENDERER_RESULT_ERROR:
+                        fprintf(stderr, "%s\n", error->message);
+                        flt_error_free(error);
+                        return false;
+
+                case FLT_RENDERER_RESULT_EMPTY:
+                case FLT_RENDERER_RESULT_OK:
+                        if (!write_surface(fr, out, &last))
+                                return false;
+                        last.signature = signature;
+                        break;
+                }
+        }
+
+        return true;
+}
+
+/* Checks whether a frame would be the same as the one before so that
+ * the writer can repeat it instead of it being rendered. This
+ * compares the signatures of both frames on the thread’s own
+ * renderer because the frame before is rendered by another thread.
+ */
+static bool
+is_repeated_frame(struct frame_renderer *fr,
+                  const struct render_queue *queue,
+                  int frame_num)
+{
+        if (frame_num <= queue->start_frame ||
+            count_blank_frames(queue->blank_frames,
+                               frame_num - 1,
+                               frame_num) > 0)
+                return false;
+
+        uint64_t prev_signature =
+                flt_renderer_get_signature(fr->renderer,
+                                           (frame_num - 1) / (double) fr->fps);
+        uint64_t signature =
+                flt_renderer_get_signature(fr->renderer,
+                                           frame_num / (double) fr->fps);
+
+        return prev_signature == signature;
+}
+
+static void *
+render_thread_cb(void *user_data)
+{
+        struct render_thread *thread = user_data;
+        struct render_queue *queue = thread->queue;
+
+        pthread_mutex_lock(&queue->mutex);
+
+        while (true) {
+                /* Wait until the frame would fit in the queue */
+                while (!queue->quit &&
+                       queue->next_frame < queue->end_frame &&
+                       queue->next_frame >=
+                       queue->write_frame + queue->n_slots)
+                        pthread_cond_wait(&queue->cond, &queue->mutex);
+
+                if (queue->quit || queue->next_frame >= queue->end_frame)
+                        break;
+
+                int frame_num = queue->next_frame++;
+
+                queue->next_frame += count_blank_frames(queue->blank_frames,
+                                                        queue->next_frame,
+                                                        queue->end_frame);
+                struct frame_slot *slot =
+                        queue->slots + frame_num % queue->n_slots;
+
+                pthread_mutex_unlock(&queue->mutex);
+
+                slot->error = NULL;
+                slot->repeat = is_repeated_frame(&thread->renderer,
+                                                 queue,
+                                                 frame_num);
+
+                if (slot->repeat) {
+                        slot->result = FLT_RENDERER_RESULT_OK;
+                } else {
+                        slot->result = render_frame(&thread->renderer,
+                                                    frame_num,
+                                                    &slot->error);
+
+                        slot->damage = thread->renderer.damage;
+                        convert_surface(&thread->renderer, slot->data);
+                }
+
+                pthread_mutex_lock(&queue->mutex);
+
+                slot->ready = true;
+                pthread_cond_broadcast(&queue->cond);
+        }
+
+        pthread_mutex_unlock(&queue->mutex);
+
+        return NULL;
+}
+
+static bool
+write_queued_frames(struct render_queue *queue,
+                    const struct frame_layout *layout,
+                    struct output *output)
+{
+        struct last_frame last = { .valid = false };
+        /* The slots are reused as soon as their frame is written so
+         * if the data wasn’t spliced it is swapped with this buffer
+         * to keep it for a repeat.
+         */
+        uint8_t *kept_data = alloc_frame_buffer(layout->frame_size);
+        bool ret = true;
+
+        for (int frame_num = queue->write_frame;
+             frame_num < queue->end_frame;
+             frame_num++) {
+                int n_blank = count_blank_frames(queue->blank_frames,
+                                                 frame_num,
+                                                 queue->end_frame);
+
+                if (n_blank > 0) {
+                        if (!write_blank_frames(layout, output, n_blank)) {
+                                ret = false;
+                                goto out;
+                        }
+
+                        last.valid = false;
+
+                        pthread_mutex_lock(&queue->mutex);
+                        queue->write_frame += n_blank;
+                        pthread_cond_broadcast(&queue->cond);
+                        pthread_mutex_unlock(&queue->mutex);
+
+                        frame_num += n_blank - 1;
+                        continue;
+                }
+
+                struct frame_slot *slot =
+                        queue->slots + frame_num % queue->n_slots;
+
+                pthread_mutex_lock(&queue->mutex);
+                while (!slot->ready)
+                        pthread_cond_wait(&queue->cond, &queue->mutex);
+                pthread_mutex_unlock(&queue->mutex);
+
+                switch (slot->result) {
+                case FLT_RENDERER_RESULT_ERROR:
+                        fprintf(stderr, "%s\n", slot->error->message);
+                        ret = false;
+                        goto out;
+
+                case FLT_RENDERER_RESULT_EMPTY:
+                case FLT_RENDERER_RESULT_OK:
+                        if (slot->repeat) {
+                                assert(last.valid);
+                                if (!write_repeated_frame(layout,
+                                                          output,
+                                                          &last)) {
+                                        ret = false;
+                                        goto out;
+                                }
+                                break;
+                        }
+
+                        if (!write_converted_frame(layout,
+                                                   output,
+                                                   &slot->data,
+                                                   &slot->damage,
+                                                   &last)) {
+                                ret = false;
+                                goto out;
+                        }
+
+                        if (!last.spliced) {
+                                uint8_t *tmp = slot->data;
+
+                                slot->data = kept_data;
+                                kept_data = tmp;
+                                last.data = kept_data;
+                        }
+                        break;
+                }
+
+                pthread_mutex_lock(&queue->mutex);
+                slot->ready = false;
+                queue->write_frame++;
+                pthread_cond_broadcast(&queue->cond);
+                pthread_mutex_unlock(&queue->mutex);
+        }
+
+out:
+        free_frame_buffer(kept_data, layout->frame_size);
+
+        return ret;
+}
+
+static bool
+render_threaded(const struct config *config,
+                const struct frame_layout *layout,
+                struct flt_scene *scene,
+                const struct blank_frames *bf,
+                struct output *out,
+                int start_frame,
+                int end_frame)
+{
+        struct render_thread *threads =
+                flt_calloc(config->n_threads * sizeof *threads);
+        int n_started = 0;
+        bool ret = true;
+
+        /* Each thread gets its own copy of the scene because the
+         * RsvgHandles and map tile cache in it aren’t thread-safe.
+         */
+        init_frame_renderer(&threads[0].renderer, config, layout, scene);
+
+        for (int i = 1; i < config->n_threads; i++) {
+                struct flt_scene *thread_scene = load_scene(config);
+
+                if (thread_scene == NULL) {
+                        for (int j = 0; j < i; j++)
+                                destroy_frame_renderer(&threads[j].renderer);
+                        flt_free(threads);
+                        return false;
+                }
+
+                init_frame_renderer(&threads[i].renderer,
+                                    config,
+                                    layout,
+                                    thread_scene);
+        }
+
+        for (int i = 0; i < config->n_threads; i++) {
+                flt_renderer_set_frame_range(threads[i].renderer.renderer,
+                                             config->fps,
+                                             start_frame,
+                                             end_frame);
+        }
+
+        /* The tiles are shared between the threads via the tile
+         * cache directory.
+         */
+        prefetch_map_tiles(&threads[0].renderer);
+
+        struct render_queue queue = {
+                .start_frame = start_frame,
+                .end_frame = end_frame,
+                .blank_frames = bf,
+                .next_frame = (start_frame +
+                               count_blank_frames(bf,
+                                                  start_frame,
+                                                  end_frame)),
+                .write_frame = start_frame,
+                .quit = false,
+                .n_slots = config->n_threads * QUEUED_FRAMES_PER_THREAD,
+        };
+
+        queue.slots = flt_calloc(queue.n_slots * sizeof *queue.slots);
+
+        for (int i = 0; i < queue.n_slots; i++)
+                queue.slots[i].data = alloc_frame_buffer(layout->frame_size);
+
+        pthread_mutex_init(&queue.mutex, NULL);
+        pthread_cond_init(&queue.cond, NULL);
+
+        for (int i = 0; i < config->n_threads; i++) {
+                threads[i].queue = &queue;
+
+                int res = pthread_create(&threads[i].thread,
+                                         NULL, /* attr */
+                                         render_thread_cb,
+                                         threads + i);
+
+                if (res) {
+                        fprintf(stderr,
+                                "error creating thread: %s\n",
+                                strerror(res));
+                        ret = false;
+                        break;
+                }
+
+                n_started++;
+        }
+
+        if (ret) {
+                ret = write_queued_frames(&queue, layout, out);
+        }
+
+        pthread_mutex_lock(&queue.mutex);
+        queue.quit = true;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.mutex);
+
+        for (int i = 0; i < n_started; i++)
+                pthread_join(threads[i].thread, NULL);
+
+        for (int i = 0; i < queue.n_slots; i++) {
+                /* Frames that were rendered but never written can
+                 * still have an error.
+                 */
+                if (queue.slots[i].ready &&
+                    queue.slots[i].result == FLT_RENDERER_RESULT_ERROR)
+                        flt_error_free(queue.slots[i].error);
+                free_frame_buffer(queue.slots[i].data, layout->frame_size);
+        }
+
+        flt_free(queue.slots);
+
+        pthread_cond_destroy(&queue.cond);
+        pthread_mutex_destroy(&queue.mutex);
+
+        for (int i = 0; i < config->n_threads; i++)
+                destroy_frame_renderer(&threads[i].renderer);
+
+        flt_free(threads);
+
+        return ret;
+}
+
+static bool
+parse_positive_int(const char *str, int *value_out)
+{
+        errno = 0;
+
+        char *tail;
+
+        long value = strtol(str, &tail, 10);
+
+        if (value <= 0 || value > INT_MAX || errno || *tail)
+                return false;
+
+        *value_out = value;
+
+        return true;
+}
+
+static bool
+parse_time(const char *str, double *value)
+{
+        char *tail;
+
+        errno = 0;
+
+        *value = strtod(str, &tail);
+
+        return (errno == 0 &&
+                (isnormal(*value) || *value == 0.0) &&
+                *tail == '\0' &&
+                *value >= 0.0);
+}
+
+/* Returns the number of the first frame whose timestamp is at or
+ * after the given time.
+ */
+static int
+get_first_frame_at(double time, int fps)
+{
+        double frame = ceil(time * fps);
+
+        if (frame >= INT_MAX)
+                return INT_MAX;
+
+        int frame_num = frame;
+
+        while (frame_num > 0 && (frame_num - 1) / (double) fps >= time)
+                frame_num--;
+        while (frame_num / (double) fps < time)
+                frame_num++;
+
+        return frame_num;
+}
+
+static void
+add_script(struct config *config,
+           const char *filename)
+{
+        flt_buffer_set_length(&config->scripts,
+                              config->scripts.length +
+                              sizeof (struct script));
+
+        struct script *script =
+                (struct script *) (config->scripts.data +
+                                   config->scripts.length) - 1;
+
+        script->filename = filename;
+        flt_buffer_init(&script->data);
+}
+
+#ifdef FLT_ENABLE_PROFILE
+#define PROFILE_OPTIONS "ST:"
+#define PROFILE_USAGE "[-S] [-T <trace-file>] "
+#else
+#define PROFILE_OPTIONS ""
+#define PROFILE_USAGE ""
+#endif
+
+static bool
+process_options(int argc, char **argv, struct config *config)
+{
+        config->n_threads = 1;
+        config->fps = DEFAULT_FPS;
+        config->start_time = 0.0;
+        config->end_time = -1.0;
+        config->tile_cache_size = 0;
+        config->pixel_format = PIXEL_FORMAT_RGBA;
+        config->compile_output = NULL;
+        flt_buffer_init(&config->scripts);
+#ifdef FLT_ENABLE_PROFILE
+        config->print_stats = false;
+        config->trace_file = NULL;
+#endif
+
+        while (true) {
+                int megabytes;
+
+                switch (getopt(argc, argv,
+                               "-j:c:f:s:e:r:C:" PROFILE_OPTIONS)) {
+                case 'j':
+                        if (!parse_positive_int(optarg, &config->n_threads)) {
+                                fprintf(stderr,
+                                        "invalid number of threads: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'c':
+                        if (!parse_positive_int(optarg, &megabytes)) {
+                                fprintf(stderr,
+                                        "invalid tile cache size: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        config->tile_cache_size =
+                                (size_t) megabytes * 1024 * 1024;
+                        break;
+
+                case 's':
+                        if (!parse_time(optarg, &config->start_time)) {
+                                fprintf(stderr,
+                                        "invalid start time: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'e':
+                        if (!parse_time(optarg, &config->end_time)) {
+                                fprintf(stderr,
+                                        "invalid end time: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'r':
+                        if (!parse_positive_int(optarg, &config->fps)) {
+                                fprintf(stderr,
+                                        "invalid frame rate: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'f':
+                        if (!strcmp(optarg, "rgba")) {
+                                config->pixel_format = PIXEL_FORMAT_RGBA;
+                        } else if (!strcmp(optarg, "bgra")) {
+                                config->pixel_format = PIXEL_FORMAT_BGRA;
+                        } else if (!strcmp(optarg, "yuva420p")) {
+                                config->pixel_format = PIXEL_FORMAT_YUVA420P;
+                        } else {
+                                fprintf(stderr,
+                                        "unknown pixel format: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'C':
+                        config->compile_output = optarg;
+                        break;
+
+#ifdef FLT_ENABLE_PROFILE
+                case 'S':
+                        config->print_stats = true;
+                        break;
+
+                case 'T':
+                        config->trace_file = optarg;
+                        break;
+#endif
+
+                case 1:
+                        if (!strcmp(optarg, "-")) {
+                                add_script(config, NULL);
+
+                                struct script *script =
+                                        (struct script *)
+                                        (config->scripts.data +
+                                         config->scripts.length) - 1;
+
+                                if (!read_stdin(&script->data))
+                                        return false;
+                        } else {
+                                add_script(config, optarg);
+                        }
+                        break;
+
+                case -1:
+                        goto done;
+
+                default:
+                        return false;
+                }
+        }
+
+done:
+        if (config->scripts.length == 0) {
+                fprintf(stderr,
+                        "usage: [-j <threads>] [-c <tile-cache-MiB>] "
+                        "[-f rgba|bgra|yuva420p] [-s <start>] [-e <end>] "
+                        "[-r <fps>] [-C <compiled-scene>] "
+                        PROFILE_USAGE
+                        "<script-file>…\n");
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+compile_scene(const struct flt_scene *scene,
+              const char *filename)
+{
+        FILE *out = fopen(filename, "wb");
+
+        if (out == NULL) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                return false;
+        }
+
+        struct flt_error *error = NULL;
+        bool ret = flt_scene_binary_write(scene, out, &error);
+
+        if (!ret) {
+                fprintf(stderr, "%s: %s\n", filename, error->message);
+                flt_error_free(error);
+        }
+
+        if (fclose(out) == EOF && ret) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                ret = false;
+        }
+
+        return ret;
+}
+
+static void
+destroy_config(struct config *config)
+{
+        struct script *scripts = (struct script *) config->scripts.data;
+        size_t n_scripts = config->scripts.length / sizeof (struct script);
+
+        for (size_t i = 0; i < n_scripts; i++)
+                flt_buffer_destroy(&scripts[i].data);
+
+        flt_buffer_destroy(&config->scripts);
+}
+
+#ifdef FLT_ENABLE_PROFILE
+static bool
+finish_profile(const struct config *config)
+{
+        bool ret = true;
+
+        if (config->print_stats)
+                flt_profile_print_stats(stderr);
+
+        if (config->trace_file) {
+                struct flt_error *error = NULL;
+
+                if (!flt_profile_write_trace(config->trace_file, &error)) {
+                        fprintf(stderr, "%s\n", error->message);
+                        flt_error_free(error);
+                        ret = false;
+                }
+        }
+
+        flt_profile_stop();
+
+        return ret;
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+        struct config config;
+        int ret = EXIT_SUCCESS;
+
+        if (!process_options(argc, argv, &config)) {
+                ret = EXIT_FAILURE;
+                goto out;
+        }
+
+#ifdef FLT_ENABLE_PROFILE
+        flt_profile_start(config.trace_file != NULL);
+#endif
+
+        struct flt_scene *scene = load_scene(&config);
+
+        if (scene == NULL) {
+                ret = EXIT_FAILURE;
+                goto out;
+        }
+
+        if (config.compile_output) {
+                if (!compile_scene(scene, config.compile_output))
+                        ret = EXIT_FAILURE;
+                flt_scene_free(scene);
+                goto out;
+        }
+
+        double end_time = config.end_time;
+
+        if (end_time < 0.0)
+                end_time = flt_scene_get_max_timestamp(scene);
+
+        /* Frames are numbered from the start of the scene so that
+         * rendering a range gives the same frames as rendering the
+         * whole scene.
+         */
+        int start_frame = get_first_frame_at(config.start_time, config.fps);
+        int end_frame = MAX(get_first_frame_at(end_time, config.fps),
+                            start_frame);
+        struct frame_layout layout;
+        struct blank_frames bf;
+        struct output output;
+
+        if (!init_frame_layout(&layout,
+                               config.pixel_format,
+                               scene->video_width,
+                               scene->video_height)) {
+                flt_scene_free(scene);
+                ret = EXIT_FAILURE;
+                goto out;
+        }
+
+        init_blank_frames(&bf, scene, config.fps);
+        init_output(&output, layout.frame_size);
+
+        /* The map renderers can be created from the threads so make
+         * sure curl’s global state is initialised before that because
+         * it isn’t thread-safe.
+         */
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+
+        if (config.n_threads > 1) {
+                if (!render_threaded(&config,
+                                     &layout,
+                                     scene,
+                                     &bf,
+                                     &output,
+                                     start_frame,
+                                     end_frame))
+                        ret = EXIT_FAILURE;
+        } else {
+                struct frame_renderer fr;
+
+                init_frame_renderer(&fr, &config, &layout, scene);
+                flt_renderer_set_frame_range(fr.renderer,
+                                             config.fps,
+                                             start_frame,
+                                             end_frame);
+                prefetch_map_tiles(&fr);
+
+                if (!render_serial(&fr,
+                                   &bf,
+                                   &output,
+                                   start_frame,
+                                   end_frame))
+                        ret = EXIT_FAILURE;
+
+                destroy_frame_renderer(&fr);
+        }
+
+        curl_global_cleanup();
+
+        destroy_output(&output);
+        destroy_blank_frames(&bf);
+        destroy_frame_layout(&layout);
+
+out:
+#ifdef FLT_ENABLE_PROFILE
+        if (ret == EXIT_SUCCESS && !finish_profile(&config))
+                ret = EXIT_FAILURE;
+#endif
+
+        destroy_config(&config);
 
         return ret;
 }
@@ -20,17 +20,67 @@
 #define FLOOTAY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <cairo.h>
 
+/* Thread safety:
+ *
+ * A struct flootay holds the scene loaded from a script and the
+ * caches that can be shared between threads. To render from several
+ * threads at the same time, create a struct flootay_context for each
+ * thread with flootay_context_new. Each context has its own render
+ * state and can only be used by one thread at a time, but different
+ * contexts of the same flootay can render at the same time.
+ *
+ * The functions that take a struct flootay instead of a context use a
+ * default context that belongs to the flootay so they count as using
+ * that context.
+ *
+ * Loading a script, creating or freeing a context and freeing the
+ * flootay must not happen while any context is rendering.
+ */
+
 struct flootay;
 
+struct flootay_context;
+
 enum flootay_render_result {
         FLOOTAY_RENDER_RESULT_ERROR,
         FLOOTAY_RENDER_RESULT_EMPTY,
         FLOOTAY_RENDER_RESULT_OK,
 };
 
+enum flootay_pixel_format {
+        /* Four bytes per pixel in this order with unpremultiplied
+         * alpha.
+         */
+        FLOOTAY_PIXEL_FORMAT_RGBA,
+        FLOOTAY_PIXEL_FORMAT_BGRA,
+        /* Three planes with the chroma subsampled by two in both
+         * directions, using limited range.
+         */
+        FLOOTAY_PIXEL_FORMAT_YUV420P,
+};
+
+enum flootay_colorspace {
+        FLOOTAY_COLORSPACE_BT601,
+        FLOOTAY_COLORSPACE_BT709,
+};
+
+/* A video frame owned by the host, such as an AVFrame from
+ * libavfilter.
+ */
+struct flootay_frame {
+        enum flootay_pixel_format format;
+        /* Only used for YUV formats */
+        enum flootay_colorspace colorspace;
+        int width, height;
+        /* For packed formats only the first plane is used */
+        uint8_t *planes[3];
+        int strides[3];
+};
+
 struct flootay *
 flootay_new(void);
 
@@ -39,7 +89,11 @@ flootay_get_error(struct flootay *flootay);
 
 /* base_dir is the base directory to load additional resources from
  * that are referenced by the script. It can be NULL to use the
- * current directory.
+ * current directory. The script can be loaded again to replace the
+ * previous one. Any referenced files that haven’t changed since the
+ * last load are reused instead of being loaded again. The file can
+ * also be a scene compiled with “flootay -C”, which is mapped instead
+ * of being parsed.
  */
 bool
 flootay_load_script(struct flootay *flootay,
@@ -51,7 +105,112 @@ flootay_render(struct flootay *flootay,
                cairo_t *cr,
                double timestamp);
 
+/* Renders the overlay for the timestamp and composites it directly
+ * onto the frame. Only the parts of the frame that are covered by the
+ * overlay are touched. Consecutive frames of the same size reuse an
+ * internal surface so nothing is allocated per frame.
+ */
+enum flootay_render_result
+flootay_render_frame(struct flootay *flootay,
+                     const struct flootay_frame *frame,
+                     double timestamp);
+
+/* Gets the bounding box in device space of everything that was drawn
+ * during the last successful call to flootay_render. Anything outside
+ * of this box was left untouched so a host only needs to composite
+ * this region. The box isn’t clipped to the size of the target. If
+ * nothing was drawn then the width and height will be zero.
+ */
+void
+flootay_get_damage(struct flootay *flootay,
+                   cairo_rectangle_int_t *damage);
+
+/* The contexts are freed along with the flootay if they haven’t
+ * already been freed.
+ */
 void
 flootay_free(struct flootay *flootay);
 
+/* Creates a context to render the scene of the flootay. The context
+ * keeps working when a new script is loaded.
+ */
+struct flootay_context *
+flootay_context_new(struct flootay *flootay);
+
+/* Gets the message for the last render error in the context */
+const char *
+flootay_context_get_error(struct flootay_context *context);
+
+/* These are the same as the functions without “context” in the name
+ * except that they use the given context.
+ */
+enum flootay_render_result
+flootay_context_render(struct flootay_context *context,
+                       cairo_t *cr,
+                       double timestamp);
+
+enum flootay_render_result
+flootay_context_render_frame(struct flootay_context *context,
+                             const struct flootay_frame *frame,
+                             double timestamp);
+
+void
+flootay_context_get_damage(struct flootay_context *context,
+                           cairo_rectangle_int_t *damage);
+
+/* Renders n_frames consecutive frames starting from start_time. Frame
+ * i is rendered at start_time + i / frame_rate into frames[i] like
+ * flootay_context_render_frame, and its result is stored in
+ * results[i]. The frames can be different buffers or the same one if
+ * the host consumes them one at a time. Returns false with the error
+ * set in the context if a frame fails. In that case the results after
+ * the failed frame aren’t set.
+ */
+bool
+flootay_context_render_frames(struct flootay_context *context,
+                              const struct flootay_frame *frames,
+                              size_t n_frames,
+                              double start_time,
+                              double frame_rate,
+                              enum flootay_render_result *results);
+
+struct flootay_batch_frame {
+        size_t frame_num;
+        double timestamp;
+        enum flootay_render_result result;
+        /* The part of the surface that was drawn to, clipped to the
+         * surface. The width and height are zero if the frame is
+         * empty.
+         */
+        cairo_rectangle_int_t damage;
+};
+
+/* The surface is a premultiplied ARGB32 image owned by the context.
+ * Everything outside the damage rectangle is transparent. The surface
+ * is reused for the next frame so if the host wants to keep the image
+ * it needs to copy it. Return false to stop the batch early.
+ */
+typedef bool
+(* flootay_batch_cb)(const struct flootay_batch_frame *frame,
+                     cairo_surface_t *surface,
+                     void *user_data);
+
+/* Renders the frames in the same way as flootay_context_render_frames
+ * but into a surface of the given size that is passed to the
+ * callback. Between frames only the damaged part of the previous frame
+ * is cleared. Returns false with the error set in the context if a
+ * frame fails.
+ */
+bool
+flootay_context_render_batch(struct flootay_context *context,
+                             int width, int height,
+                             double start_time,
+                             double frame_rate,
+                             size_t n_frames,
+                             flootay_batch_cb cb,
+                             void *user_data);
+
+void
+flootay_context_free(struct flootay_context *context);
+
 #endif /* FLOOTAY_H */
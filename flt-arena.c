@@ -0,0 +1,131 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-arena.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "flt-util.h"
+
+/* Size of the usable space in a normal chunk */
+#define CHUNK_SIZE (64 * 1024)
+
+/* Allocations bigger than this get a chunk of their own so that the
+ * rest of the current chunk isn’t wasted.
+ */
+#define MAX_SHARED_ALLOCATION (CHUNK_SIZE / 4)
+
+#define ALIGNMENT (sizeof (max_align_t))
+#define ALIGN(x) (((x) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+struct flt_arena_chunk {
+        struct flt_arena_chunk *next;
+        size_t size;
+        size_t used;
+};
+
+#define CHUNK_HEADER_SIZE ALIGN(sizeof (struct flt_arena_chunk))
+
+void
+flt_arena_init(struct flt_arena *arena)
+{
+        arena->chunks = NULL;
+}
+
+static struct flt_arena_chunk *
+allocate_chunk(size_t size)
+{
+        struct flt_arena_chunk *chunk = flt_alloc(CHUNK_HEADER_SIZE + size);
+
+        chunk->size = size;
+        chunk->used = 0;
+
+        return chunk;
+}
+
+static void *
+get_chunk_data(struct flt_arena_chunk *chunk, size_t offset)
+{
+        return (uint8_t *) chunk + CHUNK_HEADER_SIZE + offset;
+}
+
+void *
+flt_arena_alloc(struct flt_arena *arena,
+                size_t size)
+{
+        size = ALIGN(size);
+
+        struct flt_arena_chunk *chunk = arena->chunks;
+
+        if (size > MAX_SHARED_ALLOCATION) {
+                struct flt_arena_chunk *big_chunk = allocate_chunk(size);
+
+                big_chunk->used = size;
+
+                /* Add the chunk after the current one so that the
+                 * current one can still be used for small allocations.
+                 */
+                if (chunk) {
+                        big_chunk->next = chunk->next;
+                        chunk->next = big_chunk;
+                } else {
+                        big_chunk->next = NULL;
+                        arena->chunks = big_chunk;
+                }
+
+                return get_chunk_data(big_chunk, 0);
+        }
+
+        if (chunk == NULL || chunk->size - chunk->used < size) {
+                chunk = allocate_chunk(CHUNK_SIZE);
+                chunk->next = arena->chunks;
+                arena->chunks = chunk;
+        }
+
+        void *result = get_chunk_data(chunk, chunk->used);
+
+        chunk->used += size;
+
+        return result;
+}
+
+void *
+flt_arena_calloc(struct flt_arena *arena,
+                 size_t size)
+{
+        void *result = flt_arena_alloc(arena, size);
+
+        memset(result, 0, size);
+
+        return result;
+}
+
+void
+flt_arena_destroy(struct flt_arena *arena)
+{
+        struct flt_arena_chunk *chunk, *next;
+
+        for (chunk = arena->chunks; chunk; chunk = next) {
+                next = chunk->next;
+                flt_free(chunk);
+        }
+
+        arena->chunks = NULL;
+}
@@ -0,0 +1,51 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_ARENA_H
+#define FLT_ARENA_H
+
+#include <stdlib.h>
+
+/* Allocator that hands out memory from large chunks. The memory
+ * can’t be freed individually but all of it is released at once when
+ * the arena is destroyed.
+ */
+
+struct flt_arena_chunk;
+
+struct flt_arena {
+        struct flt_arena_chunk *chunks;
+};
+
+#define FLT_ARENA_STATIC_INIT { .chunks = NULL }
+
+void
+flt_arena_init(struct flt_arena *arena);
+
+void *
+flt_arena_alloc(struct flt_arena *arena,
+                size_t size);
+
+void *
+flt_arena_calloc(struct flt_arena *arena,
+                 size_t size);
+
+void
+flt_arena_destroy(struct flt_arena *arena);
+
+#endif /* FLT_ARENA_H */
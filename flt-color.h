@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_COLOR
-#define FLT_COLOR
+#ifndef FLT_COLOR_H
+#define FLT_COLOR_H
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -25,4 +25,4 @@
 bool
 flt_color_lookup(const char *name, uint32_t *value);
 
-#endif /* FLT_COLOR */
+#endif /* FLT_COLOR_H */
@@ -0,0 +1,274 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-composite.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The YUV coefficients are fixed point with 16 bits of fraction */
+#define FRACTION_BITS 16
+
+struct yuv_matrix {
+        int32_t y[3], u[3], v[3];
+};
+
+/* Divides by 255 with rounding for values up to 255 × 255 */
+static inline uint32_t
+div255(uint32_t value)
+{
+        value += 128;
+
+        return (value + (value >> 8)) >> 8;
+}
+
+static inline uint8_t
+clamp_byte(int32_t value)
+{
+        return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+void
+flt_composite_rgba(uint8_t *dst, int dst_stride,
+                   const uint8_t *src, int src_stride,
+                   int width, int height,
+                   bool swap_rb)
+{
+        int r_pos = swap_rb ? 2 : 0;
+        int b_pos = swap_rb ? 0 : 2;
+
+        for (int y = 0; y < height; y++) {
+                const uint32_t *s = (const uint32_t *) (src + y * src_stride);
+                uint8_t *d = dst + y * dst_stride;
+
+                for (int x = 0; x < width; x++, d += 4) {
+                        uint32_t pixel = s[x];
+                        uint32_t a = pixel >> 24;
+
+                        if (a == 0)
+                                continue;
+
+                        uint32_t inv = 255 - a;
+
+                        d[r_pos] = ((pixel >> 16) & 0xff) + div255(d[r_pos] *
+                                                                   inv);
+                        d[1] = ((pixel >> 8) & 0xff) + div255(d[1] * inv);
+                        d[b_pos] = (pixel & 0xff) + div255(d[b_pos] * inv);
+                        d[3] = a + div255(d[3] * inv);
+                }
+        }
+}
+
+static void
+get_yuv_matrix(enum flt_composite_colorspace colorspace,
+               struct yuv_matrix *matrix)
+{
+        double kr, kb;
+
+        switch (colorspace) {
+        case FLT_COMPOSITE_COLORSPACE_BT709:
+                kr = 0.2126;
+                kb = 0.0722;
+                break;
+        case FLT_COMPOSITE_COLORSPACE_BT601:
+        default:
+                kr = 0.299;
+                kb = 0.114;
+                break;
+        }
+
+        double kg = 1.0 - kr - kb;
+        /* Scale for limited range where the components are stored as
+         * 0-255.
+         */
+        double ys = 219.0 / 255.0 * (1 << FRACTION_BITS);
+        double cs = 224.0 / 255.0 * (1 << FRACTION_BITS);
+
+        matrix->y[0] = lround(kr * ys);
+        matrix->y[1] = lround(kg * ys);
+        matrix->y[2] = lround(kb * ys);
+        matrix->u[0] = lround(-kr / (2.0 * (1.0 - kb)) * cs);
+        matrix->u[1] = lround(-kg / (2.0 * (1.0 - kb)) * cs);
+        matrix->u[2] = lround(0.5 * cs);
+        matrix->v[0] = lround(0.5 * cs);
+        matrix->v[1] = lround(-kg / (2.0 * (1.0 - kr)) * cs);
+        matrix->v[2] = lround(-kb / (2.0 * (1.0 - kr)) * cs);
+}
+
+/* Blends a premultiplied Y, U or V value given by the dot product
+ * of the coefficients with the premultiplied colour, plus the offset
+ * scaled by the alpha. The alpha weights are multiplied by 257 to
+ * scale them from 0-255 to the fixed point fraction.
+ */
+static inline uint8_t
+blend_component(const int32_t coeffs[3],
+                const uint32_t rgb[3],
+                uint32_t alpha,
+                int offset,
+                uint8_t dst)
+{
+        int32_t value = (coeffs[0] * (int32_t) rgb[0] +
+                         coeffs[1] * (int32_t) rgb[1] +
+                         coeffs[2] * (int32_t) rgb[2] +
+                         (int32_t) (offset * 257 * alpha) +
+                         (int32_t) (dst * 257 * (255 - alpha)) +
+                         (1 << (FRACTION_BITS - 1)));
+
+        return clamp_byte(value >> FRACTION_BITS);
+}
+
+static void
+composite_luma_row(uint8_t *dst,
+                   const uint32_t *src,
+                   int width,
+                   const struct yuv_matrix *matrix)
+{
+        for (int x = 0; x < width; x++) {
+                uint32_t pixel = src[x];
+                uint32_t a = pixel >> 24;
+
+                if (a == 0)
+                        continue;
+
+                uint32_t rgb[3] = {
+                        (pixel >> 16) & 0xff,
+                        (pixel >> 8) & 0xff,
+                        pixel & 0xff,
+                };
+
+                dst[x] = blend_component(matrix->y, rgb, a, 16, dst[x]);
+        }
+}
+
+static void
+composite_chroma_row(uint8_t *u_dst,
+                     uint8_t *v_dst,
+                     const uint32_t *src0,
+                     const uint32_t *src1,
+                     int width,
+                     const struct yuv_matrix *matrix)
+{
+        for (int x = 0; x < width; x += 2) {
+                uint32_t sum[4] = { 0 };
+                int n_pixels = 0;
+
+                for (int dx = 0; dx < 2 && x + dx < width; dx++) {
+                        for (int row = 0; row < 2; row++) {
+                                const uint32_t *s = row ? src1 : src0;
+
+                                if (s == NULL)
+                                        continue;
+
+                                uint32_t pixel = s[x + dx];
+
+                                sum[0] += (pixel >> 16) & 0xff;
+                                sum[1] += (pixel >> 8) & 0xff;
+                                sum[2] += pixel & 0xff;
+                                sum[3] += pixel >> 24;
+                                n_pixels++;
+                        }
+                }
+
+                if (sum[3] == 0)
+                        continue;
+
+                /* Average the block with rounding */
+                for (int i = 0; i < 4; i++)
+                        sum[i] = (sum[i] + n_pixels / 2) / n_pixels;
+
+                u_dst[x / 2] = blend_component(matrix->u,
+                                               sum,
+                                               sum[3],
+                                               128,
+                                               u_dst[x / 2]);
+                v_dst[x / 2] = blend_component(matrix->v,
+                                               sum,
+                                               sum[3],
+                                               128,
+                                               v_dst[x / 2]);
+        }
+}
+
+void
+flt_composite_yuv420p(uint8_t *const planes[3], const int strides[3],
+                      enum flt_composite_colorspace colorspace,
+                      const uint8_t *src, int src_stride,
+                      int x, int y,
+                      int width, int height)
+{
+        struct yuv_matrix matrix;
+
+        get_yuv_matrix(colorspace, &matrix);
+
+        for (int row = 0; row < height; row++) {
+                composite_luma_row(planes[0] + (y + row) * strides[0] + x,
+                                   (const uint32_t *)
+                                   (src + row * src_stride),
+                                   width,
+                                   &matrix);
+        }
+
+        for (int row = 0; row < height; row += 2) {
+                int chroma_y = (y + row) / 2;
+                const uint32_t *src0 =
+                        (const uint32_t *) (src + row * src_stride);
+                const uint32_t *src1 =
+                        row + 1 < height ?
+                        (const uint32_t *) (src + (row + 1) * src_stride) :
+                        NULL;
+
+                composite_chroma_row(planes[1] + chroma_y * strides[1] + x / 2,
+                                     planes[2] + chroma_y * strides[2] + x / 2,
+                                     src0,
+                                     src1,
+                                     width,
+                                     &matrix);
+        }
+}
+
+void
+flt_composite_to_yuva420p(uint8_t *const planes[4], const int strides[4],
+                          enum flt_composite_colorspace colorspace,
+                          const uint8_t *src, int src_stride,
+                          int width, int height)
+{
+        int chroma_width = (width + 1) / 2;
+        int chroma_height = (height + 1) / 2;
+
+        for (int y = 0; y < height; y++) {
+                const uint32_t *s = (const uint32_t *) (src + y * src_stride);
+                uint8_t *alpha = planes[3] + y * strides[3];
+
+                memset(planes[0] + y * strides[0], 0, width);
+
+                for (int x = 0; x < width; x++)
+                        alpha[x] = s[x] >> 24;
+        }
+
+        for (int y = 0; y < chroma_height; y++) {
+                memset(planes[1] + y * strides[1], 128, chroma_width);
+                memset(planes[2] + y * strides[2], 128, chroma_width);
+        }
+
+        flt_composite_yuv420p(planes, strides,
+                              colorspace,
+                              src, src_stride,
+                              0, 0,
+                              width, height);
+}
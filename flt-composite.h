@@ -0,0 +1,68 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_COMPOSITE_H
+#define FLT_COMPOSITE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Functions to composite premultiplied native-endian ARGB32 pixels,
+ * as used by cairo image surfaces, over video frames in their own
+ * pixel format.
+ */
+
+enum flt_composite_colorspace {
+        FLT_COMPOSITE_COLORSPACE_BT601,
+        FLT_COMPOSITE_COLORSPACE_BT709,
+};
+
+/* Composites over a frame with four bytes per pixel in the order
+ * R, G, B, A, or B, G, R, A if swap_rb is set. The destination alpha
+ * is assumed to be unpremultiplied.
+ */
+void
+flt_composite_rgba(uint8_t *dst, int dst_stride,
+                   const uint8_t *src, int src_stride,
+                   int width, int height,
+                   bool swap_rb);
+
+/* Composites over a planar YUV frame with the chroma planes
+ * subsampled by two in both directions, using limited range. src
+ * points to the pixel at x, y which must both be even. The width and
+ * height can only be odd at the edges of the frame.
+ */
+void
+flt_composite_yuv420p(uint8_t *const planes[3], const int strides[3],
+                      enum flt_composite_colorspace colorspace,
+                      const uint8_t *src, int src_stride,
+                      int x, int y,
+                      int width, int height);
+
+/* Converts to YUV with premultiplied alpha in four planes, as used by
+ * ffmpeg’s yuva420p format with the overlay filter’s premultiplied
+ * mode. The result is the same as compositing onto transparent
+ * planes.
+ */
+void
+flt_composite_to_yuva420p(uint8_t *const planes[4], const int strides[4],
+                          enum flt_composite_colorspace colorspace,
+                          const uint8_t *src, int src_stride,
+                          int width, int height);
+
+#endif /* FLT_COMPOSITE_H */
@@ -22,20 +22,270 @@
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "flt-child-proc.h"
 #include "flt-util.h"
+#include "flt-buffer.h"
 
-bool
-flt_get_video_length(const char *filename,
-                     double *length_out)
+/* The results of ffprobe are cached in a file with this name in the
+ * same directory as the media file. The same file is used by
+ * speedy.py. Each line has the basename, size, modification time in
+ * nanoseconds, duration, width and height of a file separated by
+ * tabs.
+ */
+#define PROBE_CACHE_FILENAME ".flootay-probe"
+
+#define N_CACHE_FIELDS 6
+
+struct probe_info {
+        double duration;
+        /* Zero if the file has no video */
+        int width, height;
+};
+
+static int64_t
+get_mtime_ns(const struct stat *statbuf)
+{
+        return (statbuf->st_mtim.tv_sec * INT64_C(1000000000) +
+                statbuf->st_mtim.tv_nsec);
+}
+
+static char *
+get_cache_filename(const char *filename, const char **basename_out)
+{
+        const char *slash = strrchr(filename, '/');
+
+        if (slash == NULL) {
+                *basename_out = filename;
+                return flt_strdup(PROBE_CACHE_FILENAME);
+        }
+
+        *basename_out = slash + 1;
+
+        char *dir = flt_strndup(filename, slash + 1 - filename);
+        char *cache_filename = flt_strconcat(dir, PROBE_CACHE_FILENAME, NULL);
+
+        flt_free(dir);
+
+        return cache_filename;
+}
+
+/* Splits a line of the cache into its fields. The line is modified. */
+static bool
+split_cache_line(char *line, char *fields[N_CACHE_FIELDS])
+{
+        for (int i = 0; i < N_CACHE_FIELDS; i++) {
+                fields[i] = line;
+
+                char *end = line + strcspn(line, "\t\n");
+
+                if (i < N_CACHE_FIELDS - 1) {
+                        if (*end != '\t')
+                                return false;
+                } else if (*end == '\t') {
+                        return false;
+                }
+
+                *end = '\0';
+                line = end + 1;
+        }
+
+        return true;
+}
+
+static bool
+parse_cache_line(char *line,
+                 const char *basename,
+                 const struct stat *statbuf,
+                 struct probe_info *info)
+{
+        char *fields[N_CACHE_FIELDS];
+
+        if (!split_cache_line(line, fields) || strcmp(fields[0], basename))
+                return false;
+
+        char *tail;
+
+        errno = 0;
+
+        if (strtoll(fields[1], &tail, 10) != statbuf->st_size ||
+            *tail ||
+            strtoll(fields[2], &tail, 10) != get_mtime_ns(statbuf) ||
+            *tail ||
+            errno)
+                return false;
+
+        info->duration = strtod(fields[3], &tail);
+
+        if (*tail || errno || !isfinite(info->duration))
+                return false;
+
+        info->width = strtol(fields[4], &tail, 10);
+
+        if (*tail || errno)
+                return false;
+
+        info->height = strtol(fields[5], &tail, 10);
+
+        if (*tail || errno)
+                return false;
+
+        return true;
+}
+
+static bool
+lookup_cache(const char *cache_filename,
+             const char *basename,
+             const struct stat *statbuf,
+             struct probe_info *info)
+{
+        FILE *f = fopen(cache_filename, "r");
+
+        if (f == NULL)
+                return false;
+
+        char *line = NULL;
+        size_t line_size = 0;
+        bool found = false;
+
+        while (getline(&line, &line_size, f) != -1) {
+                if (parse_cache_line(line, basename, statbuf, info)) {
+                        found = true;
+                        break;
+                }
+        }
+
+        free(line);
+        fclose(f);
+
+        return found;
+}
+
+/* Replaces the entry for the file in the cache. The cache is only an
+ * optimisation so any errors are ignored.
+ */
+static void
+update_cache(const char *cache_filename,
+             const char *basename,
+             const struct stat *statbuf,
+             const struct probe_info *info)
+{
+        if (strpbrk(basename, "\t\n"))
+                return;
+
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        FILE *f = fopen(cache_filename, "r");
+
+        if (f) {
+                char *line = NULL;
+                size_t line_size = 0;
+                size_t basename_len = strlen(basename);
+
+                while (getline(&line, &line_size, f) != -1) {
+                        if (!strncmp(line, basename, basename_len) &&
+                            line[basename_len] == '\t')
+                                continue;
+
+                        flt_buffer_append_string(&buf, line);
+
+                        if (buf.length > 0 && buf.data[buf.length - 1] != '\n')
+                                flt_buffer_append_c(&buf, '\n');
+                }
+
+                free(line);
+                fclose(f);
+        }
+
+        flt_buffer_append_printf(&buf,
+                                 "%s\t%" PRId64 "\t%" PRId64 "\t%.17g\t"
+                                 "%i\t%i\n",
+                                 basename,
+                                 (int64_t) statbuf->st_size,
+                                 get_mtime_ns(statbuf),
+                                 info->duration,
+                                 info->width,
+                                 info->height);
+
+        struct flt_buffer tmp_filename = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append_printf(&tmp_filename,
+                                 "%s.tmp%i",
+                                 cache_filename,
+                                 (int) getpid());
+
+        f = fopen((const char *) tmp_filename.data, "w");
+
+        if (f) {
+                bool ok = fwrite(buf.data, 1, buf.length, f) == buf.length;
+
+                if (fclose(f) == EOF)
+                        ok = false;
+
+                if (!ok ||
+                    rename((const char *) tmp_filename.data,
+                           cache_filename) == -1)
+                        unlink((const char *) tmp_filename.data);
+        }
+
+        flt_buffer_destroy(&tmp_filename);
+        flt_buffer_destroy(&buf);
+}
+
+static bool
+parse_probe_output(char *output, struct probe_info *info)
+{
+        bool has_duration = false;
+
+        info->width = 0;
+        info->height = 0;
+
+        for (char *line = strtok(output, "\n");
+             line;
+             line = strtok(NULL, "\n")) {
+                char *tail;
+                long value;
+
+                errno = 0;
+
+                if (!strncmp(line, "duration=", 9)) {
+                        info->duration = strtod(line + 9, &tail);
+
+                        if (errno ||
+                            *tail ||
+                            !isnormal(info->duration) ||
+                            info->duration < 0.0)
+                                return false;
+
+                        has_duration = true;
+                } else if (!strncmp(line, "width=", 6) && info->width == 0) {
+                        value = strtol(line + 6, &tail, 10);
+                        if (errno == 0 && *tail == '\0' && value > 0)
+                                info->width = value;
+                } else if (!strncmp(line, "height=", 7) &&
+                           info->height == 0) {
+                        value = strtol(line + 7, &tail, 10);
+                        if (errno == 0 && *tail == '\0' && value > 0)
+                                info->height = value;
+                }
+        }
+
+        return has_duration;
+}
+
+static bool
+run_ffprobe(const char *filename, struct probe_info *info)
 {
         const char * const argv[] = {
                 "-i",
                 filename,
-                "-show_entries", "format=duration",
+                "-show_entries", "format=duration:stream=width,height",
                 "-v", "quiet",
-                "-of", "csv=p=0",
+                "-of", "default=noprint_wrappers=1",
                 NULL,
         };
 
@@ -46,21 +296,47 @@ flt_get_video_length(const char *filename,
         if (output == NULL)
                 return false;
 
-        char *tail;
-
-        errno = 0;
-        *length_out = strtod(output, &tail);
-        char end = *tail;
+        bool ret = parse_probe_output(output, info);
 
         flt_free(output);
 
-        if (errno ||
-            end != '\n' ||
-            !isnormal(*length_out) ||
-            *length_out < 0.0) {
+        if (!ret)
                 fprintf(stderr, "invalid length returned for %s\n", filename);
-                return false;
+
+        return ret;
+}
+
+bool
+flt_get_video_length(const char *filename,
+                     double *length_out)
+{
+        struct probe_info info;
+        struct stat statbuf;
+
+        if (stat(filename, &statbuf) == -1) {
+                if (!run_ffprobe(filename, &info))
+                        return false;
+
+                *length_out = info.duration;
+
+                return true;
         }
 
-        return true;
+        const char *basename;
+        char *cache_filename = get_cache_filename(filename, &basename);
+        bool ret = true;
+
+        if (!lookup_cache(cache_filename, basename, &statbuf, &info)) {
+                if (run_ffprobe(filename, &info))
+                        update_cache(cache_filename, basename, &statbuf, &info);
+                else
+                        ret = false;
+        }
+
+        flt_free(cache_filename);
+
+        if (ret)
+                *length_out = info.duration;
+
+        return ret;
 }
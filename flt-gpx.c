@@ -26,12 +26,20 @@
 #include <stdio.h>
 #include <math.h>
 #include <assert.h>
+#include <float.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "flt-util.h"
 #include "flt-buffer.h"
 #include "flt-file-error.h"
 #include "flt-parse-time.h"
 
+/* Size of the chunks used to read the GPX file if it can’t be mapped */
+#define READ_BUFFER_SIZE (64 * 1024)
+
 /* Don’t use the point if the timestamp is more than 5 seconds from
  * what we are looking for.
  */
@@ -42,6 +50,16 @@
 #define TPX_NAMESPACE "http://www.garmin.com/xmlschemas/TrackPointExtension/v2"
 #define TPX_ELEMENT(tag) MAKE_ELEMENT(TPX_NAMESPACE, tag)
 
+/* The parsed points are saved in a file with this suffix next to the
+ * GPX file so that they can be mapped directly on the next run.
+ */
+#define CACHE_SUFFIX ".flt-cache"
+#define CACHE_MAGIC "FLTGPXC"
+/* This should be increased whenever the format of the cache or the
+ * way the points are calculated changes.
+ */
+#define CACHE_VERSION 3
+
 /* Radius of the earth at the equator in metres according to WGS84.
  */
 #define EARTH_RADIUS 6378137.0
@@ -61,6 +79,48 @@ enum parse_state {
         PARSE_STATE_IN_EXTENSION_SPEED,
 };
 
+/* The header is at the start of every block of points returned by
+ * flt_gpx_parse, whether it was mapped from the cache or not, so that
+ * flt_gpx_free_points can find the size of the mapping. It is
+ * followed by the array of points and then a separate array with
+ * just the times so that searching doesn’t have to touch the rest of
+ * the points.
+ */
+struct cache_header {
+        char magic[8];
+        uint32_t version;
+        /* Used to check that the cache was made with the same
+         * layout of struct flt_gpx_point.
+         */
+        uint32_t point_size;
+        /* Size and modification time of the GPX file that the cache
+         * was made from.
+         */
+        uint64_t source_size;
+        int64_t source_mtime_sec;
+        int64_t source_mtime_nsec;
+        uint64_t n_points;
+};
+
+/* A node of the k-d tree. The position is the point on a sphere with
+ * a radius of 1 so that the straight-line distance between two nodes
+ * increases with the distance along the surface.
+ */
+struct index_node {
+        double pos[3];
+        size_t point;
+};
+
+/* The nodes are stored as an implicit k-d tree where the root of each
+ * range is the node in the middle and the split axis depends on the
+ * depth.
+ */
+struct flt_gpx_index {
+        const struct flt_gpx_point *points;
+        size_t n_nodes;
+        struct index_node *nodes;
+};
+
 struct flt_gpx_parser {
         XML_Parser parser;
 
@@ -156,13 +216,85 @@ parse_time(struct flt_gpx_parser *parser)
         return true;
 }
 
+/* Parses a plain decimal number without using the locale. If the
+ * number can’t be converted exactly with a double division, “tail”
+ * is set to NULL and the caller should use strtof instead.
+ */
+static double
+parse_decimal(const char *str, const char **tail)
+{
+        static const double powers_of_ten[] = {
+                1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+                1e21, 1e22,
+        };
+        /* The mantissa can be represented exactly in a double if it
+         * is less than this.
+         */
+        const uint64_t max_mantissa = UINT64_C(1) << 53;
+        uint64_t mantissa = 0;
+        int n_decimals = 0;
+        bool negative = false;
+        bool has_digits = false;
+
+        while (is_space(*str))
+                str++;
+
+        if (*str == '-') {
+                negative = true;
+                str++;
+        } else if (*str == '+') {
+                str++;
+        }
+
+        for (; *str >= '0' && *str <= '9'; str++) {
+                mantissa = mantissa * 10 + *str - '0';
+                has_digits = true;
+
+                if (mantissa >= max_mantissa)
+                        goto slow_path;
+        }
+
+        if (*str == '.') {
+                for (str++; *str >= '0' && *str <= '9'; str++) {
+                        mantissa = mantissa * 10 + *str - '0';
+                        n_decimals++;
+                        has_digits = true;
+
+                        if (mantissa >= max_mantissa ||
+                            n_decimals >= FLT_N_ELEMENTS(powers_of_ten))
+                                goto slow_path;
+                }
+        }
+
+        /* Let strtof handle exponents, hexadecimal and infinity */
+        if (!has_digits || isalpha(*str))
+                goto slow_path;
+
+        *tail = str;
+
+        double value = mantissa / powers_of_ten[n_decimals];
+
+        return negative ? -value : value;
+
+slow_path:
+        *tail = NULL;
+        return 0.0;
+}
+
 static bool
 parse_float(const char *str, float *out)
 {
+        const char *fast_tail;
+        float f = parse_decimal(str, &fast_tail);
         char *tail;
 
         errno = 0;
-        float f = strtof(str, &tail);
+
+        if (fast_tail)
+                tail = (char *) fast_tail;
+        else
+                f = strtof(str, &tail);
 
         while (is_space(*tail))
                 tail++;
@@ -524,24 +656,63 @@ character_data_cb(void *user_data,
         }
 }
 
+static void
+parse_buffer(struct flt_gpx_parser *parser,
+             const char *buf,
+             size_t length,
+             bool is_final)
+{
+        if (XML_Parse(parser->parser, buf, length, is_final) ==
+            XML_STATUS_ERROR)
+                report_xml_error(parser);
+}
+
+/* Parses the whole file in one call if it can be mapped, otherwise
+ * it is read in large chunks.
+ */
 static void
 run_parser(struct flt_gpx_parser *parser,
-           FILE *f)
+           int fd)
 {
-        while (true) {
-                char buf[128];
+        struct stat statbuf;
+
+        if (fstat(fd, &statbuf) == 0 &&
+            S_ISREG(statbuf.st_mode) &&
+            statbuf.st_size > 0) {
+                void *map = mmap(NULL,
+                                 statbuf.st_size,
+                                 PROT_READ,
+                                 MAP_PRIVATE,
+                                 fd,
+                                 0 /* offset */);
+
+                if (map != MAP_FAILED) {
+                        madvise(map, statbuf.st_size, MADV_SEQUENTIAL);
+                        parse_buffer(parser, map, statbuf.st_size, true);
+                        munmap(map, statbuf.st_size);
+                        return;
+                }
+        }
+
+        char *buf = flt_alloc(READ_BUFFER_SIZE);
 
-                size_t got = fread(buf, 1, sizeof buf, f);
+        while (true) {
+                ssize_t got = read(fd, buf, READ_BUFFER_SIZE);
 
-                if (XML_Parse(parser->parser, buf, got, got < sizeof buf) ==
-                    XML_STATUS_ERROR) {
-                        report_xml_error(parser);
+                if (got == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        report_error(parser, strerror(errno));
                         break;
                 }
 
-                if (got < sizeof buf)
+                parse_buffer(parser, buf, got, got == 0);
+
+                if (got == 0 || parser->error)
                         break;
         }
+
+        flt_free(buf);
 }
 
 static int
@@ -574,15 +745,15 @@ remove_duplicate_points(struct flt_gpx_point *points, size_t n_points)
         return dst - points;
 }
 
-bool
-flt_gpx_parse(const char *filename,
-              struct flt_gpx_point **points_out,
-              size_t *n_points_out,
-              struct flt_error **error)
+static bool
+parse_gpx_file(const char *filename,
+               struct flt_gpx_point **points_out,
+               size_t *n_points_out,
+               struct flt_error **error)
 {
-        FILE *f = fopen(filename, "r");
+        int fd = open(filename, O_RDONLY);
 
-        if (f == NULL) {
+        if (fd == -1) {
                 flt_file_error_set(error,
                                    errno,
                                    "%s: %s",
@@ -607,9 +778,9 @@ flt_gpx_parse(const char *filename,
         XML_SetElementHandler(parser.parser, start_element_cb, end_element_cb);
         XML_SetCharacterDataHandler(parser.parser, character_data_cb);
 
-        run_parser(&parser, f);
+        run_parser(&parser, fd);
 
-        fclose(f);
+        close(fd);
 
         flt_buffer_destroy(&parser.buf);
 
@@ -646,6 +817,237 @@ flt_gpx_parse(const char *filename,
         return true;
 }
 
+static size_t
+get_mapping_size(size_t n_points)
+{
+        return (sizeof (struct cache_header) +
+                n_points * (sizeof (struct flt_gpx_point) + sizeof (double)));
+}
+
+static void
+init_cache_header(struct cache_header *header,
+                  const struct stat *source_stat,
+                  size_t n_points)
+{
+        memset(header, 0, sizeof *header);
+        memcpy(header->magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+        header->version = CACHE_VERSION;
+        header->point_size = sizeof (struct flt_gpx_point);
+        header->source_size = source_stat->st_size;
+        header->source_mtime_sec = source_stat->st_mtim.tv_sec;
+        header->source_mtime_nsec = source_stat->st_mtim.tv_nsec;
+        header->n_points = n_points;
+}
+
+static bool
+cache_header_is_valid(const struct cache_header *header,
+                      const struct stat *source_stat,
+                      size_t cache_size)
+{
+        struct cache_header expected;
+
+        init_cache_header(&expected, source_stat, header->n_points);
+
+        if (memcmp(header, &expected, sizeof expected))
+                return false;
+
+        if (header->n_points <= 0 ||
+            header->n_points > ((cache_size - sizeof *header) /
+                                (sizeof (struct flt_gpx_point) +
+                                 sizeof (double))) ||
+            cache_size != get_mapping_size(header->n_points))
+                return false;
+
+        return true;
+}
+
+static const struct cache_header *
+load_cache(const char *cache_filename,
+           const struct stat *source_stat)
+{
+        int fd = open(cache_filename, O_RDONLY);
+
+        if (fd == -1)
+                return NULL;
+
+        const struct cache_header *header = NULL;
+        struct stat cache_stat;
+
+        if (fstat(fd, &cache_stat) == -1 ||
+            cache_stat.st_size < sizeof *header)
+                goto out;
+
+        void *map = mmap(NULL,
+                         cache_stat.st_size,
+                         PROT_READ,
+                         MAP_PRIVATE,
+                         fd,
+                         0 /* offset */);
+
+        if (map == MAP_FAILED)
+                goto out;
+
+        if (cache_header_is_valid(map, source_stat, cache_stat.st_size))
+                header = map;
+        else
+                munmap(map, cache_stat.st_size);
+
+out:
+        close(fd);
+
+        return header;
+}
+
+static bool
+write_all(int fd, const void *data, size_t length)
+{
+        while (length > 0) {
+                ssize_t wrote = write(fd, data, length);
+
+                if (wrote == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+
+                data = (const uint8_t *) data + wrote;
+                length -= wrote;
+        }
+
+        return true;
+}
+
+/* Failing to write the cache isn’t an error because the GPX file
+ * might be in a directory that can’t be written to. The cache is
+ * written to a temporary file and renamed so that another process
+ * will never map a partially written file.
+ */
+static void
+save_cache(const char *cache_filename,
+           const struct cache_header *header)
+{
+        char *tmp_filename = flt_strconcat(cache_filename, ".XXXXXX", NULL);
+        int fd = flt_create_temp_file(tmp_filename);
+
+        if (fd == -1) {
+                flt_free(tmp_filename);
+                return;
+        }
+
+        size_t size = get_mapping_size(header->n_points);
+        bool ret = write_all(fd, header, size);
+
+        if (close(fd) == -1)
+                ret = false;
+
+        if (!ret || rename(tmp_filename, cache_filename) == -1)
+                unlink(tmp_filename);
+
+        flt_free(tmp_filename);
+}
+
+/* Copies the points into an anonymous mapping with a header in front
+ * so that they can be freed in the same way as a mapped cache.
+ */
+static struct cache_header *
+make_points_mapping(const struct stat *source_stat,
+                    const struct flt_gpx_point *points,
+                    size_t n_points)
+{
+        size_t size = get_mapping_size(n_points);
+        void *map = mmap(NULL,
+                         size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, /* fd */
+                         0 /* offset */);
+
+        if (map == MAP_FAILED)
+                flt_fatal("Memory exhausted");
+
+        struct cache_header *header = map;
+
+        init_cache_header(header, source_stat, n_points);
+        struct flt_gpx_point *points_copy =
+                (struct flt_gpx_point *) (header + 1);
+        double *times = (double *) (points_copy + n_points);
+
+        memcpy(points_copy, points, n_points * sizeof *points);
+
+        for (size_t i = 0; i < n_points; i++)
+                times[i] = points[i].time;
+
+        return header;
+}
+
+bool
+flt_gpx_parse(const char *filename,
+              const struct flt_gpx_point **points_out,
+              size_t *n_points_out,
+              struct flt_error **error)
+{
+        struct stat source_stat;
+
+        if (stat(filename, &source_stat) == -1) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                return false;
+        }
+
+        char *cache_filename = flt_strconcat(filename, CACHE_SUFFIX, NULL);
+        const struct cache_header *header =
+                load_cache(cache_filename, &source_stat);
+
+        if (header == NULL) {
+                struct flt_gpx_point *points;
+                size_t n_points;
+
+                if (!parse_gpx_file(filename, &points, &n_points, error)) {
+                        flt_free(cache_filename);
+                        return false;
+                }
+
+                struct cache_header *new_header =
+                        make_points_mapping(&source_stat, points, n_points);
+
+                flt_free(points);
+
+                save_cache(cache_filename, new_header);
+
+                mprotect(new_header, get_mapping_size(n_points), PROT_READ);
+
+                header = new_header;
+        }
+
+        flt_free(cache_filename);
+
+        *points_out = (const struct flt_gpx_point *) (header + 1);
+        *n_points_out = header->n_points;
+
+        return true;
+}
+
+void
+flt_gpx_free_points(const struct flt_gpx_point *points)
+{
+        const struct cache_header *header =
+                (const struct cache_header *) points - 1;
+
+        munmap((void *) header, get_mapping_size(header->n_points));
+}
+
+const double *
+flt_gpx_get_times(const struct flt_gpx_point *points)
+{
+        const struct cache_header *header =
+                (const struct cache_header *) points - 1;
+
+        return (const double *) (points + header->n_points);
+}
+
 static void
 set_data_from_point(struct flt_gpx_data *data,
                     const struct flt_gpx_point *point)
@@ -657,27 +1059,36 @@ set_data_from_point(struct flt_gpx_data *data,
         data->distance = point->distance;
 }
 
-bool
-flt_gpx_find_data(const struct flt_gpx_point *points,
-                  size_t n_points,
-                  double timestamp,
-                  struct flt_gpx_data *data)
+/* Returns the index of the first point in the range [min, max) whose
+ * time is after the timestamp, or max if there isn’t one.
+ */
+static size_t
+find_point_after(const double *times,
+                 size_t min, size_t max,
+                 double timestamp)
 {
-        int min = 0, max = n_points;
-
         while (max > min) {
-                int mid = (min + max) / 2;
+                size_t mid = (min + max) / 2;
 
-                if (points[mid].time < timestamp) {
+                if (times[mid] <= timestamp)
                         min = mid + 1;
-                } else {
+                else
                         max = mid;
-                }
         }
 
-        if (min >= n_points || points[min].time != timestamp)
-                min--;
+        return min;
+}
 
+/* “min” is the index of the last point whose time is at or before
+ * the timestamp, or -1 if there isn’t one.
+ */
+static bool
+find_data_from_point(const struct flt_gpx_point *points,
+                     size_t n_points,
+                     int min,
+                     double timestamp,
+                     struct flt_gpx_data *data)
+{
         if (min <= 0 && timestamp <= points[0].time) {
                 if (points[0].time - timestamp <= MAX_TIME_GAP) {
                         set_data_from_point(data, points + 0);
@@ -737,3 +1148,314 @@ flt_gpx_find_data(const struct flt_gpx_point *points,
 
         return true;
 }
+
+bool
+flt_gpx_find_data(const struct flt_gpx_point *points,
+                  size_t n_points,
+                  double timestamp,
+                  struct flt_gpx_data *data)
+{
+        size_t after = find_point_after(flt_gpx_get_times(points),
+                                        0, n_points,
+                                        timestamp);
+
+        return find_data_from_point(points,
+                                    n_points,
+                                    (int) after - 1,
+                                    timestamp,
+                                    data);
+}
+
+void
+flt_gpx_cursor_init(struct flt_gpx_cursor *cursor,
+                    const struct flt_gpx_point *points,
+                    size_t n_points)
+{
+        cursor->points = points;
+        cursor->times = flt_gpx_get_times(points);
+        cursor->n_points = n_points;
+        cursor->pos = 0;
+}
+
+/* Searches forwards from “start” with exponentially increasing steps
+ * so that a small move costs about the same as the distance moved.
+ * All of the points before start must be at or before the timestamp.
+ */
+static size_t
+gallop_forwards(const double *times,
+                size_t n_points,
+                size_t start,
+                double timestamp)
+{
+        size_t min = start, step = 1;
+
+        while (true) {
+                size_t probe = min + step - 1;
+
+                if (probe >= n_points) {
+                        return find_point_after(times,
+                                                min, n_points,
+                                                timestamp);
+                }
+
+                if (times[probe] > timestamp) {
+                        return find_point_after(times,
+                                                min, probe,
+                                                timestamp);
+                }
+
+                min = probe + 1;
+                step *= 2;
+        }
+}
+
+/* Same as gallop_forwards but for when the point before “start” is
+ * after the timestamp.
+ */
+static size_t
+gallop_backwards(const double *times,
+                 size_t start,
+                 double timestamp)
+{
+        size_t max = start, step = 1;
+
+        while (true) {
+                if (max < step)
+                        return find_point_after(times, 0, max, timestamp);
+
+                size_t probe = max - step;
+
+                if (times[probe] <= timestamp) {
+                        return find_point_after(times,
+                                                probe + 1, max,
+                                                timestamp);
+                }
+
+                max = probe;
+                step *= 2;
+        }
+}
+
+bool
+flt_gpx_cursor_find_data(struct flt_gpx_cursor *cursor,
+                         double timestamp,
+                         struct flt_gpx_data *data)
+{
+        const double *times = cursor->times;
+        size_t pos = cursor->pos;
+
+        if (pos > 0 && times[pos - 1] > timestamp) {
+                pos = gallop_backwards(times, pos, timestamp);
+        } else {
+                pos = gallop_forwards(times,
+                                      cursor->n_points,
+                                      pos,
+                                      timestamp);
+        }
+
+        cursor->pos = pos;
+
+        return find_data_from_point(cursor->points,
+                                    cursor->n_points,
+                                    (int) pos - 1,
+                                    timestamp,
+                                    data);
+}
+
+static void
+get_sphere_position(double lat, double lon, double *pos)
+{
+        lat = lat / 180.0 * M_PI;
+        lon = lon / 180.0 * M_PI;
+
+        pos[0] = cos(lat) * cos(lon);
+        pos[1] = cos(lat) * sin(lon);
+        pos[2] = sin(lat);
+}
+
+static void
+swap_nodes(struct index_node *a, struct index_node *b)
+{
+        struct index_node tmp = *a;
+        *a = *b;
+        *b = tmp;
+}
+
+/* Partially sorts the nodes so that the nth node is in the right
+ * place and all of the nodes before it have a smaller position on the
+ * axis.
+ */
+static void
+select_node(struct index_node *nodes,
+            size_t n_nodes,
+            size_t nth,
+            int axis)
+{
+        size_t left = 0, right = n_nodes - 1;
+
+        while (left < right) {
+                swap_nodes(nodes + (left + right) / 2, nodes + right);
+
+                double pivot = nodes[right].pos[axis];
+                size_t store = left;
+
+                for (size_t i = left; i < right; i++) {
+                        if (nodes[i].pos[axis] < pivot)
+                                swap_nodes(nodes + i, nodes + store++);
+                }
+
+                swap_nodes(nodes + store, nodes + right);
+
+                if (store == nth)
+                        return;
+                else if (store < nth)
+                        left = store + 1;
+                else
+                        right = store - 1;
+        }
+}
+
+static void
+build_tree(struct index_node *nodes,
+           size_t n_nodes,
+           int depth)
+{
+        while (n_nodes > 1) {
+                size_t mid = n_nodes / 2;
+                int axis = depth % 3;
+
+                select_node(nodes, n_nodes, mid, axis);
+
+                build_tree(nodes, mid, depth + 1);
+
+                nodes += mid + 1;
+                n_nodes -= mid + 1;
+                depth++;
+        }
+}
+
+struct flt_gpx_index *
+flt_gpx_index_new(const struct flt_gpx_point *points,
+                  size_t n_points)
+{
+        struct flt_gpx_index *index = flt_alloc(sizeof *index);
+
+        index->points = points;
+        index->n_nodes = n_points;
+        index->nodes = flt_alloc(n_points * sizeof *index->nodes);
+
+        for (size_t i = 0; i < n_points; i++) {
+                get_sphere_position(points[i].lat,
+                                    points[i].lon,
+                                    index->nodes[i].pos);
+                index->nodes[i].point = i;
+        }
+
+        build_tree(index->nodes, n_points, 0);
+
+        return index;
+}
+
+struct nearest_search {
+        const struct flt_gpx_index *index;
+        struct flt_gpx_point target;
+        double target_pos[3];
+        size_t best_point;
+        double best_distance;
+        /* Straight-line distance through the sphere that corresponds
+         * to best_distance.
+         */
+        double best_chord;
+};
+
+static void
+check_node(struct nearest_search *search,
+           const struct index_node *node)
+{
+        double distance = flt_gpx_point_distance_between(search->index->points +
+                                                         node->point,
+                                                         &search->target);
+
+        /* Ties are resolved in favour of the earliest point */
+        if (distance < search->best_distance ||
+            (distance == search->best_distance &&
+             node->point < search->best_point)) {
+                search->best_point = node->point;
+                search->best_distance = distance;
+                search->best_chord =
+                        2.0 * sin(MIN(distance / EARTH_RADIUS, M_PI) / 2.0);
+        }
+}
+
+static void
+search_tree(struct nearest_search *search,
+            const struct index_node *nodes,
+            size_t n_nodes,
+            int depth)
+{
+        /* Allow for rounding errors in the distance calculations so
+         * that the result is the same as checking every point.
+         */
+        const double epsilon = 1e-9;
+
+        if (n_nodes <= 0)
+                return;
+
+        size_t mid = n_nodes / 2;
+        const struct index_node *node = nodes + mid;
+        int axis = depth % 3;
+        double diff = search->target_pos[axis] - node->pos[axis];
+
+        check_node(search, node);
+
+        const struct index_node *near_nodes, *far_nodes;
+        size_t n_near_nodes, n_far_nodes;
+
+        if (diff < 0.0) {
+                near_nodes = nodes;
+                n_near_nodes = mid;
+                far_nodes = nodes + mid + 1;
+                n_far_nodes = n_nodes - mid - 1;
+        } else {
+                near_nodes = nodes + mid + 1;
+                n_near_nodes = n_nodes - mid - 1;
+                far_nodes = nodes;
+                n_far_nodes = mid;
+        }
+
+        search_tree(search, near_nodes, n_near_nodes, depth + 1);
+
+        if (fabs(diff) <= search->best_chord + epsilon)
+                search_tree(search, far_nodes, n_far_nodes, depth + 1);
+}
+
+size_t
+flt_gpx_index_find_nearest(const struct flt_gpx_index *index,
+                           double lat, double lon)
+{
+        struct nearest_search search = {
+                .index = index,
+                .target = {
+                        .lat = lat,
+                        .lon = lon,
+                },
+                .best_point = 0,
+                .best_distance = DBL_MAX,
+                .best_chord = DBL_MAX,
+        };
+
+        get_sphere_position(search.target.lat,
+                            search.target.lon,
+                            search.target_pos);
+
+        search_tree(&search, index->nodes, index->n_nodes, 0);
+
+        return search.best_point;
+}
+
+void
+flt_gpx_index_free(struct flt_gpx_index *index)
+{
+        flt_free(index->nodes);
+        flt_free(index);
+}
@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_GPX
-#define FLT_GPX
+#ifndef FLT_GPX_H
+#define FLT_GPX_H
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -50,25 +50,79 @@ struct flt_gpx_point {
         float course;
 };
 
+/* Remembers the position of the last lookup so that looking up
+ * timestamps that are close together doesn’t have to search the
+ * whole array again.
+ */
+struct flt_gpx_cursor {
+        const struct flt_gpx_point *points;
+        const double *times;
+        size_t n_points;
+        /* Index of the first point after the last timestamp */
+        size_t pos;
+};
+
 struct flt_gpx_data {
         double lat, lon;
         double speed, elevation, distance;
 };
 
+/* The parsed points are cached in a file next to the GPX file. The
+ * returned points are read-only and must be freed with
+ * flt_gpx_free_points.
+ */
 bool
 flt_gpx_parse(const char *filename,
-              struct flt_gpx_point **points_out,
+              const struct flt_gpx_point **points_out,
               size_t *n_points_out,
               struct flt_error **error);
 
+void
+flt_gpx_free_points(const struct flt_gpx_point *points);
+
+/* Returns a separate array containing just the time of each point.
+ * The points must have been returned by flt_gpx_parse.
+ */
+const double *
+flt_gpx_get_times(const struct flt_gpx_point *points);
+
+/* The points must have been returned by flt_gpx_parse */
 bool
 flt_gpx_find_data(const struct flt_gpx_point *points,
                   size_t n_points,
                   double timestamp,
                   struct flt_gpx_data *data);
 
+void
+flt_gpx_cursor_init(struct flt_gpx_cursor *cursor,
+                    const struct flt_gpx_point *points,
+                    size_t n_points);
+
+bool
+flt_gpx_cursor_find_data(struct flt_gpx_cursor *cursor,
+                         double timestamp,
+                         struct flt_gpx_data *data);
+
+/* Spatial index to find the point closest to a position */
+struct flt_gpx_index;
+
+/* The points must stay valid for as long as the index is used */
+struct flt_gpx_index *
+flt_gpx_index_new(const struct flt_gpx_point *points,
+                  size_t n_points);
+
+/* Returns the index of the point that is closest to the position. If
+ * there are no points then it returns 0.
+ */
+size_t
+flt_gpx_index_find_nearest(const struct flt_gpx_index *index,
+                           double lat, double lon);
+
+void
+flt_gpx_index_free(struct flt_gpx_index *index);
+
 double
 flt_gpx_point_distance_between(const struct flt_gpx_point *a,
                                const struct flt_gpx_point *b);
 
-#endif /* FLT_GPX */
+#endif /* FLT_GPX_H */
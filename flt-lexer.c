@@ -56,6 +56,21 @@ struct token_data {
 
 #define TOKEN_QUEUE_SIZE 3
 
+/* Number of bits used for the index into the keyword hash table. The
+ * seed is chosen so that none of the keywords collide. If adding a
+ * keyword causes a collision then the assert in init_keyword_table
+ * will fail and a new seed will need to be found.
+ */
+#define KEYWORD_HASH_BITS 8
+#define KEYWORD_HASH_SIZE (1 << KEYWORD_HASH_BITS)
+#define KEYWORD_HASH_SEED 19
+
+/* Size of the chunks read from a source */
+#define READ_BUFFER_SIZE 4096
+
+_Static_assert(FLT_LEXER_N_KEYWORDS <= UINT8_MAX,
+               "Too many keywords for the keyword hash table");
+
 struct flt_lexer {
         int line_num;
         struct flt_source *source;
@@ -74,9 +89,20 @@ struct flt_lexer {
 
         bool had_eof;
 
-        uint8_t buf[128];
-        int buf_pos;
-        int buf_size;
+        /* The characters that are ready to be read. This either
+         * points into buf or, if the lexer was created from memory,
+         * to the whole input.
+         */
+        const uint8_t *data;
+        size_t data_pos;
+        size_t data_size;
+
+        uint8_t *buf;
+
+        /* Maps the hash of a symbol to the number of the keyword
+         * with that hash or zero if there isn’t one.
+         */
+        uint8_t keyword_table[KEYWORD_HASH_SIZE];
 
         /* Array of char* */
         struct flt_buffer symbols;
@@ -134,6 +160,7 @@ keywords[] = {
         [FLT_LEXER_KEYWORD_FULL_SPEED] = "full_speed",
         [FLT_LEXER_KEYWORD_TRACE] = "trace",
         [FLT_LEXER_KEYWORD_TRACE_COLOR] = "trace_color",
+        [FLT_LEXER_KEYWORD_SCALE] = "scale",
 };
 
 _Static_assert(FLT_N_ELEMENTS(keywords) == FLT_LEXER_N_KEYWORDS,
@@ -196,65 +223,112 @@ set_error_with_line(struct flt_lexer *lexer,
 }
 
 static bool
-get_character(struct flt_lexer *lexer,
-              int *ch,
-              struct flt_error **error)
+read_more(struct flt_lexer *lexer,
+          int *ch,
+          struct flt_error **error)
 {
-        if (lexer->buf_pos >= lexer->buf_size) {
-                if (lexer->had_eof) {
-                        *ch = -1;
-                        return true;
-                }
+        if (lexer->had_eof) {
+                *ch = -1;
+                return true;
+        }
 
-                size_t length = sizeof lexer->buf;
+        size_t length = READ_BUFFER_SIZE;
 
-                if (!lexer->source->read_source(lexer->source,
-                                                lexer->buf,
-                                                &length,
-                                                error))
-                        return false;
+        if (!lexer->source->read_source(lexer->source,
+                                        lexer->buf,
+                                        &length,
+                                        error))
+                return false;
 
-                lexer->had_eof = length < sizeof lexer->buf;
-                lexer->buf_size = length;
-                lexer->buf_pos = 0;
+        lexer->had_eof = length < READ_BUFFER_SIZE;
+        lexer->data_size = length;
+        lexer->data_pos = 0;
 
-                if (length <= 0) {
-                        *ch = -1;
-                        return true;
-                }
+        if (length <= 0) {
+                *ch = -1;
+                return true;
         }
 
-        *ch = lexer->buf[lexer->buf_pos++];
+        *ch = lexer->data[lexer->data_pos++];
         return true;
 }
 
+static inline bool
+get_character(struct flt_lexer *lexer,
+              int *ch,
+              struct flt_error **error)
+{
+        if (lexer->data_pos >= lexer->data_size)
+                return read_more(lexer, ch, error);
+
+        *ch = lexer->data[lexer->data_pos++];
+        return true;
+}
+
+/* This can only be used to put back the character that was just
+ * read, so it is still in the buffer.
+ */
 static void
 put_character(struct flt_lexer *lexer, int ch)
 {
         if (ch == -1) {
                 assert(lexer->had_eof);
-                assert(lexer->buf_pos >= lexer->buf_size);
+                assert(lexer->data_pos >= lexer->data_size);
                 return;
         }
 
-        assert(lexer->buf_pos > 0);
+        assert(lexer->data_pos > 0);
+        assert(lexer->data[lexer->data_pos - 1] == ch);
 
         if (ch == '\n')
                 lexer->line_num--;
 
-        lexer->buf[--lexer->buf_pos] = ch;
+        lexer->data_pos--;
 }
 
-struct flt_lexer *
-flt_lexer_new(struct flt_source *source)
+static uint32_t
+hash_symbol(const char *str,
+            size_t length)
+{
+        uint32_t hash = UINT32_C(2166136261) ^ KEYWORD_HASH_SEED;
+
+        /* FNV-1a */
+        for (size_t i = 0; i < length; i++) {
+                hash ^= (uint8_t) str[i];
+                hash *= UINT32_C(16777619);
+        }
+
+        hash ^= hash >> 16;
+
+        return hash & (KEYWORD_HASH_SIZE - 1);
+}
+
+static void
+init_keyword_table(struct flt_lexer *lexer)
+{
+        memset(lexer->keyword_table, 0, sizeof lexer->keyword_table);
+
+        for (size_t i = 1; i < FLT_LEXER_N_KEYWORDS; i++) {
+                uint32_t hash = hash_symbol(keywords[i], strlen(keywords[i]));
+
+                assert(lexer->keyword_table[hash] == 0);
+
+                lexer->keyword_table[hash] = i;
+        }
+}
+
+static struct flt_lexer *
+lexer_new(void)
 {
         struct flt_lexer *lexer = flt_alloc(sizeof *lexer);
 
-        lexer->source = source;
+        lexer->source = NULL;
         lexer->line_num = 1;
         lexer->had_eof = false;
-        lexer->buf_pos = 0;
-        lexer->buf_size = 0;
+        lexer->data = NULL;
+        lexer->data_pos = 0;
+        lexer->data_size = 0;
+        lexer->buf = NULL;
         lexer->queue_start = 0;
         lexer->n_put_tokens = 0;
         lexer->state = FLT_LEXER_STATE_SKIPPING_WHITESPACE;
@@ -263,13 +337,117 @@ flt_lexer_new(struct flt_source *source)
         for (int i = 0; i < TOKEN_QUEUE_SIZE; i++)
                 flt_buffer_init(&lexer->token_queue[i].buffer);
 
+        init_keyword_table(lexer);
+
         return lexer;
 }
 
-static bool
-is_space(char ch)
+struct flt_lexer *
+flt_lexer_new(struct flt_source *source)
+{
+        struct flt_lexer *lexer = lexer_new();
+
+        lexer->source = source;
+        lexer->buf = flt_alloc(READ_BUFFER_SIZE);
+        lexer->data = lexer->buf;
+
+        return lexer;
+}
+
+struct flt_lexer *
+flt_lexer_new_from_memory(const void *data,
+                          size_t size)
+{
+        struct flt_lexer *lexer = lexer_new();
+
+        lexer->data = data;
+        lexer->data_size = size;
+        lexer->had_eof = true;
+
+        return lexer;
+}
+
+static inline bool
+is_space(int ch)
+{
+        return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+static inline bool
+is_symbol_char(int ch)
+{
+        return ((ch >= '0' && ch <= '9') ||
+                (ch >= 'a' && ch <= 'z') ||
+                (ch >= 'A' && ch <= 'Z') ||
+                ch >= 0x80 || ch == '_');
+}
+
+static inline bool
+is_number_char(int ch)
+{
+        return ((ch >= '0' && ch <= '9') ||
+                (ch >= 'a' && ch <= 'z') ||
+                (ch >= 'A' && ch <= 'Z') ||
+                ch == ':' ||
+                ch == '.' ||
+                ch >= 0x80);
+}
+
+/* The following functions consume a run of characters that are
+ * already in the buffer so that the state machine doesn’t have to
+ * run for every character of long tokens.
+ */
+
+static void
+skip_spaces(struct flt_lexer *lexer)
+{
+        const uint8_t *data = lexer->data;
+        size_t pos = lexer->data_pos;
+
+        while (pos < lexer->data_size && is_space(data[pos])) {
+                if (data[pos] == '\n')
+                        lexer->line_num++;
+                pos++;
+        }
+
+        lexer->data_pos = pos;
+}
+
+static void
+skip_comment(struct flt_lexer *lexer)
+{
+        const uint8_t *data = lexer->data + lexer->data_pos;
+        size_t remaining = lexer->data_size - lexer->data_pos;
+        const uint8_t *end = memchr(data, '\n', remaining);
+
+        /* Leave the newline to end the comment */
+        lexer->data_pos += end ? end - data : remaining;
+}
+
+static void
+append_symbol_chars(struct flt_lexer *lexer,
+                    struct flt_buffer *buf)
 {
-        return ch && strchr(" \n\r\t", ch) != NULL;
+        size_t start = lexer->data_pos, pos = start;
+
+        while (pos < lexer->data_size && is_symbol_char(lexer->data[pos]))
+                pos++;
+
+        flt_buffer_append(buf, lexer->data + start, pos - start);
+        lexer->data_pos = pos;
+}
+
+static void
+append_number_chars(struct flt_lexer *lexer,
+                    struct flt_buffer *buf)
+{
+        size_t start = lexer->data_pos, pos = start;
+
+        while (pos < lexer->data_size && is_number_char(lexer->data[pos]))
+                pos++;
+
+        flt_buffer_append(buf, lexer->data + start, pos - start);
+        lexer->data_pos = pos;
 }
 
 static bool
@@ -351,9 +529,19 @@ normalize_string(struct flt_lexer *lexer,
 static bool
 find_symbol(struct flt_lexer *lexer,
             const char *str,
+            size_t length,
             struct flt_lexer_token *token,
             struct flt_error **error)
 {
+        int keyword = lexer->keyword_table[hash_symbol(str, length)];
+
+        /* Keywords are always ASCII so a match is valid UTF-8 */
+        if (keyword != 0 && !strcmp(keywords[keyword], str)) {
+                token->type = FLT_LEXER_TOKEN_TYPE_SYMBOL;
+                token->symbol_value = keyword;
+                return true;
+        }
+
         if (!flt_utf8_is_valid_string(str)) {
                 set_error(lexer,
                           error,
@@ -362,14 +550,6 @@ find_symbol(struct flt_lexer *lexer,
                 return false;
         }
 
-        for (size_t i = 1; i < FLT_LEXER_N_KEYWORDS; i++) {
-                if (!strcmp(keywords[i], str)) {
-                        token->type = FLT_LEXER_TOKEN_TYPE_SYMBOL;
-                        token->symbol_value = i;
-                        return true;
-                }
-        }
-
         char **symbols = (char **) lexer->symbols.data;
         size_t n_symbols = lexer->symbols.length / sizeof (char *);
 
@@ -538,8 +718,10 @@ flt_lexer_get_token(struct flt_lexer *lexer,
 
                 switch (lexer->state) {
                 case FLT_LEXER_STATE_SKIPPING_WHITESPACE:
-                        if (is_space(ch))
+                        if (is_space(ch)) {
+                                skip_spaces(lexer);
                                 break;
+                        }
 
                         token_data->line_num = lexer->line_num;
                         flt_buffer_set_length(buf, 0);
@@ -579,14 +761,10 @@ flt_lexer_get_token(struct flt_lexer *lexer,
                         break;
 
                 case FLT_LEXER_STATE_READING_NUMBER:
-                        if ((ch >= '0' && ch <= '9') ||
-                            (ch >= 'a' && ch <= 'z') ||
-                            (ch >= 'A' && ch <= 'Z') ||
-                            ch == ':' ||
-                            ch == '.' ||
-                            ch >= 0x80 ||
+                        if (is_number_char(ch) ||
                             (buf->length == 0 && ch == '-')) {
                                 flt_buffer_append_c(buf, ch);
+                                append_number_chars(lexer, buf);
                                 break;
                         } else if (ch == '_') {
                                 break;
@@ -605,11 +783,9 @@ flt_lexer_get_token(struct flt_lexer *lexer,
                         return token;
 
                 case FLT_LEXER_STATE_READING_SYMBOL:
-                        if ((ch >= '0' && ch <= '9') ||
-                            (ch >= 'a' && ch <= 'z') ||
-                            (ch >= 'A' && ch <= 'Z') ||
-                            ch >= 0x80 || ch == '_') {
+                        if (is_symbol_char(ch)) {
                                 flt_buffer_append_c(buf, ch);
+                                append_symbol_chars(lexer, buf);
                                 break;
                         }
 
@@ -617,7 +793,11 @@ flt_lexer_get_token(struct flt_lexer *lexer,
                         flt_buffer_append_c(buf, '\0');
                         str = (const char *) buf->data;
 
-                        if (!find_symbol(lexer, str, token, error))
+                        if (!find_symbol(lexer,
+                                         str,
+                                         buf->length - 1,
+                                         token,
+                                         error))
                                 return NULL;
 
                         lexer->state = FLT_LEXER_STATE_SKIPPING_WHITESPACE;
@@ -669,6 +849,8 @@ flt_lexer_get_token(struct flt_lexer *lexer,
                         if (ch == '\n') {
                                 lexer->state =
                                         FLT_LEXER_STATE_SKIPPING_WHITESPACE;
+                        } else {
+                                skip_comment(lexer);
                         }
                         break;
                 }
@@ -708,5 +890,6 @@ flt_lexer_free(struct flt_lexer *lexer)
         for (int i = 0; i < TOKEN_QUEUE_SIZE; i++)
                 flt_buffer_destroy(&lexer->token_queue[i].buffer);
 
+        flt_free(lexer->buf);
         flt_free(lexer);
 }
@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_LEXER
-#define FLT_LEXER
+#ifndef FLT_LEXER_H
+#define FLT_LEXER_H
 
 #include "flt-error.h"
 #include "flt-source.h"
@@ -80,6 +80,7 @@ enum flt_lexer_keyword {
         FLT_LEXER_KEYWORD_FULL_SPEED,
         FLT_LEXER_KEYWORD_TRACE,
         FLT_LEXER_KEYWORD_TRACE_COLOR,
+        FLT_LEXER_KEYWORD_SCALE,
 
         FLT_LEXER_N_KEYWORDS,
 };
@@ -117,6 +118,13 @@ struct flt_lexer_token {
 struct flt_lexer *
 flt_lexer_new(struct flt_source *source);
 
+/* Creates a lexer that reads directly from the data without copying
+ * it. The data must stay valid until the lexer is freed.
+ */
+struct flt_lexer *
+flt_lexer_new_from_memory(const void *data,
+                          size_t size);
+
 const struct flt_lexer_token *
 flt_lexer_get_token(struct flt_lexer *lexer,
                     struct flt_error **error);
@@ -134,4 +142,4 @@ flt_lexer_get_symbol_name(struct flt_lexer *lexer,
 void
 flt_lexer_free(struct flt_lexer *lexer);
 
-#endif /* FLT_LEXER */
+#endif /* FLT_LEXER_H */
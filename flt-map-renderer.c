@@ -26,6 +26,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <utime.h>
 #include <curl/curl.h>
 
 #include "flt-util.h"
@@ -33,12 +38,43 @@
 #include "flt-list.h"
 #include "flt-file-error.h"
 #include "flt-source-color.h"
+#include "flt-profile.h"
+#include "flt-tile-pack.h"
 
-#define N_CACHED_TILES 8
+/* Default maximum size in bytes of the decoded tiles kept in memory */
+#define DEFAULT_TILE_CACHE_SIZE (32 * 1024 * 1024)
+
+/* Number of buckets in the tile hash table. Must be a power of two. */
+#define N_TILE_BUCKETS 256
+
+/* Maximum number of tiles to download at the same time when
+ * prefetching.
+ */
+#define MAX_PARALLEL_DOWNLOADS 8
+
+/* Maximum number of requests started per second when prefetching, to
+ * be polite to the tile server.
+ */
+#define MAX_REQUESTS_PER_SECOND 20
+
+/* Number of times a download is tried if the errors look temporary */
+#define MAX_DOWNLOAD_ATTEMPTS 5
+/* Seconds to wait before the first retry. This doubles each time. */
+#define RETRY_DELAY 1.0
+
+/* Tiles that were downloaded or last checked longer ago than this
+ * number of seconds are revalidated with the server when prefetching.
+ */
+#define TILE_REFRESH_AGE (30 * 24 * 60 * 60)
 
 #define TILE_SIZE 256
 
 #define TILE_CACHE_DIRECTORY "map-tiles"
+/* Big enough for the directory, the zoom and two coordinates */
+#define TILE_FILENAME_SIZE (sizeof TILE_CACHE_DIRECTORY + 48)
+#define TMP_SUFFIX ".XXXXXX"
+/* Optional pack of decoded tiles made by pack-tiles */
+#define TILE_PACK_FILENAME TILE_CACHE_DIRECTORY "/tiles.pack"
 
 #define DEFAULT_MAP_URL_BASE "https://tile.thunderforest.com/cycle/"
 
@@ -48,22 +84,122 @@
 #define TRACE_DASH_SIZE (TRACE_LINE_WIDTH * 2.0)
 #define CROSS_DISTANCE (TRACE_LINE_WIDTH * 4)
 
+/* Maximum distance in pixels that a point of a trace can be moved
+ * when simplifying it.
+ */
+#define TRACE_SIMPLIFY_TOLERANCE 0.25
+
+/* Number of extra tiles on each side of the visible range that are
+ * composited into the mosaic so that it survives small pans.
+ */
+#define MOSAIC_MARGIN 1
+
 struct flt_map_renderer {
+        /* Cached tiles in order of when they were last used */
         struct flt_list tile_cache;
-        int n_cached_tiles;
+        struct flt_list tile_buckets[N_TILE_BUCKETS];
+        size_t tile_cache_size;
+        size_t max_tile_cache_size;
+        struct flt_map_renderer_stats stats;
+        /* Changes whenever a tile fails to load or a new one is
+         * downloaded so that the tiles that can be drawn aren’t the
+         * same as before.
+         */
+        uint32_t tile_generation;
+
+        /* The pack of decoded tiles or NULL if there isn’t one. This
+         * is opened the first time a tile isn’t in memory.
+         */
+        struct flt_tile_pack *tile_pack;
+        bool tried_tile_pack;
+
+        bool use_mosaic;
+        /* The tiles around the last position composited into one
+         * surface together with the parts of the trace that don’t
+         * move.
+         */
+        cairo_surface_t *mosaic;
+        int mosaic_zoom;
+        /* Range of tiles in the mosaic. The end is exclusive. */
+        int mosaic_x1, mosaic_y1, mosaic_x2, mosaic_y2;
+        const struct flt_trace *mosaic_trace;
+        uint32_t mosaic_trace_color;
+        /* The last trace that was drawn projected to pixels */
+        struct projected_trace *projected_trace;
         bool clip;
 
         char *url_base;
         char *api_key;
 
         CURL *curl;
-        FILE *tile_output;
+};
+
+struct projected_segment {
+        size_t n_points;
+        /* Pairs of pixel coordinates from the top-left of the world
+         * at the zoom level.
+         */
+        const int *points;
+        /* Bounding box of the points */
+        int x1, y1, x2, y2;
+};
+
+struct projected_trace {
+        const struct flt_trace *trace;
+        int zoom;
+        struct projected_segment *segments;
+        int *points;
+};
+
+struct tile_download {
+        char filename[TILE_FILENAME_SIZE];
+        char tmp_filename[TILE_FILENAME_SIZE + sizeof TMP_SUFFIX - 1];
+        FILE *output;
+        /* True if the tile already exists and is only replaced if
+         * the server has a newer one.
+         */
+        bool refresh;
+        int attempts;
+};
+
+enum prefetch_slot_state {
+        PREFETCH_SLOT_IDLE,
+        /* The download is added to the multi handle */
+        PREFETCH_SLOT_ACTIVE,
+        /* The download failed and will be tried again at retry_time */
+        PREFETCH_SLOT_WAITING,
+};
+
+struct prefetch_slot {
+        CURL *curl;
+        enum prefetch_slot_state state;
+        double retry_time;
+        struct tile_download download;
+};
+
+enum trace_layer {
+        TRACE_LAYER_ALL,
+        /* Only the segments that look the same on every frame */
+        TRACE_LAYER_STATIC,
+        /* Only the segments with moving dashes */
+        TRACE_LAYER_ANIMATED,
+};
+
+struct tile_range {
+        /* The tile and the pixel within it at the center of the map */
+        int tile_x, tile_y, pixel_x, pixel_y;
+        /* Range of tiles to draw relative to the center tile. The end
+         * is exclusive.
+         */
+        int x_start, x_end, y_start, y_end;
 };
 
 struct cached_tile {
         struct flt_list link;
+        struct flt_list bucket_link;
 
         int zoom, x, y;
+        size_t size;
 
         cairo_surface_t *surface;
 };
@@ -74,9 +210,77 @@ flt_map_renderer_error;
 static size_t
 write_tile_data_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-        struct flt_map_renderer *renderer = userdata;
+        FILE *output = userdata;
+
+        return fwrite(ptr, size, nmemb, output);
+}
+
+static CURL *
+create_curl(void)
+{
+        CURL *curl = curl_easy_init();
+
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1l);
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1l);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_tile_data_cb);
+        /* Use HTTP/2 where possible so that the parallel downloads
+         * can share a single connection.
+         */
+        curl_easy_setopt(curl,
+                         CURLOPT_HTTP_VERSION,
+                         (long) CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1l);
+
+        return curl;
+}
+
+static double
+get_monotonic_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+get_retry_delay(int attempts)
+{
+        return RETRY_DELAY * (1 << (attempts - 1));
+}
+
+static long
+get_response_code(CURL *curl)
+{
+        long code = 0;
 
-        return fwrite(ptr, size, nmemb, renderer->tile_output);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+
+        return code;
+}
+
+/* Returns whether a failed download is worth trying again */
+static bool
+is_temporary_error(CURL *curl, CURLcode res)
+{
+        switch (res) {
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+                return true;
+        case CURLE_HTTP_RETURNED_ERROR: {
+                long code = get_response_code(curl);
+                return code == 429 || code >= 500;
+        }
+        default:
+                return false;
+        }
 }
 
 struct flt_map_renderer *
@@ -87,7 +291,13 @@ flt_map_renderer_new(const char *url_base,
 
         flt_list_init(&renderer->tile_cache);
 
+        for (int i = 0; i < N_TILE_BUCKETS; i++)
+                flt_list_init(renderer->tile_buckets + i);
+
+        renderer->max_tile_cache_size = DEFAULT_TILE_CACHE_SIZE;
+
         renderer->clip = true;
+        renderer->use_mosaic = true;
 
         if (url_base == NULL)
                 url_base = DEFAULT_MAP_URL_BASE;
@@ -102,15 +312,7 @@ flt_map_renderer_new(const char *url_base,
         if (api_key)
                 renderer->api_key = flt_strdup(api_key);
 
-        renderer->curl = curl_easy_init();
-        curl_easy_setopt(renderer->curl, CURLOPT_FOLLOWLOCATION, 1l);
-        curl_easy_setopt(renderer->curl, CURLOPT_FAILONERROR, 1l);
-        curl_easy_setopt(renderer->curl,
-                         CURLOPT_WRITEFUNCTION,
-                         write_tile_data_cb);
-        curl_easy_setopt(renderer->curl,
-                         CURLOPT_WRITEDATA,
-                         renderer);
+        renderer->curl = create_curl();
 
         return renderer;
 }
@@ -122,11 +324,60 @@ flt_map_renderer_set_clip(struct flt_map_renderer *renderer,
         renderer->clip = clip;
 }
 
+void
+flt_map_renderer_set_mosaic(struct flt_map_renderer *renderer,
+                            bool use_mosaic)
+{
+        renderer->use_mosaic = use_mosaic;
+
+        if (!use_mosaic && renderer->mosaic) {
+                cairo_surface_destroy(renderer->mosaic);
+                renderer->mosaic = NULL;
+        }
+}
+
+void
+flt_map_renderer_set_tile_cache_size(struct flt_map_renderer *renderer,
+                                     size_t size)
+{
+        renderer->max_tile_cache_size = size;
+}
+
+void
+flt_map_renderer_get_stats(const struct flt_map_renderer *renderer,
+                           struct flt_map_renderer_stats *stats)
+{
+        *stats = renderer->stats;
+}
+
+uint32_t
+flt_map_renderer_get_tile_generation(const struct flt_map_renderer *renderer)
+{
+        return renderer->tile_generation;
+}
+
+static struct flt_list *
+get_tile_bucket(struct flt_map_renderer *renderer,
+                int zoom,
+                int x, int y)
+{
+        uint32_t hash = zoom;
+
+        hash = hash * 0x9e3779b1u + x;
+        hash = hash * 0x9e3779b1u + y;
+        hash ^= hash >> 16;
+
+        return renderer->tile_buckets + (hash & (N_TILE_BUCKETS - 1));
+}
+
 static void
-delete_cached_tile(struct cached_tile *tile)
+delete_cached_tile(struct flt_map_renderer *renderer,
+                   struct cached_tile *tile)
 {
+        renderer->tile_cache_size -= tile->size;
         cairo_surface_destroy(tile->surface);
         flt_list_remove(&tile->link);
+        flt_list_remove(&tile->bucket_link);
         flt_free(tile);
 }
 
@@ -135,37 +386,41 @@ get_cached_tile(struct flt_map_renderer *renderer,
                 int zoom,
                 int x, int y)
 {
+        struct flt_list *bucket = get_tile_bucket(renderer, zoom, x, y);
         struct cached_tile *tile;
 
-        flt_list_for_each(tile, &renderer->tile_cache, link) {
+        flt_list_for_each(tile, bucket, bucket_link) {
                 if (tile->zoom == zoom &&
                     tile->x == x &&
                     tile->y == y) {
-                        /* Move the tile to the front of the list to
+                        /* Move the tile to the end of the list to
                          * mark it as recently used.
                          */
                         flt_list_remove(&tile->link);
                         flt_list_insert(renderer->tile_cache.prev,
                                         &tile->link);
+                        renderer->stats.hits++;
                         return tile;
                 }
         }
 
+        renderer->stats.misses++;
+
         return NULL;
 }
 
-static char *
-get_tile_filename(int zoom, int x, int y)
+/* The filename is written to a buffer of TILE_FILENAME_SIZE so that
+ * looking up a tile doesn’t need any allocations.
+ */
+static void
+get_tile_filename(char *buf, int zoom, int x, int y)
 {
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
-
-        flt_buffer_append_printf(&buf,
-                                 "%s/%i-%i-%i.png",
-                                 TILE_CACHE_DIRECTORY,
-                                 zoom,
-                                 x, y);
-
-        return (char *) buf.data;
+        snprintf(buf,
+                 TILE_FILENAME_SIZE,
+                 "%s/%i-%i-%i.png",
+                 TILE_CACHE_DIRECTORY,
+                 zoom,
+                 x, y);
 }
 
 static struct cached_tile *
@@ -174,15 +429,23 @@ add_tile(struct flt_map_renderer *renderer,
          int x, int y,
          cairo_surface_t *surface)
 {
-        if (renderer->n_cached_tiles >= N_CACHED_TILES) {
-                struct cached_tile *last_tile =
-                        flt_container_of(renderer->tile_cache.prev,
+        size_t size = ((size_t) cairo_image_surface_get_stride(surface) *
+                       cairo_image_surface_get_height(surface));
+
+        /* Make space by discarding the least recently used tiles.
+         * The new tile is always kept even if it is bigger than the
+         * limit on its own.
+         */
+        while (!flt_list_empty(&renderer->tile_cache) &&
+               renderer->tile_cache_size + size >
+               renderer->max_tile_cache_size) {
+                struct cached_tile *oldest =
+                        flt_container_of(renderer->tile_cache.next,
                                          struct cached_tile,
                                          link);
 
-                delete_cached_tile(last_tile);
-
-                renderer->n_cached_tiles--;
+                delete_cached_tile(renderer, oldest);
+                renderer->stats.evictions++;
         }
 
         struct cached_tile *tile = flt_alloc(sizeof *tile);
@@ -190,32 +453,101 @@ add_tile(struct flt_map_renderer *renderer,
         tile->zoom = zoom;
         tile->x = x;
         tile->y = y;
+        tile->size = size;
         tile->surface = surface;
 
         flt_list_insert(renderer->tile_cache.prev, &tile->link);
+        flt_list_insert(get_tile_bucket(renderer, zoom, x, y),
+                        &tile->bucket_link);
 
-        renderer->n_cached_tiles++;
+        renderer->tile_cache_size += size;
 
         return tile;
 }
 
+_Static_assert(TILE_SIZE == FLT_TILE_PACK_TILE_SIZE,
+               "the tiles in the pack must be the same size");
+
+static struct flt_tile_pack *
+get_tile_pack(struct flt_map_renderer *renderer)
+{
+        if (!renderer->tried_tile_pack) {
+                struct flt_error *error = NULL;
+
+                renderer->tried_tile_pack = true;
+                renderer->tile_pack = flt_tile_pack_open(TILE_PACK_FILENAME,
+                                                         &error);
+
+                /* The pack is optional so it’s only worth warning
+                 * about if it exists but can’t be used.
+                 */
+                if (renderer->tile_pack == NULL) {
+                        if (error->domain != &flt_file_error ||
+                            error->code != FLT_FILE_ERROR_NOENT)
+                                flt_warning("%s", error->message);
+                        flt_error_free(error);
+                }
+        }
+
+        return renderer->tile_pack;
+}
+
+static const uint8_t *
+get_packed_tile(struct flt_map_renderer *renderer,
+                int zoom,
+                int x, int y)
+{
+        struct flt_tile_pack *pack = get_tile_pack(renderer);
+
+        if (pack == NULL)
+                return NULL;
+
+        return flt_tile_pack_get(pack, zoom, x, y);
+}
+
 static struct cached_tile *
 load_tile(struct flt_map_renderer *renderer,
           int zoom,
           int x, int y,
           struct flt_error **error)
 {
-        char *filename = get_tile_filename(zoom, x, y);
+        const uint8_t *packed = get_packed_tile(renderer, zoom, x, y);
+
+        if (packed) {
+                /* The surface is only ever used as a source so it can
+                 * point straight into the read-only mapping.
+                 */
+                uint8_t *data = (uint8_t *) packed;
+                cairo_surface_t *surface =
+                        cairo_image_surface_create_for_data
+                        (data,
+                         CAIRO_FORMAT_ARGB32,
+                         TILE_SIZE, TILE_SIZE,
+                         FLT_TILE_PACK_STRIDE);
+
+                renderer->stats.packed++;
+
+                return add_tile(renderer, zoom, x, y, surface);
+        }
+
+        char filename[TILE_FILENAME_SIZE];
+
+        get_tile_filename(filename, zoom, x, y);
+
+        FLT_PROFILE_BEGIN(start);
 
         cairo_surface_t *surface =
                 cairo_image_surface_create_from_png(filename);
 
+        FLT_PROFILE_END(start, FLT_PROFILE_TILE_DECODE);
+
         cairo_status_t status = cairo_surface_status(surface);
 
         struct cached_tile *tile = NULL;
 
         switch (status) {
         case CAIRO_STATUS_SUCCESS:
+                renderer->stats.decodes++;
                 tile = add_tile(renderer, zoom, x, y, surface);
                 break;
         case CAIRO_STATUS_FILE_NOT_FOUND:
@@ -237,8 +569,6 @@ load_tile(struct flt_map_renderer *renderer,
                 break;
         }
 
-        flt_free(filename);
-
         return tile;
 }
 
@@ -259,28 +589,40 @@ ensure_tile_cache_directory(struct flt_error **error)
 }
 
 static bool
-download_tile(struct flt_map_renderer *renderer,
-              int zoom,
-              int x, int y,
-              struct flt_error **error)
+start_tile_download(struct flt_map_renderer *renderer,
+                    struct tile_download *download,
+                    CURL *curl,
+                    int zoom,
+                    int x, int y,
+                    struct flt_error **error)
 {
         if (!ensure_tile_cache_directory(error))
                 return false;
 
-        char *filename = get_tile_filename(zoom, x, y);
-
-        bool ret = true;
+        get_tile_filename(download->filename, zoom, x, y);
+        /* The tile is downloaded to a temporary file and then
+         * renamed so that another renderer running at the same time
+         * will never see a partially written tile.
+         */
+        snprintf(download->tmp_filename,
+                 sizeof download->tmp_filename,
+                 "%s" TMP_SUFFIX,
+                 download->filename);
 
-        renderer->tile_output = fopen(filename, "wb");
+        int fd = flt_create_temp_file(download->tmp_filename);
 
-        if (renderer->tile_output == NULL) {
+        if (fd == -1 ||
+            (download->output = fdopen(fd, "wb")) == NULL) {
                 flt_file_error_set(error,
                                    errno,
                                    "%s: %s",
-                                   filename,
+                                   download->tmp_filename,
                                    strerror(errno));
-                ret = false;
-                goto out;
+                if (fd != -1) {
+                        close(fd);
+                        unlink(download->tmp_filename);
+                }
+                return false;
         }
 
         struct flt_buffer url_buf = FLT_BUFFER_STATIC_INIT;
@@ -297,11 +639,62 @@ download_tile(struct flt_map_renderer *renderer,
                                          renderer->api_key);
         }
 
-        curl_easy_setopt(renderer->curl, CURLOPT_URL, (char *) url_buf.data);
+        curl_easy_setopt(curl, CURLOPT_URL, (char *) url_buf.data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, download->output);
 
         flt_buffer_destroy(&url_buf);
 
-        CURLcode res = curl_easy_perform(renderer->curl);
+        struct stat statbuf;
+
+        download->refresh = stat(download->filename, &statbuf) == 0;
+        download->attempts = 1;
+
+        /* An existing tile is only downloaded again if the server has
+         * modified it since it was last checked.
+         */
+        if (download->refresh) {
+                curl_easy_setopt(curl,
+                                 CURLOPT_TIMECONDITION,
+                                 (long) CURL_TIMECOND_IFMODSINCE);
+                curl_easy_setopt(curl,
+                                 CURLOPT_TIMEVALUE,
+                                 (long) statbuf.st_mtime);
+        } else {
+                curl_easy_setopt(curl,
+                                 CURLOPT_TIMECONDITION,
+                                 (long) CURL_TIMECOND_NONE);
+        }
+
+        return true;
+}
+
+/* Empties the temporary file so that the download can be tried
+ * again.
+ */
+static bool
+restart_tile_download(struct tile_download *download)
+{
+        download->attempts++;
+
+        if (fflush(download->output) == EOF ||
+            ftruncate(fileno(download->output), 0) == -1)
+                return false;
+
+        rewind(download->output);
+
+        return true;
+}
+
+/* Closes the file and moves it into place if the download succeeded.
+ * The error can be NULL to ignore it.
+ */
+static bool
+finish_tile_download(struct tile_download *download,
+                     CURL *curl,
+                     CURLcode res,
+                     struct flt_error **error)
+{
+        bool ret = true;
 
         if (res != CURLE_OK) {
                 flt_set_error(error,
@@ -312,22 +705,101 @@ download_tile(struct flt_map_renderer *renderer,
                 ret = false;
         }
 
-out:
-        if (renderer->tile_output) {
-                fclose(renderer->tile_output);
-                renderer->tile_output = NULL;
+        if (fclose(download->output) == EOF && ret) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   download->tmp_filename,
+                                   strerror(errno));
+                ret = false;
+        }
+
+        long condition_unmet = 0;
+
+        if (ret && download->refresh) {
+                curl_easy_getinfo(curl,
+                                  CURLINFO_CONDITION_UNMET,
+                                  &condition_unmet);
         }
 
-        flt_free(filename);
+        if (condition_unmet) {
+                /* The tile hasn’t changed. Update the modification
+                 * time so that it won’t be checked again for a while.
+                 */
+                unlink(download->tmp_filename);
+                utime(download->filename, NULL);
+                return true;
+        }
+
+        if (ret && rename(download->tmp_filename, download->filename) == -1) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   download->filename,
+                                   strerror(errno));
+                ret = false;
+        }
+
+        if (!ret)
+                unlink(download->tmp_filename);
 
         return ret;
 }
 
+static bool
+download_tile(struct flt_map_renderer *renderer,
+              int zoom,
+              int x, int y,
+              struct flt_error **error)
+{
+        struct tile_download download;
+
+        if (!start_tile_download(renderer,
+                                 &download,
+                                 renderer->curl,
+                                 zoom,
+                                 x, y,
+                                 error))
+                return false;
+
+        FLT_PROFILE_BEGIN(start);
+
+        CURLcode res;
+
+        while (true) {
+                res = curl_easy_perform(renderer->curl);
+
+                if (res == CURLE_OK ||
+                    download.attempts >= MAX_DOWNLOAD_ATTEMPTS ||
+                    !is_temporary_error(renderer->curl, res))
+                        break;
+
+                double delay = get_retry_delay(download.attempts);
+                struct timespec ts = {
+                        .tv_sec = delay,
+                        .tv_nsec = (delay - floor(delay)) * 1e9,
+                };
+
+                nanosleep(&ts, NULL);
+
+                if (!restart_tile_download(&download)) {
+                        res = CURLE_WRITE_ERROR;
+                        break;
+                }
+        }
+
+        FLT_PROFILE_END(start, FLT_PROFILE_TILE_DOWNLOAD);
+
+        renderer->stats.downloads++;
+
+        return finish_tile_download(&download, renderer->curl, res, error);
+}
+
 static struct cached_tile *
-get_tile(struct flt_map_renderer *renderer,
-         int zoom,
-         int x, int y,
-         struct flt_error **error)
+load_or_download_tile(struct flt_map_renderer *renderer,
+                      int zoom,
+                      int x, int y,
+                      struct flt_error **error)
 {
         struct cached_tile *tile = get_cached_tile(renderer, zoom, x, y);
 
@@ -348,6 +820,8 @@ get_tile(struct flt_map_renderer *renderer,
                         if (!download_tile(renderer, zoom, x, y, error))
                                 return NULL;
 
+                        renderer->tile_generation++;
+
                         tile = load_tile(renderer, zoom, x, y, error);
 
                         if (tile == NULL)
@@ -358,6 +832,25 @@ get_tile(struct flt_map_renderer *renderer,
         return tile;
 }
 
+static struct cached_tile *
+get_tile(struct flt_map_renderer *renderer,
+         int zoom,
+         int x, int y,
+         struct flt_error **error)
+{
+        FLT_PROFILE_BEGIN(start);
+
+        struct cached_tile *tile =
+                load_or_download_tile(renderer, zoom, x, y, error);
+
+        if (tile == NULL)
+                renderer->tile_generation++;
+
+        FLT_PROFILE_END(start, FLT_PROFILE_GET_TILE);
+
+        return tile;
+}
+
 static void
 lon_to_x(double lon, int zoom,
          int *tile_x_out,
@@ -387,6 +880,61 @@ lat_to_y(double lat, int zoom,
         *pixel_y_out = round(frac_y * TILE_SIZE);
 }
 
+static void
+get_tile_range(const struct flt_map_renderer_params *params,
+               struct tile_range *range)
+{
+        lon_to_x(params->lon, params->zoom, &range->tile_x, &range->pixel_x);
+        lat_to_y(params->lat, params->zoom, &range->tile_y, &range->pixel_y);
+
+        range->x_start = -((params->map_width / 2 -
+                            range->pixel_x +
+                            TILE_SIZE -
+                            1) /
+                           TILE_SIZE);
+        range->y_start = -((params->map_height / 2 -
+                            range->pixel_y +
+                            TILE_SIZE -
+                            1) /
+                           TILE_SIZE);
+        range->x_end = ((params->map_width + range->pixel_x + TILE_SIZE - 1) /
+                        TILE_SIZE);
+        range->y_end = ((params->map_height + range->pixel_y + TILE_SIZE - 1) /
+                        TILE_SIZE);
+}
+
+static void
+add_margin(int start, int end, int n_tiles,
+           int *start_out, int *end_out)
+{
+        /* The margin doesn’t go past the edge of the world unless the
+         * visible range already does.
+         */
+        *start_out = MAX(start - MOSAIC_MARGIN, MIN(start, 0));
+        *end_out = MIN(end + MOSAIC_MARGIN, MAX(end, n_tiles));
+}
+
+/* Gets the range of tiles to put in the mosaic for a visible range.
+ * The end is exclusive.
+ */
+static void
+get_mosaic_range(const struct flt_map_renderer_params *params,
+                 const struct tile_range *range,
+                 int *x1, int *y1,
+                 int *x2, int *y2)
+{
+        int n_tiles = 1 << params->zoom;
+
+        add_margin(range->tile_x + range->x_start,
+                   range->tile_x + range->x_end,
+                   n_tiles,
+                   x1, x2);
+        add_margin(range->tile_y + range->y_start,
+                   range->tile_y + range->y_end,
+                   n_tiles,
+                   y1, y2);
+}
+
 static void
 render_tile(cairo_t *cr,
             struct cached_tile *tile,
@@ -458,27 +1006,205 @@ set_clip(cairo_t *cr,
         cairo_clip(cr);
 }
 
+static void
+project_point(const struct flt_trace_point *point,
+              int zoom,
+              int *x_out, int *y_out)
+{
+        int tile_x, tile_y, pixel_x, pixel_y;
+
+        lon_to_x(point->lon, zoom, &tile_x, &pixel_x);
+        lat_to_y(point->lat, zoom, &tile_y, &pixel_y);
+
+        *x_out = tile_x * TILE_SIZE + pixel_x;
+        *y_out = tile_y * TILE_SIZE + pixel_y;
+}
+
+static double
+distance_to_line_squared(const int *p, const int *a, const int *b)
+{
+        double dx = b[0] - a[0];
+        double dy = b[1] - a[1];
+        double length_squared = dx * dx + dy * dy;
+        double px = p[0] - a[0];
+        double py = p[1] - a[1];
+
+        if (length_squared <= 0.0)
+                return px * px + py * py;
+
+        double cross = px * dy - py * dx;
+
+        return cross * cross / length_squared;
+}
+
+/* Marks the points that are needed to keep the line within the
+ * tolerance using the Douglas-Peucker algorithm.
+ */
+static void
+simplify_points(const int *points,
+                size_t n_points,
+                bool *keep)
+{
+        const double tolerance_squared = (TRACE_SIMPLIFY_TOLERANCE *
+                                          TRACE_SIMPLIFY_TOLERANCE);
+
+        if (n_points <= 2) {
+                memset(keep, 1, n_points * sizeof *keep);
+                return;
+        }
+
+        memset(keep, 0, n_points * sizeof *keep);
+        keep[0] = keep[n_points - 1] = true;
+
+        struct flt_buffer stack = FLT_BUFFER_STATIC_INIT;
+        size_t range[2] = { 0, n_points - 1 };
+
+        flt_buffer_append(&stack, range, sizeof range);
+
+        while (stack.length > 0) {
+                stack.length -= sizeof range;
+                memcpy(range, stack.data + stack.length, sizeof range);
+
+                size_t start = range[0], end = range[1];
+                double max_distance = 0.0;
+                size_t max_point = start;
+
+                for (size_t i = start + 1; i < end; i++) {
+                        double d = distance_to_line_squared(points + i * 2,
+                                                            points + start * 2,
+                                                            points + end * 2);
+
+                        if (d > max_distance) {
+                                max_distance = d;
+                                max_point = i;
+                        }
+                }
+
+                if (max_distance <= tolerance_squared)
+                        continue;
+
+                keep[max_point] = true;
+
+                size_t first[2] = { start, max_point };
+                size_t second[2] = { max_point, end };
+
+                flt_buffer_append(&stack, first, sizeof first);
+                flt_buffer_append(&stack, second, sizeof second);
+        }
+
+        flt_buffer_destroy(&stack);
+}
+
+static void
+free_projected_trace(struct projected_trace *projected)
+{
+        flt_free(projected->segments);
+        flt_free(projected->points);
+        flt_free(projected);
+}
+
+static struct projected_trace *
+project_trace(const struct flt_trace *trace,
+              int zoom)
+{
+        struct projected_trace *projected = flt_alloc(sizeof *projected);
+        size_t max_points = 0;
+
+        for (size_t i = 0; i < trace->n_segments; i++) {
+                if (trace->segments[i].n_points > max_points)
+                        max_points = trace->segments[i].n_points;
+        }
+
+        int *segment_points = flt_alloc(max_points * 2 * sizeof (int));
+        bool *keep = flt_alloc(max_points * sizeof *keep);
+        size_t *offsets = flt_alloc(trace->n_segments * sizeof *offsets);
+        struct flt_buffer points = FLT_BUFFER_STATIC_INIT;
+
+        projected->trace = trace;
+        projected->zoom = zoom;
+        projected->segments =
+                flt_alloc(trace->n_segments * sizeof *projected->segments);
+
+        for (size_t i = 0; i < trace->n_segments; i++) {
+                const struct flt_trace_segment *segment = trace->segments + i;
+                struct projected_segment *ps = projected->segments + i;
+
+                for (size_t j = 0; j < segment->n_points; j++) {
+                        project_point(segment->points + j,
+                                      zoom,
+                                      segment_points + j * 2,
+                                      segment_points + j * 2 + 1);
+                }
+
+                simplify_points(segment_points, segment->n_points, keep);
+
+                offsets[i] = points.length / sizeof (int);
+                ps->n_points = 0;
+                ps->x1 = ps->y1 = INT_MAX;
+                ps->x2 = ps->y2 = INT_MIN;
+
+                for (size_t j = 0; j < segment->n_points; j++) {
+                        const int *p = segment_points + j * 2;
+
+                        if (!keep[j])
+                                continue;
+
+                        flt_buffer_append(&points, p, sizeof (int) * 2);
+                        ps->n_points++;
+
+                        ps->x1 = MIN(ps->x1, p[0]);
+                        ps->y1 = MIN(ps->y1, p[1]);
+                        ps->x2 = MAX(ps->x2, p[0]);
+                        ps->y2 = MAX(ps->y2, p[1]);
+                }
+        }
+
+        projected->points = (int *) points.data;
+
+        /* The buffer can move while it is being built so the
+         * pointers into it are only set at the end.
+         */
+        for (size_t i = 0; i < trace->n_segments; i++)
+                projected->segments[i].points = projected->points + offsets[i];
+
+        flt_free(offsets);
+        flt_free(keep);
+        flt_free(segment_points);
+
+        return projected;
+}
+
+static const struct projected_trace *
+get_projected_trace(struct flt_map_renderer *renderer,
+                    const struct flt_trace *trace,
+                    int zoom)
+{
+        struct projected_trace *projected = renderer->projected_trace;
+
+        if (projected && projected->trace == trace && projected->zoom == zoom)
+                return projected;
+
+        if (projected)
+                free_projected_trace(projected);
+
+        projected = project_trace(trace, zoom);
+        renderer->projected_trace = projected;
+
+        return projected;
+}
+
 static void
 add_segment_path(cairo_t *cr,
                  const struct flt_map_renderer_params *params,
                  int center_pixel_x, int center_pixel_y,
-                 const struct flt_trace_segment *segment)
+                 const struct projected_segment *segment)
 {
         for (size_t i = 0; i < segment->n_points; i++) {
-                const struct flt_trace_point *point =
-                        segment->points + i;
-                int tile_x, tile_y, pixel_x, pixel_y;
-
-                lon_to_x(point->lon, params->zoom, &tile_x, &pixel_x);
-                lat_to_y(point->lat, params->zoom, &tile_y, &pixel_y);
-
                 double x = params->draw_center_x +
-                        tile_x * TILE_SIZE +
-                        pixel_x -
+                        segment->points[i * 2] -
                         center_pixel_x;
                 double y = params->draw_center_y +
-                        tile_y * TILE_SIZE +
-                        pixel_y -
+                        segment->points[i * 2 + 1] -
                         center_pixel_y;
 
                 if (i == 0)
@@ -577,25 +1303,66 @@ draw_crossed_segment(cairo_t *cr,
         cairo_set_line_width(cr, TRACE_LINE_WIDTH);
 }
 
+static bool
+segment_is_animated(const struct flt_trace_segment *segment)
+{
+        return (segment->status == FLT_TRACE_SEGMENT_STATUS_TESTED ||
+                segment->status == FLT_TRACE_SEGMENT_STATUS_WIP);
+}
+
 static void
-draw_trace(cairo_t *cr,
+draw_trace(struct flt_map_renderer *renderer,
+           cairo_t *cr,
            const struct flt_map_renderer_params *params,
-           int center_pixel_x, int center_pixel_y)
+           int center_pixel_x, int center_pixel_y,
+           enum trace_layer layer)
 {
+        const struct projected_trace *projected =
+                get_projected_trace(renderer, params->trace, params->zoom);
+
         cairo_save(cr);
 
         cairo_set_line_width(cr, TRACE_LINE_WIDTH);
 
+        /* Segments that can’t touch the clip even with the width of
+         * the line are skipped.
+         */
+        double clip_x1, clip_y1, clip_x2, clip_y2;
+
+        cairo_clip_extents(cr, &clip_x1, &clip_y1, &clip_x2, &clip_y2);
+
+        double offset_x = center_pixel_x - params->draw_center_x;
+        double offset_y = center_pixel_y - params->draw_center_y;
+        double cull_x1 = clip_x1 + offset_x - TRACE_LINE_WIDTH;
+        double cull_y1 = clip_y1 + offset_y - TRACE_LINE_WIDTH;
+        double cull_x2 = clip_x2 + offset_x + TRACE_LINE_WIDTH;
+        double cull_y2 = clip_y2 + offset_y + TRACE_LINE_WIDTH;
+
         for (size_t segment_num = 0;
              segment_num < params->trace->n_segments;
              segment_num++) {
                 const struct flt_trace_segment *segment =
                         params->trace->segments + segment_num;
+                const struct projected_segment *projected_segment =
+                        projected->segments + segment_num;
+
+                if ((layer == TRACE_LAYER_STATIC &&
+                     segment_is_animated(segment)) ||
+                    (layer == TRACE_LAYER_ANIMATED &&
+                     !segment_is_animated(segment)))
+                        continue;
+
+                if (projected_segment->n_points <= 0 ||
+                    projected_segment->x2 < cull_x1 ||
+                    projected_segment->x1 > cull_x2 ||
+                    projected_segment->y2 < cull_y1 ||
+                    projected_segment->y1 > cull_y2)
+                        continue;
 
                 add_segment_path(cr,
                                  params,
                                  center_pixel_x, center_pixel_y,
-                                 segment);
+                                 projected_segment);
 
                 switch (segment->status) {
                 case FLT_TRACE_SEGMENT_STATUS_DONE:
@@ -637,6 +1404,165 @@ draw_trace(cairo_t *cr,
         cairo_restore(cr);
 }
 
+static bool
+render_tiles(struct flt_map_renderer *renderer,
+             cairo_t *cr,
+             const struct flt_map_renderer_params *params,
+             const struct tile_range *range,
+             struct flt_error **error)
+{
+        for (int y = range->y_start; y < range->y_end; y++) {
+                for (int x = range->x_start; x < range->x_end; x++) {
+                        struct cached_tile *tile = get_tile(renderer,
+                                                            params->zoom,
+                                                            x + range->tile_x,
+                                                            y + range->tile_y,
+                                                            error);
+
+                        if (tile == NULL)
+                                return false;
+
+                        render_tile(cr,
+                                    tile,
+                                    params->draw_center_x -
+                                    range->pixel_x +
+                                    x * TILE_SIZE,
+                                    params->draw_center_y -
+                                    range->pixel_y +
+                                    y * TILE_SIZE);
+                }
+        }
+
+        return true;
+}
+
+static bool
+mosaic_covers(const struct flt_map_renderer *renderer,
+              const struct flt_map_renderer_params *params,
+              const struct tile_range *range)
+{
+        return (renderer->mosaic &&
+                renderer->mosaic_zoom == params->zoom &&
+                renderer->mosaic_trace == params->trace &&
+                (params->trace == NULL ||
+                 renderer->mosaic_trace_color == params->trace_color) &&
+                range->tile_x + range->x_start >= renderer->mosaic_x1 &&
+                range->tile_x + range->x_end <= renderer->mosaic_x2 &&
+                range->tile_y + range->y_start >= renderer->mosaic_y1 &&
+                range->tile_y + range->y_end <= renderer->mosaic_y2);
+}
+
+static bool
+build_mosaic(struct flt_map_renderer *renderer,
+             const struct flt_map_renderer_params *params,
+             const struct tile_range *range,
+             struct flt_error **error)
+{
+        int x1, y1, x2, y2;
+
+        get_mosaic_range(params, range, &x1, &y1, &x2, &y2);
+
+        if (renderer->mosaic)
+                cairo_surface_destroy(renderer->mosaic);
+
+        renderer->mosaic =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                           (x2 - x1) * TILE_SIZE,
+                                           (y2 - y1) * TILE_SIZE);
+
+        cairo_t *cr = cairo_create(renderer->mosaic);
+
+        for (int y = y1; y < y2; y++) {
+                for (int x = x1; x < x2; x++) {
+                        struct cached_tile *tile = get_tile(renderer,
+                                                            params->zoom,
+                                                            x, y,
+                                                            error);
+
+                        if (tile == NULL) {
+                                cairo_destroy(cr);
+                                cairo_surface_destroy(renderer->mosaic);
+                                renderer->mosaic = NULL;
+                                return false;
+                        }
+
+                        cairo_set_source_surface(cr,
+                                                 tile->surface,
+                                                 (x - x1) * TILE_SIZE,
+                                                 (y - y1) * TILE_SIZE);
+                        cairo_paint(cr);
+                }
+        }
+
+        if (params->trace) {
+                struct flt_map_renderer_params mosaic_params = *params;
+
+                mosaic_params.draw_center_x = 0.0;
+                mosaic_params.draw_center_y = 0.0;
+
+                draw_trace(renderer,
+                           cr,
+                           &mosaic_params,
+                           x1 * TILE_SIZE,
+                           y1 * TILE_SIZE,
+                           TRACE_LAYER_STATIC);
+        }
+
+        cairo_destroy(cr);
+
+        cairo_surface_flush(renderer->mosaic);
+
+        renderer->mosaic_zoom = params->zoom;
+        renderer->mosaic_x1 = x1;
+        renderer->mosaic_y1 = y1;
+        renderer->mosaic_x2 = x2;
+        renderer->mosaic_y2 = y2;
+        renderer->mosaic_trace = params->trace;
+        renderer->mosaic_trace_color = params->trace_color;
+
+        return true;
+}
+
+static bool
+render_mosaic(struct flt_map_renderer *renderer,
+              cairo_t *cr,
+              const struct flt_map_renderer_params *params,
+              const struct tile_range *range,
+              struct flt_error **error)
+{
+        if (!mosaic_covers(renderer, params, range) &&
+            !build_mosaic(renderer, params, range, error))
+                return false;
+
+        int center_x = range->tile_x * TILE_SIZE + range->pixel_x;
+        int center_y = range->tile_y * TILE_SIZE + range->pixel_y;
+        double mosaic_x = (params->draw_center_x -
+                           center_x +
+                           renderer->mosaic_x1 * TILE_SIZE);
+        double mosaic_y = (params->draw_center_y -
+                           center_y +
+                           renderer->mosaic_y1 * TILE_SIZE);
+
+        cairo_save(cr);
+
+        cairo_set_source_surface(cr, renderer->mosaic, mosaic_x, mosaic_y);
+        cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+        cairo_rectangle(cr,
+                        params->draw_center_x -
+                        range->pixel_x +
+                        range->x_start * TILE_SIZE,
+                        params->draw_center_y -
+                        range->pixel_y +
+                        range->y_start * TILE_SIZE,
+                        (range->x_end - range->x_start) * TILE_SIZE,
+                        (range->y_end - range->y_start) * TILE_SIZE);
+        cairo_fill(cr);
+
+        cairo_restore(cr);
+
+        return true;
+}
+
 bool
 flt_map_renderer_render(struct flt_map_renderer *renderer,
                         cairo_t *cr,
@@ -645,6 +1571,8 @@ flt_map_renderer_render(struct flt_map_renderer *renderer,
 {
         bool ret = true;
 
+        FLT_PROFILE_BEGIN(start);
+
         cairo_save(cr);
 
         if (renderer->clip) {
@@ -655,57 +1583,391 @@ flt_map_renderer_render(struct flt_map_renderer *renderer,
                          params->map_height);
         }
 
-        int tile_x, tile_y, pixel_x, pixel_y;
+        struct tile_range range;
 
-        lon_to_x(params->lon, params->zoom, &tile_x, &pixel_x);
-        lat_to_y(params->lat, params->zoom, &tile_y, &pixel_y);
-
-        int x_tile_start = -((params->map_width / 2 - pixel_x + TILE_SIZE - 1) /
-                             TILE_SIZE);
-        int y_tile_start = -((params->map_height / 2 -
-                              pixel_y +
-                              TILE_SIZE -
-                              1) /
-                             TILE_SIZE);
-
-        for (int y = y_tile_start;
-             y * TILE_SIZE - pixel_y < params->map_height;
-             y++) {
-                for (int x = x_tile_start;
-                     x * TILE_SIZE - pixel_x < params->map_width;
-                     x++) {
-                        struct cached_tile *tile = get_tile(renderer,
-                                                            params->zoom,
-                                                            x + tile_x,
-                                                            y + tile_y,
-                                                            error);
-
-                        if (tile == NULL) {
-                                ret = false;
-                                goto out;
-                        }
+        get_tile_range(params, &range);
 
-                        render_tile(cr,
-                                    tile,
-                                    params->draw_center_x -
-                                    pixel_x +
-                                    x * TILE_SIZE,
-                                    params->draw_center_y -
-                                    pixel_y +
-                                    y * TILE_SIZE);
+        if (renderer->use_mosaic) {
+                if (!render_mosaic(renderer, cr, params, &range, error)) {
+                        ret = false;
+                        goto out;
                 }
+        } else if (!render_tiles(renderer, cr, params, &range, error)) {
+                ret = false;
+                goto out;
         }
 
         if (params->trace) {
-                draw_trace(cr,
+                draw_trace(renderer,
+                           cr,
                            params,
-                           tile_x * TILE_SIZE + pixel_x,
-                           tile_y * TILE_SIZE + pixel_y);
+                           range.tile_x * TILE_SIZE + range.pixel_x,
+                           range.tile_y * TILE_SIZE + range.pixel_y,
+                           renderer->use_mosaic ?
+                           TRACE_LAYER_ANIMATED :
+                           TRACE_LAYER_ALL);
         }
 
 out:
         cairo_restore(cr);
 
+        FLT_PROFILE_END(start, FLT_PROFILE_MAP);
+
+        return ret;
+}
+
+void
+flt_map_renderer_add_tiles(const struct flt_map_renderer_params *params,
+                           struct flt_buffer *tiles)
+{
+        struct tile_range range;
+        int x1, y1, x2, y2;
+
+        get_tile_range(params, &range);
+        get_mosaic_range(params, &range, &x1, &y1, &x2, &y2);
+
+        for (int y = y1; y < y2; y++) {
+                for (int x = x1; x < x2; x++) {
+                        struct flt_map_renderer_tile tile = {
+                                .zoom = params->zoom,
+                                .x = x,
+                                .y = y,
+                        };
+
+                        flt_buffer_append(tiles, &tile, sizeof tile);
+                }
+        }
+}
+
+static int
+compare_tile_cb(const void *pa, const void *pb)
+{
+        const struct flt_map_renderer_tile *a = pa;
+        const struct flt_map_renderer_tile *b = pb;
+
+        if (a->zoom != b->zoom)
+                return a->zoom < b->zoom ? -1 : 1;
+        if (a->y != b->y)
+                return a->y < b->y ? -1 : 1;
+        if (a->x != b->x)
+                return a->x < b->x ? -1 : 1;
+        return 0;
+}
+
+static size_t
+sort_unique_tiles(struct flt_map_renderer_tile *tiles,
+                  size_t n_tiles)
+{
+        if (n_tiles == 0)
+                return 0;
+
+        qsort(tiles, n_tiles, sizeof *tiles, compare_tile_cb);
+
+        size_t n_unique = 1;
+
+        for (size_t i = 1; i < n_tiles; i++) {
+                if (compare_tile_cb(tiles + i, tiles + n_unique - 1))
+                        tiles[n_unique++] = tiles[i];
+        }
+
+        return n_unique;
+}
+
+/* Returns true if the tile is missing or is old enough that it should
+ * be checked with the server again.
+ */
+static bool
+tile_needs_download(struct flt_map_renderer *renderer,
+                    const struct flt_map_renderer_tile *tile,
+                    time_t now)
+{
+        if (get_packed_tile(renderer, tile->zoom, tile->x, tile->y))
+                return false;
+
+        char filename[TILE_FILENAME_SIZE];
+
+        get_tile_filename(filename, tile->zoom, tile->x, tile->y);
+
+        struct stat statbuf;
+
+        if (stat(filename, &statbuf) == -1)
+                return true;
+
+        return now - statbuf.st_mtime > TILE_REFRESH_AGE;
+}
+
+static bool
+finish_prefetch_downloads(CURLM *multi,
+                          struct prefetch_slot *slots,
+                          int *n_busy,
+                          bool ret,
+                          struct flt_error **error)
+{
+        CURLMsg *msg;
+        int n_msgs;
+
+        while ((msg = curl_multi_info_read(multi, &n_msgs))) {
+                if (msg->msg != CURLMSG_DONE)
+                        continue;
+
+                struct prefetch_slot *slot = NULL;
+
+                for (int i = 0; i < MAX_PARALLEL_DOWNLOADS; i++) {
+                        if (slots[i].state == PREFETCH_SLOT_ACTIVE &&
+                            slots[i].curl == msg->easy_handle) {
+                                slot = slots + i;
+                                break;
+                        }
+                }
+
+                assert(slot);
+
+                CURLcode res = msg->data.result;
+
+                curl_multi_remove_handle(multi, slot->curl);
+
+                if (ret &&
+                    res != CURLE_OK &&
+                    slot->download.attempts < MAX_DOWNLOAD_ATTEMPTS &&
+                    is_temporary_error(slot->curl, res)) {
+                        slot->state = PREFETCH_SLOT_WAITING;
+                        slot->retry_time =
+                                get_monotonic_time() +
+                                get_retry_delay(slot->download.attempts);
+                        continue;
+                }
+
+                /* Only the first error is reported */
+                if (!finish_tile_download(&slot->download,
+                                          slot->curl,
+                                          res,
+                                          ret ? error : NULL))
+                        ret = false;
+
+                slot->state = PREFETCH_SLOT_IDLE;
+                (*n_busy)--;
+        }
+
+        return ret;
+}
+
+/* Starts the downloads again whose retry delay has passed. If there
+ * has been an error then the waiting downloads are abandoned instead.
+ */
+static bool
+retry_prefetch_downloads(CURLM *multi,
+                         struct prefetch_slot *slots,
+                         int *n_busy,
+                         double now,
+                         bool ret,
+                         struct flt_error **error)
+{
+        for (int i = 0; i < MAX_PARALLEL_DOWNLOADS; i++) {
+                struct prefetch_slot *slot = slots + i;
+
+                if (slot->state != PREFETCH_SLOT_WAITING)
+                        continue;
+
+                if (ret) {
+                        if (slot->retry_time > now)
+                                continue;
+
+                        if (restart_tile_download(&slot->download)) {
+                                curl_multi_add_handle(multi, slot->curl);
+                                slot->state = PREFETCH_SLOT_ACTIVE;
+                                continue;
+                        }
+
+                        finish_tile_download(&slot->download,
+                                             slot->curl,
+                                             CURLE_WRITE_ERROR,
+                                             error);
+                        ret = false;
+                } else {
+                        finish_tile_download(&slot->download,
+                                             slot->curl,
+                                             CURLE_ABORTED_BY_CALLBACK,
+                                             NULL);
+                }
+
+                slot->state = PREFETCH_SLOT_IDLE;
+                (*n_busy)--;
+        }
+
+        return ret;
+}
+
+static void
+abort_prefetch_downloads(CURLM *multi,
+                         struct prefetch_slot *slots)
+{
+        for (int i = 0; i < MAX_PARALLEL_DOWNLOADS; i++) {
+                if (slots[i].state == PREFETCH_SLOT_IDLE)
+                        continue;
+
+                if (slots[i].state == PREFETCH_SLOT_ACTIVE)
+                        curl_multi_remove_handle(multi, slots[i].curl);
+
+                finish_tile_download(&slots[i].download,
+                                     slots[i].curl,
+                                     CURLE_ABORTED_BY_CALLBACK,
+                                     NULL);
+                slots[i].state = PREFETCH_SLOT_IDLE;
+        }
+}
+
+static void
+set_multi_error(CURLMcode mres,
+                struct flt_error **error)
+{
+        flt_set_error(error,
+                      &flt_map_renderer_error,
+                      FLT_MAP_RENDERER_ERROR_FETCH_FAILED,
+                      "Error downloading tiles: %s",
+                      curl_multi_strerror(mres));
+}
+
+/* Returns the number of milliseconds to wait for network activity
+ * before something else needs to be done.
+ */
+static int
+get_prefetch_timeout(const struct prefetch_slot *slots,
+                     bool can_start,
+                     double next_request_time)
+{
+        double now = get_monotonic_time();
+        double timeout = 1.0;
+
+        if (can_start)
+                timeout = MIN(timeout, next_request_time - now);
+
+        for (int i = 0; i < MAX_PARALLEL_DOWNLOADS; i++) {
+                if (slots[i].state == PREFETCH_SLOT_WAITING)
+                        timeout = MIN(timeout, slots[i].retry_time - now);
+        }
+
+        return MAX(ceil(timeout * 1000.0), 0);
+}
+
+bool
+flt_map_renderer_prefetch(struct flt_map_renderer *renderer,
+                          const struct flt_map_renderer_tile *tiles_in,
+                          size_t n_tiles,
+                          struct flt_error **error)
+{
+        struct flt_map_renderer_tile *tiles =
+                flt_memdup(tiles_in, n_tiles * sizeof *tiles);
+
+        n_tiles = sort_unique_tiles(tiles, n_tiles);
+
+        CURLM *multi = curl_multi_init();
+        struct prefetch_slot slots[MAX_PARALLEL_DOWNLOADS];
+        size_t next_tile = 0;
+        /* Number of slots that are active or waiting to retry */
+        int n_busy = 0;
+        double next_request_time = 0.0;
+        time_t start_time = time(NULL);
+        bool ret = true;
+
+        curl_multi_setopt(multi,
+                          CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          (long) MAX_PARALLEL_DOWNLOADS);
+        curl_multi_setopt(multi,
+                          CURLMOPT_PIPELINING,
+                          (long) CURLPIPE_MULTIPLEX);
+
+        for (int i = 0; i < MAX_PARALLEL_DOWNLOADS; i++) {
+                slots[i].curl = create_curl();
+                slots[i].state = PREFETCH_SLOT_IDLE;
+        }
+
+        while (true) {
+                double now = get_monotonic_time();
+
+                ret = retry_prefetch_downloads(multi,
+                                               slots,
+                                               &n_busy,
+                                               now,
+                                               ret,
+                                               error);
+
+                while (ret &&
+                       n_busy < MAX_PARALLEL_DOWNLOADS &&
+                       next_tile < n_tiles &&
+                       now >= next_request_time) {
+                        const struct flt_map_renderer_tile *tile =
+                                tiles + next_tile++;
+
+                        if (!tile_needs_download(renderer, tile, start_time))
+                                continue;
+
+                        struct prefetch_slot *slot = slots;
+
+                        while (slot->state != PREFETCH_SLOT_IDLE)
+                                slot++;
+
+                        if (!start_tile_download(renderer,
+                                                 &slot->download,
+                                                 slot->curl,
+                                                 tile->zoom,
+                                                 tile->x, tile->y,
+                                                 error)) {
+                                ret = false;
+                                break;
+                        }
+
+                        curl_multi_add_handle(multi, slot->curl);
+                        slot->state = PREFETCH_SLOT_ACTIVE;
+                        n_busy++;
+                        renderer->stats.downloads++;
+
+                        next_request_time = (MAX(next_request_time, now) +
+                                             1.0 / MAX_REQUESTS_PER_SECOND);
+                }
+
+                if (n_busy <= 0 && (!ret || next_tile >= n_tiles))
+                        break;
+
+                int n_running;
+
+                CURLMcode mres = curl_multi_perform(multi, &n_running);
+
+                ret = finish_prefetch_downloads(multi,
+                                                slots,
+                                                &n_busy,
+                                                ret,
+                                                error);
+
+                if (mres != CURLM_OK) {
+                        abort_prefetch_downloads(multi, slots);
+
+                        if (ret) {
+                                set_multi_error(mres, error);
+                                ret = false;
+                        }
+
+                        break;
+                }
+
+                bool can_start = (ret &&
+                                  n_busy < MAX_PARALLEL_DOWNLOADS &&
+                                  next_tile < n_tiles);
+
+                curl_multi_poll(multi,
+                                NULL, 0,
+                                get_prefetch_timeout(slots,
+                                                     can_start,
+                                                     next_request_time),
+                                NULL);
+        }
+
+        for (int i = 0; i < MAX_PARALLEL_DOWNLOADS; i++)
+                curl_easy_cleanup(slots[i].curl);
+
+        curl_multi_cleanup(multi);
+
+        flt_free(tiles);
+
         return ret;
 }
 
@@ -715,7 +1977,21 @@ free_tile_cache(struct flt_map_renderer *renderer)
         struct cached_tile *t, *tmp;
 
         flt_list_for_each_safe(t, tmp, &renderer->tile_cache, link) {
-                delete_cached_tile(t);
+                delete_cached_tile(renderer, t);
+        }
+}
+
+void
+flt_map_renderer_clear_trace_cache(struct flt_map_renderer *renderer)
+{
+        if (renderer->mosaic) {
+                cairo_surface_destroy(renderer->mosaic);
+                renderer->mosaic = NULL;
+        }
+
+        if (renderer->projected_trace) {
+                free_projected_trace(renderer->projected_trace);
+                renderer->projected_trace = NULL;
         }
 }
 
@@ -726,5 +2002,14 @@ flt_map_renderer_free(struct flt_map_renderer *renderer)
         flt_free(renderer->url_base);
         flt_free(renderer->api_key);
         free_tile_cache(renderer);
+        if (renderer->mosaic)
+                cairo_surface_destroy(renderer->mosaic);
+        if (renderer->projected_trace)
+                free_projected_trace(renderer->projected_trace);
+        /* This must be after the tile cache because the surfaces can
+         * point into the pack.
+         */
+        if (renderer->tile_pack)
+                flt_tile_pack_close(renderer->tile_pack);
         flt_free(renderer);
 }
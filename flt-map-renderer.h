@@ -16,14 +16,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_MAP_RENDERER
-#define FLT_MAP_RENDERER
+#ifndef FLT_MAP_RENDERER_H
+#define FLT_MAP_RENDERER_H
 
 #include <cairo.h>
 #include <stdint.h>
 
 #include "flt-error.h"
 #include "flt-trace.h"
+#include "flt-buffer.h"
 
 extern struct flt_error_domain
 flt_map_renderer_error;
@@ -58,6 +59,25 @@ struct flt_map_renderer_params {
                 .video_timestamp = 0.0,         \
         }
 
+struct flt_map_renderer_tile {
+        int zoom, x, y;
+};
+
+struct flt_map_renderer_stats {
+        /* Number of tile lookups that were found in memory */
+        unsigned long hits;
+        /* Number of tile lookups that weren’t in memory */
+        unsigned long misses;
+        /* Number of PNGs decoded from the tile cache directory */
+        unsigned long decodes;
+        /* Number of tiles used from the tile pack without decoding */
+        unsigned long packed;
+        /* Number of tiles that were downloaded */
+        unsigned long downloads;
+        /* Number of tiles discarded to stay within the memory budget */
+        unsigned long evictions;
+};
+
 struct flt_map_renderer;
 
 /* url_base can be NULL to use the default. If api_key is NULL then no
@@ -71,13 +91,67 @@ void
 flt_map_renderer_set_clip(struct flt_map_renderer *renderer,
                           bool clip);
 
+/* When enabled, the tiles around the current position are composited
+ * once into a larger surface along with the parts of the trace that
+ * don’t move. The map is then drawn with a single blit until the
+ * position needs a different set of tiles. This is enabled by
+ * default.
+ */
+void
+flt_map_renderer_set_mosaic(struct flt_map_renderer *renderer,
+                            bool use_mosaic);
+
+/* Sets the maximum number of bytes of decoded tiles to keep in
+ * memory.
+ */
+void
+flt_map_renderer_set_tile_cache_size(struct flt_map_renderer *renderer,
+                                     size_t size);
+
+/* Discards anything that was cached for a particular trace. This
+ * must be called before freeing a trace that has been rendered.
+ */
+void
+flt_map_renderer_clear_trace_cache(struct flt_map_renderer *renderer);
+
+void
+flt_map_renderer_get_stats(const struct flt_map_renderer *renderer,
+                           struct flt_map_renderer_stats *stats);
+
+/* Returns a number that changes whenever a tile fails to load or a
+ * new tile is downloaded. A frame drawn before the number changed
+ * might not look the same as one drawn after even at the same
+ * position.
+ */
+uint32_t
+flt_map_renderer_get_tile_generation(const struct flt_map_renderer *renderer);
+
 bool
 flt_map_renderer_render(struct flt_map_renderer *renderer,
                         cairo_t *cr,
                         const struct flt_map_renderer_params *params,
                         struct flt_error **error);
 
+/* Appends all of the tiles that would be used to render a map with
+ * the given params to tiles as an array of struct
+ * flt_map_renderer_tile. This includes the margin of tiles around the
+ * visible ones that goes into the mosaic.
+ */
+void
+flt_map_renderer_add_tiles(const struct flt_map_renderer_params *params,
+                           struct flt_buffer *tiles);
+
+/* Downloads all of the tiles that aren’t already in the tile cache
+ * directory. Several tiles are downloaded in parallel. Duplicates in
+ * the list are ignored.
+ */
+bool
+flt_map_renderer_prefetch(struct flt_map_renderer *renderer,
+                          const struct flt_map_renderer_tile *tiles,
+                          size_t n_tiles,
+                          struct flt_error **error);
+
 void
 flt_map_renderer_free(struct flt_map_renderer *renderer);
 
-#endif /* FLT_MAP_RENDERER */
+#endif /* FLT_MAP_RENDERER_H */
@@ -18,12 +18,23 @@
 
 #include "flt-parse-stdio.h"
 
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include "flt-file-error.h"
 #include "flt-parser.h"
+#include "flt-buffer.h"
+#include "flt-scene-binary.h"
 
 struct stdio_source {
         struct flt_source base;
         FILE *infile;
+        /* Bytes that were already read to check for a compiled scene */
+        const uint8_t *peeked;
+        size_t n_peeked;
 };
 
 static bool
@@ -33,10 +44,19 @@ read_stdio_cb(struct flt_source *source,
               struct flt_error **error)
 {
         struct stdio_source *stdio_source = (struct stdio_source *) source;
+        size_t from_peeked = MIN(*length, stdio_source->n_peeked);
+
+        memcpy(ptr, stdio_source->peeked, from_peeked);
+        stdio_source->peeked += from_peeked;
+        stdio_source->n_peeked -= from_peeked;
 
-        size_t got = fread(ptr, 1, *length, stdio_source->infile);
+        size_t wanted = *length - from_peeked;
+        size_t got = fread((uint8_t *) ptr + from_peeked,
+                           1,
+                           wanted,
+                           stdio_source->infile);
 
-        if (got < *length) {
+        if (got < wanted) {
                 if (ferror(stdio_source->infile)) {
                         flt_file_error_set(error,
                                            errno,
@@ -45,21 +65,127 @@ read_stdio_cb(struct flt_source *source,
                         return false;
                 }
 
-                *length = got;
+                *length = from_peeked + got;
         }
 
         return true;
 }
 
+static bool
+parse_memory(struct flt_scene *scene,
+             const char *base_dir,
+             const void *data,
+             size_t size,
+             struct flt_error **error)
+{
+        if (flt_scene_binary_detect(data, size))
+                return flt_scene_binary_load(scene, data, size, error);
+        else
+                return flt_parser_parse_memory(scene,
+                                               data,
+                                               size,
+                                               base_dir,
+                                               error);
+}
+
+/* Loads a compiled scene from a file that can’t be mapped. The magic
+ * bytes have already been read.
+ */
+static bool
+read_binary(struct flt_scene *scene,
+            FILE *file,
+            struct flt_error **error)
+{
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append(&buf,
+                          FLT_SCENE_BINARY_MAGIC,
+                          FLT_SCENE_BINARY_MAGIC_SIZE);
+
+        while (true) {
+                flt_buffer_ensure_size(&buf, buf.length + 1024);
+
+                size_t got = fread(buf.data + buf.length,
+                                   1,
+                                   buf.size - buf.length,
+                                   file);
+
+                buf.length += got;
+
+                if (got == 0)
+                        break;
+        }
+
+        bool ret;
+
+        if (ferror(file)) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s",
+                                   strerror(errno));
+                ret = false;
+        } else {
+                ret = flt_scene_binary_load(scene, buf.data, buf.length, error);
+        }
+
+        flt_buffer_destroy(&buf);
+
+        return ret;
+}
+
 bool
 flt_parse_stdio(struct flt_scene *scene,
                 const char *base_dir,
                 FILE *file,
                 struct flt_error **error)
 {
+        uint8_t magic[FLT_SCENE_BINARY_MAGIC_SIZE];
+        size_t n_peeked = fread(magic, 1, sizeof magic, file);
+
+        if (n_peeked < sizeof magic && ferror(file)) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s",
+                                   strerror(errno));
+                return false;
+        }
+
+        struct stat statbuf;
+
+        /* If the whole of a regular file is being read then it can
+         * be mapped so that neither the lexer nor the binary loader
+         * need to copy it.
+         */
+        if (ftell(file) == (long) n_peeked &&
+            fstat(fileno(file), &statbuf) == 0 &&
+            S_ISREG(statbuf.st_mode) &&
+            statbuf.st_size > 0) {
+                void *map = mmap(NULL,
+                                 statbuf.st_size,
+                                 PROT_READ,
+                                 MAP_PRIVATE,
+                                 fileno(file),
+                                 0 /* offset */);
+
+                if (map != MAP_FAILED) {
+                        bool ret = parse_memory(scene,
+                                                base_dir,
+                                                map,
+                                                statbuf.st_size,
+                                                error);
+                        munmap(map, statbuf.st_size);
+                        return ret;
+                }
+        }
+
+        if (flt_scene_binary_detect(magic, n_peeked))
+                return read_binary(scene, file, error);
+
         struct stdio_source source = {
                 .base = { .read_source = read_stdio_cb },
                 .infile = file,
+                .peeked = magic,
+                .n_peeked = n_peeked,
         };
 
         return flt_parser_parse(scene, &source.base, base_dir, error);
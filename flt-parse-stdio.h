@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_PARSE_STDIO
-#define FLT_PARSE_STDIO
+#ifndef FLT_PARSE_STDIO_H
+#define FLT_PARSE_STDIO_H
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -36,4 +36,4 @@ flt_parse_stdio_from_file(struct flt_scene *scene,
                           const char *filename,
                           struct flt_error **error);
 
-#endif /* FLT_PARSE_STDIO */
+#endif /* FLT_PARSE_STDIO_H */
@@ -20,6 +20,12 @@
 
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+
+/* Digits of the fraction of a second after this many are ignored.
+ * Microseconds are finer than a double can hold for a current time.
+ */
+#define MAX_SUB_SECOND_DIGITS 6
 
 struct flt_error_domain
 flt_parse_time_error;
@@ -46,6 +52,29 @@ parse_digits(const char *digits,
         return value;
 }
 
+/* Number of days since the Unix epoch for a date in the proleptic
+ * Gregorian calendar. This is faster than timegm and does the same
+ * normalisation for days that are out of range.
+ */
+static int64_t
+days_from_civil(int year, int month, int day)
+{
+        if (month <= 2)
+                year--;
+
+        int64_t era = (year >= 0 ? year : year - 399) / 400;
+        int64_t year_of_era = year - era * 400;
+        int64_t day_of_year = ((153 * (month > 2 ? month - 3 : month + 9) + 2) /
+                               5 +
+                               day - 1);
+        int64_t day_of_era = (year_of_era * 365 +
+                              year_of_era / 4 -
+                              year_of_era / 100 +
+                              day_of_year);
+
+        return era * 146097 + day_of_era - 719468;
+}
+
 bool
 flt_parse_time(const char *time_str,
                double *time_out,
@@ -90,13 +119,16 @@ flt_parse_time(const char *time_str,
         if (second == -1)
                 goto fail;
 
-        int sub_second_divisor = 1;
-        int sub_second_dividend = 0;
+        int64_t sub_second_divisor = 1;
+        int64_t sub_second_dividend = 0;
 
         if (*time_str == '.') {
-                for (time_str++;
-                     *time_str >= '0' && *time_str <= '9';
-                     time_str++) {
+                for (int n_digits = 0;
+                     *(++time_str) >= '0' && *time_str <= '9';
+                     n_digits++) {
+                        if (n_digits >= MAX_SUB_SECOND_DIGITS)
+                                continue;
+
                         sub_second_dividend = (sub_second_dividend * 10 +
                                                *time_str - '0');
                         sub_second_divisor *= 10;
@@ -116,22 +148,37 @@ flt_parse_time(const char *time_str,
         if (*time_str != '\0')
                 goto fail;
 
-        struct tm tm = {
-                .tm_sec = second,
-                .tm_min = minute,
-                .tm_hour = hour,
-                .tm_mday = day,
-                .tm_mon = month - 1,
-                .tm_year = year - 1900,
-                .tm_isdst = 0,
-        };
-
-        time_t t = timegm(&tm);
-
-        if (t == (time_t) -1)
-                goto fail;
+        time_t t;
+
+        if (month >= 1 && month <= 12) {
+                t = (days_from_civil(year, month, day) * 86400 +
+                     hour * 3600 +
+                     minute * 60 +
+                     second);
+        } else {
+                struct tm tm = {
+                        .tm_sec = second,
+                        .tm_min = minute,
+                        .tm_hour = hour,
+                        .tm_mday = day,
+                        .tm_mon = month - 1,
+                        .tm_year = year - 1900,
+                        .tm_isdst = 0,
+                };
+
+                t = timegm(&tm);
+
+                if (t == (time_t) -1)
+                        goto fail;
+        }
 
-        *time_out = t + sub_second_dividend / (double) sub_second_divisor;
+        /* The time is scaled to whole sub-second units so that the
+         * division is the only rounding. The scaled value is exact in
+         * a double for any time before the year 2255.
+         */
+        *time_out = (((int64_t) t * sub_second_divisor +
+                      sub_second_dividend) /
+                     (double) sub_second_divisor);
 
         return true;
 
@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_PARSE_TIME
-#define FLT_PARSE_TIME
+#ifndef FLT_PARSE_TIME_H
+#define FLT_PARSE_TIME_H
 
 #include "flt-error.h"
 
@@ -34,4 +34,4 @@ flt_parse_time(const char *time_str,
                double *time_out,
                struct flt_error **error);
 
-#endif /* FLT_PARSE_TIME */
+#endif /* FLT_PARSE_TIME_H */
@@ -45,6 +45,26 @@ struct flt_parser {
         const char *base_dir;
 
         struct flt_scene *scene;
+
+        /* The resource files are only loaded after the whole script
+         * is parsed. These remember where each file was first used
+         * so that a load error can report the line.
+         */
+        struct flt_buffer resource_refs;
+        /* Fields that should be set to an svg handle once the files
+         * are loaded.
+         */
+        struct flt_buffer svg_fixups;
+};
+
+struct flt_parser_resource_ref {
+        const char *filename;
+        int line_num;
+};
+
+struct flt_parser_svg_fixup {
+        RsvgHandle **field;
+        struct flt_scene_svg_file *file;
 };
 
 enum flt_parser_value_type {
@@ -108,6 +128,23 @@ struct flt_parser_property {
                 }                                                       \
         } while (0)
 
+/* Everything that belongs to the scene is allocated from its arena so
+ * that it is freed in one go with the scene.
+ */
+static void *
+scene_alloc(struct flt_parser *parser,
+            size_t size)
+{
+        return flt_arena_alloc(&parser->scene->arena, size);
+}
+
+static void *
+scene_calloc(struct flt_parser *parser,
+             size_t size)
+{
+        return flt_arena_calloc(&parser->scene->arena, size);
+}
+
 static void
 set_verror(struct flt_parser *parser,
            struct flt_error **error,
@@ -415,69 +452,100 @@ get_relative_filename(struct flt_parser *parser,
                 return flt_strconcat(parser->base_dir, "/", filename, NULL);
 }
 
-static struct flt_scene_gpx_file *
-load_gpx_file(struct flt_parser *parser,
-              const char *relative_filename,
-              struct flt_error **error)
+static void
+add_resource_ref(struct flt_parser *parser,
+                 const char *filename)
 {
-        char *filename = get_relative_filename(parser, relative_filename);
-        struct flt_scene_gpx_file *gpx_file;
+        struct flt_parser_resource_ref ref = {
+                .filename = filename,
+                .line_num = flt_lexer_get_line_num(parser->lexer),
+        };
 
-        flt_list_for_each(gpx_file, &parser->scene->gpx_files, link) {
-                if (!strcmp(gpx_file->filename, filename)) {
-                        flt_free(filename);
-                        return gpx_file;
-                }
+        flt_buffer_append(&parser->resource_refs, &ref, sizeof ref);
+}
+
+static int
+get_resource_line_num(struct flt_parser *parser,
+                      const char *filename)
+{
+        const struct flt_parser_resource_ref *refs =
+                (const struct flt_parser_resource_ref *)
+                parser->resource_refs.data;
+        size_t n_refs = parser->resource_refs.length / sizeof *refs;
+
+        /* The filenames are owned by the scene which only has one
+         * copy of each so they can be compared by pointer.
+         */
+        for (size_t i = 0; i < n_refs; i++) {
+                if (refs[i].filename == filename)
+                        return refs[i].line_num;
         }
 
-        size_t n_points;
-        struct flt_gpx_point *points;
+        return flt_lexer_get_line_num(parser->lexer);
+}
 
-        if (!flt_gpx_parse(filename,
-                           &points,
-                           &n_points,
-                           error)) {
-                flt_free(filename);
-                return NULL;
-        }
+static struct flt_scene_gpx_file *
+add_gpx_file(struct flt_parser *parser,
+             const char *relative_filename)
+{
+        char *filename = get_relative_filename(parser, relative_filename);
+
+        struct flt_scene_gpx_file *gpx_file =
+                flt_scene_add_gpx_file(parser->scene, filename);
+
+        flt_free(filename);
 
-        gpx_file = flt_alloc(sizeof *gpx_file);
-        gpx_file->filename = filename;
-        gpx_file->n_points = n_points;
-        gpx_file->points = points;
-        flt_list_insert(parser->scene->gpx_files.prev, &gpx_file->link);
+        add_resource_ref(parser, gpx_file->filename);
 
         return gpx_file;
 }
 
 static struct flt_scene_trace *
-load_trace(struct flt_parser *parser,
-           const char *relative_filename,
-           struct flt_error **error)
+add_trace(struct flt_parser *parser,
+          const char *relative_filename)
 {
         char *filename = get_relative_filename(parser, relative_filename);
-        struct flt_scene_trace *trace;
 
-        flt_list_for_each(trace, &parser->scene->traces, link) {
-                if (!strcmp(trace->filename, filename)) {
-                        flt_free(filename);
-                        return trace;
-                }
-        }
+        struct flt_scene_trace *trace =
+                flt_scene_add_trace(parser->scene, filename);
+
+        flt_free(filename);
 
-        struct flt_trace *trace_data = flt_trace_parse(filename, error);
+        add_resource_ref(parser, trace->filename);
 
-        if (trace_data == NULL) {
-                flt_free(filename);
-                return NULL;
+        return trace;
+}
+
+static bool
+has_svg_fixup(struct flt_parser *parser,
+              RsvgHandle **field)
+{
+        const struct flt_parser_svg_fixup *fixups =
+                (const struct flt_parser_svg_fixup *)
+                parser->svg_fixups.data;
+        size_t n_fixups = parser->svg_fixups.length / sizeof *fixups;
+
+        /* The field is most likely to be from the last object so
+         * search backwards.
+         */
+        for (size_t i = n_fixups; i > 0; i--) {
+                if (fixups[i - 1].field == field)
+                        return true;
         }
 
-        trace = flt_alloc(sizeof *trace);
-        trace->filename = filename;
-        trace->trace = trace_data;
-        flt_list_insert(parser->scene->traces.prev, &trace->link);
+        return false;
+}
+
+static void
+apply_svg_fixups(struct flt_parser *parser)
+{
+        const struct flt_parser_svg_fixup *fixups =
+                (const struct flt_parser_svg_fixup *)
+                parser->svg_fixups.data;
+        size_t n_fixups = parser->svg_fixups.length / sizeof *fixups;
 
-        return trace;
+        for (size_t i = 0; i < n_fixups; i++)
+                *fixups[i].field = g_object_ref(fixups[i].file->handle);
 }
 
 static enum flt_parser_return
@@ -498,29 +566,23 @@ parse_svg_property(struct flt_parser *parser,
         RsvgHandle **field =
                 (RsvgHandle **) (((uint8_t *) object) + prop->offset);
 
-        if (*field != NULL) {
+        if (has_svg_fixup(parser, field)) {
                 set_multiple_property_values_error(parser, prop, error);
                 return FLT_PARSER_RETURN_ERROR;
         }
 
         char *filename = get_relative_filename(parser, token->string_value);
 
-        GError *svg_error = NULL;
-
-        *field = rsvg_handle_new_from_file(filename, &svg_error);
+        struct flt_parser_svg_fixup fixup = {
+                .field = field,
+                .file = flt_scene_add_svg_file(parser->scene, filename),
+        };
 
         flt_free(filename);
 
-        if (*field == NULL) {
-                set_error(parser,
-                          error,
-                          "%s",
-                          svg_error->message);
-
-                g_error_free(svg_error);
+        add_resource_ref(parser, fixup.file->filename);
 
-                return FLT_PARSER_RETURN_ERROR;
-        }
+        flt_buffer_append(&parser->svg_fixups, &fixup, sizeof fixup);
 
         return FLT_PARSER_RETURN_OK;
 }
@@ -549,9 +611,9 @@ parse_trace_property(struct flt_parser *parser,
                 return FLT_PARSER_RETURN_ERROR;
         }
 
-        *field = load_trace(parser, token->string_value, error);
+        *field = add_trace(parser, token->string_value);
 
-        return *field ? FLT_PARSER_RETURN_OK : FLT_PARSER_RETURN_ERROR;
+        return FLT_PARSER_RETURN_OK;
 }
 
 static enum flt_parser_return
@@ -660,7 +722,7 @@ parse_base_key_frame_default(struct flt_parser *parser,
                                  link);
 
         struct flt_scene_key_frame *key_frame =
-                flt_alloc(struct_size);
+                scene_alloc(parser, struct_size);
 
         double last_timestamp = -DBL_MIN;
 
@@ -822,12 +884,14 @@ parse_rectangle(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_rectangle *rectangle = flt_alloc(sizeof *rectangle);
+        struct flt_scene_rectangle *rectangle =
+                scene_alloc(parser, sizeof *rectangle);
 
         rectangle->base.type = FLT_SCENE_OBJECT_TYPE_RECTANGLE;
         rectangle->color = 0;
 
         flt_list_init(&rectangle->base.key_frames);
+        rectangle->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &rectangle->base.link);
 
         while (true) {
@@ -987,7 +1051,8 @@ parse_score(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_score *score = flt_alloc(sizeof *score);
+        struct flt_scene_score *score =
+                scene_alloc(parser, sizeof *score);
 
         score->base.type = FLT_SCENE_OBJECT_TYPE_SCORE;
         score->position = FLT_SCENE_POSITION_TOP_LEFT;
@@ -995,6 +1060,7 @@ parse_score(struct flt_parser *parser,
         score->color = DEFAULT_TEXT_COLOR;
 
         flt_list_init(&score->base.key_frames);
+        score->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &score->base.link);
 
         while (true) {
@@ -1166,11 +1232,13 @@ parse_svg(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_svg *svg = flt_calloc(sizeof *svg);
+        struct flt_scene_svg *svg =
+                scene_calloc(parser, sizeof *svg);
 
         svg->base.type = FLT_SCENE_OBJECT_TYPE_SVG;
 
         flt_list_init(&svg->base.key_frames);
+        svg->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &svg->base.link);
 
         while (true) {
@@ -1228,7 +1296,7 @@ parse_svg(struct flt_parser *parser,
                 return FLT_PARSER_RETURN_ERROR;
         }
 
-        if (svg->handle == NULL) {
+        if (!has_svg_fixup(parser, &svg->handle)) {
                 set_error_with_line(parser,
                                     error,
                                     svg_line_num,
@@ -1326,15 +1394,7 @@ parse_gpx_file(struct flt_parser *parser,
                 return FLT_PARSER_RETURN_ERROR;
         }
 
-        struct flt_scene_gpx_file *gpx_file =
-                load_gpx_file(parser,
-                              token->string_value,
-                              error);
-
-        if (gpx_file == NULL)
-                return FLT_PARSER_RETURN_ERROR;
-
-        gpx->file = gpx_file;
+        gpx->file = add_gpx_file(parser, token->string_value);
 
         return FLT_PARSER_RETURN_OK;
 }
@@ -1366,7 +1426,7 @@ parse_gpx_object(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_gpx_object *object = flt_alloc(struct_size);
+        struct flt_scene_gpx_object *object = scene_alloc(parser, struct_size);
 
         memcpy(object, default_values, struct_size);
 
@@ -1501,7 +1561,7 @@ parse_gpx_speed(struct flt_parser *parser,
                                  base.link);
         assert(gpx->base.type == FLT_SCENE_OBJECT_TYPE_GPX);
 
-        const struct flt_scene_gpx_speed *speed =
+        struct flt_scene_gpx_speed *speed =
                 flt_container_of(gpx->objects.prev,
                                  struct flt_scene_gpx_speed,
                                  base.link);
@@ -1509,9 +1569,9 @@ parse_gpx_speed(struct flt_parser *parser,
 
         int item_count = 0;
 
-        if (speed->dial)
+        if (has_svg_fixup(parser, &speed->dial))
                 item_count++;
-        if (speed->needle)
+        if (has_svg_fixup(parser, &speed->needle))
                 item_count++;
         if (speed->width >= 0.0)
                 item_count++;
@@ -1607,6 +1667,7 @@ parse_gpx_map(struct flt_parser *parser,
                         .position = FLT_SCENE_POSITION_BOTTOM_RIGHT,
                 },
                 .trace_color = 0xff0000,
+                .scale = 1.0,
         };
 
         static const struct flt_parser_property props[] = {
@@ -1620,6 +1681,13 @@ parse_gpx_map(struct flt_parser *parser,
                         FLT_PARSER_VALUE_TYPE_COLOR,
                         FLT_LEXER_KEYWORD_TRACE_COLOR,
                 },
+                {
+                        offsetof(struct flt_scene_gpx_map, scale),
+                        FLT_PARSER_VALUE_TYPE_DOUBLE,
+                        FLT_LEXER_KEYWORD_SCALE,
+                        .min_double_value = 0.1,
+                        .max_double_value = 1.0,
+                },
         };
 
         return parse_gpx_object(parser,
@@ -1647,11 +1715,13 @@ parse_gpx(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_gpx *gpx = flt_calloc(sizeof *gpx);
+        struct flt_scene_gpx *gpx =
+                scene_calloc(parser, sizeof *gpx);
 
         gpx->base.type = FLT_SCENE_OBJECT_TYPE_GPX;
 
         flt_list_init(&gpx->base.key_frames);
+        gpx->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &gpx->base.link);
 
         flt_list_init(&gpx->objects);
@@ -1881,11 +1951,13 @@ parse_curve(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_curve *curve = flt_calloc(sizeof *curve);
+        struct flt_scene_curve *curve =
+                scene_calloc(parser, sizeof *curve);
 
         curve->base.type = FLT_SCENE_OBJECT_TYPE_CURVE;
 
         flt_list_init(&curve->base.key_frames);
+        curve->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &curve->base.link);
 
         while (true) {
@@ -2040,13 +2112,15 @@ parse_time(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_time *time = flt_calloc(sizeof *time);
+        struct flt_scene_time *time =
+                scene_calloc(parser, sizeof *time);
 
         time->base.type = FLT_SCENE_OBJECT_TYPE_TIME;
         time->position = FLT_SCENE_POSITION_TOP_MIDDLE;
         time->color = DEFAULT_TEXT_COLOR;
 
         flt_list_init(&time->base.key_frames);
+        time->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &time->base.link);
 
         while (true) {
@@ -2168,7 +2242,8 @@ parse_text(struct flt_parser *parser,
                       "expected ‘{’",
                       error);
 
-        struct flt_scene_text *text = flt_alloc(sizeof *text);
+        struct flt_scene_text *text =
+                scene_alloc(parser, sizeof *text);
 
         text->base.type = FLT_SCENE_OBJECT_TYPE_TEXT;
         text->position = FLT_SCENE_POSITION_TOP_RIGHT;
@@ -2176,6 +2251,7 @@ parse_text(struct flt_parser *parser,
         text->color = DEFAULT_TEXT_COLOR;
 
         flt_list_init(&text->base.key_frames);
+        text->base.key_frame_array = NULL;
         flt_list_insert(parser->scene->objects.prev, &text->base.link);
 
         while (true) {
@@ -2331,24 +2407,78 @@ parse_file(struct flt_parser *parser,
         return true;
 }
 
-bool
-flt_parser_parse(struct flt_scene *scene,
-                 struct flt_source *source,
+static bool
+load_resources(struct flt_parser *parser,
+               struct flt_error **error)
+{
+        struct flt_error *load_error = NULL;
+        const char *failed_filename;
+
+        if (!flt_scene_load_resources(parser->scene,
+                                      &failed_filename,
+                                      &load_error)) {
+                set_error_with_line(parser,
+                                    error,
+                                    get_resource_line_num(parser,
+                                                          failed_filename),
+                                    "%s",
+                                    load_error->message);
+                flt_error_free(load_error);
+                return false;
+        }
+
+        apply_svg_fixups(parser);
+
+        return true;
+}
+
+static bool
+parse_with_lexer(struct flt_scene *scene,
+                 struct flt_lexer *lexer,
                  const char *base_dir,
                  struct flt_error **error)
 {
         struct flt_parser parser = {
-                .lexer = flt_lexer_new(source),
+                .lexer = lexer,
                 .scene = scene,
                 .base_dir = base_dir,
+                .resource_refs = FLT_BUFFER_STATIC_INIT,
+                .svg_fixups = FLT_BUFFER_STATIC_INIT,
         };
 
-        bool ret = true;
+        bool ret = parse_file(&parser, error) && load_resources(&parser, error);
 
-        if (!parse_file(&parser, error))
-                ret = false;
+        if (ret)
+                flt_scene_build_index(scene);
 
+        flt_buffer_destroy(&parser.svg_fixups);
+        flt_buffer_destroy(&parser.resource_refs);
         flt_lexer_free(parser.lexer);
 
         return ret;
 }
+
+bool
+flt_parser_parse(struct flt_scene *scene,
+                 struct flt_source *source,
+                 const char *base_dir,
+                 struct flt_error **error)
+{
+        return parse_with_lexer(scene,
+                                flt_lexer_new(source),
+                                base_dir,
+                                error);
+}
+
+bool
+flt_parser_parse_memory(struct flt_scene *scene,
+                        const void *data,
+                        size_t size,
+                        const char *base_dir,
+                        struct flt_error **error)
+{
+        return parse_with_lexer(scene,
+                                flt_lexer_new_from_memory(data, size),
+                                base_dir,
+                                error);
+}
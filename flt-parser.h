@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_PARSER
-#define FLT_PARSER
+#ifndef FLT_PARSER_H
+#define FLT_PARSER_H
 
 #include <stdbool.h>
 
@@ -38,4 +38,14 @@ flt_parser_parse(struct flt_scene *scene,
                  const char *base_dir,
                  struct flt_error **error);
 
-#endif /* FLT_PARSER */
+/* Same as flt_parser_parse but the lexer reads directly from the
+ * data instead of copying it from a source.
+ */
+bool
+flt_parser_parse_memory(struct flt_scene *scene,
+                        const void *data,
+                        size_t size,
+                        const char *base_dir,
+                        struct flt_error **error);
+
+#endif /* FLT_PARSER_H */
@@ -0,0 +1,275 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-pcm-cache.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "flt-util.h"
+#include "flt-buffer.h"
+
+#define CACHE_MAGIC "FLTPCMC"
+/* This should be increased whenever the format of the cache changes */
+#define CACHE_VERSION 1
+
+struct cache_trailer {
+        char magic[8];
+        uint32_t version;
+        uint32_t sample_rate;
+        uint32_t channels;
+        uint32_t sample_size;
+        /* Size and modification time of the sound that the cache was
+         * made from.
+         */
+        uint64_t source_size;
+        int64_t source_mtime_sec;
+        int64_t source_mtime_nsec;
+};
+
+static void
+init_cache_trailer(struct cache_trailer *trailer,
+                   const struct flt_pcm_format *format,
+                   const struct stat *source_stat)
+{
+        memset(trailer, 0, sizeof *trailer);
+        memcpy(trailer->magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+        trailer->version = CACHE_VERSION;
+        trailer->sample_rate = format->sample_rate;
+        trailer->channels = format->channels;
+        trailer->sample_size = format->sample_size;
+        trailer->source_size = source_stat->st_size;
+        trailer->source_mtime_sec = source_stat->st_mtim.tv_sec;
+        trailer->source_mtime_nsec = source_stat->st_mtim.tv_nsec;
+}
+
+static char *
+get_cache_filename(const char *filename)
+{
+        return flt_strconcat(filename, ".flt-pcm", NULL);
+}
+
+static bool
+map_cache(const char *cache_filename,
+          const struct flt_pcm_format *format,
+          const struct stat *source_stat,
+          struct flt_pcm *pcm)
+{
+        int fd = open(cache_filename, O_RDONLY);
+
+        if (fd == -1)
+                return false;
+
+        struct cache_trailer expected;
+        struct stat cache_stat;
+        size_t frame_size = format->channels * format->sample_size;
+        bool ret = false;
+
+        init_cache_trailer(&expected, format, source_stat);
+
+        if (fstat(fd, &cache_stat) == -1 ||
+            cache_stat.st_size < sizeof expected ||
+            (cache_stat.st_size - sizeof expected) % frame_size != 0)
+                goto out;
+
+        void *map = mmap(NULL,
+                         cache_stat.st_size,
+                         PROT_READ,
+                         MAP_PRIVATE,
+                         fd,
+                         0 /* offset */);
+
+        if (map == MAP_FAILED)
+                goto out;
+
+        size_t data_size = cache_stat.st_size - sizeof expected;
+
+        if (memcmp((const uint8_t *) map + data_size,
+                   &expected,
+                   sizeof expected)) {
+                munmap(map, cache_stat.st_size);
+                goto out;
+        }
+
+        /* The samples are read once from start to finish */
+        madvise(map, cache_stat.st_size, MADV_SEQUENTIAL);
+
+        pcm->frames = map;
+        pcm->n_frames = data_size / frame_size;
+        pcm->map_size = cache_stat.st_size;
+
+        ret = true;
+
+out:
+        close(fd);
+
+        return ret;
+}
+
+bool
+flt_pcm_cache_load(const char *filename,
+                   const struct flt_pcm_format *format,
+                   struct flt_pcm *pcm)
+{
+        struct stat source_stat;
+
+        if (stat(filename, &source_stat) == -1)
+                return false;
+
+        char *cache_filename = get_cache_filename(filename);
+
+        bool ret = map_cache(cache_filename, format, &source_stat, pcm);
+
+        flt_free(cache_filename);
+
+        return ret;
+}
+
+bool
+flt_pcm_cache_start_decode(const char *filename,
+                           const struct flt_pcm_format *format,
+                           struct flt_pcm_decode *decode)
+{
+        if (stat(filename, &decode->source_stat) == -1)
+                return false;
+
+        decode->format = *format;
+        decode->cache_filename = get_cache_filename(filename);
+        decode->tmp_filename = flt_strconcat(decode->cache_filename,
+                                             ".XXXXXX",
+                                             NULL);
+
+        /* Failing to create the file isn’t reported because the
+         * sound might be in a directory that can’t be written to.
+         */
+        int fd = flt_create_temp_file(decode->tmp_filename);
+
+        if (fd == -1)
+                goto error;
+
+        close(fd);
+
+        struct flt_buffer rate_buf = FLT_BUFFER_STATIC_INIT;
+        struct flt_buffer channels_buf = FLT_BUFFER_STATIC_INIT;
+        struct flt_buffer format_buf = FLT_BUFFER_STATIC_INIT;
+        struct flt_buffer codec_buf = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append_printf(&rate_buf, "%i", format->sample_rate);
+        flt_buffer_append_printf(&channels_buf, "%i", format->channels);
+        flt_buffer_append_printf(&format_buf,
+                                 "s%ile",
+                                 format->sample_size * 8);
+        flt_buffer_append_printf(&codec_buf,
+                                 "pcm_s%ile",
+                                 format->sample_size * 8);
+
+        const char *ffmpeg_args[] = {
+                "-i", filename,
+                "-ar", (const char *) rate_buf.data,
+                "-ac", (const char *) channels_buf.data,
+                "-f", (const char *) format_buf.data,
+                "-c:a", (const char *) codec_buf.data,
+                "-hide_banner",
+                "-loglevel", "error",
+                "-nostdin",
+                "-y",
+                decode->tmp_filename,
+                NULL,
+        };
+
+        bool run_ret = flt_child_proc_open(NULL, /* source_dir */
+                                           "ffmpeg",
+                                           ffmpeg_args,
+                                           &decode->cp);
+
+        flt_buffer_destroy(&rate_buf);
+        flt_buffer_destroy(&channels_buf);
+        flt_buffer_destroy(&format_buf);
+        flt_buffer_destroy(&codec_buf);
+
+        if (!run_ret) {
+                unlink(decode->tmp_filename);
+                goto error;
+        }
+
+        return true;
+
+error:
+        flt_free(decode->tmp_filename);
+        flt_free(decode->cache_filename);
+        return false;
+}
+
+static bool
+append_trailer(const char *filename,
+               const struct cache_trailer *trailer)
+{
+        int fd = open(filename, O_WRONLY | O_APPEND);
+
+        if (fd == -1)
+                return false;
+
+        bool ret = write(fd, trailer, sizeof *trailer) == sizeof *trailer;
+
+        if (close(fd) == -1)
+                ret = false;
+
+        return ret;
+}
+
+bool
+flt_pcm_cache_finish_decode(struct flt_pcm_decode *decode,
+                            struct flt_pcm *pcm)
+{
+        struct cache_trailer trailer;
+        bool ret = false;
+
+        init_cache_trailer(&trailer, &decode->format, &decode->source_stat);
+
+        /* The trailer is only added once ffmpeg has succeeded and
+         * the file is renamed so that another process will never map
+         * a partially written cache.
+         */
+        if (!flt_child_proc_close(&decode->cp) ||
+            !append_trailer(decode->tmp_filename, &trailer) ||
+            rename(decode->tmp_filename, decode->cache_filename) == -1) {
+                unlink(decode->tmp_filename);
+                goto out;
+        }
+
+        ret = map_cache(decode->cache_filename,
+                        &decode->format,
+                        &decode->source_stat,
+                        pcm);
+
+out:
+        flt_free(decode->tmp_filename);
+        flt_free(decode->cache_filename);
+
+        return ret;
+}
+
+void
+flt_pcm_destroy(struct flt_pcm *pcm)
+{
+        munmap((void *) pcm->frames, pcm->map_size);
+}
@@ -0,0 +1,79 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_PCM_CACHE_H
+#define FLT_PCM_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "flt-child-proc.h"
+
+/* Decoded audio is cached in a file with the same name as the sound
+ * plus “.flt-pcm”. The file contains the raw signed little-endian
+ * samples followed by a trailer that records the sample format and
+ * the size and modification time of the sound so that the cache is
+ * remade whenever any of them change.
+ */
+
+struct flt_pcm_format {
+        int sample_rate;
+        int channels;
+        /* Bytes per sample */
+        int sample_size;
+};
+
+struct flt_pcm {
+        const uint8_t *frames;
+        size_t n_frames;
+        size_t map_size;
+};
+
+struct flt_pcm_decode {
+        struct flt_child_proc cp;
+        char *cache_filename;
+        char *tmp_filename;
+        struct flt_pcm_format format;
+        struct stat source_stat;
+};
+
+/* Maps the cache for the file if it is valid */
+bool
+flt_pcm_cache_load(const char *filename,
+                   const struct flt_pcm_format *format,
+                   struct flt_pcm *pcm);
+
+/* Starts an ffmpeg process to decode the file into the cache. Any
+ * number of these can run at the same time.
+ */
+bool
+flt_pcm_cache_start_decode(const char *filename,
+                           const struct flt_pcm_format *format,
+                           struct flt_pcm_decode *decode);
+
+/* Waits for the decode to finish and maps the result */
+bool
+flt_pcm_cache_finish_decode(struct flt_pcm_decode *decode,
+                            struct flt_pcm *pcm);
+
+void
+flt_pcm_destroy(struct flt_pcm *pcm);
+
+#endif /* FLT_PCM_CACHE_H */
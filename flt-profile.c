@@ -0,0 +1,299 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-profile.h"
+
+#ifdef FLT_ENABLE_PROFILE
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "flt-util.h"
+#include "flt-list.h"
+#include "flt-buffer.h"
+#include "flt-file-error.h"
+
+/* Limit on the number of calls to keep for the trace from each thread
+ * so that a long render doesn’t use all of the memory. Anything after
+ * that is still counted in the stats.
+ */
+#define MAX_EVENTS_PER_THREAD (4 * 1024 * 1024)
+
+struct counter {
+        atomic_uint_fast64_t n_calls;
+        atomic_uint_fast64_t total_ns;
+};
+
+struct event {
+        uint64_t start;
+        uint32_t duration;
+        uint32_t counter;
+};
+
+struct thread_events {
+        struct flt_list link;
+        int tid;
+        size_t n_dropped;
+        struct flt_buffer events;
+};
+
+static const char *const
+counter_names[] = {
+        [FLT_PROFILE_OBJECT_RECTANGLE] = "rectangle",
+        [FLT_PROFILE_OBJECT_SVG] = "svg",
+        [FLT_PROFILE_OBJECT_SCORE] = "score",
+        [FLT_PROFILE_OBJECT_GPX] = "gpx",
+        [FLT_PROFILE_OBJECT_TIME] = "time",
+        [FLT_PROFILE_OBJECT_CURVE] = "curve",
+        [FLT_PROFILE_OBJECT_TEXT] = "text",
+        [FLT_PROFILE_RENDER] = "render",
+        [FLT_PROFILE_SVG] = "render_svg",
+        [FLT_PROFILE_SVG_RASTERIZE] = "svg_rasterize",
+        [FLT_PROFILE_TEXT] = "render_text",
+        [FLT_PROFILE_MAP] = "map",
+        [FLT_PROFILE_GET_TILE] = "get_tile",
+        [FLT_PROFILE_TILE_DECODE] = "tile_decode",
+        [FLT_PROFILE_TILE_DOWNLOAD] = "tile_download",
+        [FLT_PROFILE_CONVERT] = "convert",
+        [FLT_PROFILE_WRITE] = "write",
+};
+
+_Static_assert(FLT_N_ELEMENTS(counter_names) == FLT_PROFILE_N_COUNTERS,
+               "every counter needs a name");
+
+static struct counter counters[FLT_PROFILE_N_COUNTERS];
+
+/* These are only written by flt_profile_start */
+static bool active;
+static bool record_trace;
+static uint64_t start_time;
+
+/* Protects the list of threads and next_tid */
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct flt_list threads;
+static int next_tid;
+
+static _Thread_local struct thread_events *current_thread;
+
+static uint64_t
+get_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+void
+flt_profile_start(bool record_trace_arg)
+{
+        flt_list_init(&threads);
+        record_trace = record_trace_arg;
+        start_time = get_ns();
+        active = true;
+}
+
+uint64_t
+flt_profile_begin(void)
+{
+        return active ? get_ns() : 0;
+}
+
+static struct thread_events *
+get_current_thread(void)
+{
+        if (current_thread == NULL) {
+                struct thread_events *thread = flt_calloc(sizeof *thread);
+
+                flt_buffer_init(&thread->events);
+
+                pthread_mutex_lock(&threads_mutex);
+                thread->tid = ++next_tid;
+                flt_list_insert(threads.prev, &thread->link);
+                pthread_mutex_unlock(&threads_mutex);
+
+                current_thread = thread;
+        }
+
+        return current_thread;
+}
+
+void
+flt_profile_end(enum flt_profile_counter counter,
+                uint64_t start)
+{
+        if (start == 0)
+                return;
+
+        uint64_t duration = get_ns() - start;
+
+        atomic_fetch_add_explicit(&counters[counter].n_calls,
+                                  1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&counters[counter].total_ns,
+                                  duration,
+                                  memory_order_relaxed);
+
+        if (!record_trace)
+                return;
+
+        struct thread_events *thread = get_current_thread();
+
+        if (thread->events.length / sizeof (struct event) >=
+            MAX_EVENTS_PER_THREAD) {
+                thread->n_dropped++;
+                return;
+        }
+
+        struct event event = {
+                .start = start - start_time,
+                .duration = MIN(duration, UINT32_MAX),
+                .counter = counter,
+        };
+
+        flt_buffer_append(&thread->events, &event, sizeof event);
+}
+
+void
+flt_profile_print_stats(FILE *out)
+{
+        fprintf(out,
+                "%-16s %10s %12s %12s\n",
+                "counter", "calls", "total ms", "mean us");
+
+        for (int i = 0; i < FLT_PROFILE_N_COUNTERS; i++) {
+                uint64_t n_calls = atomic_load(&counters[i].n_calls);
+
+                if (n_calls == 0)
+                        continue;
+
+                uint64_t total_ns = atomic_load(&counters[i].total_ns);
+
+                fprintf(out,
+                        "%-16s %10" PRIu64 " %12.3f %12.3f\n",
+                        counter_names[i],
+                        n_calls,
+                        total_ns / 1e6,
+                        total_ns / 1e3 / n_calls);
+        }
+}
+
+static void
+write_thread_events(FILE *out,
+                    const struct thread_events *thread,
+                    bool *first)
+{
+        const struct event *events =
+                (const struct event *) thread->events.data;
+        size_t n_events = thread->events.length / sizeof *events;
+
+        fprintf(out,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%i,\"args\":{\"name\":\"thread %i\"}}",
+                *first ? "" : ",",
+                thread->tid,
+                thread->tid);
+
+        *first = false;
+
+        for (size_t i = 0; i < n_events; i++) {
+                fprintf(out,
+                        ",\n{\"name\":\"%s\",\"cat\":\"flootay\","
+                        "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":1,\"tid\":%i}",
+                        counter_names[events[i].counter],
+                        events[i].start / 1e3,
+                        events[i].duration / 1e3,
+                        thread->tid);
+        }
+
+        if (thread->n_dropped > 0) {
+                fprintf(stderr,
+                        "warning: %zu calls from thread %i were left out "
+                        "of the trace\n",
+                        thread->n_dropped,
+                        thread->tid);
+        }
+}
+
+bool
+flt_profile_write_trace(const char *filename,
+                        struct flt_error **error)
+{
+        FILE *out = fopen(filename, "w");
+
+        if (out == NULL) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                return false;
+        }
+
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+
+        bool first = true;
+        const struct thread_events *thread;
+
+        pthread_mutex_lock(&threads_mutex);
+
+        flt_list_for_each(thread, &threads, link) {
+                write_thread_events(out, thread, &first);
+        }
+
+        pthread_mutex_unlock(&threads_mutex);
+
+        fputs("\n]}\n", out);
+
+        bool write_error = ferror(out);
+
+        if (fclose(out) == EOF || write_error) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+void
+flt_profile_stop(void)
+{
+        struct thread_events *thread, *tmp;
+
+        active = false;
+
+        flt_list_for_each_safe(thread, tmp, &threads, link) {
+                flt_buffer_destroy(&thread->events);
+                flt_free(thread);
+        }
+
+        flt_list_init(&threads);
+        current_thread = NULL;
+}
+
+#endif /* FLT_ENABLE_PROFILE */
@@ -0,0 +1,110 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_PROFILE_H
+#define FLT_PROFILE_H
+
+/* Timers for the parts of the render pipeline. These are only built
+ * when flootay is configured with -Dprofile=true. Otherwise the macros
+ * expand to nothing so they don’t cost anything. Even when they are
+ * built, nothing is recorded until flt_profile_start is called.
+ *
+ * A timer is used like this:
+ *
+ *   FLT_PROFILE_BEGIN(start);
+ *   do_something();
+ *   FLT_PROFILE_END(start, FLT_PROFILE_SOMETHING);
+ */
+
+enum flt_profile_counter {
+        /* One for each enum flt_scene_object_type in the same order */
+        FLT_PROFILE_OBJECT_RECTANGLE,
+        FLT_PROFILE_OBJECT_SVG,
+        FLT_PROFILE_OBJECT_SCORE,
+        FLT_PROFILE_OBJECT_GPX,
+        FLT_PROFILE_OBJECT_TIME,
+        FLT_PROFILE_OBJECT_CURVE,
+        FLT_PROFILE_OBJECT_TEXT,
+
+        FLT_PROFILE_RENDER,
+        FLT_PROFILE_SVG,
+        FLT_PROFILE_SVG_RASTERIZE,
+        FLT_PROFILE_TEXT,
+        FLT_PROFILE_MAP,
+        FLT_PROFILE_GET_TILE,
+        FLT_PROFILE_TILE_DECODE,
+        FLT_PROFILE_TILE_DOWNLOAD,
+        FLT_PROFILE_CONVERT,
+        FLT_PROFILE_WRITE,
+
+        FLT_PROFILE_N_COUNTERS
+};
+
+#ifdef FLT_ENABLE_PROFILE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "flt-error.h"
+
+/* Starts recording the timers. If record_trace is true then every
+ * timed call is also kept so that it can be written with
+ * flt_profile_write_trace. This must be called before any threads
+ * that use the timers are started.
+ */
+void
+flt_profile_start(bool record_trace);
+
+uint64_t
+flt_profile_begin(void);
+
+void
+flt_profile_end(enum flt_profile_counter counter,
+                uint64_t start);
+
+/* Writes a table with the number of calls and total time of each
+ * counter.
+ */
+void
+flt_profile_print_stats(FILE *out);
+
+/* Writes the recorded calls in the Chrome trace event format which
+ * can be loaded in Perfetto or chrome://tracing.
+ */
+bool
+flt_profile_write_trace(const char *filename,
+                        struct flt_error **error);
+
+/* Frees the recorded calls. The threads that used the timers must
+ * have finished.
+ */
+void
+flt_profile_stop(void);
+
+#define FLT_PROFILE_BEGIN(var) uint64_t var = flt_profile_begin()
+#define FLT_PROFILE_END(var, counter) flt_profile_end((counter), (var))
+
+#else /* FLT_ENABLE_PROFILE */
+
+#define FLT_PROFILE_BEGIN(var)
+#define FLT_PROFILE_END(var, counter)
+
+#endif /* FLT_ENABLE_PROFILE */
+
+#endif /* FLT_PROFILE_H */
@@ -20,29 +20,110 @@
 
 #include <math.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
 
 #include "flt-util.h"
 #include "flt-buffer.h"
 #include "flt-map-renderer.h"
+#include "flt-svg-cache.h"
+#include "flt-text-cache.h"
 #include "flt-source-color.h"
+#include "flt-profile.h"
 
 #define ELEVATION_LABEL "ELEVATION"
 #define SCORE_SLIDE_TIME 0.5
+#define DISTANCE_BUF_SIZE 32
+#define TIME_BUF_SIZE 32
 #define MAP_POINT_SIZE 24.0
+#define MAP_SIZE_TILE_UNITS 216.0f
+
+/* Maximum size in bytes of the rendered text runs */
+#define TEXT_CACHE_SIZE (16 * 1024 * 1024)
+
+/* Maximum number of key frames to step through before falling back to
+ * a binary search when the timestamp moves forward.
+ */
+#define MAX_CURSOR_STEPS 4
 
 struct font_with_size {
         cairo_font_face_t *face;
         double size;
+
+        /* Cached on first use */
+        bool has_extents;
+        cairo_font_extents_t extents;
+};
+
+/* The GPX data for every frame of a GPX object in the frame range,
+ * computed in one pass the first time the object is rendered.
+ */
+struct gpx_frame_table {
+        bool built;
+        /* Frame number of the first entry */
+        int first_frame;
+        size_t n_frames;
+        struct flt_gpx_data *data;
+        /* False for frames where the GPX file has no data */
+        bool *has_data;
 };
 
 struct flt_renderer {
         struct flt_scene *scene;
         struct flt_map_renderer *map_renderer;
+        /* Zero to use the map renderer’s default */
+        size_t map_tile_cache_size;
+        struct flt_svg_cache *svg_cache;
+        /* False if the svg cache is shared and owned by someone else */
+        bool owns_svg_cache;
+        struct flt_text_cache *text_cache;
         cairo_pattern_t *map_point_pattern;
+        /* Surface that maps with a reduced scale are drawn into. It
+         * is kept between frames and only recreated if the size
+         * changes.
+         */
+        cairo_surface_t *map_layer;
+        cairo_t *map_layer_cr;
+        int map_layer_size;
         double position_offsets[FLT_SCENE_N_POSITIONS];
         float gap;
 
+        /* Bounding box in device space of everything drawn during
+         * the last render.
+         */
+        double damage_x1, damage_y1, damage_x2, damage_y2;
+
+        /* For each object, the index of the first key frame that was
+         * after the timestamp of the last render.
+         */
+        size_t *key_frame_cursors;
+        /* For each object, the position of the last GPX lookup. This
+         * is only used for GPX objects.
+         */
+        struct flt_gpx_cursor *gpx_cursors;
+
+        /* The frames that will be rendered, if they are known. fps
+         * is zero otherwise.
+         */
+        int fps;
+        int start_frame, end_frame;
+        /* For each object, the table of GPX data per frame. This is
+         * only used for GPX objects.
+         */
+        struct gpx_frame_table *gpx_tables;
+
+        /* The objects that were between their first and last key
+         * frame at the time of the last render, in scene order.
+         */
+        size_t n_active_objects;
+        const struct flt_scene_object **active_objects;
+        /* Position in the scene’s sorted start and end lists */
+        size_t next_start, next_end;
+        double last_timestamp;
+
         struct font_with_size digits_font;
         struct font_with_size units_font;
         struct font_with_size label_font;
@@ -74,6 +155,38 @@ clamp(int value, int min, int max)
         return value;
 }
 
+static void
+add_damage(struct flt_renderer *renderer,
+           cairo_t *cr,
+           double x1, double y1,
+           double x2, double y2)
+{
+        double xs[] = { x1, x2, x1, x2 };
+        double ys[] = { y1, y1, y2, y2 };
+
+        /* Transform all four corners so that the box is still
+         * correct if the transformation has a rotation.
+         */
+        for (int i = 0; i < FLT_N_ELEMENTS(xs); i++) {
+                cairo_user_to_device(cr, xs + i, ys + i);
+
+                renderer->damage_x1 = MIN(renderer->damage_x1, xs[i]);
+                renderer->damage_y1 = MIN(renderer->damage_y1, ys[i]);
+                renderer->damage_x2 = MAX(renderer->damage_x2, xs[i]);
+                renderer->damage_y2 = MAX(renderer->damage_y2, ys[i]);
+        }
+}
+
+static void
+add_stroke_damage(struct flt_renderer *renderer,
+                  cairo_t *cr)
+{
+        double x1, y1, x2, y2;
+
+        cairo_stroke_extents(cr, &x1, &y1, &x2, &y2);
+        add_damage(renderer, cr, x1, y1, x2, y2);
+}
+
 static void
 set_font(cairo_t *cr, const struct font_with_size *font)
 {
@@ -81,6 +194,20 @@ set_font(cairo_t *cr, const struct font_with_size *font)
         cairo_set_font_size(cr, font->size);
 }
 
+static const cairo_font_extents_t *
+get_font_extents(cairo_t *cr, struct font_with_size *font)
+{
+        if (!font->has_extents) {
+                cairo_save(cr);
+                set_font(cr, font);
+                cairo_font_extents(cr, &font->extents);
+                cairo_restore(cr);
+                font->has_extents = true;
+        }
+
+        return &font->extents;
+}
+
 static void
 get_position(struct flt_renderer *renderer,
              enum flt_scene_position position,
@@ -123,6 +250,27 @@ get_position(struct flt_renderer *renderer,
         renderer->position_offsets[position] += height;
 }
 
+static void
+interpolate_rectangle(const struct flt_renderer *renderer,
+                      double i,
+                      const struct flt_scene_rectangle_key_frame *s,
+                      const struct flt_scene_rectangle_key_frame *e,
+                      int coords[4])
+{
+        coords[0] = clamp(interpolate(i, s->x1, e->x1),
+                          0,
+                          renderer->scene->video_width);
+        coords[1] = clamp(interpolate(i, s->y1, e->y1),
+                          0,
+                          renderer->scene->video_height);
+        coords[2] = clamp(interpolate(i, s->x2, e->x2),
+                          coords[0],
+                          renderer->scene->video_width);
+        coords[3] = clamp(interpolate(i, s->y2, e->y2),
+                          coords[1],
+                          renderer->scene->video_height);
+}
+
 static void
 interpolate_and_add_rectangle(struct flt_renderer *renderer,
                               cairo_t *cr,
@@ -131,47 +279,60 @@ interpolate_and_add_rectangle(struct flt_renderer *renderer,
                               const struct flt_scene_rectangle_key_frame *s,
                               const struct flt_scene_rectangle_key_frame *e)
 {
-        int x1 = clamp(interpolate(i, s->x1, e->x1),
-                       0,
-                       renderer->scene->video_width);
-        int y1 = clamp(interpolate(i, s->y1, e->y1),
-                       0,
-                       renderer->scene->video_height);
-        int x2 = clamp(interpolate(i, s->x2, e->x2),
-                       x1,
-                       renderer->scene->video_width);
-        int y2 = clamp(interpolate(i, s->y2, e->y2),
-                       y1,
-                       renderer->scene->video_height);
+        int coords[4];
+
+        interpolate_rectangle(renderer, i, s, e, coords);
+
+        int x1 = coords[0], y1 = coords[1], x2 = coords[2], y2 = coords[3];
+
+        /* Nothing is visible once the rectangle has been clipped */
+        if (x1 >= x2 || y1 >= y2)
+                return;
 
         flt_source_color_set(cr, rectangle->color, 1.0);
         cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
         cairo_fill(cr);
+
+        add_damage(renderer, cr, x1, y1, x2, y2);
 }
 
 static bool
-render_svg(RsvgHandle *handle,
+render_svg(struct flt_renderer *renderer,
+           RsvgHandle *handle,
            cairo_t *cr,
            const RsvgRectangle *viewport,
-           struct flt_error **error_out)
+           struct flt_error **error)
 {
-        GError *error = NULL;
+        FLT_PROFILE_BEGIN(start);
 
-        if (!rsvg_handle_render_document(handle,
-                                         cr,
-                                         viewport,
-                                         &error)) {
-                flt_set_error(error_out,
-                              &flt_renderer_error,
-                              FLT_RENDERER_ERROR_SVG,
-                              "%s",
-                              error->message);
-                g_error_free(error);
+        bool ret = flt_svg_cache_render(renderer->svg_cache,
+                                        handle,
+                                        cr,
+                                        viewport,
+                                        error);
 
-                return false;
-        }
+        FLT_PROFILE_END(start, FLT_PROFILE_SVG);
 
-        return true;
+        return ret;
+}
+
+static void
+interpolate_svg_viewport(double i,
+                         const struct flt_scene_svg_key_frame *s,
+                         const struct flt_scene_svg_key_frame *e,
+                         RsvgRectangle *viewport)
+{
+        double x1 = interpolate_double(i, s->x1, e->x1);
+        double y1 = interpolate_double(i, s->y1, e->y1);
+        double x2 = interpolate_double(i, s->x2, e->x2);
+        double y2 = interpolate_double(i, s->y2, e->y2);
+
+        *viewport = (RsvgRectangle) {
+                .x = MIN(x1, x2),
+                .y = MIN(y1, y2),
+                .width = fabs(x1 - x2),
+                .height = fabs(y2 - y1),
+        };
 }
 
 static bool
@@ -185,35 +346,60 @@ interpolate_and_add_svg(struct flt_renderer *renderer,
                         flt_scene_svg_key_frame *e,
                         struct flt_error **error)
 {
-        double x1 = interpolate_double(i, s->x1, e->x1);
-        double y1 = interpolate_double(i, s->y1, e->y1);
-        double x2 = interpolate_double(i, s->x2, e->x2);
-        double y2 = interpolate_double(i, s->y2, e->y2);
+        RsvgRectangle viewport;
 
-        RsvgRectangle viewport = {
-                .x = MIN(x1, x2),
-                .y = MIN(y1, y2),
-                .width = fabs(x1 - x2),
-                .height = fabs(y2 - y1),
-        };
+        interpolate_svg_viewport(i, s, e, &viewport);
+
+        add_damage(renderer,
+                   cr,
+                   viewport.x, viewport.y,
+                   viewport.x + viewport.width,
+                   viewport.y + viewport.height);
 
-        return render_svg(svg->handle, cr, &viewport, error);
+        return render_svg(renderer, svg->handle, cr, &viewport, error);
 }
 
 static void
-render_text(struct flt_renderer *renderer,
-            cairo_t *cr,
-            uint32_t color,
-            const char *text)
+draw_text(struct flt_renderer *renderer,
+          cairo_t *cr,
+          const struct font_with_size *font,
+          uint32_t color,
+          const char *text)
 {
+        struct flt_text_cache_params params = {
+                .face = font->face,
+                .size = font->size,
+                .line_width = renderer->scene->video_height / 90.0f,
+                .color = color,
+        };
+        cairo_rectangle_t extents;
+
+        if (flt_text_cache_render(renderer->text_cache,
+                                  cr,
+                                  &params,
+                                  text,
+                                  &extents)) {
+                if (extents.width > 0.0) {
+                        add_damage(renderer,
+                                   cr,
+                                   extents.x,
+                                   extents.y,
+                                   extents.x + extents.width,
+                                   extents.y + extents.height);
+                }
+                return;
+        }
+
         double after_x, after_y;
 
         cairo_save(cr);
-        cairo_set_line_width(cr, renderer->scene->video_height / 90.0f);
+        set_font(cr, font);
+        cairo_set_line_width(cr, params.line_width);
         cairo_text_path(cr, text);
         cairo_get_current_point(cr, &after_x, &after_y);
-        cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
         cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+        add_stroke_damage(renderer, cr);
+        cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
         cairo_stroke_preserve(cr);
         flt_source_color_set(cr, color, 1.0);
         cairo_fill(cr);
@@ -222,6 +408,20 @@ render_text(struct flt_renderer *renderer,
         cairo_move_to(cr, after_x, after_y);
 }
 
+static void
+render_text(struct flt_renderer *renderer,
+            cairo_t *cr,
+            const struct font_with_size *font,
+            uint32_t color,
+            const char *text)
+{
+        FLT_PROFILE_BEGIN(start);
+
+        draw_text(renderer, cr, font, color, text);
+
+        FLT_PROFILE_END(start, FLT_PROFILE_TEXT);
+}
+
 static FLT_NULL_TERMINATED void
 render_text_parts(struct flt_renderer *renderer,
                   cairo_t *cr,
@@ -239,8 +439,8 @@ render_text_parts(struct flt_renderer *renderer,
         double ascent = 0.0, height = 0.0, x_advance = 0.0;
 
         while (true) {
-                const struct font_with_size *font =
-                        va_arg(ap, const struct font_with_size *);
+                struct font_with_size *font =
+                        va_arg(ap, struct font_with_size *);
 
                 if (font == NULL)
                         break;
@@ -253,12 +453,12 @@ render_text_parts(struct flt_renderer *renderer,
                 cairo_text_extents(cr, text, &text_extents);
                 x_advance += text_extents.x_advance;
 
-                cairo_font_extents_t font_extents;
-                cairo_font_extents(cr, &font_extents);
-                if (font_extents.ascent > ascent)
-                        ascent = font_extents.ascent;
-                if (font_extents.height > height)
-                        height = font_extents.height;
+                const cairo_font_extents_t *font_extents =
+                        get_font_extents(cr, font);
+                if (font_extents->ascent > ascent)
+                        ascent = font_extents->ascent;
+                if (font_extents->height > height)
+                        height = font_extents->height;
         }
 
         va_end(ap);
@@ -276,8 +476,11 @@ render_text_parts(struct flt_renderer *renderer,
                 if (font == NULL)
                         break;
 
-                set_font(cr, font);
-                render_text(renderer, cr, color, va_arg(copy, const char *));
+                render_text(renderer,
+                            cr,
+                            font,
+                            color,
+                            va_arg(copy, const char *));
         }
 
         va_end(copy);
@@ -285,6 +488,15 @@ render_text_parts(struct flt_renderer *renderer,
         cairo_restore(cr);
 }
 
+static bool
+score_is_sliding(const struct flt_scene_score_key_frame *s,
+                 const struct flt_scene_score_key_frame *e,
+                 double timestamp)
+{
+        return (s->value != e->value &&
+                timestamp >= e->base.timestamp - SCORE_SLIDE_TIME);
+}
+
 static void
 interpolate_and_add_score(struct flt_renderer *renderer,
                           cairo_t *cr,
@@ -298,8 +510,8 @@ interpolate_and_add_score(struct flt_renderer *renderer,
 
         const char *score_label = score->label ? score->label : "SCORE";
 
-        cairo_font_extents_t font_extents;
-        cairo_font_extents(cr, &font_extents);
+        const cairo_font_extents_t font_extents =
+                *get_font_extents(cr, &renderer->score_font);
 
         cairo_text_extents_t label_extents;
         cairo_text_extents(cr, score_label, &label_extents);
@@ -321,13 +533,16 @@ interpolate_and_add_score(struct flt_renderer *renderer,
 
         cairo_move_to(cr, base_x, base_y + font_extents.ascent);
 
-        render_text(renderer, cr, score->color, score_label);
+        render_text(renderer,
+                    cr,
+                    &renderer->score_font,
+                    score->color,
+                    score_label);
         cairo_rel_move_to(cr, space_extents.x_advance, 0.0);
 
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        char buf[16];
 
-        if (s->value != e->value &&
-            timestamp >= e->base.timestamp - SCORE_SLIDE_TIME) {
+        if (score_is_sliding(s, e, timestamp)) {
                 double score_x, score_y;
                 cairo_get_current_point(cr, &score_x, &score_y);
 
@@ -356,32 +571,32 @@ interpolate_and_add_score(struct flt_renderer *renderer,
                 cairo_move_to(cr,
                               score_x,
                               score_y + font_extents.height - offset);
-                flt_buffer_append_printf(&buf, "%i", bottom_value);
+                snprintf(buf, sizeof buf, "%i", bottom_value);
                 render_text(renderer,
                             cr,
+                            &renderer->score_font,
                             score->color,
-                            (const char *) buf.data);
+                            buf);
 
                 cairo_move_to(cr, score_x, score_y - offset);
-                flt_buffer_set_length(&buf, 0);
-                flt_buffer_append_printf(&buf, "%i", top_value);
+                snprintf(buf, sizeof buf, "%i", top_value);
                 render_text(renderer,
                             cr,
+                            &renderer->score_font,
                             score->color,
-                            (const char *) buf.data);
+                            buf);
 
                 cairo_restore(cr);
         } else {
-                flt_buffer_append_printf(&buf, "%i", s->value);
+                snprintf(buf, sizeof buf, "%i", s->value);
                 render_text(renderer,
                             cr,
+                            &renderer->score_font,
                             score->color,
-                            (const char *) buf.data);
+                            buf);
         }
 
         cairo_restore(cr);
-
-        flt_buffer_destroy(&buf);
 }
 
 static bool
@@ -403,7 +618,7 @@ add_speed_dial(struct flt_renderer *renderer,
                      &viewport.x,
                      &viewport.y);
 
-        if (!render_svg(speed->dial, cr, &viewport, error))
+        if (!render_svg(renderer, speed->dial, cr, &viewport, error))
                 return false;
 
         cairo_save(cr);
@@ -411,40 +626,62 @@ add_speed_dial(struct flt_renderer *renderer,
         double rotation_x = viewport.x + viewport.width / 2.0;
         double rotation_y = viewport.y + viewport.height / 2.0;
 
+        /* The needle can be rotated to any angle so it can reach
+         * anywhere in the circle around the corners of the viewport.
+         */
+        double radius = sqrt(viewport.width * viewport.width +
+                             viewport.height * viewport.height) / 2.0;
+
+        add_damage(renderer,
+                   cr,
+                   rotation_x - radius, rotation_y - radius,
+                   rotation_x + radius, rotation_y + radius);
+
         cairo_translate(cr, rotation_x, rotation_y);
         cairo_rotate(cr, speed_ms * 2.0 * M_PI / speed->full_speed);
         cairo_translate(cr, -rotation_x, -rotation_y);
 
-        bool ret = render_svg(speed->needle, cr, &viewport, error);
+        /* The needle is drawn from the cached image with the
+         * rotation so librsvg only needs to render it once.
+         */
+        bool ret = render_svg(renderer,
+                              speed->needle,
+                              cr,
+                              &viewport,
+                              error);
 
         cairo_restore(cr);
 
         return ret;
 }
 
+static int
+get_speed_kmh(double speed_ms)
+{
+        return round(speed_ms * 3600 / 1000);
+}
+
 static void
 add_speed_digits(struct flt_renderer *renderer,
                  cairo_t *cr,
                  const struct flt_scene_gpx_speed *speed,
                  double speed_ms)
 {
-        int speed_kmh = round(speed_ms * 3600 / 1000);
+        int speed_kmh = get_speed_kmh(speed_ms);
 
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        char buf[16];
 
-        flt_buffer_append_printf(&buf, "%2i", speed_kmh);
+        snprintf(buf, sizeof buf, "%2i", speed_kmh);
 
         render_text_parts(renderer,
                           cr,
                           speed->base.position,
                           speed->color,
                           &renderer->digits_font,
-                          (const char *) buf.data,
+                          buf,
                           &renderer->units_font,
                           " km/h",
                           NULL);
-
-        flt_buffer_destroy(&buf);
 }
 
 static bool
@@ -468,20 +705,18 @@ add_elevation(struct flt_renderer *renderer,
               const struct flt_scene_gpx_elevation *elevation_obj,
               double elevation)
 {
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        char buf[16];
 
-        flt_buffer_append_printf(&buf, "%2i", (int) round(elevation));
+        snprintf(buf, sizeof buf, "%2i", (int) round(elevation));
 
         render_text_parts(renderer,
                           cr,
                           elevation_obj->base.position,
                           elevation_obj->color,
                           &renderer->digits_font,
-                          (const char  *) buf.data,
+                          buf,
                           NULL);
 
-        flt_buffer_destroy(&buf);
-
         render_text_parts(renderer,
                           cr,
                           elevation_obj->base.position,
@@ -491,40 +726,134 @@ add_elevation(struct flt_renderer *renderer,
                           NULL);
 }
 
-static void
-add_distance(struct flt_renderer *renderer,
-             cairo_t *cr,
-             const struct flt_scene_gpx_distance *distance_obj,
-             double distance)
+/* Formats the distance into a buffer of DISTANCE_BUF_SIZE and returns
+ * the units.
+ */
+static const char *
+format_distance(const struct flt_scene_gpx_distance *distance_obj,
+                double distance,
+                char *buf)
 {
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
-        const char *units;
-
         distance += distance_obj->offset;
 
         if (distance < 1000.0) {
-                flt_buffer_append_printf(&buf,
-                                         "%2i",
-                                         (int) distance);
-                units = " m";
+                snprintf(buf, DISTANCE_BUF_SIZE, "%2i", (int) distance);
+                return " m";
         } else {
-                flt_buffer_append_printf(&buf,
-                                         "%.2f",
-                                         distance / 1000.0);
-                units = " km";
+                snprintf(buf, DISTANCE_BUF_SIZE, "%.2f", distance / 1000.0);
+                return " km";
         }
+}
+
+static void
+add_distance(struct flt_renderer *renderer,
+             cairo_t *cr,
+             const struct flt_scene_gpx_distance *distance_obj,
+             double distance)
+{
+        char buf[DISTANCE_BUF_SIZE];
+        const char *units = format_distance(distance_obj, distance, buf);
 
         render_text_parts(renderer,
                           cr,
                           distance_obj->base.position,
                           distance_obj->color,
                           &renderer->digits_font,
-                          (const char *) buf.data,
+                          buf,
                           &renderer->units_font,
                           units,
                           NULL);
+}
+
+static void
+ensure_map_renderer(struct flt_renderer *renderer)
+{
+        if (renderer->map_renderer == NULL) {
+                renderer->map_renderer =
+                        flt_map_renderer_new(renderer->scene->map_url_base,
+                                             renderer->scene->map_api_key);
 
-        flt_buffer_destroy(&buf);
+                if (renderer->map_tile_cache_size > 0) {
+                        flt_map_renderer_set_tile_cache_size
+                                (renderer->map_renderer,
+                                 renderer->map_tile_cache_size);
+                }
+        }
+}
+
+static void
+init_map_params(struct flt_map_renderer_params *params,
+                double lat, double lon)
+{
+        *params = (struct flt_map_renderer_params)
+                FLT_MAP_RENDERER_DEFAULT_PARAMS;
+
+        params->lat = lat;
+        params->lon = lon;
+        params->map_width = round(MAP_SIZE_TILE_UNITS);
+        params->map_height = params->map_width;
+}
+
+/* Draws the map with its top-left corner at the origin */
+static bool
+draw_map(struct flt_renderer *renderer,
+         cairo_t *cr,
+         const struct flt_scene_gpx_map *map,
+         float map_size,
+         double lat, double lon,
+         double video_timestamp,
+         struct flt_error **error)
+{
+        float map_scale = map_size / MAP_SIZE_TILE_UNITS;
+        bool ret = true;
+
+        cairo_save(cr);
+        cairo_translate(cr, map_size / 2.0, map_size / 2.0);
+        cairo_scale(cr, map_scale, map_scale);
+
+        struct flt_map_renderer_params params;
+
+        init_map_params(&params, lat, lon);
+        params.trace = map->trace ? map->trace->trace : NULL;
+        params.trace_color = map->trace_color;
+        params.video_timestamp = video_timestamp;
+
+        if (!flt_map_renderer_render(renderer->map_renderer,
+                                     cr,
+                                     &params,
+                                     error))
+                ret = false;
+
+        cairo_set_source(cr, renderer->map_point_pattern);
+        cairo_rectangle(cr,
+                        -MAP_POINT_SIZE / 2.0, -MAP_POINT_SIZE / 2.0,
+                        MAP_POINT_SIZE,
+                        MAP_POINT_SIZE);
+        cairo_fill(cr);
+
+        cairo_restore(cr);
+
+        return ret;
+}
+
+static cairo_t *
+get_map_layer(struct flt_renderer *renderer, int size)
+{
+        if (renderer->map_layer && renderer->map_layer_size != size) {
+                cairo_destroy(renderer->map_layer_cr);
+                cairo_surface_destroy(renderer->map_layer);
+                renderer->map_layer = NULL;
+        }
+
+        if (renderer->map_layer == NULL) {
+                renderer->map_layer =
+                        cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                   size, size);
+                renderer->map_layer_cr = cairo_create(renderer->map_layer);
+                renderer->map_layer_size = size;
+        }
+
+        return renderer->map_layer_cr;
 }
 
 static bool
@@ -535,11 +864,7 @@ add_map(struct flt_renderer *renderer,
         double video_timestamp,
         struct flt_error **error)
 {
-        if (renderer->map_renderer == NULL) {
-                renderer->map_renderer =
-                        flt_map_renderer_new(renderer->scene->map_url_base,
-                                             renderer->scene->map_api_key);
-        }
+        ensure_map_renderer(renderer);
 
         if (renderer->map_point_pattern == NULL) {
                 cairo_pattern_t *p =
@@ -562,11 +887,7 @@ add_map(struct flt_renderer *renderer,
                 renderer->map_point_pattern = p;
         }
 
-        bool ret = true;
-
-        const float map_size_tile_units = 216.0f;
         float map_size = renderer->scene->video_height * 0.3;
-        float map_scale = map_size / map_size_tile_units;
 
         double map_x, map_y;
 
@@ -575,40 +896,184 @@ add_map(struct flt_renderer *renderer,
                      map_size, map_size,
                      &map_x, &map_y);
 
-        cairo_save(cr);
-        cairo_translate(cr,
-                        map_x + map_size / 2.0,
-                        map_y + map_size / 2.0);
-        cairo_scale(cr, map_scale, map_scale);
+        add_damage(renderer,
+                   cr,
+                   map_x, map_y,
+                   map_x + map_size, map_y + map_size);
 
-        struct flt_map_renderer_params params = FLT_MAP_RENDERER_DEFAULT_PARAMS;
+        if (map->scale >= 1.0) {
+                cairo_save(cr);
+                cairo_translate(cr, map_x, map_y);
 
-        params.lat = lat;
-        params.lon = lon;
-        params.map_width = round(map_size_tile_units);
-        params.map_height = params.map_width;
-        params.trace = map->trace ? map->trace->trace : NULL;
-        params.trace_color = map->trace_color;
-        params.video_timestamp = video_timestamp;
+                bool ret = draw_map(renderer,
+                                    cr,
+                                    map,
+                                    map_size,
+                                    lat, lon,
+                                    video_timestamp,
+                                    error);
 
-        if (!flt_map_renderer_render(renderer->map_renderer,
-                                     cr,
-                                     &params,
-                                     error))
-                ret = false;
+                cairo_restore(cr);
 
-        cairo_set_source(cr, renderer->map_point_pattern);
+                return ret;
+        }
+
+        cairo_t *layer_cr = get_map_layer(renderer,
+                                          ceil(map_size * map->scale));
+        double layer_scale = renderer->map_layer_size / map_size;
+
+        cairo_save(layer_cr);
+        cairo_set_operator(layer_cr, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(layer_cr);
+        cairo_restore(layer_cr);
+
+        cairo_save(layer_cr);
+        cairo_scale(layer_cr, layer_scale, layer_scale);
+
+        bool ret = draw_map(renderer,
+                            layer_cr,
+                            map,
+                            map_size,
+                            lat, lon,
+                            video_timestamp,
+                            error);
+
+        cairo_restore(layer_cr);
+
+        cairo_surface_flush(renderer->map_layer);
+
+        cairo_save(cr);
+        cairo_translate(cr, map_x, map_y);
+        cairo_scale(cr, 1.0 / layer_scale, 1.0 / layer_scale);
+        cairo_set_source_surface(cr, renderer->map_layer, 0.0, 0.0);
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
         cairo_rectangle(cr,
-                        -MAP_POINT_SIZE / 2.0, -MAP_POINT_SIZE / 2.0,
-                        MAP_POINT_SIZE,
-                        MAP_POINT_SIZE);
+                        0.0, 0.0,
+                        renderer->map_layer_size, renderer->map_layer_size);
         cairo_fill(cr);
-
         cairo_restore(cr);
 
         return ret;
 }
 
+static void
+build_gpx_frame_table(const struct flt_renderer *renderer,
+                      const struct flt_scene_gpx *gpx,
+                      struct gpx_frame_table *table)
+{
+        const struct flt_scene_object *object = &gpx->base;
+        struct flt_scene_key_frame * const *key_frames =
+                object->key_frame_array;
+        size_t n_key_frames = object->n_key_frames;
+        double fps = renderer->fps;
+
+        table->built = true;
+        table->first_frame = renderer->start_frame;
+        table->n_frames = 0;
+        table->data = NULL;
+        table->has_data = NULL;
+
+        if (n_key_frames < 2)
+                return;
+
+        int first_frame = MAX(renderer->start_frame,
+                              floor(key_frames[0]->timestamp * fps));
+        int end_frame = MIN(renderer->end_frame,
+                            ceil(key_frames[n_key_frames - 1]->timestamp *
+                                 fps) + 1);
+
+        if (end_frame <= first_frame)
+                return;
+
+        table->first_frame = first_frame;
+        table->n_frames = end_frame - first_frame;
+        table->data = flt_alloc(table->n_frames * sizeof *table->data);
+        table->has_data = flt_alloc(table->n_frames * sizeof *table->has_data);
+
+        struct flt_gpx_cursor cursor;
+
+        flt_gpx_cursor_init(&cursor,
+                            gpx->file->points,
+                            gpx->file->n_points);
+
+        size_t end_key_frame = 0;
+
+        for (size_t f = 0; f < table->n_frames; f++) {
+                double video_timestamp = (first_frame + f) / fps;
+
+                while (end_key_frame < n_key_frames &&
+                       key_frames[end_key_frame]->timestamp <=
+                       video_timestamp)
+                        end_key_frame++;
+
+                /* Same rule as when the object is rendered */
+                if (end_key_frame == 0 || end_key_frame >= n_key_frames) {
+                        table->has_data[f] = false;
+                        continue;
+                }
+
+                const struct flt_scene_gpx_key_frame *s =
+                        (const void *) key_frames[end_key_frame - 1];
+                const struct flt_scene_gpx_key_frame *e =
+                        (const void *) key_frames[end_key_frame];
+                double i = ((video_timestamp - s->base.timestamp) /
+                            (e->base.timestamp - s->base.timestamp));
+                double timestamp = interpolate_double(i,
+                                                      s->timestamp,
+                                                      e->timestamp);
+
+                table->has_data[f] = flt_gpx_cursor_find_data(&cursor,
+                                                              timestamp,
+                                                              table->data + f);
+        }
+}
+
+/* Looks up the GPX data for the timestamp. If the timestamp is one of
+ * the frames that the renderer was told about then this comes from
+ * the object’s frame table, otherwise it is searched for.
+ */
+static bool
+get_gpx_data(struct flt_renderer *renderer,
+             const struct flt_scene_gpx *gpx,
+             double video_timestamp,
+             double i,
+             const struct flt_scene_gpx_key_frame *s,
+             const struct flt_scene_gpx_key_frame *e,
+             struct flt_gpx_data *data)
+{
+        if (renderer->fps > 0) {
+                double frame = round(video_timestamp * renderer->fps);
+
+                if (frame / renderer->fps == video_timestamp &&
+                    frame >= renderer->start_frame &&
+                    frame < renderer->end_frame) {
+                        struct gpx_frame_table *table =
+                                renderer->gpx_tables + gpx->base.index;
+
+                        if (!table->built)
+                                build_gpx_frame_table(renderer, gpx, table);
+
+                        size_t f = (int) frame - table->first_frame;
+
+                        if (frame >= table->first_frame &&
+                            f < table->n_frames) {
+                                if (!table->has_data[f])
+                                        return false;
+
+                                *data = table->data[f];
+                                return true;
+                        }
+                }
+        }
+
+        double timestamp = interpolate_double(i, s->timestamp, e->timestamp);
+
+        return flt_gpx_cursor_find_data(renderer->gpx_cursors +
+                                        gpx->base.index,
+                                        timestamp,
+                                        data);
+}
+
 static bool
 interpolate_and_add_gpx(struct flt_renderer *renderer,
                         cairo_t *cr,
@@ -619,14 +1084,9 @@ interpolate_and_add_gpx(struct flt_renderer *renderer,
                         const struct flt_scene_gpx_key_frame *e,
                         struct flt_error **error)
 {
-        double timestamp = interpolate_double(i, s->timestamp, e->timestamp);
-
         struct flt_gpx_data gpx_data;
 
-        if (!flt_gpx_find_data(gpx->file->points,
-                               gpx->file->n_points,
-                               timestamp,
-                               &gpx_data))
+        if (!get_gpx_data(renderer, gpx, video_timestamp, i, s, e, &gpx_data))
                 return true;
 
         const struct flt_scene_gpx_object *object;
@@ -672,47 +1132,58 @@ interpolate_and_add_gpx(struct flt_renderer *renderer,
         return true;
 }
 
+/* Formats the interpolated time into a buffer of TIME_BUF_SIZE */
 static void
-interpolate_and_add_time(struct flt_renderer *renderer,
-                         cairo_t *cr,
-                         const struct flt_scene_time *time,
-                         double i,
-                         const struct flt_scene_time_key_frame *s,
-                         const struct flt_scene_time_key_frame *e)
+format_time(double i,
+            const struct flt_scene_time_key_frame *s,
+            const struct flt_scene_time_key_frame *e,
+            char *buf)
 {
         int value = interpolate_double(i, s->value, e->value);
-
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        const char *sign = "";
 
         if (value < 0) {
-                flt_buffer_append_c(&buf, '-');
+                sign = "-";
                 value = -value;
         }
 
         if (value >= 3600) {
-                flt_buffer_append_printf(&buf,
-                                         "%ih%02im%02is",
-                                         value / 3600,
-                                         value % 3600 / 60,
-                                         value % 60);
+                snprintf(buf, TIME_BUF_SIZE,
+                         "%s%ih%02im%02is",
+                         sign,
+                         value / 3600,
+                         value % 3600 / 60,
+                         value % 60);
         } else if (value >= 60) {
-                flt_buffer_append_printf(&buf,
-                                         "%im%02is",
-                                         value / 60,
-                                         value % 60);
+                snprintf(buf, TIME_BUF_SIZE,
+                         "%s%im%02is",
+                         sign,
+                         value / 60,
+                         value % 60);
         } else {
-                flt_buffer_append_printf(&buf, "%is", value);
+                snprintf(buf, TIME_BUF_SIZE, "%s%is", sign, value);
         }
-
-        render_text_parts(renderer,
-                          cr,
-                          time->position,
-                          time->color,
-                          &renderer->digits_font,
-                          (const char *) buf.data,
-                          NULL);
-
-        flt_buffer_destroy(&buf);
+}
+
+static void
+interpolate_and_add_time(struct flt_renderer *renderer,
+                         cairo_t *cr,
+                         const struct flt_scene_time *time,
+                         double i,
+                         const struct flt_scene_time_key_frame *s,
+                         const struct flt_scene_time_key_frame *e)
+{
+        char buf[TIME_BUF_SIZE];
+
+        format_time(i, s, e, buf);
+
+        render_text_parts(renderer,
+                          cr,
+                          time->position,
+                          time->color,
+                          &renderer->digits_font,
+                          buf,
+                          NULL);
 }
 
 static void
@@ -741,18 +1212,79 @@ clip_curve_axis(double t,
                          t3 * points[3]);
 }
 
+static double
+evaluate_curve_axis(double t, const double points[4])
+{
+        double rt = 1.0 - t;
+
+        return (rt * rt * rt * points[0] +
+                3.0 * rt * rt * t * points[1] +
+                3.0 * rt * t * t * points[2] +
+                t * t * t * points[3]);
+}
+
+/* Gets the range covered by one axis of the curve. The extremes are
+ * either at the end points or where the derivative is zero.
+ */
 static void
-interpolate_and_add_curve(struct flt_renderer *renderer,
-                          cairo_t *cr,
-                          const struct flt_scene_curve *curve,
-                          double i,
-                          const struct flt_scene_curve_key_frame *s,
-                          const struct flt_scene_curve_key_frame *e)
+get_curve_axis_range(const double points[4],
+                     double *min_out,
+                     double *max_out)
+{
+        double min = MIN(points[0], points[3]);
+        double max = MAX(points[0], points[3]);
+
+        /* The derivative divided by 3 is at² + bt + c */
+        double a = -points[0] + 3.0 * points[1] - 3.0 * points[2] + points[3];
+        double b = 2.0 * (points[0] - 2.0 * points[1] + points[2]);
+        double c = points[1] - points[0];
+        double roots[2];
+        int n_roots = 0;
+
+        if (fabs(a) < 1e-12) {
+                if (fabs(b) >= 1e-12)
+                        roots[n_roots++] = -c / b;
+        } else {
+                double discriminant = b * b - 4.0 * a * c;
+
+                if (discriminant >= 0.0) {
+                        double root = sqrt(discriminant);
+
+                        roots[n_roots++] = (-b + root) / (2.0 * a);
+                        roots[n_roots++] = (-b - root) / (2.0 * a);
+                }
+        }
+
+        for (int i = 0; i < n_roots; i++) {
+                if (roots[i] <= 0.0 || roots[i] >= 1.0)
+                        continue;
+
+                double value = evaluate_curve_axis(roots[i], points);
+
+                min = MIN(min, value);
+                max = MAX(max, value);
+        }
+
+        *min_out = min;
+        *max_out = max;
+}
+
+struct curve_state {
+        double sub_x_points[4], sub_y_points[4];
+        double stroke_width;
+};
+
+/* Returns false if none of the curve is visible */
+static bool
+interpolate_curve(double i,
+                  const struct flt_scene_curve_key_frame *s,
+                  const struct flt_scene_curve_key_frame *e,
+                  struct curve_state *state)
 {
         double t = interpolate_double(i, s->t, e->t);
 
         if (t <= 0.0)
-                return;
+                return false;
 
         double x_points[4], y_points[4];
 
@@ -765,24 +1297,42 @@ interpolate_and_add_curve(struct flt_renderer *renderer,
                                                  e->points[p].y);
         }
 
-        double sub_x_points[4], sub_y_points[4];
-
         if (t >= 1.0) {
-                memcpy(sub_x_points, x_points, sizeof x_points);
-                memcpy(sub_y_points, y_points, sizeof y_points);
+                memcpy(state->sub_x_points, x_points, sizeof x_points);
+                memcpy(state->sub_y_points, y_points, sizeof y_points);
         } else {
-                clip_curve_axis(t, x_points, sub_x_points);
-                clip_curve_axis(t, y_points, sub_y_points);
+                clip_curve_axis(t, x_points, state->sub_x_points);
+                clip_curve_axis(t, y_points, state->sub_y_points);
         }
 
+        state->stroke_width = interpolate_double(i,
+                                                 s->stroke_width,
+                                                 e->stroke_width);
+
+        return true;
+}
+
+static void
+interpolate_and_add_curve(struct flt_renderer *renderer,
+                          cairo_t *cr,
+                          const struct flt_scene_curve *curve,
+                          double i,
+                          const struct flt_scene_curve_key_frame *s,
+                          const struct flt_scene_curve_key_frame *e)
+{
+        struct curve_state state;
+
+        if (!interpolate_curve(i, s, e, &state))
+                return;
+
+        const double *sub_x_points = state.sub_x_points;
+        const double *sub_y_points = state.sub_y_points;
+
         cairo_save(cr);
 
         cairo_set_antialias(cr, CAIRO_ANTIALIAS_BEST);
         flt_source_color_set(cr, curve->color, 1.0);
-        cairo_set_line_width(cr,
-                             interpolate_double(i,
-                                                s->stroke_width,
-                                                e->stroke_width));
+        cairo_set_line_width(cr, state.stroke_width);
         cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
 
         cairo_move_to(cr, sub_x_points[0], sub_y_points[0]);
@@ -790,6 +1340,23 @@ interpolate_and_add_curve(struct flt_renderer *renderer,
                        sub_x_points[1], sub_y_points[1],
                        sub_x_points[2], sub_y_points[2],
                        sub_x_points[3], sub_y_points[3]);
+
+        /* With round caps the stroke reaches half of the line width
+         * past the curve in every direction. This avoids asking
+         * cairo for the stroke extents which would stroke the path
+         * a second time.
+         */
+        double x1, y1, x2, y2;
+        double half_width = state.stroke_width / 2.0;
+
+        get_curve_axis_range(sub_x_points, &x1, &x2);
+        get_curve_axis_range(sub_y_points, &y1, &y2);
+
+        add_damage(renderer,
+                   cr,
+                   x1 - half_width, y1 - half_width,
+                   x2 + half_width, y2 + half_width);
+
         cairo_stroke(cr);
 
         cairo_restore(cr);
@@ -809,6 +1376,95 @@ add_text(struct flt_renderer *renderer,
                           NULL);
 }
 
+/* Returns the index of the first key frame in [min, max) that is
+ * after the timestamp, or max if there isn’t one.
+ */
+static size_t
+search_key_frames(struct flt_scene_key_frame * const *key_frames,
+                  size_t min, size_t max,
+                  double timestamp)
+{
+        while (min < max) {
+                size_t mid = (min + max) / 2;
+
+                if (key_frames[mid]->timestamp <= timestamp)
+                        min = mid + 1;
+                else
+                        max = mid;
+        }
+
+        return min;
+}
+
+static size_t
+find_end_key_frame(struct flt_renderer *renderer,
+                   const struct flt_scene_object *object,
+                   double timestamp)
+{
+        struct flt_scene_key_frame * const *key_frames =
+                object->key_frame_array;
+        size_t n_key_frames = object->n_key_frames;
+        size_t *cursor = renderer->key_frame_cursors + object->index;
+        size_t pos = *cursor;
+
+        if (pos > 0 && key_frames[pos - 1]->timestamp > timestamp) {
+                /* Seeking backwards */
+                pos = search_key_frames(key_frames, 0, pos - 1, timestamp);
+        } else {
+                for (int i = 0;
+                     pos < n_key_frames &&
+                             key_frames[pos]->timestamp <= timestamp;
+                     i++) {
+                        if (i >= MAX_CURSOR_STEPS) {
+                                pos = search_key_frames(key_frames,
+                                                        pos + 1,
+                                                        n_key_frames,
+                                                        timestamp);
+                                break;
+                        }
+
+                        pos++;
+                }
+        }
+
+        *cursor = pos;
+
+        return pos;
+}
+
+/* Finds the key frames either side of the timestamp and the position
+ * between them. Returns false if the object isn’t visible.
+ */
+static bool
+get_key_frames(struct flt_renderer *renderer,
+               const struct flt_scene_object *object,
+               double timestamp,
+               const struct flt_scene_key_frame **s_out,
+               const struct flt_scene_key_frame **e_out,
+               double *i_out)
+{
+        size_t end_frame_num = find_end_key_frame(renderer,
+                                                  object,
+                                                  timestamp);
+
+        /* Ignore if the timestamp is after the last frame or if the
+         * end frame is the first frame.
+         */
+        if (end_frame_num == 0 || end_frame_num >= object->n_key_frames)
+                return false;
+
+        const struct flt_scene_key_frame *e =
+                object->key_frame_array[end_frame_num];
+        const struct flt_scene_key_frame *s =
+                object->key_frame_array[end_frame_num - 1];
+
+        *s_out = s;
+        *e_out = e;
+        *i_out = (timestamp - s->timestamp) / (e->timestamp - s->timestamp);
+
+        return true;
+}
+
 static enum flt_renderer_result
 interpolate_and_add_object(struct flt_renderer *renderer,
                            cairo_t *cr,
@@ -816,28 +1472,12 @@ interpolate_and_add_object(struct flt_renderer *renderer,
                            const struct flt_scene_object *object,
                            struct flt_error **error)
 {
-        const struct flt_scene_key_frame *end_frame;
-
-        flt_list_for_each(end_frame, &object->key_frames, link) {
-                if (end_frame->timestamp > timestamp)
-                        goto found_frame;
-        }
-
-        return FLT_RENDERER_RESULT_EMPTY;
-
-found_frame:
+        const struct flt_scene_key_frame *s, *end_frame;
+        double i;
 
-        /* Ignore if the end frame is the first frame */
-        if (object->key_frames.next == &end_frame->link)
+        if (!get_key_frames(renderer, object, timestamp, &s, &end_frame, &i))
                 return FLT_RENDERER_RESULT_EMPTY;
 
-        const struct flt_scene_key_frame *s =
-                flt_container_of(end_frame->link.prev,
-                                 struct flt_scene_key_frame,
-                                 link);
-        double i = ((timestamp - s->timestamp) /
-                    (end_frame->timestamp - s->timestamp));
-
         switch (object->type) {
         case FLT_SCENE_OBJECT_TYPE_RECTANGLE:
                 interpolate_and_add_rectangle(renderer,
@@ -926,61 +1566,472 @@ found_frame:
         return FLT_RENDERER_RESULT_OK;
 }
 
+static void
+init_scene_state(struct flt_renderer *renderer,
+                 struct flt_scene *scene)
+{
+        renderer->scene = scene;
+
+        renderer->gap = scene->video_height / 15.0f;
+
+        renderer->damage_x1 = renderer->damage_y1 = DBL_MAX;
+        renderer->damage_x2 = renderer->damage_y2 = -DBL_MAX;
+
+        renderer->key_frame_cursors =
+                flt_calloc(scene->n_objects *
+                           sizeof *renderer->key_frame_cursors);
+        renderer->active_objects =
+                flt_alloc(scene->n_timed_objects *
+                          sizeof *renderer->active_objects);
+
+        renderer->gpx_cursors =
+                flt_calloc(scene->n_objects * sizeof *renderer->gpx_cursors);
+        renderer->gpx_tables =
+                flt_calloc(scene->n_objects * sizeof *renderer->gpx_tables);
+
+        const struct flt_scene_object *object;
+
+        flt_list_for_each(object, &scene->objects, link) {
+                if (object->type != FLT_SCENE_OBJECT_TYPE_GPX)
+                        continue;
+
+                const struct flt_scene_gpx *gpx =
+                        (const struct flt_scene_gpx *) object;
+
+                flt_gpx_cursor_init(renderer->gpx_cursors + object->index,
+                                    gpx->file->points,
+                                    gpx->file->n_points);
+        }
+
+        renderer->n_active_objects = 0;
+        renderer->next_start = renderer->next_end = 0;
+        renderer->last_timestamp = -DBL_MAX;
+
+        renderer->digits_font.size = scene->video_height / 12.0f;
+        renderer->units_font.size = scene->video_height / 24.0f;
+        renderer->label_font.size = scene->video_height / 30.0f;
+        renderer->score_font.size = scene->video_height / 10.0f;
+}
+
+static void
+free_gpx_tables(struct flt_renderer *renderer)
+{
+        for (size_t i = 0; i < renderer->scene->n_objects; i++) {
+                struct gpx_frame_table *table = renderer->gpx_tables + i;
+
+                if (table->built) {
+                        flt_free(table->data);
+                        flt_free(table->has_data);
+                        table->built = false;
+                }
+        }
+}
+
 struct flt_renderer *
 flt_renderer_new(struct flt_scene *scene)
 {
-        struct flt_renderer *renderer = flt_calloc(sizeof *renderer);
+        struct flt_svg_cache *svg_cache =
+                flt_svg_cache_new(FLT_SVG_CACHE_DEFAULT_SIZE);
+        struct flt_renderer *renderer =
+                flt_renderer_new_with_svg_cache(scene, svg_cache);
 
-        renderer->scene = scene;
+        renderer->owns_svg_cache = true;
 
-        renderer->gap = scene->video_height / 15.0f;
+        return renderer;
+}
+
+struct flt_renderer *
+flt_renderer_new_with_svg_cache(struct flt_scene *scene,
+                                struct flt_svg_cache *svg_cache)
+{
+        struct flt_renderer *renderer = flt_calloc(sizeof *renderer);
+
+        renderer->svg_cache = svg_cache;
+        renderer->text_cache = flt_text_cache_new(TEXT_CACHE_SIZE);
 
         renderer->digits_font.face =
                 cairo_toy_font_face_create("monospace",
                                            CAIRO_FONT_SLANT_NORMAL,
                                            CAIRO_FONT_WEIGHT_NORMAL);
-        renderer->digits_font.size = scene->video_height / 12.0f;
 
         renderer->units_font.face =
                 cairo_toy_font_face_create("",
                                            CAIRO_FONT_SLANT_NORMAL,
                                            CAIRO_FONT_WEIGHT_NORMAL);
-        renderer->units_font.size = scene->video_height / 24.0f;
 
         renderer->label_font.face =
                 cairo_font_face_reference(renderer->units_font.face);
-        renderer->label_font.size = scene->video_height / 30.0f;
 
         renderer->score_font.face =
                 cairo_font_face_reference(renderer->units_font.face);
-        renderer->score_font.size = scene->video_height / 10.0f;
+
+        init_scene_state(renderer, scene);
 
         return renderer;
 }
 
+static bool
+strings_equal(const char *a, const char *b)
+{
+        if (a == NULL || b == NULL)
+                return a == b;
+
+        return !strcmp(a, b);
+}
+
+void
+flt_renderer_set_scene(struct flt_renderer *renderer,
+                       struct flt_scene *scene)
+{
+        if (renderer->map_renderer) {
+                if (strings_equal(renderer->scene->map_url_base,
+                                  scene->map_url_base) &&
+                    strings_equal(renderer->scene->map_api_key,
+                                  scene->map_api_key)) {
+                        flt_map_renderer_clear_trace_cache
+                                (renderer->map_renderer);
+                } else {
+                        flt_map_renderer_free(renderer->map_renderer);
+                        renderer->map_renderer = NULL;
+                }
+        }
+
+        free_gpx_tables(renderer);
+        flt_free(renderer->gpx_tables);
+        flt_free(renderer->key_frame_cursors);
+        flt_free(renderer->gpx_cursors);
+        flt_free(renderer->active_objects);
+
+        init_scene_state(renderer, scene);
+}
+
+void
+flt_renderer_set_frame_range(struct flt_renderer *renderer,
+                             int fps,
+                             int start_frame,
+                             int end_frame)
+{
+        free_gpx_tables(renderer);
+
+        renderer->fps = fps;
+        renderer->start_frame = start_frame;
+        renderer->end_frame = end_frame;
+}
+
+/* Returns the position in the active objects where the object is or
+ * should be inserted.
+ */
+static size_t
+find_active_object(const struct flt_renderer *renderer,
+                   const struct flt_scene_object *object)
+{
+        size_t min = 0, max = renderer->n_active_objects;
+
+        while (min < max) {
+                size_t mid = (min + max) / 2;
+
+                if (renderer->active_objects[mid]->index < object->index)
+                        min = mid + 1;
+                else
+                        max = mid;
+        }
+
+        return min;
+}
+
+static void
+add_active_object(struct flt_renderer *renderer,
+                  const struct flt_scene_object *object)
+{
+        size_t pos = find_active_object(renderer, object);
+
+        memmove(renderer->active_objects + pos + 1,
+                renderer->active_objects + pos,
+                (renderer->n_active_objects - pos) *
+                sizeof *renderer->active_objects);
+        renderer->active_objects[pos] = object;
+        renderer->n_active_objects++;
+}
+
+static void
+remove_active_object(struct flt_renderer *renderer,
+                     const struct flt_scene_object *object)
+{
+        size_t pos = find_active_object(renderer, object);
+
+        assert(pos < renderer->n_active_objects &&
+               renderer->active_objects[pos] == object);
+
+        renderer->n_active_objects--;
+        memmove(renderer->active_objects + pos,
+                renderer->active_objects + pos + 1,
+                (renderer->n_active_objects - pos) *
+                sizeof *renderer->active_objects);
+}
+
+static void
+update_active_objects(struct flt_renderer *renderer,
+                      double timestamp)
+{
+        const struct flt_scene *scene = renderer->scene;
+
+        /* Start again from the beginning if seeking backwards */
+        if (timestamp < renderer->last_timestamp) {
+                renderer->n_active_objects = 0;
+                renderer->next_start = 0;
+                renderer->next_end = 0;
+        }
+
+        renderer->last_timestamp = timestamp;
+
+        while (renderer->next_start < scene->n_timed_objects) {
+                const struct flt_scene_object *object =
+                        scene->objects_by_start[renderer->next_start];
+
+                if (object->key_frame_array[0]->timestamp > timestamp)
+                        break;
+
+                add_active_object(renderer, object);
+                renderer->next_start++;
+        }
+
+        while (renderer->next_end < scene->n_timed_objects) {
+                const struct flt_scene_object *object =
+                        scene->objects_by_end[renderer->next_end];
+
+                if (object->key_frame_array[object->n_key_frames - 1]->
+                    timestamp > timestamp)
+                        break;
+
+                remove_active_object(renderer, object);
+                renderer->next_end++;
+        }
+}
+
+static void
+hash_bytes(uint64_t *hash, const void *data, size_t length)
+{
+        const uint8_t *p = data;
+
+        /* FNV-1a */
+        for (size_t i = 0; i < length; i++) {
+                *hash ^= p[i];
+                *hash *= UINT64_C(1099511628211);
+        }
+}
+
+#define HASH_VALUE(hash, value) hash_bytes((hash), &(value), sizeof (value))
+
+static void
+hash_gpx(struct flt_renderer *renderer,
+         uint64_t *hash,
+         const struct flt_scene_gpx *gpx,
+         double video_timestamp,
+         double i,
+         const struct flt_scene_gpx_key_frame *s,
+         const struct flt_scene_gpx_key_frame *e)
+{
+        struct flt_gpx_data gpx_data;
+
+        if (!get_gpx_data(renderer, gpx, video_timestamp, i, s, e, &gpx_data))
+                return;
+
+        const struct flt_scene_gpx_object *object;
+
+        flt_list_for_each(object, &gpx->objects, link) {
+                switch (object->type) {
+                case FLT_SCENE_GPX_OBJECT_TYPE_SPEED:
+                        if (((const struct flt_scene_gpx_speed *)
+                             object)->dial) {
+                                HASH_VALUE(hash, gpx_data.speed);
+                        } else {
+                                int kmh = get_speed_kmh(gpx_data.speed);
+                                HASH_VALUE(hash, kmh);
+                        }
+                        break;
+                case FLT_SCENE_GPX_OBJECT_TYPE_ELEVATION: {
+                        int elevation = round(gpx_data.elevation);
+                        HASH_VALUE(hash, elevation);
+                        break;
+                }
+                case FLT_SCENE_GPX_OBJECT_TYPE_DISTANCE: {
+                        char buf[DISTANCE_BUF_SIZE];
+
+                        format_distance((const struct
+                                         flt_scene_gpx_distance *) object,
+                                        gpx_data.distance,
+                                        buf);
+                        hash_bytes(hash, buf, strlen(buf));
+                        break;
+                }
+                case FLT_SCENE_GPX_OBJECT_TYPE_MAP:
+                        HASH_VALUE(hash, gpx_data.lat);
+                        HASH_VALUE(hash, gpx_data.lon);
+                        /* A frame drawn with a missing tile can’t be
+                         * reused after the tile becomes available
+                         */
+                        if (renderer->map_renderer) {
+                                uint32_t generation =
+                                        flt_map_renderer_get_tile_generation
+                                        (renderer->map_renderer);
+                                HASH_VALUE(hash, generation);
+                        }
+                        /* The dashes on the trace move with time */
+                        if (((const struct flt_scene_gpx_map *)
+                             object)->trace)
+                                HASH_VALUE(hash, video_timestamp);
+                        break;
+                }
+        }
+}
+
+static void
+hash_object(struct flt_renderer *renderer,
+            uint64_t *hash,
+            double timestamp,
+            const struct flt_scene_object *object)
+{
+        const struct flt_scene_key_frame *s, *e;
+        double i;
+
+        HASH_VALUE(hash, object->index);
+
+        if (!get_key_frames(renderer, object, timestamp, &s, &e, &i))
+                return;
+
+        switch (object->type) {
+        case FLT_SCENE_OBJECT_TYPE_RECTANGLE: {
+                int coords[4];
+
+                interpolate_rectangle(renderer,
+                                      i,
+                                      (const void *) s,
+                                      (const void *) e,
+                                      coords);
+                HASH_VALUE(hash, coords);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SVG: {
+                RsvgRectangle viewport;
+
+                interpolate_svg_viewport(i,
+                                         (const void *) s,
+                                         (const void *) e,
+                                         &viewport);
+                HASH_VALUE(hash, viewport);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SCORE: {
+                const struct flt_scene_score_key_frame *score_s =
+                        (const void *) s;
+                const struct flt_scene_score_key_frame *score_e =
+                        (const void *) e;
+
+                HASH_VALUE(hash, score_s->value);
+
+                if (score_is_sliding(score_s, score_e, timestamp)) {
+                        HASH_VALUE(hash, score_e->value);
+                        HASH_VALUE(hash, timestamp);
+                }
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_GPX:
+                hash_gpx(renderer,
+                         hash,
+                         (const struct flt_scene_gpx *) object,
+                         timestamp,
+                         i,
+                         (const void *) s,
+                         (const void *) e);
+                break;
+        case FLT_SCENE_OBJECT_TYPE_TIME: {
+                char buf[TIME_BUF_SIZE];
+
+                format_time(i, (const void *) s, (const void *) e, buf);
+                hash_bytes(hash, buf, strlen(buf));
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_CURVE: {
+                struct curve_state state;
+
+                if (interpolate_curve(i,
+                                      (const void *) s,
+                                      (const void *) e,
+                                      &state))
+                        HASH_VALUE(hash, state);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TEXT:
+                /* Text never changes while it is visible */
+                break;
+        }
+}
+
+uint64_t
+flt_renderer_get_signature(struct flt_renderer *renderer,
+                           double timestamp)
+{
+        uint64_t hash = UINT64_C(14695981039346656037);
+
+        update_active_objects(renderer, timestamp);
+
+        for (size_t i = 0; i < renderer->n_active_objects; i++) {
+                hash_object(renderer,
+                            &hash,
+                            timestamp,
+                            renderer->active_objects[i]);
+        }
+
+        return hash;
+}
+
+_Static_assert(FLT_PROFILE_OBJECT_TEXT - FLT_PROFILE_OBJECT_RECTANGLE ==
+               FLT_SCENE_OBJECT_TYPE_TEXT,
+               "the profile counters must match the object types");
+
 enum flt_renderer_result
 flt_renderer_render(struct flt_renderer *renderer,
                     cairo_t *cr,
                     double timestamp,
                     struct flt_error **error)
 {
-        const struct flt_scene_object *object;
-
         enum flt_renderer_result ret = FLT_RENDERER_RESULT_EMPTY;
 
+        FLT_PROFILE_BEGIN(render_start);
+
         /* Reset all of the position offsets to 0.0 */
         memset(renderer->position_offsets,
                0,
                sizeof renderer->position_offsets);
 
-        flt_list_for_each(object, &renderer->scene->objects, link) {
-                switch (interpolate_and_add_object(renderer,
+        renderer->damage_x1 = renderer->damage_y1 = DBL_MAX;
+        renderer->damage_x2 = renderer->damage_y2 = -DBL_MAX;
+
+        update_active_objects(renderer, timestamp);
+
+        for (size_t i = 0; i < renderer->n_active_objects; i++) {
+                const struct flt_scene_object *object =
+                        renderer->active_objects[i];
+
+                FLT_PROFILE_BEGIN(object_start);
+
+                enum flt_renderer_result object_ret =
+                        interpolate_and_add_object(renderer,
                                                    cr,
                                                    timestamp,
                                                    object,
-                                                   error)) {
+                                                   error);
+
+                /* The object counters are in the same order as the
+                 * object types.
+                 */
+                FLT_PROFILE_END(object_start,
+                                FLT_PROFILE_OBJECT_RECTANGLE + object->type);
+
+                switch (object_ret) {
                 case FLT_RENDERER_RESULT_ERROR:
-                        return FLT_RENDERER_RESULT_ERROR;
+                        ret = FLT_RENDERER_RESULT_ERROR;
+                        goto out;
 
                 case FLT_RENDERER_RESULT_EMPTY:
                         break;
@@ -991,9 +2042,223 @@ flt_renderer_render(struct flt_renderer *renderer,
                 }
         }
 
+out:
+        FLT_PROFILE_END(render_start, FLT_PROFILE_RENDER);
+
+        return ret;
+}
+
+static void
+add_map_tiles_for_position(double lat, double lon,
+                           struct flt_buffer *tiles)
+{
+        struct flt_map_renderer_params params;
+
+        init_map_params(&params, lat, lon);
+        flt_map_renderer_add_tiles(&params, tiles);
+}
+
+/* Adds the tiles for every position that the map could be centered
+ * on while interpolating between the two positions.
+ */
+static void
+add_map_tiles_for_line(const struct flt_gpx_data *a,
+                       const struct flt_gpx_data *b,
+                       struct flt_buffer *tiles)
+{
+        struct flt_map_renderer_params params =
+                FLT_MAP_RENDERER_DEFAULT_PARAMS;
+        /* A quarter of the width of a tile in degrees of longitude.
+         * This is also less than the height of a tile in degrees of
+         * latitude except near the poles.
+         */
+        double step = 360.0 / (1 << params.zoom) / 4.0;
+        double max_diff = MAX(fabs(b->lat - a->lat), fabs(b->lon - a->lon));
+        int n_steps = ceil(max_diff / step);
+
+        for (int i = 1; i <= n_steps; i++) {
+                double t = i / (double) n_steps;
+
+                add_map_tiles_for_position(interpolate_double(t,
+                                                              a->lat,
+                                                              b->lat),
+                                           interpolate_double(t,
+                                                              a->lon,
+                                                              b->lon),
+                                           tiles);
+        }
+}
+
+struct map_tiles_state {
+        struct flt_gpx_cursor cursor;
+        struct flt_buffer *tiles;
+        bool has_last_data;
+        struct flt_gpx_data last_data;
+};
+
+static void
+add_map_tiles_for_time(double timestamp,
+                       struct map_tiles_state *state)
+{
+        struct flt_gpx_data data;
+
+        if (!flt_gpx_cursor_find_data(&state->cursor, timestamp, &data)) {
+                state->has_last_data = false;
+                return;
+        }
+
+        if (state->has_last_data) {
+                add_map_tiles_for_line(&state->last_data,
+                                       &data,
+                                       state->tiles);
+        } else {
+                add_map_tiles_for_position(data.lat, data.lon, state->tiles);
+        }
+
+        state->last_data = data;
+        state->has_last_data = true;
+}
+
+static void
+add_map_tiles_for_range(const struct flt_scene_gpx_file *file,
+                        double start_time,
+                        double end_time,
+                        struct flt_buffer *tiles)
+{
+        struct map_tiles_state state = {
+                .tiles = tiles,
+                .has_last_data = false,
+        };
+
+        if (start_time > end_time) {
+                double tmp = start_time;
+                start_time = end_time;
+                end_time = tmp;
+        }
+
+        flt_gpx_cursor_init(&state.cursor, file->points, file->n_points);
+
+        add_map_tiles_for_time(start_time, &state);
+
+        /* After the first lookup the cursor is at the first point
+         * after the start time.
+         */
+        for (size_t i = state.cursor.pos;
+             i < file->n_points && state.cursor.times[i] < end_time;
+             i++)
+                add_map_tiles_for_time(state.cursor.times[i], &state);
+
+        add_map_tiles_for_time(end_time, &state);
+}
+
+static bool
+gpx_has_map(const struct flt_scene_gpx *gpx)
+{
+        const struct flt_scene_gpx_object *object;
+
+        flt_list_for_each(object, &gpx->objects, link) {
+                if (object->type == FLT_SCENE_GPX_OBJECT_TYPE_MAP)
+                        return true;
+        }
+
+        return false;
+}
+
+bool
+flt_renderer_prefetch_map_tiles(struct flt_renderer *renderer,
+                                struct flt_error **error)
+{
+        struct flt_buffer tiles = FLT_BUFFER_STATIC_INIT;
+        const struct flt_scene_object *object;
+
+        flt_list_for_each(object, &renderer->scene->objects, link) {
+                if (object->type != FLT_SCENE_OBJECT_TYPE_GPX)
+                        continue;
+
+                const struct flt_scene_gpx *gpx =
+                        (const struct flt_scene_gpx *) object;
+
+                if (!gpx_has_map(gpx))
+                        continue;
+
+                for (size_t i = 1; i < object->n_key_frames; i++) {
+                        const struct flt_scene_gpx_key_frame *s =
+                                (const struct flt_scene_gpx_key_frame *)
+                                object->key_frame_array[i - 1];
+                        const struct flt_scene_gpx_key_frame *e =
+                                (const struct flt_scene_gpx_key_frame *)
+                                object->key_frame_array[i];
+
+                        add_map_tiles_for_range(gpx->file,
+                                                s->timestamp,
+                                                e->timestamp,
+                                                &tiles);
+                }
+        }
+
+        bool ret = true;
+
+        if (tiles.length > 0) {
+                ensure_map_renderer(renderer);
+
+                ret = flt_map_renderer_prefetch(renderer->map_renderer,
+                                                (const struct
+                                                 flt_map_renderer_tile *)
+                                                tiles.data,
+                                                tiles.length /
+                                                sizeof (struct
+                                                        flt_map_renderer_tile),
+                                                error);
+        }
+
+        flt_buffer_destroy(&tiles);
+
         return ret;
 }
 
+void
+flt_renderer_set_map_tile_cache_size(struct flt_renderer *renderer,
+                                     size_t size)
+{
+        renderer->map_tile_cache_size = size;
+
+        if (renderer->map_renderer)
+                flt_map_renderer_set_tile_cache_size(renderer->map_renderer,
+                                                     size);
+}
+
+/* Converts a coordinate of the damage to an int. The range is
+ * limited so that the width and height can’t overflow either.
+ */
+static int
+clamp_damage_coord(double value)
+{
+        return MIN(MAX(value, -INT_MAX / 2), INT_MAX / 2);
+}
+
+void
+flt_renderer_get_damage(const struct flt_renderer *renderer,
+                        cairo_rectangle_int_t *damage)
+{
+        if (renderer->damage_x1 > renderer->damage_x2 ||
+            renderer->damage_y1 > renderer->damage_y2) {
+                damage->x = damage->y = 0;
+                damage->width = damage->height = 0;
+                return;
+        }
+
+        /* Round outwards and add an extra pixel for antialiasing */
+        int x1 = clamp_damage_coord(floor(renderer->damage_x1) - 1);
+        int y1 = clamp_damage_coord(floor(renderer->damage_y1) - 1);
+        int x2 = clamp_damage_coord(ceil(renderer->damage_x2) + 1);
+        int y2 = clamp_damage_coord(ceil(renderer->damage_y2) + 1);
+
+        damage->x = x1;
+        damage->y = y1;
+        damage->width = x2 - x1;
+        damage->height = y2 - y1;
+}
+
 static void
 destroy_font_with_size(struct font_with_size *font)
 {
@@ -1013,8 +2278,22 @@ flt_renderer_free(struct flt_renderer *renderer)
 
         if (renderer->map_point_pattern)
                 cairo_pattern_destroy(renderer->map_point_pattern);
+        if (renderer->map_layer) {
+                cairo_destroy(renderer->map_layer_cr);
+                cairo_surface_destroy(renderer->map_layer);
+        }
         if (renderer->map_renderer)
                 flt_map_renderer_free(renderer->map_renderer);
 
+        if (renderer->owns_svg_cache)
+                flt_svg_cache_free(renderer->svg_cache);
+        flt_text_cache_free(renderer->text_cache);
+
+        free_gpx_tables(renderer);
+        flt_free(renderer->gpx_tables);
+        flt_free(renderer->key_frame_cursors);
+        flt_free(renderer->gpx_cursors);
+        flt_free(renderer->active_objects);
+
         flt_free(renderer);
 }
@@ -16,14 +16,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_RENDERER
-#define FLT_RENDERER
+#ifndef FLT_RENDERER_H
+#define FLT_RENDERER_H
 
 #include <cairo.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "flt-scene.h"
 #include "flt-error.h"
+#include "flt-svg-cache.h"
 
 struct flt_renderer;
 
@@ -40,16 +42,80 @@ enum flt_renderer_error {
 extern struct flt_error_domain
 flt_renderer_error;
 
+/* A renderer only reads from the scene so several renderers can
+ * render the same scene on different threads. Each renderer can only
+ * be used by one thread at a time.
+ */
 struct flt_renderer *
 flt_renderer_new(struct flt_scene *scene);
 
+/* Creates a renderer that uses an svg cache that can be shared with
+ * other renderers. The cache must outlive the renderer.
+ */
+struct flt_renderer *
+flt_renderer_new_with_svg_cache(struct flt_scene *scene,
+                                struct flt_svg_cache *svg_cache);
+
+/* Switches to rendering a different scene. The caches are kept so
+ * that anything that hasn’t changed in the new scene doesn’t need to
+ * be rendered again. The old scene must not be freed before calling
+ * this.
+ */
+void
+flt_renderer_set_scene(struct flt_renderer *renderer,
+                       struct flt_scene *scene);
+
+/* Tells the renderer that it is going to render the frames in the
+ * range [start_frame, end_frame) at the given frame rate. The GPX
+ * data for each of these frames is then computed in one pass when a
+ * GPX object is first rendered. Other timestamps can still be
+ * rendered. An fps of zero turns this off.
+ */
+void
+flt_renderer_set_frame_range(struct flt_renderer *renderer,
+                             int fps,
+                             int start_frame,
+                             int end_frame);
+
 enum flt_renderer_result
 flt_renderer_render(struct flt_renderer *renderer,
                     cairo_t *cr,
                     double timestamp,
                     struct flt_error **error);
 
+/* Gets a hash of everything that rendering the timestamp would draw,
+ * computed without drawing anything. If two timestamps have the same
+ * signature then they render the same image so the second one can
+ * reuse the first.
+ */
+uint64_t
+flt_renderer_get_signature(struct flt_renderer *renderer,
+                           double timestamp);
+
+/* Downloads any map tiles that rendering the scene will need so that
+ * the rendering doesn’t have to wait for them.
+ */
+bool
+flt_renderer_prefetch_map_tiles(struct flt_renderer *renderer,
+                                struct flt_error **error);
+
+/* Sets the maximum number of bytes of decoded map tiles to keep in
+ * memory.
+ */
+void
+flt_renderer_set_map_tile_cache_size(struct flt_renderer *renderer,
+                                     size_t size);
+
+/* Gets the bounding box in device space of everything that was drawn
+ * during the last call to flt_renderer_render. The box isn’t clipped
+ * to the size of the surface. If nothing was drawn then the width and
+ * height will be zero.
+ */
+void
+flt_renderer_get_damage(const struct flt_renderer *renderer,
+                        cairo_rectangle_int_t *damage);
+
 void
 flt_renderer_free(struct flt_renderer *renderer);
 
-#endif /* FLT_RENDERER */
+#endif /* FLT_RENDERER_H */
@@ -0,0 +1,301 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-resource-cache.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "flt-util.h"
+#include "flt-list.h"
+#include "flt-file-error.h"
+
+enum resource_type {
+        RESOURCE_TYPE_GPX,
+        RESOURCE_TYPE_TRACE,
+        RESOURCE_TYPE_SVG,
+};
+
+struct resource {
+        struct flt_list link;
+
+        enum resource_type type;
+        char *filename;
+        off_t size;
+        struct timespec mtime;
+
+        /* The load that last used the resource */
+        unsigned generation;
+        /* Set when the file has changed and a newer version has been
+         * loaded. The resource is kept until it is purged because the
+         * previous scene might still be using it.
+         */
+        bool stale;
+
+        union {
+                struct {
+                        const struct flt_gpx_point *points;
+                        size_t n_points;
+                } gpx;
+                struct flt_trace *trace;
+                RsvgHandle *svg;
+        };
+};
+
+struct flt_resource_cache {
+        /* The files are loaded from multiple threads. The mutex only
+         * protects the list and is not held while parsing a file.
+         */
+        pthread_mutex_t mutex;
+        struct flt_list resources;
+        unsigned generation;
+};
+
+struct flt_resource_cache *
+flt_resource_cache_new(void)
+{
+        struct flt_resource_cache *cache = flt_calloc(sizeof *cache);
+
+        pthread_mutex_init(&cache->mutex, NULL);
+        flt_list_init(&cache->resources);
+
+        return cache;
+}
+
+void
+flt_resource_cache_begin_load(struct flt_resource_cache *cache)
+{
+        cache->generation++;
+}
+
+static void
+free_resource(struct resource *resource)
+{
+        switch (resource->type) {
+        case RESOURCE_TYPE_GPX:
+                flt_gpx_free_points(resource->gpx.points);
+                break;
+        case RESOURCE_TYPE_TRACE:
+                flt_trace_free(resource->trace);
+                break;
+        case RESOURCE_TYPE_SVG:
+                g_object_unref(resource->svg);
+                break;
+        }
+
+        flt_list_remove(&resource->link);
+        flt_free(resource->filename);
+        flt_free(resource);
+}
+
+void
+flt_resource_cache_purge(struct flt_resource_cache *cache)
+{
+        struct resource *resource, *tmp;
+
+        flt_list_for_each_safe(resource, tmp, &cache->resources, link) {
+                if (resource->generation != cache->generation)
+                        free_resource(resource);
+        }
+}
+
+static bool
+stat_file(const char *filename,
+          struct stat *statbuf,
+          struct flt_error **error)
+{
+        if (stat(filename, statbuf) == -1) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+/* Looks for an up-to-date copy of the file. If there is an old copy
+ * then it is marked as stale so that it won’t be found again.
+ */
+static struct resource *
+find_resource(struct flt_resource_cache *cache,
+              enum resource_type type,
+              const char *filename,
+              const struct stat *statbuf)
+{
+        struct resource *resource, *ret = NULL;
+
+        pthread_mutex_lock(&cache->mutex);
+
+        flt_list_for_each(resource, &cache->resources, link) {
+                if (resource->stale ||
+                    resource->type != type ||
+                    strcmp(resource->filename, filename))
+                        continue;
+
+                if (resource->size == statbuf->st_size &&
+                    resource->mtime.tv_sec == statbuf->st_mtim.tv_sec &&
+                    resource->mtime.tv_nsec == statbuf->st_mtim.tv_nsec) {
+                        resource->generation = cache->generation;
+                        ret = resource;
+                        break;
+                }
+
+                resource->stale = true;
+        }
+
+        pthread_mutex_unlock(&cache->mutex);
+
+        return ret;
+}
+
+static struct resource *
+add_resource(struct flt_resource_cache *cache,
+             enum resource_type type,
+             const char *filename,
+             const struct stat *statbuf)
+{
+        struct resource *resource = flt_calloc(sizeof *resource);
+
+        resource->type = type;
+        resource->filename = flt_strdup(filename);
+        resource->size = statbuf->st_size;
+        resource->mtime = statbuf->st_mtim;
+        resource->generation = cache->generation;
+
+        pthread_mutex_lock(&cache->mutex);
+        flt_list_insert(cache->resources.prev, &resource->link);
+        pthread_mutex_unlock(&cache->mutex);
+
+        return resource;
+}
+
+bool
+flt_resource_cache_get_gpx(struct flt_resource_cache *cache,
+                           const char *filename,
+                           const struct flt_gpx_point **points_out,
+                           size_t *n_points_out,
+                           struct flt_error **error)
+{
+        struct stat statbuf;
+
+        if (!stat_file(filename, &statbuf, error))
+                return false;
+
+        struct resource *resource =
+                find_resource(cache, RESOURCE_TYPE_GPX, filename, &statbuf);
+
+        if (resource == NULL) {
+                const struct flt_gpx_point *points;
+                size_t n_points;
+
+                if (!flt_gpx_parse(filename, &points, &n_points, error))
+                        return false;
+
+                resource = add_resource(cache,
+                                        RESOURCE_TYPE_GPX,
+                                        filename,
+                                        &statbuf);
+                resource->gpx.points = points;
+                resource->gpx.n_points = n_points;
+        }
+
+        *points_out = resource->gpx.points;
+        *n_points_out = resource->gpx.n_points;
+
+        return true;
+}
+
+struct flt_trace *
+flt_resource_cache_get_trace(struct flt_resource_cache *cache,
+                             const char *filename,
+                             struct flt_error **error)
+{
+        struct stat statbuf;
+
+        if (!stat_file(filename, &statbuf, error))
+                return NULL;
+
+        struct resource *resource =
+                find_resource(cache, RESOURCE_TYPE_TRACE, filename, &statbuf);
+
+        if (resource == NULL) {
+                struct flt_trace *trace = flt_trace_parse(filename, error);
+
+                if (trace == NULL)
+                        return NULL;
+
+                resource = add_resource(cache,
+                                        RESOURCE_TYPE_TRACE,
+                                        filename,
+                                        &statbuf);
+                resource->trace = trace;
+        }
+
+        return resource->trace;
+}
+
+RsvgHandle *
+flt_resource_cache_get_svg(struct flt_resource_cache *cache,
+                           const char *filename,
+                           GError **error)
+{
+        struct stat statbuf;
+
+        /* If the file can’t be read then let librsvg report the
+         * error.
+         */
+        if (stat(filename, &statbuf) == -1)
+                return rsvg_handle_new_from_file(filename, error);
+
+        struct resource *resource =
+                find_resource(cache, RESOURCE_TYPE_SVG, filename, &statbuf);
+
+        if (resource == NULL) {
+                RsvgHandle *handle = rsvg_handle_new_from_file(filename, error);
+
+                if (handle == NULL)
+                        return NULL;
+
+                resource = add_resource(cache,
+                                        RESOURCE_TYPE_SVG,
+                                        filename,
+                                        &statbuf);
+                resource->svg = handle;
+        }
+
+        return g_object_ref(resource->svg);
+}
+
+void
+flt_resource_cache_free(struct flt_resource_cache *cache)
+{
+        struct resource *resource, *tmp;
+
+        flt_list_for_each_safe(resource, tmp, &cache->resources, link) {
+                free_resource(resource);
+        }
+
+        pthread_mutex_destroy(&cache->mutex);
+
+        flt_free(cache);
+}
@@ -0,0 +1,80 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_RESOURCE_CACHE_H
+#define FLT_RESOURCE_CACHE_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <librsvg/rsvg.h>
+
+#include "flt-gpx.h"
+#include "flt-trace.h"
+#include "flt-error.h"
+
+/* Keeps the files loaded by a script between loads so that reloading
+ * a script only has to load the files that have changed. The files
+ * are identified by their name, size and modification time.
+ */
+
+struct flt_resource_cache;
+
+struct flt_resource_cache *
+flt_resource_cache_new(void);
+
+/* Starts a new load. Any resource that isn’t used again before the
+ * next call to flt_resource_cache_purge will be freed by it.
+ */
+void
+flt_resource_cache_begin_load(struct flt_resource_cache *cache);
+
+/* Frees the resources that weren’t used since the last call to
+ * flt_resource_cache_begin_load. Nothing can be using them anymore
+ * when this is called.
+ */
+void
+flt_resource_cache_purge(struct flt_resource_cache *cache);
+
+/* The get functions can be called from multiple threads at the same
+ * time as long as they aren’t loading the same file.
+ */
+
+/* The points are owned by the cache */
+bool
+flt_resource_cache_get_gpx(struct flt_resource_cache *cache,
+                           const char *filename,
+                           const struct flt_gpx_point **points_out,
+                           size_t *n_points_out,
+                           struct flt_error **error);
+
+/* The trace is owned by the cache */
+struct flt_trace *
+flt_resource_cache_get_trace(struct flt_resource_cache *cache,
+                             const char *filename,
+                             struct flt_error **error);
+
+/* Returns a new reference to the handle */
+RsvgHandle *
+flt_resource_cache_get_svg(struct flt_resource_cache *cache,
+                           const char *filename,
+                           GError **error);
+
+void
+flt_resource_cache_free(struct flt_resource_cache *cache);
+
+#endif /* FLT_RESOURCE_CACHE_H */
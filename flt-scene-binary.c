@@ -0,0 +1,1280 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-scene-binary.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <assert.h>
+
+#include "flt-util.h"
+#include "flt-buffer.h"
+#include "flt-file-error.h"
+
+struct flt_error_domain
+flt_scene_binary_error;
+
+/* This should be increased whenever the layout changes */
+#define FORMAT_VERSION 2
+
+/* Written in the native byte order to detect files from a different
+ * kind of machine.
+ */
+#define BYTE_ORDER_MARK UINT32_C(0x01020304)
+
+/* Used instead of a length for a NULL string and instead of an index
+ * for a missing resource.
+ */
+#define NO_INDEX UINT32_MAX
+
+struct reader {
+        const uint8_t *data;
+        size_t size;
+        size_t pos;
+};
+
+struct loader {
+        struct reader reader;
+        struct flt_scene *scene;
+
+        size_t n_gpx_files;
+        struct flt_scene_gpx_file **gpx_files;
+        size_t n_traces;
+        struct flt_scene_trace **traces;
+        size_t n_svgs;
+        struct flt_scene_svg_file **svgs;
+};
+
+bool
+flt_scene_binary_detect(const void *data,
+                        size_t size)
+{
+        return (size >= FLT_SCENE_BINARY_MAGIC_SIZE &&
+                !memcmp(data,
+                        FLT_SCENE_BINARY_MAGIC,
+                        FLT_SCENE_BINARY_MAGIC_SIZE));
+}
+
+static void
+write_u32(struct flt_buffer *buf,
+          uint32_t value)
+{
+        flt_buffer_append(buf, &value, sizeof value);
+}
+
+static void
+write_int(struct flt_buffer *buf,
+          int value)
+{
+        int32_t int32_value = value;
+
+        flt_buffer_append(buf, &int32_value, sizeof int32_value);
+}
+
+static void
+write_double(struct flt_buffer *buf,
+             double value)
+{
+        flt_buffer_append(buf, &value, sizeof value);
+}
+
+static void
+write_string(struct flt_buffer *buf,
+             const char *str)
+{
+        if (str == NULL) {
+                write_u32(buf, NO_INDEX);
+                return;
+        }
+
+        size_t length = strlen(str);
+
+        write_u32(buf, length);
+        flt_buffer_append(buf, str, length);
+}
+
+static void
+write_filename(struct flt_buffer *buf,
+               const char *filename)
+{
+        /* Store the absolute path so that the compiled scene can be
+         * used from any directory.
+         */
+        char *path = realpath(filename, NULL);
+
+        write_string(buf, path ? path : filename);
+
+        free(path);
+}
+
+static void
+write_resources(struct flt_buffer *buf,
+                const struct flt_scene *scene)
+{
+        const struct flt_scene_gpx_file *gpx_file;
+        const struct flt_scene_trace *trace;
+        const struct flt_scene_svg_file *svg_file;
+
+        write_u32(buf, flt_list_length(&scene->gpx_files));
+
+        flt_list_for_each(gpx_file, &scene->gpx_files, link)
+                write_filename(buf, gpx_file->filename);
+
+        write_u32(buf, flt_list_length(&scene->traces));
+
+        flt_list_for_each(trace, &scene->traces, link)
+                write_filename(buf, trace->filename);
+
+        write_u32(buf, flt_list_length(&scene->svg_files));
+
+        flt_list_for_each(svg_file, &scene->svg_files, link)
+                write_filename(buf, svg_file->filename);
+}
+
+static uint32_t
+get_gpx_file_index(const struct flt_scene *scene,
+                   const struct flt_scene_gpx_file *file)
+{
+        const struct flt_scene_gpx_file *other;
+        uint32_t index = 0;
+
+        flt_list_for_each(other, &scene->gpx_files, link) {
+                if (other == file)
+                        return index;
+                index++;
+        }
+
+        return NO_INDEX;
+}
+
+static uint32_t
+get_trace_index(const struct flt_scene *scene,
+                const struct flt_scene_trace *trace)
+{
+        const struct flt_scene_trace *other;
+        uint32_t index = 0;
+
+        flt_list_for_each(other, &scene->traces, link) {
+                if (other == trace)
+                        return index;
+                index++;
+        }
+
+        return NO_INDEX;
+}
+
+static uint32_t
+get_svg_index(const struct flt_scene *scene,
+              const RsvgHandle *handle)
+{
+        const struct flt_scene_svg_file *svg_file;
+        uint32_t index = 0;
+
+        flt_list_for_each(svg_file, &scene->svg_files, link) {
+                if (svg_file->handle == handle)
+                        return index;
+                index++;
+        }
+
+        return NO_INDEX;
+}
+
+static void
+write_gpx_object(struct flt_buffer *buf,
+                 const struct flt_scene *scene,
+                 const struct flt_scene_gpx_object *object)
+{
+        write_u32(buf, object->type);
+        write_u32(buf, object->position);
+
+        switch (object->type) {
+        case FLT_SCENE_GPX_OBJECT_TYPE_SPEED: {
+                const struct flt_scene_gpx_speed *speed =
+                        (const struct flt_scene_gpx_speed *) object;
+                write_u32(buf, speed->color);
+                write_u32(buf, get_svg_index(scene, speed->dial));
+                write_u32(buf, get_svg_index(scene, speed->needle));
+                write_double(buf, speed->width);
+                write_double(buf, speed->height);
+                write_double(buf, speed->full_speed);
+                break;
+        }
+        case FLT_SCENE_GPX_OBJECT_TYPE_ELEVATION: {
+                const struct flt_scene_gpx_elevation *elevation =
+                        (const struct flt_scene_gpx_elevation *) object;
+                write_u32(buf, elevation->color);
+                break;
+        }
+        case FLT_SCENE_GPX_OBJECT_TYPE_DISTANCE: {
+                const struct flt_scene_gpx_distance *distance =
+                        (const struct flt_scene_gpx_distance *) object;
+                write_double(buf, distance->offset);
+                write_u32(buf, distance->color);
+                break;
+        }
+        case FLT_SCENE_GPX_OBJECT_TYPE_MAP: {
+                const struct flt_scene_gpx_map *map =
+                        (const struct flt_scene_gpx_map *) object;
+                write_u32(buf, get_trace_index(scene, map->trace));
+                write_u32(buf, map->trace_color);
+                write_double(buf, map->scale);
+                break;
+        }
+        }
+}
+
+static void
+write_key_frame(struct flt_buffer *buf,
+                enum flt_scene_object_type type,
+                const struct flt_scene_key_frame *key_frame)
+{
+        write_double(buf, key_frame->timestamp);
+
+        switch (type) {
+        case FLT_SCENE_OBJECT_TYPE_RECTANGLE: {
+                const struct flt_scene_rectangle_key_frame *rectangle =
+                        (const struct flt_scene_rectangle_key_frame *)
+                        key_frame;
+                write_int(buf, rectangle->x1);
+                write_int(buf, rectangle->y1);
+                write_int(buf, rectangle->x2);
+                write_int(buf, rectangle->y2);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SVG: {
+                const struct flt_scene_svg_key_frame *svg =
+                        (const struct flt_scene_svg_key_frame *) key_frame;
+                write_int(buf, svg->x1);
+                write_int(buf, svg->y1);
+                write_int(buf, svg->x2);
+                write_int(buf, svg->y2);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SCORE: {
+                const struct flt_scene_score_key_frame *score =
+                        (const struct flt_scene_score_key_frame *) key_frame;
+                write_int(buf, score->value);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_GPX: {
+                const struct flt_scene_gpx_key_frame *gpx =
+                        (const struct flt_scene_gpx_key_frame *) key_frame;
+                write_double(buf, gpx->timestamp);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TIME: {
+                const struct flt_scene_time_key_frame *time =
+                        (const struct flt_scene_time_key_frame *) key_frame;
+                write_double(buf, time->value);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_CURVE: {
+                const struct flt_scene_curve_key_frame *curve =
+                        (const struct flt_scene_curve_key_frame *) key_frame;
+                write_double(buf, curve->t);
+                for (int i = 0; i < FLT_N_ELEMENTS(curve->points); i++) {
+                        write_double(buf, curve->points[i].x);
+                        write_double(buf, curve->points[i].y);
+                }
+                write_double(buf, curve->stroke_width);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TEXT:
+                break;
+        }
+}
+
+static void
+write_object(struct flt_buffer *buf,
+             const struct flt_scene *scene,
+             const struct flt_scene_object *object)
+{
+        write_u32(buf, object->type);
+
+        switch (object->type) {
+        case FLT_SCENE_OBJECT_TYPE_RECTANGLE: {
+                const struct flt_scene_rectangle *rectangle =
+                        (const struct flt_scene_rectangle *) object;
+                write_u32(buf, rectangle->color);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SVG: {
+                const struct flt_scene_svg *svg =
+                        (const struct flt_scene_svg *) object;
+                write_u32(buf, get_svg_index(scene, svg->handle));
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SCORE: {
+                const struct flt_scene_score *score =
+                        (const struct flt_scene_score *) object;
+                write_u32(buf, score->position);
+                write_string(buf, score->label);
+                write_u32(buf, score->color);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_GPX: {
+                const struct flt_scene_gpx *gpx =
+                        (const struct flt_scene_gpx *) object;
+                const struct flt_scene_gpx_object *gpx_object;
+
+                write_u32(buf, get_gpx_file_index(scene, gpx->file));
+                write_u32(buf, flt_list_length(&gpx->objects));
+
+                flt_list_for_each(gpx_object, &gpx->objects, link)
+                        write_gpx_object(buf, scene, gpx_object);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TIME: {
+                const struct flt_scene_time *time =
+                        (const struct flt_scene_time *) object;
+                write_u32(buf, time->position);
+                write_u32(buf, time->color);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_CURVE: {
+                const struct flt_scene_curve *curve =
+                        (const struct flt_scene_curve *) object;
+                write_u32(buf, curve->color);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TEXT: {
+                const struct flt_scene_text *text =
+                        (const struct flt_scene_text *) object;
+                write_u32(buf, text->position);
+                write_string(buf, text->text);
+                write_u32(buf, text->color);
+                break;
+        }
+        }
+
+        const struct flt_scene_key_frame *key_frame;
+
+        write_u32(buf, flt_list_length(&object->key_frames));
+
+        flt_list_for_each(key_frame, &object->key_frames, link)
+                write_key_frame(buf, object->type, key_frame);
+}
+
+bool
+flt_scene_binary_write(const struct flt_scene *scene,
+                       FILE *out,
+                       struct flt_error **error)
+{
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append(&buf,
+                          FLT_SCENE_BINARY_MAGIC,
+                          FLT_SCENE_BINARY_MAGIC_SIZE);
+        write_u32(&buf, FORMAT_VERSION);
+        write_u32(&buf, BYTE_ORDER_MARK);
+
+        write_int(&buf, scene->video_width);
+        write_int(&buf, scene->video_height);
+        write_string(&buf, scene->map_url_base);
+        write_string(&buf, scene->map_api_key);
+
+        write_resources(&buf, scene);
+
+        const struct flt_scene_object *object;
+
+        write_u32(&buf, flt_list_length(&scene->objects));
+
+        flt_list_for_each(object, &scene->objects, link)
+                write_object(&buf, scene, object);
+
+        bool ret = true;
+
+        if (fwrite(buf.data, 1, buf.length, out) != buf.length ||
+            fflush(out) == EOF) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "error writing compiled scene: %s",
+                                   strerror(errno));
+                ret = false;
+        }
+
+        flt_buffer_destroy(&buf);
+
+        return ret;
+}
+
+FLT_PRINTF_FORMAT(2, 3) static void
+set_invalid_error(struct flt_error **error,
+                  const char *format,
+                  ...)
+{
+        va_list ap;
+
+        va_start(ap, format);
+        flt_set_error_va_list(error,
+                              &flt_scene_binary_error,
+                              FLT_SCENE_BINARY_ERROR_INVALID,
+                              format,
+                              ap);
+        va_end(ap);
+}
+
+static bool
+read_bytes(struct reader *reader,
+           void *data,
+           size_t length,
+           struct flt_error **error)
+{
+        if (reader->size - reader->pos < length) {
+                set_invalid_error(error, "compiled scene is truncated");
+                return false;
+        }
+
+        memcpy(data, reader->data + reader->pos, length);
+        reader->pos += length;
+
+        return true;
+}
+
+static bool
+read_u32(struct reader *reader,
+         uint32_t *value_out,
+         struct flt_error **error)
+{
+        return read_bytes(reader, value_out, sizeof *value_out, error);
+}
+
+static bool
+read_int(struct reader *reader,
+         int *value_out,
+         struct flt_error **error)
+{
+        int32_t value;
+
+        if (!read_bytes(reader, &value, sizeof value, error))
+                return false;
+
+        *value_out = value;
+
+        return true;
+}
+
+static bool
+read_double(struct reader *reader,
+            double *value_out,
+            struct flt_error **error)
+{
+        return read_bytes(reader, value_out, sizeof *value_out, error);
+}
+
+/* Reads a number of items where each item takes at least item_size
+ * bytes so that a corrupt count can’t cause a huge allocation.
+ */
+static bool
+read_count(struct reader *reader,
+           size_t item_size,
+           size_t *count_out,
+           struct flt_error **error)
+{
+        uint32_t count;
+
+        if (!read_u32(reader, &count, error))
+                return false;
+
+        if (count > (reader->size - reader->pos) / item_size) {
+                set_invalid_error(error, "compiled scene is truncated");
+                return false;
+        }
+
+        *count_out = count;
+
+        return true;
+}
+
+static bool
+read_string(struct reader *reader,
+            char **str_out,
+            struct flt_error **error)
+{
+        uint32_t length;
+
+        if (!read_u32(reader, &length, error))
+                return false;
+
+        if (length == NO_INDEX) {
+                *str_out = NULL;
+                return true;
+        }
+
+        if (reader->size - reader->pos < length) {
+                set_invalid_error(error, "compiled scene is truncated");
+                return false;
+        }
+
+        *str_out = flt_strndup((const char *) reader->data + reader->pos,
+                               length);
+        reader->pos += length;
+
+        return true;
+}
+
+static bool
+read_position(struct reader *reader,
+              enum flt_scene_position *position_out,
+              struct flt_error **error)
+{
+        uint32_t position;
+
+        if (!read_u32(reader, &position, error))
+                return false;
+
+        if (position >= FLT_SCENE_N_POSITIONS) {
+                set_invalid_error(error, "invalid position in compiled scene");
+                return false;
+        }
+
+        *position_out = position;
+
+        return true;
+}
+
+static bool
+read_index(struct reader *reader,
+           size_t n_resources,
+           bool allow_none,
+           uint32_t *index_out,
+           struct flt_error **error)
+{
+        uint32_t index;
+
+        if (!read_u32(reader, &index, error))
+                return false;
+
+        if ((index != NO_INDEX || !allow_none) && index >= n_resources) {
+                set_invalid_error(error,
+                                  "invalid resource in compiled scene");
+                return false;
+        }
+
+        *index_out = index;
+
+        return true;
+}
+
+static bool
+read_svg(struct loader *loader,
+         bool allow_none,
+         RsvgHandle **handle_out,
+         struct flt_error **error)
+{
+        uint32_t index;
+
+        if (!read_index(&loader->reader,
+                        loader->n_svgs,
+                        allow_none,
+                        &index,
+                        error))
+                return false;
+
+        if (index == NO_INDEX)
+                *handle_out = NULL;
+        else
+                *handle_out = g_object_ref(loader->svgs[index]->handle);
+
+        return true;
+}
+
+static bool
+load_filenames(struct loader *loader,
+               size_t *n_filenames_out,
+               char ***filenames_out,
+               struct flt_error **error)
+{
+        size_t n_filenames;
+
+        if (!read_count(&loader->reader,
+                        sizeof (uint32_t),
+                        &n_filenames,
+                        error))
+                return false;
+
+        char **filenames = flt_calloc(n_filenames * sizeof *filenames);
+
+        *n_filenames_out = n_filenames;
+        *filenames_out = filenames;
+
+        for (size_t i = 0; i < n_filenames; i++) {
+                if (!read_string(&loader->reader, filenames + i, error))
+                        return false;
+
+                if (filenames[i] == NULL) {
+                        set_invalid_error(error,
+                                          "missing filename in compiled "
+                                          "scene");
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static void
+free_filenames(size_t n_filenames,
+               char **filenames)
+{
+        for (size_t i = 0; i < n_filenames; i++)
+                flt_free(filenames[i]);
+
+        flt_free(filenames);
+}
+
+static bool
+load_gpx_files(struct loader *loader,
+               struct flt_error **error)
+{
+        size_t n_filenames = 0;
+        char **filenames = NULL;
+        bool ret = true;
+
+        if (!load_filenames(loader, &n_filenames, &filenames, error)) {
+                ret = false;
+                goto out;
+        }
+
+        loader->gpx_files = flt_alloc(n_filenames * sizeof *loader->gpx_files);
+
+        for (size_t i = 0; i < n_filenames; i++) {
+                loader->gpx_files[i] =
+                        flt_scene_add_gpx_file(loader->scene, filenames[i]);
+        }
+
+        loader->n_gpx_files = n_filenames;
+
+out:
+        free_filenames(n_filenames, filenames);
+
+        return ret;
+}
+
+static bool
+load_traces(struct loader *loader,
+            struct flt_error **error)
+{
+        size_t n_filenames = 0;
+        char **filenames = NULL;
+        bool ret = true;
+
+        if (!load_filenames(loader, &n_filenames, &filenames, error)) {
+                ret = false;
+                goto out;
+        }
+
+        loader->traces = flt_alloc(n_filenames * sizeof *loader->traces);
+
+        for (size_t i = 0; i < n_filenames; i++) {
+                loader->traces[i] =
+                        flt_scene_add_trace(loader->scene, filenames[i]);
+        }
+
+        loader->n_traces = n_filenames;
+
+out:
+        free_filenames(n_filenames, filenames);
+
+        return ret;
+}
+
+static bool
+load_svgs(struct loader *loader,
+          struct flt_error **error)
+{
+        size_t n_filenames = 0;
+        char **filenames = NULL;
+        bool ret = true;
+
+        if (!load_filenames(loader, &n_filenames, &filenames, error)) {
+                ret = false;
+                goto out;
+        }
+
+        loader->svgs = flt_alloc(n_filenames * sizeof *loader->svgs);
+
+        for (size_t i = 0; i < n_filenames; i++) {
+                loader->svgs[i] =
+                        flt_scene_add_svg_file(loader->scene, filenames[i]);
+        }
+
+        loader->n_svgs = n_filenames;
+
+out:
+        free_filenames(n_filenames, filenames);
+
+        return ret;
+}
+
+static bool
+get_gpx_object_size(uint32_t type,
+                    size_t *struct_size_out)
+{
+        switch ((enum flt_scene_gpx_object_type) type) {
+        case FLT_SCENE_GPX_OBJECT_TYPE_SPEED:
+                *struct_size_out = sizeof (struct flt_scene_gpx_speed);
+                return true;
+        case FLT_SCENE_GPX_OBJECT_TYPE_ELEVATION:
+                *struct_size_out = sizeof (struct flt_scene_gpx_elevation);
+                return true;
+        case FLT_SCENE_GPX_OBJECT_TYPE_DISTANCE:
+                *struct_size_out = sizeof (struct flt_scene_gpx_distance);
+                return true;
+        case FLT_SCENE_GPX_OBJECT_TYPE_MAP:
+                *struct_size_out = sizeof (struct flt_scene_gpx_map);
+                return true;
+        }
+
+        return false;
+}
+
+static bool
+load_gpx_object(struct loader *loader,
+                struct flt_scene_gpx *gpx,
+                struct flt_error **error)
+{
+        struct reader *reader = &loader->reader;
+        uint32_t type;
+        size_t struct_size;
+
+        if (!read_u32(reader, &type, error))
+                return false;
+
+        if (!get_gpx_object_size(type, &struct_size)) {
+                set_invalid_error(error,
+                                  "invalid gpx object in compiled scene");
+                return false;
+        }
+
+        struct flt_scene_gpx_object *object =
+                flt_arena_calloc(&loader->scene->arena, struct_size);
+
+        object->type = type;
+        flt_list_insert(gpx->objects.prev, &object->link);
+
+        if (!read_position(reader, &object->position, error))
+                return false;
+
+        switch (object->type) {
+        case FLT_SCENE_GPX_OBJECT_TYPE_SPEED: {
+                struct flt_scene_gpx_speed *speed =
+                        (struct flt_scene_gpx_speed *) object;
+
+                if (!read_u32(reader, &speed->color, error) ||
+                    !read_svg(loader, true, &speed->dial, error) ||
+                    !read_svg(loader, true, &speed->needle, error) ||
+                    !read_double(reader, &speed->width, error) ||
+                    !read_double(reader, &speed->height, error) ||
+                    !read_double(reader, &speed->full_speed, error))
+                        return false;
+
+                if ((speed->dial == NULL) != (speed->needle == NULL)) {
+                        set_invalid_error(error,
+                                          "speed object in compiled scene "
+                                          "has a dial without a needle");
+                        return false;
+                }
+
+                return true;
+        }
+        case FLT_SCENE_GPX_OBJECT_TYPE_ELEVATION: {
+                struct flt_scene_gpx_elevation *elevation =
+                        (struct flt_scene_gpx_elevation *) object;
+
+                return read_u32(reader, &elevation->color, error);
+        }
+        case FLT_SCENE_GPX_OBJECT_TYPE_DISTANCE: {
+                struct flt_scene_gpx_distance *distance =
+                        (struct flt_scene_gpx_distance *) object;
+
+                return (read_double(reader, &distance->offset, error) &&
+                        read_u32(reader, &distance->color, error));
+        }
+        case FLT_SCENE_GPX_OBJECT_TYPE_MAP: {
+                struct flt_scene_gpx_map *map =
+                        (struct flt_scene_gpx_map *) object;
+                uint32_t index;
+
+                if (!read_index(reader,
+                                loader->n_traces,
+                                true, /* allow_none */
+                                &index,
+                                error) ||
+                    !read_u32(reader, &map->trace_color, error) ||
+                    !read_double(reader, &map->scale, error))
+                        return false;
+
+                /* Same range as the parser. This also rejects NaN. */
+                if (!(map->scale >= 0.1 && map->scale <= 1.0)) {
+                        set_invalid_error(error,
+                                          "invalid map scale in compiled "
+                                          "scene");
+                        return false;
+                }
+
+                map->trace = index == NO_INDEX ? NULL : loader->traces[index];
+
+                return true;
+        }
+        }
+
+        assert(!"unknown gpx object type");
+
+        return false;
+}
+
+static bool
+load_gpx(struct loader *loader,
+         struct flt_scene_gpx *gpx,
+         struct flt_error **error)
+{
+        uint32_t index;
+        size_t n_objects;
+
+        if (!read_index(&loader->reader,
+                        loader->n_gpx_files,
+                        false, /* allow_none */
+                        &index,
+                        error) ||
+            !read_count(&loader->reader,
+                        sizeof (uint32_t) * 2,
+                        &n_objects,
+                        error))
+                return false;
+
+        gpx->file = loader->gpx_files[index];
+
+        if (n_objects == 0) {
+                set_invalid_error(error,
+                                  "gpx in compiled scene has no objects");
+                return false;
+        }
+
+        for (size_t i = 0; i < n_objects; i++) {
+                if (!load_gpx_object(loader, gpx, error))
+                        return false;
+        }
+
+        return true;
+}
+
+static bool
+load_key_frame(struct reader *reader,
+               enum flt_scene_object_type type,
+               struct flt_scene_key_frame *key_frame,
+               struct flt_error **error)
+{
+        switch (type) {
+        case FLT_SCENE_OBJECT_TYPE_RECTANGLE: {
+                struct flt_scene_rectangle_key_frame *rectangle =
+                        (struct flt_scene_rectangle_key_frame *) key_frame;
+                return (read_int(reader, &rectangle->x1, error) &&
+                        read_int(reader, &rectangle->y1, error) &&
+                        read_int(reader, &rectangle->x2, error) &&
+                        read_int(reader, &rectangle->y2, error));
+        }
+        case FLT_SCENE_OBJECT_TYPE_SVG: {
+                struct flt_scene_svg_key_frame *svg =
+                        (struct flt_scene_svg_key_frame *) key_frame;
+                return (read_int(reader, &svg->x1, error) &&
+                        read_int(reader, &svg->y1, error) &&
+                        read_int(reader, &svg->x2, error) &&
+                        read_int(reader, &svg->y2, error));
+        }
+        case FLT_SCENE_OBJECT_TYPE_SCORE: {
+                struct flt_scene_score_key_frame *score =
+                        (struct flt_scene_score_key_frame *) key_frame;
+                return read_int(reader, &score->value, error);
+        }
+        case FLT_SCENE_OBJECT_TYPE_GPX: {
+                struct flt_scene_gpx_key_frame *gpx =
+                        (struct flt_scene_gpx_key_frame *) key_frame;
+                return read_double(reader, &gpx->timestamp, error);
+        }
+        case FLT_SCENE_OBJECT_TYPE_TIME: {
+                struct flt_scene_time_key_frame *time =
+                        (struct flt_scene_time_key_frame *) key_frame;
+                return read_double(reader, &time->value, error);
+        }
+        case FLT_SCENE_OBJECT_TYPE_CURVE: {
+                struct flt_scene_curve_key_frame *curve =
+                        (struct flt_scene_curve_key_frame *) key_frame;
+
+                if (!read_double(reader, &curve->t, error))
+                        return false;
+
+                for (int i = 0; i < FLT_N_ELEMENTS(curve->points); i++) {
+                        if (!read_double(reader,
+                                         &curve->points[i].x,
+                                         error) ||
+                            !read_double(reader,
+                                         &curve->points[i].y,
+                                         error))
+                                return false;
+                }
+
+                return read_double(reader, &curve->stroke_width, error);
+        }
+        case FLT_SCENE_OBJECT_TYPE_TEXT:
+                return true;
+        }
+
+        assert(!"unknown object type");
+
+        return false;
+}
+
+static bool
+load_key_frames(struct loader *loader,
+                struct flt_scene_object *object,
+                size_t key_frame_size,
+                struct flt_error **error)
+{
+        struct reader *reader = &loader->reader;
+        size_t n_key_frames;
+
+        if (!read_count(reader, sizeof (double), &n_key_frames, error))
+                return false;
+
+        if (n_key_frames == 0) {
+                set_invalid_error(error,
+                                  "object in compiled scene has no key "
+                                  "frames");
+                return false;
+        }
+
+        /* All of the key frames for an object are allocated in one
+         * block.
+         */
+        uint8_t *key_frames = flt_arena_calloc(&loader->scene->arena,
+                                               n_key_frames *
+                                               key_frame_size);
+
+        for (size_t i = 0; i < n_key_frames; i++) {
+                struct flt_scene_key_frame *key_frame =
+                        (struct flt_scene_key_frame *)
+                        (key_frames + i * key_frame_size);
+
+                if (!read_double(reader, &key_frame->timestamp, error))
+                        return false;
+
+                if (i > 0 &&
+                    !(key_frame->timestamp >
+                      ((struct flt_scene_key_frame *)
+                       (key_frames + (i - 1) * key_frame_size))->timestamp)) {
+                        set_invalid_error(error,
+                                          "key frames out of order in "
+                                          "compiled scene");
+                        return false;
+                }
+
+                if (!load_key_frame(reader, object->type, key_frame, error))
+                        return false;
+
+                flt_list_insert(object->key_frames.prev, &key_frame->link);
+        }
+
+        return true;
+}
+
+static bool
+get_object_sizes(uint32_t type,
+                 size_t *struct_size_out,
+                 size_t *key_frame_size_out)
+{
+        switch ((enum flt_scene_object_type) type) {
+        case FLT_SCENE_OBJECT_TYPE_RECTANGLE:
+                *struct_size_out = sizeof (struct flt_scene_rectangle);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_rectangle_key_frame);
+                return true;
+        case FLT_SCENE_OBJECT_TYPE_SVG:
+                *struct_size_out = sizeof (struct flt_scene_svg);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_svg_key_frame);
+                return true;
+        case FLT_SCENE_OBJECT_TYPE_SCORE:
+                *struct_size_out = sizeof (struct flt_scene_score);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_score_key_frame);
+                return true;
+        case FLT_SCENE_OBJECT_TYPE_GPX:
+                *struct_size_out = sizeof (struct flt_scene_gpx);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_gpx_key_frame);
+                return true;
+        case FLT_SCENE_OBJECT_TYPE_TIME:
+                *struct_size_out = sizeof (struct flt_scene_time);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_time_key_frame);
+                return true;
+        case FLT_SCENE_OBJECT_TYPE_CURVE:
+                *struct_size_out = sizeof (struct flt_scene_curve);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_curve_key_frame);
+                return true;
+        case FLT_SCENE_OBJECT_TYPE_TEXT:
+                *struct_size_out = sizeof (struct flt_scene_text);
+                *key_frame_size_out =
+                        sizeof (struct flt_scene_text_key_frame);
+                return true;
+        }
+
+        return false;
+}
+
+static bool
+load_object(struct loader *loader,
+            struct flt_error **error)
+{
+        struct reader *reader = &loader->reader;
+        uint32_t type;
+        size_t struct_size, key_frame_size;
+
+        if (!read_u32(reader, &type, error))
+                return false;
+
+        if (!get_object_sizes(type, &struct_size, &key_frame_size)) {
+                set_invalid_error(error, "invalid object in compiled scene");
+                return false;
+        }
+
+        /* The object is added to the scene straight away so that
+         * anything loaded so far will be freed with the scene if
+         * there is an error.
+         */
+        struct flt_scene_object *object =
+                flt_arena_calloc(&loader->scene->arena, struct_size);
+
+        object->type = type;
+        flt_list_init(&object->key_frames);
+        object->key_frame_array = NULL;
+        flt_list_insert(loader->scene->objects.prev, &object->link);
+
+        bool ret = true;
+
+        switch (object->type) {
+        case FLT_SCENE_OBJECT_TYPE_RECTANGLE: {
+                struct flt_scene_rectangle *rectangle =
+                        (struct flt_scene_rectangle *) object;
+                ret = read_u32(reader, &rectangle->color, error);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SVG: {
+                struct flt_scene_svg *svg = (struct flt_scene_svg *) object;
+                ret = read_svg(loader,
+                               false, /* allow_none */
+                               &svg->handle,
+                               error);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_SCORE: {
+                struct flt_scene_score *score =
+                        (struct flt_scene_score *) object;
+                ret = (read_position(reader, &score->position, error) &&
+                       read_string(reader, &score->label, error) &&
+                       read_u32(reader, &score->color, error));
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_GPX: {
+                struct flt_scene_gpx *gpx = (struct flt_scene_gpx *) object;
+                flt_list_init(&gpx->objects);
+                ret = load_gpx(loader, gpx, error);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TIME: {
+                struct flt_scene_time *time = (struct flt_scene_time *) object;
+                ret = (read_position(reader, &time->position, error) &&
+                       read_u32(reader, &time->color, error));
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_CURVE: {
+                struct flt_scene_curve *curve =
+                        (struct flt_scene_curve *) object;
+                ret = read_u32(reader, &curve->color, error);
+                break;
+        }
+        case FLT_SCENE_OBJECT_TYPE_TEXT: {
+                struct flt_scene_text *text = (struct flt_scene_text *) object;
+
+                ret = (read_position(reader, &text->position, error) &&
+                       read_string(reader, &text->text, error) &&
+                       read_u32(reader, &text->color, error));
+
+                if (ret && text->text == NULL) {
+                        set_invalid_error(error,
+                                          "text object in compiled scene "
+                                          "has no text");
+                        ret = false;
+                }
+                break;
+        }
+        }
+
+        if (!ret)
+                return false;
+
+        return load_key_frames(loader, object, key_frame_size, error);
+}
+
+static bool
+load_header(struct reader *reader,
+            struct flt_error **error)
+{
+        if (!flt_scene_binary_detect(reader->data, reader->size)) {
+                set_invalid_error(error, "not a compiled scene");
+                return false;
+        }
+
+        reader->pos = FLT_SCENE_BINARY_MAGIC_SIZE;
+
+        uint32_t version, byte_order_mark;
+
+        if (!read_u32(reader, &version, error) ||
+            !read_u32(reader, &byte_order_mark, error))
+                return false;
+
+        if (version != FORMAT_VERSION) {
+                flt_set_error(error,
+                              &flt_scene_binary_error,
+                              FLT_SCENE_BINARY_ERROR_VERSION,
+                              "compiled scene has version %" PRIu32 " but "
+                              "only version %i is supported",
+                              version,
+                              FORMAT_VERSION);
+                return false;
+        }
+
+        if (byte_order_mark != BYTE_ORDER_MARK) {
+                flt_set_error(error,
+                              &flt_scene_binary_error,
+                              FLT_SCENE_BINARY_ERROR_VERSION,
+                              "compiled scene was made on a machine with a "
+                              "different byte order");
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+load_scene_properties(struct loader *loader,
+                      struct flt_error **error)
+{
+        struct reader *reader = &loader->reader;
+        struct flt_scene *scene = loader->scene;
+        int video_width, video_height;
+        char *map_url_base, *map_api_key;
+
+        if (!read_int(reader, &video_width, error) ||
+            !read_int(reader, &video_height, error))
+                return false;
+
+        if (video_width <= 0 || video_height <= 0) {
+                set_invalid_error(error,
+                                  "invalid video size in compiled scene");
+                return false;
+        }
+
+        scene->video_width = video_width;
+        scene->video_height = video_height;
+
+        if (!read_string(reader, &map_url_base, error))
+                return false;
+
+        if (map_url_base) {
+                flt_free(scene->map_url_base);
+                scene->map_url_base = map_url_base;
+        }
+
+        if (!read_string(reader, &map_api_key, error))
+                return false;
+
+        if (map_api_key) {
+                flt_free(scene->map_api_key);
+                scene->map_api_key = map_api_key;
+        }
+
+        return true;
+}
+
+static bool
+load_objects(struct loader *loader,
+             struct flt_error **error)
+{
+        size_t n_objects;
+
+        if (!read_count(&loader->reader,
+                        sizeof (uint32_t),
+                        &n_objects,
+                        error))
+                return false;
+
+        for (size_t i = 0; i < n_objects; i++) {
+                if (!load_object(loader, error))
+                        return false;
+        }
+
+        if (loader->reader.pos != loader->reader.size) {
+                set_invalid_error(error,
+                                  "unexpected data at the end of the "
+                                  "compiled scene");
+                return false;
+        }
+
+        return true;
+}
+
+bool
+flt_scene_binary_load(struct flt_scene *scene,
+                      const void *data,
+                      size_t size,
+                      struct flt_error **error)
+{
+        struct loader loader = {
+                .reader = {
+                        .data = data,
+                        .size = size,
+                        .pos = 0,
+                },
+                .scene = scene,
+        };
+
+        bool ret = (load_header(&loader.reader, error) &&
+                    load_scene_properties(&loader, error) &&
+                    load_gpx_files(&loader, error) &&
+                    load_traces(&loader, error) &&
+                    load_svgs(&loader, error) &&
+                    flt_scene_load_resources(scene,
+                                             NULL, /* failed_filename_out */
+                                             error) &&
+                    load_objects(&loader, error));
+
+        flt_free(loader.svgs);
+        flt_free(loader.traces);
+        flt_free(loader.gpx_files);
+
+        if (ret)
+                flt_scene_build_index(scene);
+
+        return ret;
+}
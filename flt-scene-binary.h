@@ -0,0 +1,70 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_SCENE_BINARY_H
+#define FLT_SCENE_BINARY_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flt-error.h"
+#include "flt-scene.h"
+
+/* A compiled scene is a versioned binary dump of the objects in a
+ * scene so that it can be loaded without running the lexer and
+ * parser. The files that the scene uses are stored by their absolute
+ * filename and are loaded again when the scene is loaded. Numbers
+ * are stored in the native byte order so a compiled scene can only
+ * be loaded on the same kind of machine that compiled it.
+ */
+
+extern struct flt_error_domain
+flt_scene_binary_error;
+
+enum flt_scene_binary_error {
+        FLT_SCENE_BINARY_ERROR_INVALID,
+        FLT_SCENE_BINARY_ERROR_VERSION,
+};
+
+#define FLT_SCENE_BINARY_MAGIC "FLTSCENE"
+#define FLT_SCENE_BINARY_MAGIC_SIZE (sizeof FLT_SCENE_BINARY_MAGIC - 1)
+
+/* Returns whether the data starts with the magic bytes of a compiled
+ * scene.
+ */
+bool
+flt_scene_binary_detect(const void *data,
+                        size_t size);
+
+bool
+flt_scene_binary_write(const struct flt_scene *scene,
+                       FILE *out,
+                       struct flt_error **error);
+
+/* Adds the objects from the compiled scene to the scene, in the same
+ * way as parsing another script. Nothing is kept pointing into the
+ * data so it can be unmapped afterwards.
+ */
+bool
+flt_scene_binary_load(struct flt_scene *scene,
+                      const void *data,
+                      size_t size,
+                      struct flt_error **error);
+
+#endif /* FLT_SCENE_BINARY_H */
@@ -18,17 +18,56 @@
 
 #include "flt-scene.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
 #include "flt-util.h"
+#include "flt-buffer.h"
+#include "flt-resource-cache.h"
 
-static void
-destroy_key_frames(struct flt_list *key_frames)
-{
-        struct flt_scene_key_frame *key_frame, *tmp;
+struct flt_error_domain
+flt_scene_error;
 
-        flt_list_for_each_safe(key_frame, tmp, key_frames, link) {
-                flt_free(key_frame);
-        }
-}
+/* The most threads to use to load the resource files. Loading is
+ * mostly limited by parsing so there isn’t much point having more
+ * threads than CPUs.
+ */
+#define MAX_LOADER_THREADS 8
+
+enum resource_job_type {
+        RESOURCE_JOB_GPX,
+        RESOURCE_JOB_TRACE,
+        RESOURCE_JOB_SVG,
+};
+
+struct resource_job {
+        enum resource_job_type type;
+
+        union {
+                void *resource;
+                struct flt_scene_gpx_file *gpx_file;
+                struct flt_scene_trace *trace;
+                struct flt_scene_svg_file *svg_file;
+        };
+
+        const char *filename;
+
+        /* Set by the thread that loads the file if it fails */
+        struct flt_error *error;
+};
+
+struct resource_loader {
+        struct flt_resource_cache *cache;
+
+        /* Protects next_job */
+        pthread_mutex_t mutex;
+        size_t next_job;
+
+        size_t n_jobs;
+        struct resource_job *jobs;
+};
 
 static void
 destroy_svg(struct flt_scene_svg *svg)
@@ -49,9 +88,9 @@ destroy_gpx_speed(struct flt_scene_gpx_speed *speed)
 static void
 destroy_gpx(struct flt_scene_gpx *gpx)
 {
-        struct flt_scene_gpx_object *object, *tmp;
+        struct flt_scene_gpx_object *object;
 
-        flt_list_for_each_safe(object, tmp, &gpx->objects, link) {
+        flt_list_for_each(object, &gpx->objects, link) {
                 switch (object->type) {
                 case FLT_SCENE_GPX_OBJECT_TYPE_SPEED:
                         destroy_gpx_speed((struct flt_scene_gpx_speed *)
@@ -62,8 +101,6 @@ destroy_gpx(struct flt_scene_gpx *gpx)
                 case FLT_SCENE_GPX_OBJECT_TYPE_MAP:
                         break;
                 }
-
-                flt_free(object);
         }
 }
 
@@ -82,7 +119,7 @@ destroy_text(struct flt_scene_text *text)
 static void
 destroy_object(struct flt_scene_object *object)
 {
-        destroy_key_frames(&object->key_frames);
+        flt_free(object->key_frame_array);
 
         switch (object->type) {
         case FLT_SCENE_OBJECT_TYPE_RECTANGLE:
@@ -102,40 +139,50 @@ destroy_object(struct flt_scene_object *object)
                 destroy_text((struct flt_scene_text *) object);
                 break;
         }
-
-        flt_free(object);
 }
 
 static void
 destroy_gpx_files(struct flt_scene *scene)
 {
-        struct flt_scene_gpx_file *file, *tmp;
+        struct flt_scene_gpx_file *file;
 
-        flt_list_for_each_safe(file, tmp, &scene->gpx_files, link) {
+        flt_list_for_each(file, &scene->gpx_files, link) {
                 flt_free(file->filename);
-                flt_free(file->points);
-                flt_free(file);
+                if (scene->resource_cache == NULL && file->points)
+                        flt_gpx_free_points(file->points);
         }
 }
 
 static void
 destroy_traces(struct flt_scene *scene)
 {
-        struct flt_scene_trace *trace, *tmp;
+        struct flt_scene_trace *trace;
 
-        flt_list_for_each_safe(trace, tmp, &scene->traces, link) {
+        flt_list_for_each(trace, &scene->traces, link) {
                 flt_free(trace->filename);
-                flt_trace_free(trace->trace);
-                flt_free(trace);
+                if (scene->resource_cache == NULL && trace->trace)
+                        flt_trace_free(trace->trace);
+        }
+}
+
+static void
+destroy_svg_files(struct flt_scene *scene)
+{
+        struct flt_scene_svg_file *file;
+
+        flt_list_for_each(file, &scene->svg_files, link) {
+                flt_free(file->filename);
+                if (file->handle)
+                        g_object_unref(file->handle);
         }
 }
 
 static void
 destroy_objects(struct flt_scene *scene)
 {
-        struct flt_scene_object *object, *tmp;
+        struct flt_scene_object *object;
 
-        flt_list_for_each_safe(object, tmp, &scene->objects, link) {
+        flt_list_for_each(object, &scene->objects, link) {
                 destroy_object(object);
         }
 }
@@ -151,10 +198,134 @@ flt_scene_new(void)
         flt_list_init(&scene->objects);
         flt_list_init(&scene->gpx_files);
         flt_list_init(&scene->traces);
+        flt_list_init(&scene->svg_files);
+
+        flt_arena_init(&scene->arena);
 
         return scene;
 }
 
+static double
+get_start_time(const struct flt_scene_object *object)
+{
+        return object->key_frame_array[0]->timestamp;
+}
+
+static double
+get_end_time(const struct flt_scene_object *object)
+{
+        return object->key_frame_array[object->n_key_frames - 1]->timestamp;
+}
+
+static int
+compare_times(double a_time, const struct flt_scene_object *a,
+              double b_time, const struct flt_scene_object *b)
+{
+        if (a_time < b_time)
+                return -1;
+        if (a_time > b_time)
+                return 1;
+
+        /* Keep the sort stable */
+        if (a->index < b->index)
+                return -1;
+        if (a->index > b->index)
+                return 1;
+
+        return 0;
+}
+
+static int
+compare_start_cb(const void *pa, const void *pb)
+{
+        const struct flt_scene_object *a =
+                *(const struct flt_scene_object * const *) pa;
+        const struct flt_scene_object *b =
+                *(const struct flt_scene_object * const *) pb;
+
+        return compare_times(get_start_time(a), a, get_start_time(b), b);
+}
+
+static int
+compare_end_cb(const void *pa, const void *pb)
+{
+        const struct flt_scene_object *a =
+                *(const struct flt_scene_object * const *) pa;
+        const struct flt_scene_object *b =
+                *(const struct flt_scene_object * const *) pb;
+
+        return compare_times(get_end_time(a), a, get_end_time(b), b);
+}
+
+static void
+build_timeline(struct flt_scene *scene)
+{
+        struct flt_scene_object *object;
+
+        flt_free(scene->objects_by_start);
+        flt_free(scene->objects_by_end);
+
+        size_t n_objects = 0;
+
+        scene->objects_by_start =
+                flt_alloc(scene->n_objects * sizeof *scene->objects_by_start);
+
+        flt_list_for_each(object, &scene->objects, link) {
+                /* Objects with a single key frame are never drawn */
+                if (object->n_key_frames >= 2)
+                        scene->objects_by_start[n_objects++] = object;
+        }
+
+        scene->n_timed_objects = n_objects;
+
+        scene->objects_by_end =
+                flt_memdup(scene->objects_by_start,
+                           n_objects * sizeof *scene->objects_by_end);
+
+        qsort(scene->objects_by_start,
+              n_objects,
+              sizeof *scene->objects_by_start,
+              compare_start_cb);
+        qsort(scene->objects_by_end,
+              n_objects,
+              sizeof *scene->objects_by_end,
+              compare_end_cb);
+}
+
+void
+flt_scene_build_index(struct flt_scene *scene)
+{
+        struct flt_scene_object *object;
+        size_t object_num = 0;
+
+        flt_list_for_each(object, &scene->objects, link) {
+                object->index = object_num++;
+
+                /* Key frames can only be added to new objects so
+                 * objects from a previous parse are already indexed.
+                 */
+                if (object->key_frame_array)
+                        continue;
+
+                object->n_key_frames = flt_list_length(&object->key_frames);
+                object->key_frame_array =
+                        flt_alloc(object->n_key_frames *
+                                  sizeof *object->key_frame_array);
+
+                struct flt_scene_key_frame *key_frame;
+                size_t key_frame_num = 0;
+
+                flt_list_for_each(key_frame, &object->key_frames, link) {
+                        object->key_frame_array[key_frame_num++] =
+                                key_frame;
+                }
+        }
+
+        scene->n_objects = object_num;
+
+        build_timeline(scene);
+}
+
 double
 flt_scene_get_max_timestamp(const struct flt_scene *scene)
 {
@@ -175,15 +346,352 @@ flt_scene_get_max_timestamp(const struct flt_scene *scene)
         return max_timestamp;
 }
 
+struct flt_scene_gpx_file *
+flt_scene_add_gpx_file(struct flt_scene *scene,
+                       const char *filename)
+{
+        struct flt_scene_gpx_file *gpx_file;
+
+        flt_list_for_each(gpx_file, &scene->gpx_files, link) {
+                if (!strcmp(gpx_file->filename, filename))
+                        return gpx_file;
+        }
+
+        gpx_file = flt_arena_calloc(&scene->arena, sizeof *gpx_file);
+        gpx_file->filename = flt_strdup(filename);
+        flt_list_insert(scene->gpx_files.prev, &gpx_file->link);
+
+        return gpx_file;
+}
+
+struct flt_scene_trace *
+flt_scene_add_trace(struct flt_scene *scene,
+                    const char *filename)
+{
+        struct flt_scene_trace *trace;
+
+        flt_list_for_each(trace, &scene->traces, link) {
+                if (!strcmp(trace->filename, filename))
+                        return trace;
+        }
+
+        trace = flt_arena_calloc(&scene->arena, sizeof *trace);
+        trace->filename = flt_strdup(filename);
+        flt_list_insert(scene->traces.prev, &trace->link);
+
+        return trace;
+}
+
+struct flt_scene_svg_file *
+flt_scene_add_svg_file(struct flt_scene *scene,
+                       const char *filename)
+{
+        struct flt_scene_svg_file *svg_file;
+
+        flt_list_for_each(svg_file, &scene->svg_files, link) {
+                if (!strcmp(svg_file->filename, filename))
+                        return svg_file;
+        }
+
+        svg_file = flt_arena_calloc(&scene->arena, sizeof *svg_file);
+        svg_file->filename = flt_strdup(filename);
+        flt_list_insert(scene->svg_files.prev, &svg_file->link);
+
+        return svg_file;
+}
+
+static void
+load_gpx_job(struct flt_resource_cache *cache,
+             struct resource_job *job)
+{
+        struct flt_scene_gpx_file *gpx_file = job->gpx_file;
+        const struct flt_gpx_point *points;
+        size_t n_points;
+        bool ret;
+
+        if (cache) {
+                ret = flt_resource_cache_get_gpx(cache,
+                                                 gpx_file->filename,
+                                                 &points,
+                                                 &n_points,
+                                                 &job->error);
+        } else {
+                ret = flt_gpx_parse(gpx_file->filename,
+                                    &points,
+                                    &n_points,
+                                    &job->error);
+        }
+
+        if (ret) {
+                gpx_file->points = points;
+                gpx_file->n_points = n_points;
+        }
+}
+
+static void
+load_trace_job(struct flt_resource_cache *cache,
+               struct resource_job *job)
+{
+        struct flt_scene_trace *trace = job->trace;
+
+        if (cache) {
+                trace->trace = flt_resource_cache_get_trace(cache,
+                                                            trace->filename,
+                                                            &job->error);
+        } else {
+                trace->trace = flt_trace_parse(trace->filename, &job->error);
+        }
+}
+
+static void
+load_svg_job(struct flt_resource_cache *cache,
+             struct resource_job *job)
+{
+        struct flt_scene_svg_file *svg_file = job->svg_file;
+        GError *svg_error = NULL;
+
+        if (cache) {
+                svg_file->handle = flt_resource_cache_get_svg(cache,
+                                                              svg_file->
+                                                              filename,
+                                                              &svg_error);
+        } else {
+                svg_file->handle = rsvg_handle_new_from_file(svg_file->
+                                                             filename,
+                                                             &svg_error);
+        }
+
+        if (svg_file->handle == NULL) {
+                flt_set_error(&job->error,
+                              &flt_scene_error,
+                              FLT_SCENE_ERROR_SVG,
+                              "%s: %s",
+                              svg_file->filename,
+                              svg_error->message);
+                g_error_free(svg_error);
+        }
+}
+
+static void *
+resource_thread_cb(void *user_data)
+{
+        struct resource_loader *loader = user_data;
+
+        while (true) {
+                pthread_mutex_lock(&loader->mutex);
+                size_t job_num = loader->next_job++;
+                pthread_mutex_unlock(&loader->mutex);
+
+                if (job_num >= loader->n_jobs)
+                        break;
+
+                struct resource_job *job = loader->jobs + job_num;
+
+                switch (job->type) {
+                case RESOURCE_JOB_GPX:
+                        load_gpx_job(loader->cache, job);
+                        break;
+                case RESOURCE_JOB_TRACE:
+                        load_trace_job(loader->cache, job);
+                        break;
+                case RESOURCE_JOB_SVG:
+                        load_svg_job(loader->cache, job);
+                        break;
+                }
+        }
+
+        return NULL;
+}
+
+static void
+add_job(struct flt_buffer *jobs,
+        enum resource_job_type type,
+        void *resource,
+        const char *filename)
+{
+        struct resource_job job = {
+                .type = type,
+                .resource = resource,
+                .filename = filename,
+                .error = NULL,
+        };
+
+        flt_buffer_append(jobs, &job, sizeof job);
+}
+
+static void
+get_jobs(struct flt_scene *scene,
+         struct flt_buffer *jobs)
+{
+        struct flt_scene_gpx_file *gpx_file;
+        struct flt_scene_trace *trace;
+        struct flt_scene_svg_file *svg_file;
+
+        flt_list_for_each(gpx_file, &scene->gpx_files, link) {
+                if (gpx_file->points == NULL) {
+                        add_job(jobs,
+                                RESOURCE_JOB_GPX,
+                                gpx_file,
+                                gpx_file->filename);
+                }
+        }
+
+        flt_list_for_each(trace, &scene->traces, link) {
+                if (trace->trace == NULL) {
+                        add_job(jobs,
+                                RESOURCE_JOB_TRACE,
+                                trace,
+                                trace->filename);
+                }
+        }
+
+        flt_list_for_each(svg_file, &scene->svg_files, link) {
+                if (svg_file->handle == NULL) {
+                        add_job(jobs,
+                                RESOURCE_JOB_SVG,
+                                svg_file,
+                                svg_file->filename);
+                }
+        }
+}
+
+static int
+get_n_threads(size_t n_jobs)
+{
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int n_threads = MAX_LOADER_THREADS;
+
+        if (n_cpus > 0 && n_cpus < n_threads)
+                n_threads = n_cpus;
+        if (n_jobs < n_threads)
+                n_threads = n_jobs;
+
+        return n_threads;
+}
+
+bool
+flt_scene_load_resources(struct flt_scene *scene,
+                         const char **failed_filename_out,
+                         struct flt_error **error)
+{
+        struct flt_buffer jobs = FLT_BUFFER_STATIC_INIT;
+
+        get_jobs(scene, &jobs);
+
+        struct resource_loader loader = {
+                .cache = scene->resource_cache,
+                .next_job = 0,
+                .n_jobs = jobs.length / sizeof (struct resource_job),
+                .jobs = (struct resource_job *) jobs.data,
+        };
+
+        pthread_mutex_init(&loader.mutex, NULL);
+
+        /* The calling thread also loads files so it only needs to
+         * start the extra threads.
+         */
+        int n_threads = get_n_threads(loader.n_jobs);
+        pthread_t *threads = flt_alloc(MAX(n_threads, 1) * sizeof *threads);
+        int n_started = 0;
+
+        for (int i = 1; i < n_threads; i++) {
+                if (pthread_create(threads + n_started,
+                                   NULL, /* attr */
+                                   resource_thread_cb,
+                                   &loader) == 0)
+                        n_started++;
+        }
+
+        resource_thread_cb(&loader);
+
+        for (int i = 0; i < n_started; i++)
+                pthread_join(threads[i], NULL);
+
+        flt_free(threads);
+        pthread_mutex_destroy(&loader.mutex);
+
+        bool ret = true;
+
+        for (size_t i = 0; i < loader.n_jobs; i++) {
+                struct resource_job *job = loader.jobs + i;
+
+                if (job->error == NULL)
+                        continue;
+
+                if (ret) {
+                        if (failed_filename_out)
+                                *failed_filename_out = job->filename;
+                        flt_error_propagate(error, job->error);
+                        ret = false;
+                } else {
+                        flt_error_free(job->error);
+                }
+        }
+
+        flt_buffer_destroy(&jobs);
+
+        return ret;
+}
+
+size_t
+flt_scene_get_active_intervals(const struct flt_scene *scene,
+                               struct flt_scene_interval **intervals_out)
+{
+        size_t n_objects = scene->n_timed_objects;
+
+        if (n_objects == 0) {
+                *intervals_out = NULL;
+                return 0;
+        }
+
+        struct flt_scene_interval *intervals =
+                flt_alloc(n_objects * sizeof *intervals);
+        size_t n_intervals = 0;
+
+        /* The objects are already sorted by start time so
+         * overlapping and touching intervals can be merged in one
+         * pass.
+         */
+        for (size_t i = 0; i < n_objects; i++) {
+                const struct flt_scene_object *object =
+                        scene->objects_by_start[i];
+                double start = get_start_time(object);
+                double end = get_end_time(object);
+
+                if (n_intervals > 0 &&
+                    start <= intervals[n_intervals - 1].end) {
+                        struct flt_scene_interval *last =
+                                intervals + n_intervals - 1;
+
+                        if (end > last->end)
+                                last->end = end;
+                } else {
+                        intervals[n_intervals].start = start;
+                        intervals[n_intervals].end = end;
+                        n_intervals++;
+                }
+        }
+
+        *intervals_out = intervals;
+
+        return n_intervals;
+}
+
 void
 flt_scene_free(struct flt_scene *scene)
 {
         destroy_gpx_files(scene);
         destroy_traces(scene);
+        destroy_svg_files(scene);
         destroy_objects(scene);
 
+        flt_free(scene->objects_by_start);
+        flt_free(scene->objects_by_end);
+
         flt_free(scene->map_url_base);
         flt_free(scene->map_api_key);
 
+        flt_arena_destroy(&scene->arena);
+
         flt_free(scene);
 }
@@ -16,14 +16,25 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_SCENE
-#define FLT_SCENE
+#ifndef FLT_SCENE_H
+#define FLT_SCENE_H
 
 #include <librsvg/rsvg.h>
 
 #include "flt-list.h"
+#include "flt-arena.h"
 #include "flt-gpx.h"
 #include "flt-trace.h"
+#include "flt-error.h"
+
+struct flt_resource_cache;
+
+extern struct flt_error_domain
+flt_scene_error;
+
+enum flt_scene_error {
+        FLT_SCENE_ERROR_SVG,
+};
 
 enum flt_scene_vertical_position {
         FLT_SCENE_VERTICAL_POSITION_TOP = 0,
@@ -74,11 +85,15 @@ enum flt_scene_object_type {
         FLT_SCENE_OBJECT_TYPE_TEXT,
 };
 
+/* For the resource files, the data is NULL until the file is loaded
+ * by flt_scene_load_resources.
+ */
+
 struct flt_scene_gpx_file {
         struct flt_list link;
         char *filename;
         size_t n_points;
-        struct flt_gpx_point *points;
+        const struct flt_gpx_point *points;
 };
 
 struct flt_scene_trace {
@@ -87,12 +102,29 @@ struct flt_scene_trace {
         struct flt_trace *trace;
 };
 
+/* Remembers where each SVG handle was loaded from so that the scene
+ * can be serialised and so that a file used twice is only loaded once.
+ */
+struct flt_scene_svg_file {
+        struct flt_list link;
+        char *filename;
+        RsvgHandle *handle;
+};
+
 struct flt_scene_object {
         struct flt_list link;
 
         enum flt_scene_object_type type;
 
         struct flt_list key_frames;
+
+        /* Position of the object in the scene’s list of objects and
+         * an array of pointers to the key frames in time order.
+         * These are filled in by flt_scene_build_index.
+         */
+        size_t index;
+        size_t n_key_frames;
+        struct flt_scene_key_frame **key_frame_array;
 };
 
 struct flt_scene_key_frame {
@@ -184,6 +216,11 @@ struct flt_scene_gpx_map {
         struct flt_scene_gpx_object base;
         const struct flt_scene_trace *trace;
         uint32_t trace_color;
+        /* Resolution of the map relative to the video. If this is
+         * less than 1 the map is drawn into a smaller surface which
+         * is then scaled up onto the frame.
+         */
+        double scale;
 };
 
 struct flt_scene_gpx {
@@ -228,20 +265,89 @@ struct flt_scene {
         int video_width, video_height;
 
         struct flt_list objects;
+        /* Number of objects that have been indexed */
+        size_t n_objects;
+        /* The objects that have at least two key frames, sorted by
+         * the time of their first key frame and by the time of their
+         * last key frame. These are the times that the objects start
+         * and stop being drawn.
+         */
+        size_t n_timed_objects;
+        struct flt_scene_object **objects_by_start;
+        struct flt_scene_object **objects_by_end;
         struct flt_list gpx_files;
         struct flt_list traces;
+        struct flt_list svg_files;
 
         char *map_url_base;
         char *map_api_key;
+
+        /* If this is set then the GPX points and traces are owned by
+         * the cache instead of the scene.
+         */
+        struct flt_resource_cache *resource_cache;
+
+        /* The objects, key frames and resource files are
+         * allocated from this.
+         */
+        struct flt_arena arena;
+};
+
+/* A half-open interval of time [start, end) */
+struct flt_scene_interval {
+        double start, end;
 };
 
 struct flt_scene *
 flt_scene_new(void);
 
+/* Gets a sorted list of non-overlapping intervals covering all of the
+ * times where at least one object in the scene is between its first
+ * and last key frame. Nothing will be drawn outside of these
+ * intervals. The returned array should be freed with flt_free.
+ */
+size_t
+flt_scene_get_active_intervals(const struct flt_scene *scene,
+                               struct flt_scene_interval **intervals_out);
+
+/* Builds the lookup structures for all of the objects. This is
+ * called by the parser after each successful parse.
+ */
+void
+flt_scene_build_index(struct flt_scene *scene);
+
 double
 flt_scene_get_max_timestamp(const struct flt_scene *scene);
 
+/* These add a resource file to the scene without loading it. The
+ * filename should already be relative to the working directory. If
+ * the scene already has the file then the same entry is returned.
+ */
+struct flt_scene_gpx_file *
+flt_scene_add_gpx_file(struct flt_scene *scene,
+                       const char *filename);
+
+struct flt_scene_trace *
+flt_scene_add_trace(struct flt_scene *scene,
+                    const char *filename);
+
+struct flt_scene_svg_file *
+flt_scene_add_svg_file(struct flt_scene *scene,
+                       const char *filename);
+
+/* Loads all of the resource files that have been added but not loaded
+ * yet. The files are loaded in parallel on a few threads. If a
+ * resource cache is set the files are taken from it. If any file
+ * fails to load then false is returned with the error for the first
+ * one and its filename is stored in failed_filename_out if that
+ * isn’t NULL.
+ */
+bool
+flt_scene_load_resources(struct flt_scene *scene,
+                         const char **failed_filename_out,
+                         struct flt_error **error);
+
 void
 flt_scene_free(struct flt_scene *scene);
 
-#endif /* FLT_SCENE */
+#endif /* FLT_SCENE_H */
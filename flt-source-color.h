@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_SOURCE_COLOR
-#define FLT_SOURCE_COLOR
+#ifndef FLT_SOURCE_COLOR_H
+#define FLT_SOURCE_COLOR_H
 
 #include <cairo.h>
 #include <stdint.h>
@@ -25,4 +25,4 @@
 void
 flt_source_color_set(cairo_t *cr, uint32_t color, double alpha);
 
-#endif /* FLT_SOURCE_COLOR */
+#endif /* FLT_SOURCE_COLOR_H */
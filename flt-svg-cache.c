@@ -0,0 +1,235 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-svg-cache.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#include "flt-util.h"
+#include "flt-list.h"
+#include "flt-profile.h"
+#include "flt-renderer.h"
+
+struct flt_svg_cache {
+        /* Protects everything in the cache */
+        pthread_mutex_t mutex;
+        struct flt_list images;
+        size_t total_size;
+        size_t max_size;
+};
+
+struct cached_image {
+        struct flt_list link;
+
+        /* A reference is held on the handle so that its address
+         * can’t be reused by a different image while it is cached.
+         */
+        RsvgHandle *handle;
+        int width, height;
+        size_t size;
+
+        cairo_surface_t *surface;
+};
+
+struct flt_svg_cache *
+flt_svg_cache_new(size_t max_size)
+{
+        struct flt_svg_cache *cache = flt_calloc(sizeof *cache);
+
+        pthread_mutex_init(&cache->mutex, NULL);
+        flt_list_init(&cache->images);
+        cache->max_size = max_size;
+
+        return cache;
+}
+
+static void
+delete_cached_image(struct flt_svg_cache *cache,
+                    struct cached_image *image)
+{
+        cache->total_size -= image->size;
+        cairo_surface_destroy(image->surface);
+        g_object_unref(image->handle);
+        flt_list_remove(&image->link);
+        flt_free(image);
+}
+
+static struct cached_image *
+get_cached_image(struct flt_svg_cache *cache,
+                 RsvgHandle *handle,
+                 int width, int height)
+{
+        struct cached_image *image;
+
+        flt_list_for_each(image, &cache->images, link) {
+                if (image->handle == handle &&
+                    image->width == width &&
+                    image->height == height) {
+                        /* Move the image to the end of the list to
+                         * mark it as recently used.
+                         */
+                        flt_list_remove(&image->link);
+                        flt_list_insert(cache->images.prev, &image->link);
+                        return image;
+                }
+        }
+
+        return NULL;
+}
+
+static cairo_surface_t *
+rasterize(RsvgHandle *handle,
+          int width, int height,
+          struct flt_error **error_out)
+{
+        cairo_surface_t *surface =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                           width, height);
+        cairo_t *cr = cairo_create(surface);
+        RsvgRectangle viewport = {
+                .x = 0.0, .y = 0.0,
+                .width = width, .height = height,
+        };
+        GError *error = NULL;
+
+        FLT_PROFILE_BEGIN(start);
+
+        bool ret = rsvg_handle_render_document(handle, cr, &viewport, &error);
+
+        FLT_PROFILE_END(start, FLT_PROFILE_SVG_RASTERIZE);
+
+        cairo_destroy(cr);
+
+        if (!ret) {
+                flt_set_error(error_out,
+                              &flt_renderer_error,
+                              FLT_RENDERER_ERROR_SVG,
+                              "%s",
+                              error->message);
+                g_error_free(error);
+                cairo_surface_destroy(surface);
+                return NULL;
+        }
+
+        cairo_surface_flush(surface);
+
+        return surface;
+}
+
+static struct cached_image *
+add_image(struct flt_svg_cache *cache,
+          RsvgHandle *handle,
+          int width, int height,
+          struct flt_error **error)
+{
+        cairo_surface_t *surface = rasterize(handle, width, height, error);
+
+        if (surface == NULL)
+                return NULL;
+
+        struct cached_image *image = flt_alloc(sizeof *image);
+
+        image->handle = g_object_ref(handle);
+        image->width = width;
+        image->height = height;
+        image->size = (size_t) cairo_image_surface_get_stride(surface) * height;
+        image->surface = surface;
+
+        /* Make space by discarding the least recently used images.
+         * The new image is always kept even if it is bigger than the
+         * limit on its own.
+         */
+        while (!flt_list_empty(&cache->images) &&
+               cache->total_size + image->size > cache->max_size) {
+                struct cached_image *oldest =
+                        flt_container_of(cache->images.next,
+                                         struct cached_image,
+                                         link);
+
+                delete_cached_image(cache, oldest);
+        }
+
+        flt_list_insert(cache->images.prev, &image->link);
+        cache->total_size += image->size;
+
+        return image;
+}
+
+bool
+flt_svg_cache_render(struct flt_svg_cache *cache,
+                     RsvgHandle *handle,
+                     cairo_t *cr,
+                     const RsvgRectangle *viewport,
+                     struct flt_error **error)
+{
+        int width = lround(viewport->width);
+        int height = lround(viewport->height);
+
+        if (width <= 0 || height <= 0)
+                return true;
+
+        pthread_mutex_lock(&cache->mutex);
+
+        struct cached_image *image = get_cached_image(cache,
+                                                      handle,
+                                                      width, height);
+
+        if (image == NULL)
+                image = add_image(cache, handle, width, height, error);
+
+        /* Keep a reference on the surface so that another thread can
+         * evict the image while this one is painting it.
+         */
+        cairo_surface_t *surface =
+                image ? cairo_surface_reference(image->surface) : NULL;
+
+        pthread_mutex_unlock(&cache->mutex);
+
+        if (surface == NULL)
+                return false;
+
+        cairo_save(cr);
+
+        cairo_translate(cr, viewport->x, viewport->y);
+        cairo_scale(cr,
+                    viewport->width / width,
+                    viewport->height / height);
+        cairo_set_source_surface(cr, surface, 0.0, 0.0);
+        cairo_paint(cr);
+
+        cairo_restore(cr);
+
+        cairo_surface_destroy(surface);
+
+        return true;
+}
+
+void
+flt_svg_cache_free(struct flt_svg_cache *cache)
+{
+        struct cached_image *image, *tmp;
+
+        flt_list_for_each_safe(image, tmp, &cache->images, link) {
+                delete_cached_image(cache, image);
+        }
+
+        pthread_mutex_destroy(&cache->mutex);
+
+        flt_free(cache);
+}
@@ -0,0 +1,60 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_SVG_CACHE_H
+#define FLT_SVG_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <cairo.h>
+#include <librsvg/rsvg.h>
+
+#include "flt-error.h"
+
+/* A cache of SVG documents rasterised at integer sizes so that they
+ * can be drawn with a single blit instead of running librsvg every
+ * frame. The least recently used images are discarded when the total
+ * size of the images goes over max_size bytes. The cache can be shared
+ * between renderers on different threads. The images are rasterised
+ * with the cache locked because an RsvgHandle can only be used by one
+ * thread at a time.
+ */
+struct flt_svg_cache;
+
+#define FLT_SVG_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+struct flt_svg_cache *
+flt_svg_cache_new(size_t max_size);
+
+/* Draws the document into the viewport with the current
+ * transformation of cr. The image is rasterised at the viewport size
+ * rounded to the nearest pixel and then scaled to fit. If librsvg
+ * fails, the error is FLT_RENDERER_ERROR_SVG in flt_renderer_error,
+ * the same as when the renderer drew SVGs directly.
+ */
+bool
+flt_svg_cache_render(struct flt_svg_cache *cache,
+                     RsvgHandle *handle,
+                     cairo_t *cr,
+                     const RsvgRectangle *viewport,
+                     struct flt_error **error);
+
+void
+flt_svg_cache_free(struct flt_svg_cache *cache);
+
+#endif /* FLT_SVG_CACHE_H */
@@ -0,0 +1,357 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-text-cache.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "flt-util.h"
+#include "flt-list.h"
+#include "flt-source-color.h"
+
+/* The position of the text is rounded to this fraction of a pixel */
+#define SUBPIXEL_STEPS 4
+
+/* Must be a power of two */
+#define N_BUCKETS 256
+
+struct flt_text_cache {
+        /* List of runs in order of when they were last used */
+        struct flt_list runs;
+        struct flt_list buckets[N_BUCKETS];
+
+        size_t total_size;
+        size_t max_size;
+
+        /* Used to measure the text before creating an image for it */
+        cairo_surface_t *measure_surface;
+        cairo_t *measure_cr;
+};
+
+struct cached_run {
+        struct flt_list link;
+        struct flt_list bucket_link;
+
+        uint32_t hash;
+        struct flt_text_cache_params params;
+        int phase_x, phase_y;
+        char *text;
+
+        /* Position of the image relative to the pixel containing the
+         * start of the text.
+         */
+        int x, y;
+        int width, height;
+        double advance_x, advance_y;
+        size_t size;
+
+        /* NULL if the text doesn’t draw anything */
+        cairo_surface_t *surface;
+};
+
+struct flt_text_cache *
+flt_text_cache_new(size_t max_size)
+{
+        struct flt_text_cache *cache = flt_calloc(sizeof *cache);
+
+        flt_list_init(&cache->runs);
+
+        for (int i = 0; i < N_BUCKETS; i++)
+                flt_list_init(cache->buckets + i);
+
+        cache->max_size = max_size;
+
+        cache->measure_surface =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+        cache->measure_cr = cairo_create(cache->measure_surface);
+
+        return cache;
+}
+
+static uint32_t
+hash_bytes(uint32_t hash, const void *data, size_t length)
+{
+        const uint8_t *p = data;
+
+        /* FNV-1a */
+        for (size_t i = 0; i < length; i++) {
+                hash ^= p[i];
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+static uint32_t
+hash_run(const struct flt_text_cache_params *params,
+         int phase_x, int phase_y,
+         const char *text)
+{
+        uint32_t hash = 2166136261u;
+
+        hash = hash_bytes(hash, &params->face, sizeof params->face);
+        hash = hash_bytes(hash, &params->size, sizeof params->size);
+        hash = hash_bytes(hash,
+                          &params->line_width,
+                          sizeof params->line_width);
+        hash = hash_bytes(hash, &params->color, sizeof params->color);
+        hash = hash_bytes(hash, &phase_x, sizeof phase_x);
+        hash = hash_bytes(hash, &phase_y, sizeof phase_y);
+        hash = hash_bytes(hash, text, strlen(text));
+
+        return hash;
+}
+
+static void
+delete_cached_run(struct flt_text_cache *cache,
+                  struct cached_run *run)
+{
+        cache->total_size -= run->size;
+        if (run->surface)
+                cairo_surface_destroy(run->surface);
+        flt_list_remove(&run->link);
+        flt_list_remove(&run->bucket_link);
+        flt_free(run->text);
+        flt_free(run);
+}
+
+static struct cached_run *
+get_cached_run(struct flt_text_cache *cache,
+               uint32_t hash,
+               const struct flt_text_cache_params *params,
+               int phase_x, int phase_y,
+               const char *text)
+{
+        struct flt_list *bucket = cache->buckets + (hash & (N_BUCKETS - 1));
+        struct cached_run *run;
+
+        flt_list_for_each(run, bucket, bucket_link) {
+                if (run->hash == hash &&
+                    run->params.face == params->face &&
+                    run->params.size == params->size &&
+                    run->params.line_width == params->line_width &&
+                    run->params.color == params->color &&
+                    run->phase_x == phase_x &&
+                    run->phase_y == phase_y &&
+                    !strcmp(run->text, text)) {
+                        /* Move the run to the end of the list to mark
+                         * it as recently used.
+                         */
+                        flt_list_remove(&run->link);
+                        flt_list_insert(cache->runs.prev, &run->link);
+                        return run;
+                }
+        }
+
+        return NULL;
+}
+
+static void
+add_text_path(cairo_t *cr,
+              const struct flt_text_cache_params *params,
+              double x, double y,
+              const char *text)
+{
+        cairo_set_font_face(cr, params->face);
+        cairo_set_font_size(cr, params->size);
+        cairo_set_line_width(cr, params->line_width);
+        cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+        cairo_new_path(cr);
+        cairo_move_to(cr, x, y);
+        cairo_text_path(cr, text);
+}
+
+static void
+rasterize(struct flt_text_cache *cache,
+          struct cached_run *run)
+{
+        cairo_t *measure_cr = cache->measure_cr;
+        double start_x = run->phase_x / (double) SUBPIXEL_STEPS;
+        double start_y = run->phase_y / (double) SUBPIXEL_STEPS;
+        double end_x, end_y;
+        double x1, y1, x2, y2;
+
+        add_text_path(measure_cr, &run->params, start_x, start_y, run->text);
+        cairo_get_current_point(measure_cr, &end_x, &end_y);
+        cairo_stroke_extents(measure_cr, &x1, &y1, &x2, &y2);
+        cairo_new_path(measure_cr);
+
+        run->advance_x = end_x - start_x;
+        run->advance_y = end_y - start_y;
+
+        if (x2 <= x1 || y2 <= y1) {
+                run->surface = NULL;
+                run->x = run->y = run->width = run->height = 0;
+                run->size = 0;
+                return;
+        }
+
+        run->x = floor(x1);
+        run->y = floor(y1);
+        run->width = (int) ceil(x2) - run->x;
+        run->height = (int) ceil(y2) - run->y;
+
+        run->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                  run->width,
+                                                  run->height);
+        run->size = ((size_t) cairo_image_surface_get_stride(run->surface) *
+                     run->height);
+
+        cairo_t *cr = cairo_create(run->surface);
+
+        cairo_translate(cr, -run->x, -run->y);
+        add_text_path(cr, &run->params, start_x, start_y, run->text);
+        cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+        cairo_stroke_preserve(cr);
+        flt_source_color_set(cr, run->params.color, 1.0);
+        cairo_fill(cr);
+
+        cairo_destroy(cr);
+
+        cairo_surface_flush(run->surface);
+}
+
+static struct cached_run *
+add_run(struct flt_text_cache *cache,
+        uint32_t hash,
+        const struct flt_text_cache_params *params,
+        int phase_x, int phase_y,
+        const char *text)
+{
+        struct cached_run *run = flt_alloc(sizeof *run);
+
+        run->hash = hash;
+        run->params = *params;
+        run->phase_x = phase_x;
+        run->phase_y = phase_y;
+        run->text = flt_strdup(text);
+
+        rasterize(cache, run);
+
+        /* Make space by discarding the least recently used runs. The
+         * new run is always kept even if it is bigger than the limit
+         * on its own.
+         */
+        while (!flt_list_empty(&cache->runs) &&
+               cache->total_size + run->size > cache->max_size) {
+                struct cached_run *oldest =
+                        flt_container_of(cache->runs.next,
+                                         struct cached_run,
+                                         link);
+
+                delete_cached_run(cache, oldest);
+        }
+
+        flt_list_insert(cache->runs.prev, &run->link);
+        flt_list_insert(cache->buckets + (hash & (N_BUCKETS - 1)),
+                        &run->bucket_link);
+        cache->total_size += run->size;
+
+        return run;
+}
+
+static void
+split_position(double pos, double *pixel_out, int *phase_out)
+{
+        double pixel = floor(pos);
+        int phase = lround((pos - pixel) * SUBPIXEL_STEPS);
+
+        if (phase >= SUBPIXEL_STEPS) {
+                phase -= SUBPIXEL_STEPS;
+                pixel += 1.0;
+        }
+
+        *pixel_out = pixel;
+        *phase_out = phase;
+}
+
+bool
+flt_text_cache_render(struct flt_text_cache *cache,
+                      cairo_t *cr,
+                      const struct flt_text_cache_params *params,
+                      const char *text,
+                      cairo_rectangle_t *extents_out)
+{
+        cairo_matrix_t matrix;
+
+        cairo_get_matrix(cr, &matrix);
+
+        if (matrix.xx != 1.0 || matrix.yy != 1.0 ||
+            matrix.xy != 0.0 || matrix.yx != 0.0 ||
+            !cairo_has_current_point(cr))
+                return false;
+
+        double user_x, user_y;
+
+        cairo_get_current_point(cr, &user_x, &user_y);
+
+        double pixel_x, pixel_y;
+        int phase_x, phase_y;
+
+        split_position(user_x + matrix.x0, &pixel_x, &phase_x);
+        split_position(user_y + matrix.y0, &pixel_y, &phase_y);
+
+        uint32_t hash = hash_run(params, phase_x, phase_y, text);
+        struct cached_run *run = get_cached_run(cache,
+                                                hash,
+                                                params,
+                                                phase_x, phase_y,
+                                                text);
+
+        if (run == NULL)
+                run = add_run(cache, hash, params, phase_x, phase_y, text);
+
+        /* Position of the image in user space. This is always on a
+         * pixel boundary in device space.
+         */
+        double x = pixel_x + run->x - matrix.x0;
+        double y = pixel_y + run->y - matrix.y0;
+
+        if (run->surface) {
+                cairo_save(cr);
+                cairo_set_source_surface(cr, run->surface, x, y);
+                cairo_rectangle(cr, x, y, run->width, run->height);
+                cairo_fill(cr);
+                cairo_restore(cr);
+        }
+
+        extents_out->x = x;
+        extents_out->y = y;
+        extents_out->width = run->width;
+        extents_out->height = run->height;
+
+        cairo_move_to(cr, user_x + run->advance_x, user_y + run->advance_y);
+
+        return true;
+}
+
+void
+flt_text_cache_free(struct flt_text_cache *cache)
+{
+        struct cached_run *run, *tmp;
+
+        flt_list_for_each_safe(run, tmp, &cache->runs, link) {
+                delete_cached_run(cache, run);
+        }
+
+        cairo_destroy(cache->measure_cr);
+        cairo_surface_destroy(cache->measure_surface);
+
+        flt_free(cache);
+}
@@ -0,0 +1,61 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_TEXT_CACHE_H
+#define FLT_TEXT_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <cairo.h>
+
+/* A cache of outlined text runs rendered into image surfaces so that
+ * a readout that doesn’t change can be drawn with a single blit. The
+ * least recently used runs are discarded when the total size of the
+ * images goes over max_size bytes. The cache isn’t thread-safe.
+ */
+struct flt_text_cache;
+
+struct flt_text_cache_params {
+        cairo_font_face_t *face;
+        double size;
+        /* Width of the black outline */
+        double line_width;
+        uint32_t color;
+};
+
+struct flt_text_cache *
+flt_text_cache_new(size_t max_size);
+
+/* Draws the text at the current point and moves the current point to
+ * the end of the text. The part of the surface that was drawn to is
+ * returned in user space in extents_out. The cache can only be used
+ * when the transformation of cr is a translation. Otherwise nothing
+ * is drawn and false is returned.
+ */
+bool
+flt_text_cache_render(struct flt_text_cache *cache,
+                      cairo_t *cr,
+                      const struct flt_text_cache_params *params,
+                      const char *text,
+                      cairo_rectangle_t *extents_out);
+
+void
+flt_text_cache_free(struct flt_text_cache *cache);
+
+#endif /* FLT_TEXT_CACHE_H */
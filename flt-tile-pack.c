@@ -0,0 +1,331 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-tile-pack.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flt-util.h"
+#include "flt-file-error.h"
+
+struct flt_error_domain
+flt_tile_pack_error;
+
+#define MAGIC "FLTTILES"
+
+/* This should be increased whenever the layout changes */
+#define FORMAT_VERSION 1
+
+/* Written in the native byte order to detect files from a different
+ * kind of machine.
+ */
+#define BYTE_ORDER_MARK UINT32_C(0x01020304)
+
+/* The tile data starts on a page boundary so that every tile is
+ * aligned in the mapping.
+ */
+#define DATA_ALIGNMENT 4096
+
+struct pack_header {
+        char magic[sizeof MAGIC - 1];
+        uint32_t byte_order;
+        uint32_t version;
+        uint32_t tile_size;
+        uint32_t n_tiles;
+        uint64_t data_offset;
+};
+
+/* The entries are sorted by zoom, x and then y. The data for each
+ * tile follows in the same order.
+ */
+struct pack_entry {
+        int32_t zoom, x, y;
+        uint32_t padding;
+};
+
+struct flt_tile_pack {
+        const uint8_t *map;
+        size_t map_size;
+        size_t n_tiles;
+        const struct pack_entry *entries;
+        const uint8_t *data;
+};
+
+static uint64_t
+get_data_offset(size_t n_tiles)
+{
+        uint64_t offset = (sizeof (struct pack_header) +
+                           n_tiles * sizeof (struct pack_entry));
+
+        return (offset + DATA_ALIGNMENT - 1) & ~(uint64_t) (DATA_ALIGNMENT - 1);
+}
+
+static bool
+validate_header(const struct pack_header *header,
+                size_t size,
+                const char *filename,
+                struct flt_error **error)
+{
+        if (memcmp(header->magic, MAGIC, sizeof header->magic) ||
+            header->byte_order != BYTE_ORDER_MARK ||
+            header->tile_size != FLT_TILE_PACK_TILE_SIZE)
+                goto invalid;
+
+        if (header->version != FORMAT_VERSION) {
+                flt_set_error(error,
+                              &flt_tile_pack_error,
+                              FLT_TILE_PACK_ERROR_VERSION,
+                              "%s: tile pack is from a different version "
+                              "of flootay",
+                              filename);
+                return false;
+        }
+
+        if (header->n_tiles > (size - sizeof *header) /
+            (sizeof (struct pack_entry) + FLT_TILE_PACK_TILE_BYTES) ||
+            header->data_offset != get_data_offset(header->n_tiles) ||
+            header->data_offset > size ||
+            (size - header->data_offset) / FLT_TILE_PACK_TILE_BYTES <
+            header->n_tiles)
+                goto invalid;
+
+        return true;
+
+invalid:
+        flt_set_error(error,
+                      &flt_tile_pack_error,
+                      FLT_TILE_PACK_ERROR_INVALID,
+                      "%s: invalid tile pack",
+                      filename);
+        return false;
+}
+
+struct flt_tile_pack *
+flt_tile_pack_open(const char *filename,
+                   struct flt_error **error)
+{
+        int fd = open(filename, O_RDONLY);
+
+        if (fd == -1) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                return NULL;
+        }
+
+        struct flt_tile_pack *pack = NULL;
+        struct stat statbuf;
+
+        if (fstat(fd, &statbuf) == -1) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                goto out;
+        }
+
+        if (statbuf.st_size < sizeof (struct pack_header)) {
+                flt_set_error(error,
+                              &flt_tile_pack_error,
+                              FLT_TILE_PACK_ERROR_INVALID,
+                              "%s: invalid tile pack",
+                              filename);
+                goto out;
+        }
+
+        /* The mapping is shared so that every process using the pack
+         * uses the same pages.
+         */
+        void *map = mmap(NULL,
+                         statbuf.st_size,
+                         PROT_READ,
+                         MAP_SHARED,
+                         fd,
+                         0 /* offset */);
+
+        if (map == MAP_FAILED) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "%s: %s",
+                                   filename,
+                                   strerror(errno));
+                goto out;
+        }
+
+        const struct pack_header *header = map;
+
+        if (!validate_header(header, statbuf.st_size, filename, error)) {
+                munmap(map, statbuf.st_size);
+                goto out;
+        }
+
+        pack = flt_alloc(sizeof *pack);
+        pack->map = map;
+        pack->map_size = statbuf.st_size;
+        pack->n_tiles = header->n_tiles;
+        pack->entries = (const struct pack_entry *) (header + 1);
+        pack->data = pack->map + header->data_offset;
+
+out:
+        close(fd);
+
+        return pack;
+}
+
+static int
+compare_tile(int zoom_a, int x_a, int y_a,
+             int zoom_b, int x_b, int y_b)
+{
+        if (zoom_a != zoom_b)
+                return zoom_a < zoom_b ? -1 : 1;
+        if (x_a != x_b)
+                return x_a < x_b ? -1 : 1;
+        if (y_a != y_b)
+                return y_a < y_b ? -1 : 1;
+        return 0;
+}
+
+const uint8_t *
+flt_tile_pack_get(const struct flt_tile_pack *pack,
+                  int zoom, int x, int y)
+{
+        size_t min = 0, max = pack->n_tiles;
+
+        while (min < max) {
+                size_t mid = (min + max) / 2;
+                const struct pack_entry *entry = pack->entries + mid;
+                int cmp = compare_tile(zoom, x, y,
+                                       entry->zoom, entry->x, entry->y);
+
+                if (cmp == 0)
+                        return pack->data + mid * FLT_TILE_PACK_TILE_BYTES;
+                else if (cmp < 0)
+                        max = mid;
+                else
+                        min = mid + 1;
+        }
+
+        return NULL;
+}
+
+void
+flt_tile_pack_close(struct flt_tile_pack *pack)
+{
+        munmap((void *) pack->map, pack->map_size);
+        flt_free(pack);
+}
+
+static int
+compare_tile_cb(const void *pa, const void *pb)
+{
+        const struct flt_tile_pack_tile *a = pa;
+        const struct flt_tile_pack_tile *b = pb;
+
+        return compare_tile(a->zoom, a->x, a->y, b->zoom, b->x, b->y);
+}
+
+static bool
+write_data(FILE *out,
+           const void *data,
+           size_t size,
+           struct flt_error **error)
+{
+        if (fwrite(data, 1, size, out) != size) {
+                flt_file_error_set(error,
+                                   errno,
+                                   "error writing tile pack: %s",
+                                   strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+bool
+flt_tile_pack_write(FILE *out,
+                    size_t n_tiles,
+                    const struct flt_tile_pack_tile *tiles_in,
+                    flt_tile_pack_load_cb load_cb,
+                    void *user_data,
+                    struct flt_error **error)
+{
+        if (n_tiles > UINT32_MAX) {
+                flt_set_error(error,
+                              &flt_tile_pack_error,
+                              FLT_TILE_PACK_ERROR_INVALID,
+                              "too many tiles for a tile pack");
+                return false;
+        }
+
+        struct flt_tile_pack_tile *tiles =
+                flt_memdup(tiles_in, n_tiles * sizeof *tiles);
+
+        qsort(tiles, n_tiles, sizeof *tiles, compare_tile_cb);
+
+        struct pack_header header = {
+                .byte_order = BYTE_ORDER_MARK,
+                .version = FORMAT_VERSION,
+                .tile_size = FLT_TILE_PACK_TILE_SIZE,
+                .n_tiles = n_tiles,
+                .data_offset = get_data_offset(n_tiles),
+        };
+
+        memcpy(header.magic, MAGIC, sizeof header.magic);
+
+        uint8_t *data = flt_calloc(MAX(FLT_TILE_PACK_TILE_BYTES,
+                                       DATA_ALIGNMENT));
+        bool ret = write_data(out, &header, sizeof header, error);
+
+        for (size_t i = 0; i < n_tiles && ret; i++) {
+                struct pack_entry entry = {
+                        .zoom = tiles[i].zoom,
+                        .x = tiles[i].x,
+                        .y = tiles[i].y,
+                };
+
+                ret = write_data(out, &entry, sizeof entry, error);
+        }
+
+        if (ret) {
+                size_t padding = (header.data_offset -
+                                  sizeof header -
+                                  n_tiles * sizeof (struct pack_entry));
+
+                /* The buffer is still clear at this point */
+                ret = write_data(out, data, padding, error);
+        }
+
+        for (size_t i = 0; i < n_tiles && ret; i++) {
+                ret = (load_cb(tiles + i, data, user_data, error) &&
+                       write_data(out, data, FLT_TILE_PACK_TILE_BYTES, error));
+        }
+
+        flt_free(data);
+        flt_free(tiles);
+
+        return ret;
+}
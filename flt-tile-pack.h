@@ -0,0 +1,92 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_TILE_PACK_H
+#define FLT_TILE_PACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "flt-error.h"
+
+/* A tile pack is a single file of map tiles that are already decoded
+ * to premultiplied ARGB32 so that they can be used straight from a
+ * read-only mapping of the file without decompressing any PNGs. The
+ * mapping is shared between every process that renders from the
+ * same pack. Like a compiled scene it is stored in the native byte
+ * order and should be regenerated from the PNG tiles rather than
+ * copied to a different kind of machine.
+ */
+
+extern struct flt_error_domain
+flt_tile_pack_error;
+
+enum flt_tile_pack_error {
+        FLT_TILE_PACK_ERROR_INVALID,
+        FLT_TILE_PACK_ERROR_VERSION,
+};
+
+#define FLT_TILE_PACK_TILE_SIZE 256
+#define FLT_TILE_PACK_STRIDE (FLT_TILE_PACK_TILE_SIZE * 4)
+#define FLT_TILE_PACK_TILE_BYTES \
+        (FLT_TILE_PACK_STRIDE * FLT_TILE_PACK_TILE_SIZE)
+
+struct flt_tile_pack;
+
+struct flt_tile_pack_tile {
+        int zoom, x, y;
+};
+
+struct flt_tile_pack *
+flt_tile_pack_open(const char *filename,
+                   struct flt_error **error);
+
+/* Returns the pixels of a tile with a stride of FLT_TILE_PACK_STRIDE,
+ * or NULL if the pack doesn’t contain it. The data stays valid until
+ * the pack is closed.
+ */
+const uint8_t *
+flt_tile_pack_get(const struct flt_tile_pack *pack,
+                  int zoom, int x, int y);
+
+void
+flt_tile_pack_close(struct flt_tile_pack *pack);
+
+/* Called to get the pixels of each tile while writing a pack. The
+ * pixels should be written to data with a stride of
+ * FLT_TILE_PACK_STRIDE.
+ */
+typedef bool
+(* flt_tile_pack_load_cb)(const struct flt_tile_pack_tile *tile,
+                          uint8_t *data,
+                          void *user_data,
+                          struct flt_error **error);
+
+/* Writes a pack containing the given tiles. They don’t need to be
+ * sorted but there shouldn’t be any duplicates.
+ */
+bool
+flt_tile_pack_write(FILE *out,
+                    size_t n_tiles,
+                    const struct flt_tile_pack_tile *tiles,
+                    flt_tile_pack_load_cb load_cb,
+                    void *user_data,
+                    struct flt_error **error);
+
+#endif /* FLT_TILE_PACK_H */
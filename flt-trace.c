@@ -19,18 +19,35 @@
 #include "flt-trace.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <json_object.h>
 #include <errno.h>
-#include <json_tokener.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "flt-util.h"
 #include "flt-buffer.h"
 #include "flt-file-error.h"
+#include "flt-utf8.h"
 
 /* This file parses the cycle path trace files used by Cyclopolis:
  * https://github.com/benoitdemaegdt/voieslyonnaises/tree/main/content/voies-cyclables
+ *
+ * The JSON is parsed directly from the mapped file without building a
+ * tree of objects. The points of each segment are added straight to
+ * the array that ends up in the trace.
+ */
+
+/* Maximum length of a number in the JSON */
+#define MAX_NUMBER_LENGTH 64
+/* Maximum number of nested arrays and objects. The values are
+ * skipped recursively so this stops a malicious file from using up
+ * the stack.
  */
+#define MAX_DEPTH 64
 
 static const char * const
 status_names[] = {
@@ -45,12 +62,41 @@ status_names[] = {
 };
 
 struct parser {
-        struct flt_error *error;
         const char *filename;
+        /* The start of the file and the current position */
+        const char *data, *p, *end;
+        /* Number of arrays and objects that the position is in */
+        int depth;
+        /* Temporary buffer used for decoding strings */
+        struct flt_buffer buf;
         struct flt_buffer segments;
         struct flt_buffer points;
 };
 
+/* State collected while parsing a feature. The properties and
+ * coordinates are only checked if the geometry turns out to be a
+ * LineString because other types of geometry can have a different
+ * structure, so errors in them are saved until the end of the
+ * feature.
+ */
+struct feature {
+        bool has_geometry;
+        bool has_type;
+        bool is_line_string;
+        bool has_coordinates;
+        struct flt_error *coordinates_error;
+        bool has_properties;
+        bool has_status;
+        enum flt_trace_segment_status status;
+        struct flt_error *properties_error;
+};
+
+enum next_result {
+        NEXT_RESULT_ERROR,
+        NEXT_RESULT_ITEM,
+        NEXT_RESULT_END,
+};
+
 struct flt_error_domain
 flt_trace_error;
 
@@ -62,302 +108,471 @@ destroy_segments(struct flt_trace_segment *segments,
                 flt_free(segments[i].points);
 }
 
-static bool
-check_only_spaces_in_buffer(const char *filename,
-                            const char *buf,
-                            size_t buf_length,
-                            struct flt_error **error)
-{
-        for (size_t i = 0; i < buf_length; i++) {
-                if (!strchr(" \t\r\n", buf[i])) {
-                        flt_set_error(error,
-                                      &flt_trace_error,
-                                      FLT_TRACE_ERROR_INVALID,
-                                      "%s: extra data at end of file",
-                                      filename);
-                        return false;
+FLT_PRINTF_FORMAT(3, 4) static void
+set_parse_error(const struct parser *parser,
+                struct flt_error **error,
+                const char *format,
+                ...)
+{
+        int line = 1;
+
+        for (const char *p = parser->data; p < parser->p; p++) {
+                if (*p == '\n')
+                        line++;
+        }
+
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        va_list ap;
+
+        va_start(ap, format);
+        flt_buffer_append_vprintf(&buf, format, ap);
+        va_end(ap);
+
+        flt_set_error(error,
+                      &flt_trace_error,
+                      FLT_TRACE_ERROR_INVALID,
+                      "%s:%i: %s",
+                      parser->filename,
+                      line,
+                      (const char *) buf.data);
+
+        flt_buffer_destroy(&buf);
+}
+
+static void
+skip_space(struct parser *parser)
+{
+        while (parser->p < parser->end) {
+                switch (*parser->p) {
+                case ' ':
+                case '\t':
+                case '\r':
+                case '\n':
+                        parser->p++;
+                        break;
+                default:
+                        return;
                 }
         }
+}
+
+/* Skips whitespace and checks that there is more data */
+static bool
+skip_to_token(struct parser *parser,
+              struct flt_error **error)
+{
+        skip_space(parser);
+
+        if (parser->p >= parser->end) {
+                set_parse_error(parser, error, "unexpected EOF");
+                return false;
+        }
 
         return true;
 }
 
 static bool
-check_only_spaces_after_parse_end(const char *filename,
-                                  struct json_tokener *tokener,
-                                  const char *buf,
-                                  size_t buf_size,
-                                  struct flt_error **error)
+expect_char(struct parser *parser,
+            char ch,
+            struct flt_error **error)
 {
-        size_t used = json_tokener_get_parse_end(tokener);
+        if (!skip_to_token(parser, error))
+                return false;
+
+        if (*parser->p != ch) {
+                set_parse_error(parser, error, "“%c” expected", ch);
+                return false;
+        }
+
+        parser->p++;
 
-        return check_only_spaces_in_buffer(filename,
-                                           buf + used,
-                                           buf_size - used,
-                                           error);
+        return true;
 }
 
-static ssize_t
-fill_buffer(const char *filename,
-            char *buf,
-            size_t buf_size,
-            FILE *input,
-            struct flt_error **error)
+static bool
+check_type(struct parser *parser,
+           char start_char,
+           const char *type_name,
+           struct flt_error **error)
 {
-        size_t got = fread(buf, 1, sizeof buf, input);
+        if (!skip_to_token(parser, error))
+                return false;
 
-        if (ferror(input)) {
-                flt_file_error_set(error,
-                                   errno,
-                                   "%s: %s",
-                                   filename,
-                                   strerror(errno));
-                return -1;
+        if (*parser->p != start_char) {
+                set_parse_error(parser,
+                                error,
+                                "%s expected but a different type was found",
+                                type_name);
+                return false;
         }
 
-        return got;
+        return true;
 }
 
+/* Must be called after consuming the opening bracket of an array or
+ * object. The depth should be decremented again after the closing
+ * bracket.
+ */
 static bool
-check_only_spaces_in_file(const char *filename,
-                          char *buf,
-                          size_t buf_size,
-                          FILE *input,
-                          struct flt_error **error)
+enter_container(struct parser *parser,
+                struct flt_error **error)
 {
-        while (true) {
-                ssize_t got = fill_buffer(filename,
-                                          buf,
-                                          buf_size,
-                                          input,
-                                          error);
+        if (parser->depth >= MAX_DEPTH) {
+                set_parse_error(parser, error, "nesting too deep");
+                return false;
+        }
 
-                if (got < 0)
-                        return false;
+        parser->depth++;
 
-                if (got == 0)
-                        return true;
+        return true;
+}
 
-                if (!check_only_spaces_in_buffer(filename, buf, got, error))
-                        return false;
+static int
+parse_hex_digits(const char *p)
+{
+        int value = 0;
+
+        for (int i = 0; i < 4; i++) {
+                value <<= 4;
+
+                if (p[i] >= '0' && p[i] <= '9')
+                        value |= p[i] - '0';
+                else if (p[i] >= 'a' && p[i] <= 'f')
+                        value |= p[i] - 'a' + 10;
+                else if (p[i] >= 'A' && p[i] <= 'F')
+                        value |= p[i] - 'A' + 10;
+                else
+                        return -1;
         }
+
+        return value;
 }
 
-static struct json_object *
-load_json_from_file(const char *filename,
-                    struct flt_error **error)
+static bool
+parse_unicode_escape(struct parser *parser,
+                     struct flt_error **error)
 {
-        FILE *input = fopen(filename, "r");
+        if (parser->end - parser->p < 4 ||
+            parse_hex_digits(parser->p) == -1)
+                goto error;
+
+        uint32_t ch = parse_hex_digits(parser->p);
+
+        parser->p += 4;
+
+        /* Combine surrogate pairs */
+        if (ch >= 0xd800 && ch < 0xdc00) {
+                if (parser->end - parser->p < 6 ||
+                    parser->p[0] != '\\' ||
+                    parser->p[1] != 'u')
+                        goto error;
 
-        if (input == NULL) {
-                flt_file_error_set(error,
-                                   errno,
-                                   "%s: %s",
-                                   filename,
-                                   strerror(errno));
-                return NULL;
+                int low = parse_hex_digits(parser->p + 2);
+
+                if (low < 0xdc00 || low >= 0xe000)
+                        goto error;
+
+                ch = 0x10000 + ((ch - 0xd800) << 10) + (low - 0xdc00);
+                parser->p += 6;
+        } else if (ch >= 0xdc00 && ch < 0xe000) {
+                goto error;
         }
 
-        struct json_tokener *tokener = json_tokener_new();
-        char buf[1024];
-        struct json_object *obj = NULL;
+        char utf8[FLT_UTF8_MAX_CHAR_LENGTH];
+        int len = flt_utf8_encode(ch, utf8);
+
+        flt_buffer_append(&parser->buf, utf8, len);
+
+        return true;
+
+error:
+        set_parse_error(parser, error, "invalid unicode escape");
+        return false;
+}
+
+/* Decodes a string into parser->buf */
+static bool
+parse_string(struct parser *parser,
+             struct flt_error **error)
+{
+        if (!check_type(parser, '"', "string", error))
+                return false;
+
+        parser->p++;
+
+        flt_buffer_set_length(&parser->buf, 0);
 
         while (true) {
-                ssize_t got = fill_buffer(filename,
-                                          buf,
-                                          sizeof buf,
-                                          input,
-                                          error);
+                const char *start = parser->p;
 
-                if (got < 0)
-                        break;
+                while (parser->p < parser->end &&
+                       *parser->p != '"' &&
+                       *parser->p != '\\' &&
+                       (unsigned char) *parser->p >= ' ')
+                        parser->p++;
 
-                if (got == 0) {
-                        flt_set_error(error,
-                                      &flt_trace_error,
-                                      FLT_TRACE_ERROR_INVALID,
-                                      "%s: %s",
-                                      filename,
-                                      "unexpected EOF");
-                        break;
+                flt_buffer_append(&parser->buf, start, parser->p - start);
+
+                if (parser->p >= parser->end) {
+                        set_parse_error(parser, error, "unexpected EOF");
+                        return false;
                 }
 
-                obj = json_tokener_parse_ex(tokener, buf, got);
-
-                if (obj) {
-                        if (!check_only_spaces_after_parse_end(filename,
-                                                               tokener,
-                                                               buf,
-                                                               got,
-                                                               error) ||
-                            !check_only_spaces_in_file(filename,
-                                                       buf,
-                                                       sizeof buf,
-                                                       input,
-                                                       error)) {
-                                json_object_put(obj);
-                                obj = NULL;
-                        }
+                char ch = *(parser->p++);
 
+                if (ch == '"')
                         break;
-                } else {
-                        enum json_tokener_error jerr =
-                                json_tokener_get_error(tokener);
-
-                        if (jerr != json_tokener_continue) {
-                                flt_set_error(error,
-                                              &flt_trace_error,
-                                              FLT_TRACE_ERROR_INVALID,
-                                              "%s: %s",
-                                              filename,
-                                              json_tokener_error_desc(jerr));
-                                break;
-                        }
+
+                if (ch != '\\' || parser->p >= parser->end) {
+                        set_parse_error(parser, error, "invalid string");
+                        return false;
+                }
+
+                switch (*(parser->p++)) {
+                case '"':
+                        flt_buffer_append_c(&parser->buf, '"');
+                        break;
+                case '\\':
+                        flt_buffer_append_c(&parser->buf, '\\');
+                        break;
+                case '/':
+                        flt_buffer_append_c(&parser->buf, '/');
+                        break;
+                case 'b':
+                        flt_buffer_append_c(&parser->buf, '\b');
+                        break;
+                case 'f':
+                        flt_buffer_append_c(&parser->buf, '\f');
+                        break;
+                case 'n':
+                        flt_buffer_append_c(&parser->buf, '\n');
+                        break;
+                case 'r':
+                        flt_buffer_append_c(&parser->buf, '\r');
+                        break;
+                case 't':
+                        flt_buffer_append_c(&parser->buf, '\t');
+                        break;
+                case 'u':
+                        if (!parse_unicode_escape(parser, error))
+                                return false;
+                        break;
+                default:
+                        parser->p--;
+                        set_parse_error(parser, error, "invalid escape");
+                        return false;
                 }
         }
 
-        fclose(input);
-        json_tokener_free(tokener);
+        flt_buffer_append_c(&parser->buf, '\0');
+        parser->buf.length--;
 
-        return obj;
+        return true;
 }
 
-static struct json_object *
-get_field(struct parser *parser,
-          struct json_object *obj,
-          const char *field,
-          struct flt_error **error)
+static bool
+is_number_char(char ch)
 {
-        if (!json_object_is_type(obj, json_type_object)) {
-                flt_set_error(error,
-                              &flt_trace_error,
-                              FLT_TRACE_ERROR_INVALID,
-                              "%s: object expected but a different type "
-                              "was found",
-                              parser->filename);
-                return NULL;
+        return ((ch >= '0' && ch <= '9') ||
+                ch == '-' || ch == '+' ||
+                ch == '.' ||
+                ch == 'e' || ch == 'E');
+}
+
+static bool
+is_number_start(struct parser *parser)
+{
+        return (parser->p < parser->end &&
+                ((*parser->p >= '0' && *parser->p <= '9') ||
+                 *parser->p == '-'));
+}
+
+static bool
+parse_number(struct parser *parser,
+             double *value_out,
+             struct flt_error **error)
+{
+        char buf[MAX_NUMBER_LENGTH + 1];
+        size_t len = 0;
+
+        while (parser->p + len < parser->end &&
+               len < MAX_NUMBER_LENGTH &&
+               is_number_char(parser->p[len])) {
+                buf[len] = parser->p[len];
+                len++;
         }
 
-        struct json_object *value;
+        buf[len] = '\0';
+
+        char *tail;
 
-        if (!json_object_object_get_ex(obj, field, &value)) {
-                flt_set_error(error,
-                              &flt_trace_error,
-                              FLT_TRACE_ERROR_INVALID,
-                              "%s: missing property “%s”",
-                              parser->filename,
-                              field);
-                return NULL;
+        errno = 0;
+        double value = strtod(buf, &tail);
+
+        if (len <= 0 || tail != buf + len || errno) {
+                set_parse_error(parser, error, "invalid number");
+                return false;
         }
 
-        return value;
+        parser->p += len;
+        *value_out = value;
+
+        return true;
 }
 
 static bool
-check_array(struct parser *parser,
-            struct json_object *obj,
-            struct flt_error **error)
+parse_keyword(struct parser *parser,
+              const char *keyword,
+              struct flt_error **error)
 {
-        if (!json_object_is_type(obj, json_type_array)) {
-                flt_set_error(error,
-                              &flt_trace_error,
-                              FLT_TRACE_ERROR_INVALID,
-                              "%s: array expected but a different type "
-                              "was found",
-                              parser->filename);
+        size_t len = strlen(keyword);
+
+        if ((size_t) (parser->end - parser->p) < len ||
+            memcmp(parser->p, keyword, len)) {
+                set_parse_error(parser, error, "unexpected character");
                 return false;
-        } else {
-                return true;
         }
-}
 
-enum check_string_result {
-        CHECK_STRING_RESULT_ERROR,
-        CHECK_STRING_RESULT_MATCHED,
-        CHECK_STRING_RESULT_NOT_MATCHED,
-};
+        parser->p += len;
 
-static enum check_string_result
-compare_string(struct parser *parser,
-               struct json_object *value,
-               const char *expected_value,
-               struct flt_error **error)
+        return true;
+}
+
+/* Moves to the next element of an array or a member of an object.
+ * The opening bracket must already have been consumed.
+ */
+static enum next_result
+next_item(struct parser *parser,
+          char close_char,
+          bool *first,
+          struct flt_error **error)
 {
-       if (!json_object_is_type(value, json_type_string)) {
-                flt_set_error(error,
-                              &flt_trace_error,
-                              FLT_TRACE_ERROR_INVALID,
-                              "%s: string expected but a different type "
-                              "was found",
-                              parser->filename);
-                return CHECK_STRING_RESULT_ERROR;
+        if (!skip_to_token(parser, error))
+                return NEXT_RESULT_ERROR;
+
+        if (*parser->p == close_char) {
+                parser->p++;
+                return NEXT_RESULT_END;
         }
 
-        size_t len = json_object_get_string_len(value);
+        if (!*first && !expect_char(parser, ',', error))
+                return NEXT_RESULT_ERROR;
 
-        if (len == strlen(expected_value) &&
-            !memcmp(expected_value, json_object_get_string(value), len))
-                return CHECK_STRING_RESULT_MATCHED;
-        else
-                return CHECK_STRING_RESULT_NOT_MATCHED;
+        *first = false;
+
+        return NEXT_RESULT_ITEM;
 }
 
-static enum check_string_result
-check_string_field(struct parser *parser,
-                   struct json_object *obj,
-                   const char *field,
-                   const char *expected_value,
-                   struct flt_error **error)
+/* Moves to the next member of an object and leaves its name in
+ * parser->buf.
+ */
+static enum next_result
+next_member(struct parser *parser,
+            bool *first,
+            struct flt_error **error)
 {
-        struct json_object *value =
-                get_field(parser, obj, field, error);
+        enum next_result result = next_item(parser, '}', first, error);
 
-        if (value == NULL)
-                return CHECK_STRING_RESULT_ERROR;
+        if (result != NEXT_RESULT_ITEM)
+                return result;
 
-        return compare_string(parser, value, expected_value, error);
+        if (!parse_string(parser, error) ||
+            !expect_char(parser, ':', error))
+                return NEXT_RESULT_ERROR;
+
+        return NEXT_RESULT_ITEM;
 }
 
 static bool
-extract_status(struct parser *parser,
-               struct json_object *feature,
-               enum flt_trace_segment_status *status_ret,
-               struct flt_error **error)
+member_is(const struct parser *parser,
+          const char *name)
 {
-        struct json_object *properties =
-                get_field(parser, feature, "properties", error);
+        return !strcmp((const char *) parser->buf.data, name);
+}
 
-        if (properties == NULL)
+static bool
+skip_value(struct parser *parser,
+           struct flt_error **error)
+{
+        if (!skip_to_token(parser, error))
                 return false;
 
-        struct json_object *status_obj =
-                get_field(parser, properties, "status", error);
+        bool first = true;
+        enum next_result result;
 
-        if (status_obj == NULL)
-                return false;
+        switch (*parser->p) {
+        case '{':
+                parser->p++;
 
-        for (unsigned i = 0; i < FLT_N_ELEMENTS(status_names); i++) {
-                switch (compare_string(parser,
-                                       status_obj,
-                                       status_names[i],
-                                       error)) {
-                case CHECK_STRING_RESULT_ERROR:
+                if (!enter_container(parser, error))
                         return false;
-                case CHECK_STRING_RESULT_NOT_MATCHED:
-                        continue;
-                case CHECK_STRING_RESULT_MATCHED:
-                        *status_ret = i;
-                        return true;
+
+                while ((result = next_member(parser, &first, error)) ==
+                       NEXT_RESULT_ITEM) {
+                        if (!skip_value(parser, error))
+                                return false;
                 }
+
+                parser->depth--;
+
+                return result == NEXT_RESULT_END;
+
+        case '[':
+                parser->p++;
+
+                if (!enter_container(parser, error))
+                        return false;
+
+                while ((result = next_item(parser, ']', &first, error)) ==
+                       NEXT_RESULT_ITEM) {
+                        if (!skip_value(parser, error))
+                                return false;
+                }
+
+                parser->depth--;
+
+                return result == NEXT_RESULT_END;
+
+        case '"':
+                return parse_string(parser, error);
+
+        case 't':
+                return parse_keyword(parser, "true", error);
+        case 'f':
+                return parse_keyword(parser, "false", error);
+        case 'n':
+                return parse_keyword(parser, "null", error);
         }
 
-        flt_set_error(error,
-                      &flt_trace_error,
-                      FLT_TRACE_ERROR_INVALID,
-                      "%s: unexpected feature status: %s",
-                      parser->filename,
-                      json_object_get_string(status_obj));
-        return false;
+        if (!is_number_start(parser)) {
+                set_parse_error(parser, error, "unexpected character");
+                return false;
+        }
+
+        double value;
+
+        return parse_number(parser, &value, error);
+}
+
+/* Saves an error about the structure of a value that is only
+ * relevant for some types of feature and skips the value. If the
+ * value has invalid syntax then it is a real error.
+ */
+static bool
+defer_error(struct parser *parser,
+            const char *value_start,
+            struct flt_error *structure_error,
+            struct flt_error **deferred_error,
+            struct flt_error **error)
+{
+        if (*deferred_error)
+                flt_error_free(structure_error);
+        else
+                *deferred_error = structure_error;
+
+        parser->p = value_start;
+
+        return skip_value(parser, error);
 }
 
 static void
@@ -380,40 +595,55 @@ add_point(struct parser *parser,
 
 static bool
 parse_coordinate(struct parser *parser,
-                 struct json_object *coord,
                  struct flt_error **error)
 {
-        if (!check_array(parser, coord, error))
+        if (!check_type(parser, '[', "array", error))
                 return false;
 
-        size_t len = json_object_array_length(coord);
+        parser->p++;
 
-        if (len != 2) {
-                flt_set_error(error,
-                              &flt_trace_error,
-                              FLT_TRACE_ERROR_INVALID,
-                              "%s: encountered coordinate with %zu elements",
-                              parser->filename,
-                              len);
+        if (!enter_container(parser, error))
                 return false;
-        }
 
         double parts[2];
+        size_t n_parts = 0;
+        bool first = true;
+        enum next_result result;
+
+        while ((result = next_item(parser, ']', &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                skip_space(parser);
+
+                if (!is_number_start(parser)) {
+                        set_parse_error(parser,
+                                        error,
+                                        "number expected but a different "
+                                        "type was found");
+                        return false;
+                }
 
-        for (int i = 0; i < 2; i++) {
-                struct json_object *part = json_object_array_get_idx(coord, i);
+                double value;
 
-                if (!json_object_is_type(part, json_type_double)) {
-                        flt_set_error(error,
-                                      &flt_trace_error,
-                                      FLT_TRACE_ERROR_INVALID,
-                                      "%s: double expected but a different "
-                                      "type was found",
-                                      parser->filename);
+                if (!parse_number(parser, &value, error))
                         return false;
-                }
 
-                parts[i] = json_object_get_double(part);
+                if (n_parts < FLT_N_ELEMENTS(parts))
+                        parts[n_parts] = value;
+
+                n_parts++;
+        }
+
+        if (result == NEXT_RESULT_ERROR)
+                return false;
+
+        parser->depth--;
+
+        if (n_parts != 2) {
+                set_parse_error(parser,
+                                error,
+                                "encountered coordinate with %zu elements",
+                                n_parts);
+                return false;
         }
 
         add_point(parser, parts);
@@ -423,26 +653,180 @@ parse_coordinate(struct parser *parser,
 
 static bool
 parse_coordinates(struct parser *parser,
-                  struct json_object *coordinates,
+                  struct feature *feature,
                   struct flt_error **error)
 {
-        if (!check_array(parser, coordinates, error))
+        if (!skip_to_token(parser, error))
+                return false;
+
+        const char *value_start = parser->p;
+        struct flt_error *structure_error = NULL;
+
+        feature->has_coordinates = true;
+        flt_buffer_set_length(&parser->points, 0);
+
+        if (!check_type(parser, '[', "array", &structure_error))
+                goto structure_error;
+
+        parser->p++;
+
+        int depth = parser->depth;
+
+        if (!enter_container(parser, error))
                 return false;
 
+        bool first = true;
+        enum next_result result;
+
+        while ((result = next_item(parser, ']', &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                if (!parse_coordinate(parser, &structure_error)) {
+                        /* The value is skipped again from the start */
+                        parser->depth = depth;
+                        goto structure_error;
+                }
+        }
+
+        parser->depth--;
+
+        return result == NEXT_RESULT_END;
+
+structure_error:
         flt_buffer_set_length(&parser->points, 0);
 
-        size_t len = json_object_array_length(coordinates);
+        return defer_error(parser,
+                           value_start,
+                           structure_error,
+                           &feature->coordinates_error,
+                           error);
+}
+
+static bool
+parse_geometry(struct parser *parser,
+               struct feature *feature,
+               struct flt_error **error)
+{
+        if (!check_type(parser, '{', "object", error))
+                return false;
+
+        parser->p++;
+
+        if (!enter_container(parser, error))
+                return false;
 
-        for (size_t i = 0; i < len; i++) {
-                struct json_object *coord =
-                        json_object_array_get_idx(coordinates, i);
-                if (!parse_coordinate(parser, coord, error))
+        feature->has_geometry = true;
+
+        bool first = true;
+        enum next_result result;
+
+        while ((result = next_member(parser, &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                if (member_is(parser, "type")) {
+                        if (!parse_string(parser, error))
+                                return false;
+
+                        feature->has_type = true;
+                        feature->is_line_string = member_is(parser,
+                                                            "LineString");
+                } else if (member_is(parser, "coordinates")) {
+                        if (!parse_coordinates(parser, feature, error))
+                                return false;
+                } else if (!skip_value(parser, error)) {
                         return false;
+                }
+        }
+
+        if (result == NEXT_RESULT_ERROR)
+                return false;
+
+        parser->depth--;
+
+        if (!feature->has_type) {
+                set_parse_error(parser, error, "missing property “type”");
+                return false;
         }
 
         return true;
 }
 
+static bool
+parse_status(struct parser *parser,
+             struct feature *feature,
+             struct flt_error **property_error)
+{
+        if (!parse_string(parser, property_error))
+                return false;
+
+        for (unsigned i = 0; i < FLT_N_ELEMENTS(status_names); i++) {
+                if (member_is(parser, status_names[i])) {
+                        feature->has_status = true;
+                        feature->status = i;
+                        return true;
+                }
+        }
+
+        set_parse_error(parser,
+                        property_error,
+                        "unexpected feature status: %s",
+                        (const char *) parser->buf.data);
+
+        return false;
+}
+
+static bool
+parse_properties(struct parser *parser,
+                 struct feature *feature,
+                 struct flt_error **error)
+{
+        if (!skip_to_token(parser, error))
+                return false;
+
+        feature->has_properties = true;
+
+        const char *value_start = parser->p;
+        struct flt_error *structure_error = NULL;
+
+        if (!check_type(parser, '{', "object", &structure_error))
+                goto structure_error;
+
+        parser->p++;
+
+        if (!enter_container(parser, error))
+                return false;
+
+        bool first = true;
+        enum next_result result;
+
+        while ((result = next_member(parser, &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                if (member_is(parser, "status")) {
+                        const char *status_start = parser->p;
+
+                        if (!parse_status(parser, feature, &structure_error)) {
+                                if (!defer_error(parser,
+                                                 status_start,
+                                                 structure_error,
+                                                 &feature->properties_error,
+                                                 error))
+                                        return false;
+                        }
+                } else if (!skip_value(parser, error)) {
+                        return false;
+                }
+        }
+
+        parser->depth--;
+
+        return result == NEXT_RESULT_END;
+
+structure_error:
+        return defer_error(parser,
+                           value_start,
+                           structure_error,
+                           &feature->properties_error,
+                           error);
+}
+
 static void
 store_segment(struct parser *parser,
               enum flt_trace_segment_status status)
@@ -466,102 +850,228 @@ store_segment(struct parser *parser,
 }
 
 static bool
-parse_feature(struct parser *parser,
-              struct json_object *feature,
-              struct flt_error **error)
+finish_feature(struct parser *parser,
+               struct feature *feature,
+               struct flt_error **error)
 {
-        struct json_object *geometry =
-                get_field(parser, feature, "geometry", error);
+        if (!feature->has_geometry) {
+                set_parse_error(parser,
+                                error,
+                                "missing property “geometry”");
+                return false;
+        }
+
+        if (!feature->is_line_string)
+                return true;
 
-        if (geometry == NULL)
+        if (!feature->has_properties) {
+                set_parse_error(parser,
+                                error,
+                                "missing property “properties”");
                 return false;
+        }
 
-        switch (check_string_field(parser,
-                                   geometry,
-                                   "type",
-                                   "LineString",
-                                   error)) {
-        case CHECK_STRING_RESULT_ERROR:
+        if (feature->properties_error) {
+                flt_error_propagate(error, feature->properties_error);
+                feature->properties_error = NULL;
                 return false;
-        case CHECK_STRING_RESULT_NOT_MATCHED:
-                return true;
-        case CHECK_STRING_RESULT_MATCHED:
-                break;
         }
 
-        enum flt_trace_segment_status status;
+        if (!feature->has_status) {
+                set_parse_error(parser, error, "missing property “status”");
+                return false;
+        }
 
-        if (!extract_status(parser, feature, &status, error))
+        if (!feature->has_coordinates) {
+                set_parse_error(parser,
+                                error,
+                                "missing property “coordinates”");
                 return false;
+        }
 
-        struct json_object *coordinates =
-                get_field(parser, geometry, "coordinates", error);
+        if (feature->coordinates_error) {
+                flt_error_propagate(error, feature->coordinates_error);
+                feature->coordinates_error = NULL;
+                return false;
+        }
 
-        if (coordinates == NULL)
+        store_segment(parser, feature->status);
+
+        return true;
+}
+
+static bool
+parse_feature_members(struct parser *parser,
+                      struct feature *feature,
+                      struct flt_error **error)
+{
+        if (!check_type(parser, '{', "object", error))
                 return false;
 
-        if (!parse_coordinates(parser, coordinates, error))
+        parser->p++;
+
+        if (!enter_container(parser, error))
                 return false;
 
-        store_segment(parser, status);
+        bool first = true;
+        enum next_result result;
 
-        return true;
+        while ((result = next_member(parser, &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                bool ret;
+
+                if (member_is(parser, "geometry"))
+                        ret = parse_geometry(parser, feature, error);
+                else if (member_is(parser, "properties"))
+                        ret = parse_properties(parser, feature, error);
+                else
+                        ret = skip_value(parser, error);
+
+                if (!ret)
+                        return false;
+        }
+
+        parser->depth--;
+
+        return result == NEXT_RESULT_END;
 }
 
 static bool
-parse_object(struct parser *parser,
-             struct json_object *obj,
-             struct flt_error **error)
+parse_feature(struct parser *parser,
+              struct flt_error **error)
 {
-        struct json_object *features =
-                get_field(parser, obj, "features", error);
+        struct feature feature = {
+                .has_geometry = false,
+                .coordinates_error = NULL,
+                .properties_error = NULL,
+        };
+
+        flt_buffer_set_length(&parser->points, 0);
+
+        bool ret = (parse_feature_members(parser, &feature, error) &&
+                    finish_feature(parser, &feature, error));
+
+        if (feature.coordinates_error)
+                flt_error_free(feature.coordinates_error);
+        if (feature.properties_error)
+                flt_error_free(feature.properties_error);
 
-        if (features == NULL)
+        return ret;
+}
+
+static bool
+parse_features(struct parser *parser,
+               struct flt_error **error)
+{
+        if (!check_type(parser, '[', "array", error))
                 return false;
 
-        if (!check_array(parser, features, error))
+        parser->p++;
+
+        if (!enter_container(parser, error))
                 return false;
 
-        size_t n_features = json_object_array_length(features);
+        bool first = true;
+        enum next_result result;
 
-        for (size_t i = 0; i < n_features; i++) {
-                if (!parse_feature(parser,
-                                   json_object_array_get_idx(features, i),
-                                   error))
+        while ((result = next_item(parser, ']', &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                if (!parse_feature(parser, error))
                         return false;
         }
 
-        return true;
+        parser->depth--;
+
+        return result == NEXT_RESULT_END;
 }
 
-struct flt_trace *
-flt_trace_parse(const char *filename,
-                struct flt_error **error)
+static bool
+parse_object(struct parser *parser,
+             struct flt_error **error)
 {
-        struct json_object *obj = load_json_from_file(filename, error);
+        if (!check_type(parser, '{', "object", error))
+                return false;
+
+        parser->p++;
+
+        if (!enter_container(parser, error))
+                return false;
+
+        bool first = true;
+        bool has_features = false;
+        enum next_result result;
+
+        while ((result = next_member(parser, &first, error)) ==
+               NEXT_RESULT_ITEM) {
+                bool ret;
+
+                if (member_is(parser, "features")) {
+                        /* Only the last features array is used */
+                        destroy_segments((struct flt_trace_segment *)
+                                         parser->segments.data,
+                                         parser->segments.length /
+                                         sizeof (struct flt_trace_segment));
+                        flt_buffer_set_length(&parser->segments, 0);
+                        ret = parse_features(parser, error);
+                        has_features = true;
+                } else {
+                        ret = skip_value(parser, error);
+                }
+
+                if (!ret)
+                        return false;
+        }
+
+        if (result == NEXT_RESULT_ERROR)
+                return false;
+
+        parser->depth--;
+
+        if (!has_features) {
+                set_parse_error(parser,
+                                error,
+                                "missing property “features”");
+                return false;
+        }
+
+        skip_space(parser);
+
+        if (parser->p < parser->end) {
+                set_parse_error(parser, error, "extra data at end of file");
+                return false;
+        }
 
-        if (obj == NULL)
-                return NULL;
+        return true;
+}
 
+static bool
+parse_data(const char *filename,
+           const char *data,
+           size_t length,
+           struct flt_trace_segment **segments_out,
+           size_t *n_segments_out,
+           struct flt_error **error)
+{
         struct parser parser = {
                 .filename = filename,
+                .data = data,
+                .p = data,
+                .end = data + length,
+                .depth = 0,
+                .buf = FLT_BUFFER_STATIC_INIT,
                 .segments = FLT_BUFFER_STATIC_INIT,
                 .points = FLT_BUFFER_STATIC_INIT,
         };
 
-        struct flt_trace *ret = NULL;
-
-        bool parse_ret = parse_object(&parser, obj, error);
+        bool ret = parse_object(&parser, error);
 
         size_t n_segments = parser.segments.length /
                 sizeof (struct flt_trace_segment);
 
-        if (parse_ret) {
-                ret = flt_alloc(sizeof *ret);
-
-                ret->n_segments = n_segments;
-                ret->segments =
+        if (ret) {
+                *segments_out =
                         (struct flt_trace_segment *) parser.segments.data;
+                *n_segments_out = n_segments;
         } else {
                 destroy_segments((struct flt_trace_segment *)
                                  parser.segments.data,
@@ -570,9 +1080,101 @@ flt_trace_parse(const char *filename,
         }
 
         flt_buffer_destroy(&parser.points);
-        json_object_put(obj);
+        flt_buffer_destroy(&parser.buf);
+
+        return ret;
+}
+
+static bool
+read_file(int fd,
+          struct flt_buffer *buf)
+{
+        while (true) {
+                flt_buffer_ensure_size(buf, buf->length + 65536);
+
+                ssize_t got = read(fd,
+                                   buf->data + buf->length,
+                                   buf->size - buf->length);
+
+                if (got == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+
+                if (got == 0)
+                        return true;
+
+                buf->length += got;
+        }
+}
+
+struct flt_trace *
+flt_trace_parse(const char *filename,
+                struct flt_error **error)
+{
+        int fd = open(filename, O_RDONLY);
+
+        if (fd == -1)
+                goto file_error;
+
+        struct stat statbuf;
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        void *map = MAP_FAILED;
+        const char *data;
+        size_t length;
+
+        if (fstat(fd, &statbuf) == 0 &&
+            S_ISREG(statbuf.st_mode) &&
+            statbuf.st_size > 0) {
+                map = mmap(NULL,
+                           statbuf.st_size,
+                           PROT_READ,
+                           MAP_PRIVATE,
+                           fd,
+                           0 /* offset */);
+        }
+
+        if (map != MAP_FAILED) {
+                data = map;
+                length = statbuf.st_size;
+        } else if (read_file(fd, &buf)) {
+                data = (const char *) buf.data;
+                length = buf.length;
+        } else {
+                int err = errno;
+                close(fd);
+                flt_buffer_destroy(&buf);
+                errno = err;
+                goto file_error;
+        }
+
+        close(fd);
+
+        struct flt_trace_segment *segments;
+        size_t n_segments;
+        struct flt_trace *ret = NULL;
+
+        if (parse_data(filename, data, length, &segments, &n_segments, error)) {
+                ret = flt_alloc(sizeof *ret);
+                ret->n_segments = n_segments;
+                ret->segments = segments;
+        }
+
+        if (map != MAP_FAILED)
+                munmap(map, statbuf.st_size);
+
+        flt_buffer_destroy(&buf);
 
         return ret;
+
+file_error:
+        flt_file_error_set(error,
+                           errno,
+                           "%s: %s",
+                           filename,
+                           strerror(errno));
+        return NULL;
 }
 
 void
@@ -16,8 +16,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef FLT_TRACE
-#define FLT_TRACE
+#ifndef FLT_TRACE_H
+#define FLT_TRACE_H
 
 #include "flt-error.h"
 
@@ -61,4 +61,4 @@ flt_trace_parse(const char *filename,
 void
 flt_trace_free(struct flt_trace *trace);
 
-#endif /* FLT_TRACE */
+#endif /* FLT_TRACE_H */
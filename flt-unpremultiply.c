@@ -0,0 +1,258 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flt-unpremultiply.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#if defined(__ARM_NEON) &&                              \
+        defined(__BYTE_ORDER__) &&                      \
+        __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#else
+#define HAVE_NEON 0
+#endif
+
+/* Instead of dividing by the alpha, each component is multiplied by
+ * ceil(255 × 65536 / alpha) and shifted down by 16. For every
+ * component that is less than or equal to the alpha, which is always
+ * the case for a valid premultiplied pixel, this gives exactly the
+ * same result as c × 255 / a and the product fits in 32 bits. The
+ * entry for zero is zero so that fully transparent pixels don’t need
+ * a special case.
+ */
+#define RECIP(a) (((a) != 0) *                                          \
+                  ((255u * 65536u + (a) - 1) / ((a) ? (a) : 1)))
+#define RECIP4(a) RECIP(a), RECIP((a) + 1), RECIP((a) + 2), RECIP((a) + 3)
+#define RECIP16(a) \
+        RECIP4(a), RECIP4((a) + 4), RECIP4((a) + 8), RECIP4((a) + 12)
+#define RECIP64(a) \
+        RECIP16(a), RECIP16((a) + 16), RECIP16((a) + 32), RECIP16((a) + 48)
+
+static const uint32_t
+reciprocals[256] = {
+        RECIP64(0), RECIP64(64), RECIP64(128), RECIP64(192),
+};
+
+static void
+unpremultiply_row_scalar(const uint32_t *src,
+                         uint8_t *dst,
+                         int width)
+{
+        for (int x = 0; x < width; x++) {
+                uint32_t value = src[x];
+                uint32_t a = value >> 24;
+                uint32_t m = reciprocals[a];
+
+                *(dst++) = (((value >> 16) & 0xff) * m) >> 16;
+                *(dst++) = (((value >> 8) & 0xff) * m) >> 16;
+                *(dst++) = ((value & 0xff) * m) >> 16;
+                *(dst++) = a;
+        }
+}
+
+#if HAVE_X86_SIMD
+
+__attribute__((target("sse4.1")))
+static void
+unpremultiply_row_sse41(const uint32_t *src,
+                        uint8_t *dst,
+                        int width)
+{
+        const __m128i mask = _mm_set1_epi32(0xff);
+        int x;
+
+        for (x = 0; x + 4 <= width; x += 4) {
+                __m128i pix = _mm_loadu_si128((const __m128i *) (src + x));
+                __m128i m = _mm_set_epi32(reciprocals[src[x + 3] >> 24],
+                                          reciprocals[src[x + 2] >> 24],
+                                          reciprocals[src[x + 1] >> 24],
+                                          reciprocals[src[x + 0] >> 24]);
+
+                __m128i r = _mm_and_si128(_mm_srli_epi32(pix, 16), mask);
+                __m128i g = _mm_and_si128(_mm_srli_epi32(pix, 8), mask);
+                __m128i b = _mm_and_si128(pix, mask);
+                __m128i a = _mm_srli_epi32(pix, 24);
+
+                r = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(r, m), 16),
+                                  mask);
+                g = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(g, m), 16),
+                                  mask);
+                b = _mm_and_si128(_mm_srli_epi32(_mm_mullo_epi32(b, m), 16),
+                                  mask);
+
+                __m128i out = _mm_or_si128(_mm_or_si128(r,
+                                                        _mm_slli_epi32(g, 8)),
+                                           _mm_or_si128(_mm_slli_epi32(b, 16),
+                                                        _mm_slli_epi32(a, 24)));
+
+                _mm_storeu_si128((__m128i *) (dst + x * 4), out);
+        }
+
+        unpremultiply_row_scalar(src + x, dst + x * 4, width - x);
+}
+
+__attribute__((target("avx2")))
+static void
+unpremultiply_row_avx2(const uint32_t *src,
+                       uint8_t *dst,
+                       int width)
+{
+        const __m256i mask = _mm256_set1_epi32(0xff);
+        int x;
+
+        for (x = 0; x + 8 <= width; x += 8) {
+                __m256i pix =
+                        _mm256_loadu_si256((const __m256i *) (src + x));
+                __m256i a = _mm256_srli_epi32(pix, 24);
+                __m256i m = _mm256_i32gather_epi32((const int *) reciprocals,
+                                                   a,
+                                                   sizeof reciprocals[0]);
+
+                __m256i r = _mm256_and_si256(_mm256_srli_epi32(pix, 16), mask);
+                __m256i g = _mm256_and_si256(_mm256_srli_epi32(pix, 8), mask);
+                __m256i b = _mm256_and_si256(pix, mask);
+
+                r = _mm256_srli_epi32(_mm256_mullo_epi32(r, m), 16);
+                g = _mm256_srli_epi32(_mm256_mullo_epi32(g, m), 16);
+                b = _mm256_srli_epi32(_mm256_mullo_epi32(b, m), 16);
+
+                r = _mm256_and_si256(r, mask);
+                g = _mm256_and_si256(g, mask);
+                b = _mm256_and_si256(b, mask);
+
+                __m256i out =
+                        _mm256_or_si256(_mm256_or_si256(r,
+                                                        _mm256_slli_epi32(g,
+                                                                          8)),
+                                        _mm256_or_si256(_mm256_slli_epi32(b,
+                                                                          16),
+                                                        _mm256_slli_epi32(a,
+                                                                          24)));
+
+                _mm256_storeu_si256((__m256i *) (dst + x * 4), out);
+        }
+
+        unpremultiply_row_sse41(src + x, dst + x * 4, width - x);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+#if HAVE_NEON
+
+static void
+unpremultiply_row_neon(const uint32_t *src,
+                       uint8_t *dst,
+                       int width)
+{
+        const uint32x4_t mask = vdupq_n_u32(0xff);
+        int x;
+
+        for (x = 0; x + 4 <= width; x += 4) {
+                uint32x4_t pix = vld1q_u32(src + x);
+                const uint32_t m_values[4] = {
+                        reciprocals[src[x + 0] >> 24],
+                        reciprocals[src[x + 1] >> 24],
+                        reciprocals[src[x + 2] >> 24],
+                        reciprocals[src[x + 3] >> 24],
+                };
+                uint32x4_t m = vld1q_u32(m_values);
+
+                uint32x4_t r = vandq_u32(vshrq_n_u32(pix, 16), mask);
+                uint32x4_t g = vandq_u32(vshrq_n_u32(pix, 8), mask);
+                uint32x4_t b = vandq_u32(pix, mask);
+                uint32x4_t a = vshrq_n_u32(pix, 24);
+
+                r = vandq_u32(vshrq_n_u32(vmulq_u32(r, m), 16), mask);
+                g = vandq_u32(vshrq_n_u32(vmulq_u32(g, m), 16), mask);
+                b = vandq_u32(vshrq_n_u32(vmulq_u32(b, m), 16), mask);
+
+                uint32x4_t out = vorrq_u32(vorrq_u32(r, vshlq_n_u32(g, 8)),
+                                           vorrq_u32(vshlq_n_u32(b, 16),
+                                                     vshlq_n_u32(a, 24)));
+
+                vst1q_u8(dst + x * 4, vreinterpretq_u8_u32(out));
+        }
+
+        unpremultiply_row_scalar(src + x, dst + x * 4, width - x);
+}
+
+#endif /* HAVE_NEON */
+
+void
+flt_unpremultiply_row(const uint32_t *src,
+                      uint8_t *dst,
+                      int width)
+{
+#if HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2")) {
+                unpremultiply_row_avx2(src, dst, width);
+                return;
+        }
+
+        if (__builtin_cpu_supports("sse4.1")) {
+                unpremultiply_row_sse41(src, dst, width);
+                return;
+        }
+#endif
+
+#if HAVE_NEON
+        unpremultiply_row_neon(src, dst, width);
+#else
+        unpremultiply_row_scalar(src, dst, width);
+#endif
+}
+
+int
+flt_unpremultiply_get_impls(struct flt_unpremultiply_impl
+                            impls[FLT_UNPREMULTIPLY_MAX_IMPLS])
+{
+        int n_impls = 0;
+
+        impls[n_impls++] = (struct flt_unpremultiply_impl) {
+                "scalar", unpremultiply_row_scalar,
+        };
+
+#if HAVE_X86_SIMD
+        if (__builtin_cpu_supports("sse4.1")) {
+                impls[n_impls++] = (struct flt_unpremultiply_impl) {
+                        "sse4.1", unpremultiply_row_sse41,
+                };
+        }
+
+        if (__builtin_cpu_supports("avx2")) {
+                impls[n_impls++] = (struct flt_unpremultiply_impl) {
+                        "avx2", unpremultiply_row_avx2,
+                };
+        }
+#endif
+
+#if HAVE_NEON
+        impls[n_impls++] = (struct flt_unpremultiply_impl) {
+                "neon", unpremultiply_row_neon,
+        };
+#endif
+
+        return n_impls;
+}
@@ -0,0 +1,52 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLT_UNPREMULTIPLY_H
+#define FLT_UNPREMULTIPLY_H
+
+#include <stdint.h>
+
+/* Converts a row of premultiplied native-endian ARGB32 pixels, as
+ * used by cairo image surfaces, to unpremultiplied RGBA bytes. The
+ * result is the same as dividing each component by the alpha with
+ * integer division. The fastest implementation that the CPU supports
+ * is picked at runtime.
+ */
+void
+flt_unpremultiply_row(const uint32_t *src,
+                      uint8_t *dst,
+                      int width);
+
+#define FLT_UNPREMULTIPLY_MAX_IMPLS 4
+
+/* One of the implementations of flt_unpremultiply_row. These are only
+ * exposed so that the tests can compare them with each other.
+ */
+struct flt_unpremultiply_impl {
+        const char *name;
+        void (* row)(const uint32_t *src, uint8_t *dst, int width);
+};
+
+/* Fills in the implementations that the CPU can run, starting with
+ * the scalar one, and returns how many there are.
+ */
+int
+flt_unpremultiply_get_impls(struct flt_unpremultiply_impl
+                            impls[FLT_UNPREMULTIPLY_MAX_IMPLS]);
+
+#endif /* FLT_UNPREMULTIPLY_H */
@@ -24,6 +24,12 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define TEMP_SUFFIX_LENGTH 6
+#define TEMP_FILE_ATTEMPTS 100
 
 void
 flt_fatal(const char *format, ...)
@@ -53,9 +59,24 @@ flt_warning(const char *format, ...)
         fputc('\n', stderr);
 }
 
+static flt_alloc_hook
+alloc_hook;
+static void *
+alloc_hook_data;
+
+void
+flt_set_alloc_hook(flt_alloc_hook hook, void *user_data)
+{
+        alloc_hook = hook;
+        alloc_hook_data = user_data;
+}
+
 void *
 flt_alloc(size_t size)
 {
+        if (alloc_hook)
+                alloc_hook(size, alloc_hook_data);
+
         void *result = malloc(size);
 
         if (result == NULL)
@@ -80,6 +101,9 @@ flt_realloc(void *ptr, size_t size)
         if (ptr == NULL)
                 return flt_alloc(size);
 
+        if (alloc_hook)
+                alloc_hook(size, alloc_hook_data);
+
         ptr = realloc(ptr, size);
 
         if (ptr == NULL)
@@ -167,3 +191,55 @@ flt_free(void *ptr)
         if (ptr)
                 free(ptr);
 }
+
+int
+flt_create_temp_file(char *template)
+{
+        static const char chars[] =
+                "abcdefghijklmnopqrstuvwxyz"
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                "0123456789";
+        /* Makes the names unique between threads of this process */
+        static unsigned counter;
+
+        size_t length = strlen(template);
+
+        if (length < TEMP_SUFFIX_LENGTH ||
+            strspn(template + length - TEMP_SUFFIX_LENGTH, "X") !=
+            TEMP_SUFFIX_LENGTH) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        char *suffix = template + length - TEMP_SUFFIX_LENGTH;
+
+        for (int attempt = 0; attempt < TEMP_FILE_ATTEMPTS; attempt++) {
+                struct timespec ts;
+
+                clock_gettime(CLOCK_REALTIME, &ts);
+
+                uint64_t value = (ts.tv_nsec ^
+                                  ((uint64_t) ts.tv_sec << 30) ^
+                                  ((uint64_t) getpid() << 40) ^
+                                  (__atomic_fetch_add(&counter,
+                                                      1,
+                                                      __ATOMIC_RELAXED) *
+                                   UINT64_C(0x9e3779b97f4a7c15)));
+
+                for (int i = 0; i < TEMP_SUFFIX_LENGTH; i++) {
+                        suffix[i] = chars[value % (sizeof chars - 1)];
+                        value /= sizeof chars - 1;
+                }
+
+                int fd = open(template,
+                              O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                              0666);
+
+                if (fd != -1 || errno != EEXIST)
+                        return fd;
+        }
+
+        errno = EEXIST;
+
+        return -1;
+}
@@ -50,6 +50,17 @@
 #define FLT_N_ELEMENTS(array) \
   (sizeof (array) / sizeof ((array)[0]))
 
+/* Called with the size of every allocation made with flt_alloc,
+ * flt_calloc or flt_realloc. This is meant for tests that check how
+ * many allocations something does. It isn’t thread-safe so it should
+ * be set before any threads are started.
+ */
+typedef void
+(* flt_alloc_hook)(size_t size, void *user_data);
+
+void
+flt_set_alloc_hook(flt_alloc_hook hook, void *user_data);
+
 void *
 flt_alloc(size_t size);
 
@@ -74,6 +85,15 @@ flt_strndup(const char *str, size_t size);
 void *
 flt_memdup(const void *data, size_t size);
 
+/* Creates a file with a unique name like mkstemp, but with mode 0666
+ * so that it gets the same permissions as any other file once the
+ * umask is applied. The template must end with six “X” characters
+ * which are replaced. Returns a file descriptor opened for writing or
+ * -1 with errno set.
+ */
+int
+flt_create_temp_file(char *template);
+
 FLT_NO_RETURN
 FLT_PRINTF_FORMAT(1, 2)
 void
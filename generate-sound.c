@@ -26,30 +26,63 @@
 #include <stdint.h>
 #include <math.h>
 #include <float.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "flt-buffer.h"
 #include "flt-util.h"
 #include "flt-child-proc.h"
 #include "flt-list.h"
 #include "flt-get-video-length.h"
+#include "flt-pcm-cache.h"
 
 #define SAMPLE_RATE 48000
 #define CHANNELS 2
 #define SAMPLE_SIZE 3
 #define SAMPLE_MAX_VALUE ((1 << (SAMPLE_SIZE * 8)) - 1)
-
+#define FRAME_SIZE (SAMPLE_SIZE * CHANNELS)
+
+/* The vector versions of the mixing expect packed 24-bit stereo */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+        SAMPLE_SIZE == 3 && CHANNELS == 2
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+/* Number of frames that are mixed at a time */
 #define BUFFER_SIZE 4096
 
 #define VOLUME_SLIDE_TIME 1.0
 #define QUIET_VOLUME 0.1
 #define MUSIC_FADE_OUT_TIME 3.0
 
+/* Size in bytes of the buffer for each sound that is decoded ahead */
+#define DECODE_RING_SIZE (SAMPLE_RATE * 4 * FRAME_SIZE)
+/* Maximum number of bytes that a decode thread reads at a time */
+#define DECODE_CHUNK_SIZE (BUFFER_SIZE * FRAME_SIZE)
+#define DEFAULT_LOOKAHEAD 5.0
+
+/* A sound file that has been decoded into the PCM cache. The same
+ * file can be used by multiple sounds.
+ */
+struct pcm_file {
+        struct flt_list link;
+        const char *filename;
+        bool loaded;
+        struct flt_pcm pcm;
+};
+
 struct sound {
         struct flt_list link;
         double volume;
         double start_time;
         double length;
         char *filename;
+        /* NULL if the sound isn’t in the PCM cache */
+        const struct pcm_file *pcm;
 };
 
 struct config {
@@ -58,6 +91,55 @@ struct config {
 
         double music_start_time;
         double music_end_time;
+
+        /* Number of threads to decode the sounds ahead of time, or
+         * zero to decode each sound only when it starts.
+         */
+        int n_decode_threads;
+        /* How long before a sound starts to start decoding it */
+        double lookahead;
+
+        bool use_pcm_cache;
+        struct flt_list pcm_files;
+};
+
+struct decode_pool {
+        pthread_mutex_t mutex;
+        /* Signalled whenever a decoder’s ring buffer changes */
+        pthread_cond_t cond;
+
+        /* The decoders in the order that they were started, which is
+         * also the order that they will be needed.
+         */
+        struct flt_list decoders;
+        bool quit;
+
+        int n_threads;
+        pthread_t *threads;
+};
+
+struct decoder {
+        struct flt_list pool_link;
+        /* Link in the list of decoders waiting for their sound to
+         * start.
+         */
+        struct flt_list queue_link;
+
+        struct decode_pool *pool;
+        const struct sound *sound;
+        struct flt_child_proc cp;
+        FILE *f;
+
+        /* True while a thread is reading into the ring buffer */
+        bool busy;
+        bool eof;
+
+        /* The total number of bytes written to and read from the
+         * ring buffer. The positions in the buffer are these modulo
+         * its size.
+         */
+        size_t write_pos, read_pos;
+        uint8_t ring[DECODE_RING_SIZE];
 };
 
 struct running_sound {
@@ -65,6 +147,20 @@ struct running_sound {
         const struct sound *sound;
         struct flt_child_proc cp;
         FILE *f;
+        /* If one of these is set then the samples come from there
+         * instead.
+         */
+        struct decoder *decoder;
+        const struct flt_pcm *pcm;
+        /* Position and end of the samples to read from the PCM in
+         * bytes.
+         */
+        size_t pcm_pos, pcm_end;
+        bool eof;
+
+        /* Frames that have been read but not mixed yet */
+        size_t buf_start, buf_end;
+        uint8_t buf[BUFFER_SIZE * FRAME_SIZE];
 };
 
 struct data {
@@ -74,6 +170,27 @@ struct data {
         const struct flt_list *next_music_link;
         struct flt_list running_sounds;
         const struct sound *music_sound;
+
+        /* First sound that might still change the music volume. The
+         * sounds before it finished sliding the volume back up.
+         */
+        const struct flt_list *next_ducking_link;
+        /* Array of the const struct sound * that can change the music
+         * volume during the current block.
+         */
+        struct flt_buffer ducking_sounds;
+
+        /* Only used when decoding ahead */
+        struct decode_pool *pool;
+        struct flt_list queued_sounds;
+        struct flt_list queued_music;
+        const struct flt_list *next_decode_sound_link;
+        const struct flt_list *next_decode_music_link;
+        double next_decode_music_time;
+
+        float mix[BUFFER_SIZE * CHANNELS];
+        float envelope[BUFFER_SIZE];
+        uint8_t out[BUFFER_SIZE * FRAME_SIZE];
 };
 
 static const struct sound
@@ -85,9 +202,36 @@ default_sound = {
 static const struct flt_child_proc
 child_proc_init = FLT_CHILD_PROC_INIT;
 
+/* Returns false if the decoder’s ffmpeg process failed */
+static bool
+free_decoder(struct decoder *decoder)
+{
+        struct decode_pool *pool = decoder->pool;
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while (decoder->busy)
+                pthread_cond_wait(&pool->cond, &pool->mutex);
+
+        flt_list_remove(&decoder->pool_link);
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        fclose(decoder->f);
+
+        bool ret = flt_child_proc_close(&decoder->cp);
+
+        flt_free(decoder);
+
+        return ret;
+}
+
 static void
 free_running_sound(struct running_sound *sound)
 {
+        if (sound->decoder)
+                free_decoder(sound->decoder);
+
         if (sound->f)
                 fclose(sound->f);
 
@@ -123,18 +267,67 @@ get_fade_out_volume(struct data *data,
         return 1.0;
 }
 
+/* Collects the sounds whose volume slides overlap the block of time
+ * in data->ducking_sounds so that the volume for each sample only
+ * needs to look at those.
+ */
+static void
+get_ducking_sounds(struct data *data,
+                   double start_time,
+                   double end_time)
+{
+        const struct flt_list *sounds = &data->config->sounds;
+        const struct sound *s;
+
+        /* The sounds are sorted by start time so only the ones at the
+         * start of the list can be skipped forever.
+         */
+        while (data->next_ducking_link != sounds) {
+                s = flt_container_of(data->next_ducking_link,
+                                     struct sound,
+                                     link);
+
+                if (s->start_time + s->length + VOLUME_SLIDE_TIME >
+                    start_time)
+                        break;
+
+                data->next_ducking_link = data->next_ducking_link->next;
+        }
+
+        flt_buffer_set_length(&data->ducking_sounds, 0);
+
+        for (const struct flt_list *l = data->next_ducking_link;
+             l != sounds;
+             l = l->next) {
+                s = flt_container_of(l, struct sound, link);
+
+                if (s->start_time - VOLUME_SLIDE_TIME > end_time)
+                        break;
+
+                if (s->start_time + s->length + VOLUME_SLIDE_TIME <=
+                    start_time)
+                        continue;
+
+                flt_buffer_append(&data->ducking_sounds, &s, sizeof s);
+        }
+}
+
 static double
 get_music_volume(struct data *data,
                  double sample_time)
 {
         double max_volume = 1.0;
 
-        const struct sound *s;
+        const struct sound * const *sounds =
+                (const struct sound * const *) data->ducking_sounds.data;
+        size_t n_sounds = data->ducking_sounds.length / sizeof *sounds;
+
+        for (size_t i = 0; i < n_sounds; i++) {
+                const struct sound *s = sounds[i];
 
-        flt_list_for_each(s, &data->config->sounds, link) {
-                if (data->config->music_end_time > s->start_time &&
-                    sample_time < s->start_time) {
-                        if (sample_time >= s->start_time - VOLUME_SLIDE_TIME) {
+                if (sample_time < s->start_time) {
+                        if (data->config->music_end_time > s->start_time &&
+                            sample_time >= s->start_time - VOLUME_SLIDE_TIME) {
                                 float v = ((1.0 - ((sample_time +
                                                     VOLUME_SLIDE_TIME -
                                                     s->start_time) /
@@ -176,15 +369,11 @@ get_music_volume(struct data *data,
 }
 
 static bool
-start_sound(struct flt_list *running_sounds,
-            const struct sound *sound,
-            double length)
+open_sound(const struct sound *sound,
+           double length,
+           struct flt_child_proc *cp,
+           FILE **f_out)
 {
-        struct running_sound *rs = flt_calloc(sizeof *rs);
-
-        rs->sound = sound;
-        rs->cp = child_proc_init;
-
         struct flt_buffer length_buf = FLT_BUFFER_STATIC_INIT;
 
         const char *ffmpeg_args[] = {
@@ -222,111 +411,719 @@ start_sound(struct flt_list *running_sounds,
         bool run_ret = flt_child_proc_open(NULL, /* source_dir */
                                            "ffmpeg",
                                            ffmpeg_args,
-                                           &rs->cp);
+                                           cp);
 
         flt_buffer_destroy(&length_buf);
 
-        if (!run_ret) {
-                free_running_sound(rs);
+        if (!run_ret)
                 return false;
-        }
 
-        rs->f = fdopen(rs->cp.read_fd, "r");
+        *f_out = fdopen(cp->read_fd, "r");
 
-        if (rs->f == NULL) {
+        if (*f_out == NULL) {
                 fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
-                free_running_sound(rs);
+                flt_child_proc_close(cp);
+                *cp = child_proc_init;
                 return false;
         }
 
-        rs->cp.read_fd = -1;
+        cp->read_fd = -1;
+
+        return true;
+}
+
+static bool
+start_sound(struct flt_list *running_sounds,
+            const struct sound *sound,
+            double length)
+{
+        struct running_sound *rs = flt_calloc(sizeof *rs);
+
+        rs->sound = sound;
+        rs->cp = child_proc_init;
+
+        if (sound->pcm) {
+                size_t n_frames = sound->pcm->pcm.n_frames;
+
+                /* This should match what ffmpeg does with -to */
+                if (length < DBL_MAX)
+                        n_frames = MIN(n_frames, ceil(length * SAMPLE_RATE));
+
+                rs->pcm = &sound->pcm->pcm;
+                rs->pcm_end = n_frames * FRAME_SIZE;
+        } else if (!open_sound(sound, length, &rs->cp, &rs->f)) {
+                free_running_sound(rs);
+                return false;
+        }
 
         flt_list_insert(running_sounds->prev, &rs->link);
 
         return true;
 }
 
-static bool
-read_samples(struct running_sound *rs, double samples[CHANNELS])
+static void
+start_decoded_sound(struct flt_list *running_sounds,
+                    struct flt_list *queue)
 {
-        for (int i = 0; i < CHANNELS; i++) {
-                uint8_t buf[SAMPLE_SIZE];
+        struct running_sound *rs = flt_calloc(sizeof *rs);
+        struct decoder *decoder =
+                flt_container_of(queue->next, struct decoder, queue_link);
 
-                if (fread(buf, 1, sizeof buf, rs->f) != sizeof buf)
-                        return false;
+        flt_list_remove(&decoder->queue_link);
+
+        rs->sound = decoder->sound;
+        rs->cp = child_proc_init;
+        rs->decoder = decoder;
+
+        flt_list_insert(running_sounds->prev, &rs->link);
+}
+
+static struct decoder *
+find_decoder_with_space(struct decode_pool *pool)
+{
+        struct decoder *decoder;
+
+        flt_list_for_each(decoder, &pool->decoders, pool_link) {
+                if (!decoder->busy &&
+                    !decoder->eof &&
+                    decoder->write_pos - decoder->read_pos +
+                    DECODE_CHUNK_SIZE <= DECODE_RING_SIZE)
+                        return decoder;
+        }
+
+        return NULL;
+}
+
+static void *
+decode_thread_cb(void *user_data)
+{
+        struct decode_pool *pool = user_data;
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while (!pool->quit) {
+                struct decoder *decoder = find_decoder_with_space(pool);
+
+                if (decoder == NULL) {
+                        pthread_cond_wait(&pool->cond, &pool->mutex);
+                        continue;
+                }
+
+                size_t offset = decoder->write_pos % DECODE_RING_SIZE;
+                size_t size = MIN(DECODE_CHUNK_SIZE,
+                                  DECODE_RING_SIZE - offset);
+
+                decoder->busy = true;
+
+                pthread_mutex_unlock(&pool->mutex);
+
+                size_t got = fread(decoder->ring + offset,
+                                   1,
+                                   size,
+                                   decoder->f);
 
-                int value = 0;
+                pthread_mutex_lock(&pool->mutex);
 
-                for (int j = 0; j < SAMPLE_SIZE; j++)
-                        value |= buf[j] << (8 * j);
+                decoder->write_pos += got;
 
-                if ((buf[SAMPLE_SIZE - 1] & 0x80))
-                        value |= -1 << (SAMPLE_SIZE * 8);
+                if (got < size)
+                        decoder->eof = true;
 
-                samples[i] = value / (double) SAMPLE_MAX_VALUE;
+                decoder->busy = false;
+
+                pthread_cond_broadcast(&pool->cond);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        return NULL;
+}
+
+/* Reads up to size bytes from the decoder, waiting if they haven’t
+ * been decoded yet. The result is only short at the end of the sound.
+ */
+static size_t
+read_decoder(struct decoder *decoder, uint8_t *buf, size_t size)
+{
+        struct decode_pool *pool = decoder->pool;
+        size_t total = 0;
+
+        pthread_mutex_lock(&pool->mutex);
+
+        while (total < size) {
+                while (decoder->write_pos == decoder->read_pos &&
+                       !decoder->eof)
+                        pthread_cond_wait(&pool->cond, &pool->mutex);
+
+                size_t offset = decoder->read_pos % DECODE_RING_SIZE;
+                size_t n = MIN(decoder->write_pos - decoder->read_pos,
+                               DECODE_RING_SIZE - offset);
+
+                n = MIN(n, size - total);
+
+                if (n == 0)
+                        break;
+
+                /* Only this thread changes the read position so the
+                 * data can be copied without the lock.
+                 */
+                pthread_mutex_unlock(&pool->mutex);
+                memcpy(buf + total, decoder->ring + offset, n);
+                pthread_mutex_lock(&pool->mutex);
+
+                decoder->read_pos += n;
+                total += n;
+
+                pthread_cond_broadcast(&pool->cond);
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        return total;
+}
+
+static bool
+queue_decoder(struct decode_pool *pool,
+              struct flt_list *queue,
+              const struct sound *sound,
+              double length)
+{
+        struct decoder *decoder = flt_calloc(sizeof *decoder);
+
+        decoder->pool = pool;
+        decoder->sound = sound;
+        decoder->cp = child_proc_init;
+
+        if (!open_sound(sound, length, &decoder->cp, &decoder->f)) {
+                flt_free(decoder);
+                return false;
         }
 
+        flt_list_insert(queue->prev, &decoder->queue_link);
+
+        pthread_mutex_lock(&pool->mutex);
+        flt_list_insert(pool->decoders.prev, &decoder->pool_link);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+
         return true;
 }
 
+static void
+decode_pool_free(struct decode_pool *pool)
+{
+        pthread_mutex_lock(&pool->mutex);
+        pool->quit = true;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (int i = 0; i < pool->n_threads; i++)
+                pthread_join(pool->threads[i], NULL);
+
+        /* Free the decoders whose sounds never started */
+        struct decoder *decoder, *tmp;
+
+        flt_list_for_each_safe(decoder, tmp, &pool->decoders, pool_link) {
+                free_decoder(decoder);
+        }
+
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->mutex);
+
+        flt_free(pool->threads);
+        flt_free(pool);
+}
+
+static struct decode_pool *
+decode_pool_new(int n_threads)
+{
+        struct decode_pool *pool = flt_calloc(sizeof *pool);
+
+        pthread_mutex_init(&pool->mutex, NULL);
+        pthread_cond_init(&pool->cond, NULL);
+        flt_list_init(&pool->decoders);
+
+        pool->threads = flt_alloc(n_threads * sizeof *pool->threads);
+
+        for (int i = 0; i < n_threads; i++) {
+                int res = pthread_create(pool->threads + i,
+                                         NULL, /* attr */
+                                         decode_thread_cb,
+                                         pool);
+
+                if (res) {
+                        fprintf(stderr,
+                                "error creating thread: %s\n",
+                                strerror(res));
+                        break;
+                }
+
+                pool->n_threads++;
+        }
+
+        if (pool->n_threads == 0) {
+                decode_pool_free(pool);
+                return NULL;
+        }
+
+        return pool;
+}
+
+/* Tries to have n_frames frames ready in the sound’s buffer. Returns
+ * the number of frames available, which is only less than n_frames
+ * if the end of the sound was reached.
+ */
+static size_t
+fill_buffer(struct running_sound *rs, size_t n_frames)
+{
+        size_t available = rs->buf_end - rs->buf_start;
+        size_t wanted = n_frames * FRAME_SIZE;
+
+        if (available < wanted && !rs->eof) {
+                memmove(rs->buf, rs->buf + rs->buf_start, available);
+                rs->buf_start = 0;
+                rs->buf_end = available;
+
+                size_t got;
+
+                if (rs->pcm) {
+                        got = MIN(wanted - available,
+                                  rs->pcm_end - rs->pcm_pos);
+                        memcpy(rs->buf + available,
+                               rs->pcm->frames + rs->pcm_pos,
+                               got);
+                        rs->pcm_pos += got;
+                } else if (rs->decoder) {
+                        got = read_decoder(rs->decoder,
+                                           rs->buf + available,
+                                           wanted - available);
+                } else {
+                        got = fread(rs->buf + available,
+                                    1,
+                                    wanted - available,
+                                    rs->f);
+                }
+
+                if (got < wanted - available)
+                        rs->eof = true;
+
+                rs->buf_end += got;
+                available += got;
+        }
+
+        return MIN(available / FRAME_SIZE, n_frames);
+}
+
+static inline float
+get_sample(const uint8_t *buf)
+{
+        uint32_t value = 0;
+
+        for (int j = 0; j < SAMPLE_SIZE; j++)
+                value |= (uint32_t) buf[j] << (8 * (j + 4 - SAMPLE_SIZE));
+
+        /* The arithmetic shift extends the sign */
+        return (int32_t) value >> (8 * (4 - SAMPLE_SIZE));
+}
+
+/* The samples are mixed in units of the integer sample values so
+ * that a single sound at full volume comes out unchanged.
+ */
+static void
+add_samples_scalar(float *restrict mix,
+                   const uint8_t *restrict buf,
+                   size_t n_frames,
+                   float volume)
+{
+        for (size_t i = 0; i < n_frames * CHANNELS; i++)
+                mix[i] += get_sample(buf + i * SAMPLE_SIZE) * volume;
+}
+
+static void
+add_samples_with_envelope_scalar(float *restrict mix,
+                                 const uint8_t *restrict buf,
+                                 size_t n_frames,
+                                 const float *restrict volumes)
+{
+        for (size_t i = 0; i < n_frames; i++) {
+                for (int j = 0; j < CHANNELS; j++) {
+                        size_t sample = i * CHANNELS + j;
+
+                        mix[sample] += (get_sample(buf + sample * SAMPLE_SIZE) *
+                                        volumes[i]);
+                }
+        }
+}
+
+#if HAVE_X86_SIMD
+
+/* The vector versions multiply and add in the same order as the
+ * scalar ones without fusing, so the results are identical.
+ */
+
+/* Moves each of four packed 24-bit samples into the top three bytes
+ * of a 32-bit lane so that an arithmetic shift extends the sign.
+ */
+#define S24_SHUFFLE -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+
+/* Reads four samples. The load is 16 bytes wide so there must be at
+ * least that many bytes readable at buf.
+ */
+__attribute__((target("ssse3")))
+static inline __m128
+load_samples_ssse3(const uint8_t *buf)
+{
+        __m128i v = _mm_loadu_si128((const __m128i *) buf);
+
+        v = _mm_shuffle_epi8(v, _mm_setr_epi8(S24_SHUFFLE));
+
+        return _mm_cvtepi32_ps(_mm_srai_epi32(v, 8));
+}
+
+/* Reads eight samples with two 16-byte loads so there must be at
+ * least 28 bytes readable at buf.
+ */
+__attribute__((target("avx2")))
+static inline __m256
+load_samples_avx2(const uint8_t *buf)
+{
+        __m128i lo = _mm_loadu_si128((const __m128i *) buf);
+        __m128i hi = _mm_loadu_si128((const __m128i *) (buf + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),
+                                            hi,
+                                            1);
+
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(S24_SHUFFLE,
+                                                     S24_SHUFFLE));
+
+        return _mm256_cvtepi32_ps(_mm256_srai_epi32(v, 8));
+}
+
+__attribute__((target("ssse3")))
+static void
+add_samples_ssse3(float *restrict mix,
+                  const uint8_t *restrict buf,
+                  size_t n_frames,
+                  float volume)
+{
+        size_t n_samples = n_frames * CHANNELS;
+        __m128 v = _mm_set1_ps(volume);
+        size_t i;
+
+        for (i = 0; i + 6 <= n_samples; i += 4) {
+                __m128 s = load_samples_ssse3(buf + i * SAMPLE_SIZE);
+                __m128 m = _mm_loadu_ps(mix + i);
+
+                _mm_storeu_ps(mix + i, _mm_add_ps(m, _mm_mul_ps(s, v)));
+        }
+
+        add_samples_scalar(mix + i,
+                           buf + i * SAMPLE_SIZE,
+                           (n_samples - i) / CHANNELS,
+                           volume);
+}
+
+__attribute__((target("avx2")))
+static void
+add_samples_avx2(float *restrict mix,
+                 const uint8_t *restrict buf,
+                 size_t n_frames,
+                 float volume)
+{
+        size_t n_samples = n_frames * CHANNELS;
+        __m256 v = _mm256_set1_ps(volume);
+        size_t i;
+
+        for (i = 0; i + 10 <= n_samples; i += 8) {
+                __m256 s = load_samples_avx2(buf + i * SAMPLE_SIZE);
+                __m256 m = _mm256_loadu_ps(mix + i);
+
+                _mm256_storeu_ps(mix + i,
+                                 _mm256_add_ps(m, _mm256_mul_ps(s, v)));
+        }
+
+        add_samples_ssse3(mix + i,
+                          buf + i * SAMPLE_SIZE,
+                          (n_samples - i) / CHANNELS,
+                          volume);
+}
+
+__attribute__((target("ssse3")))
+static void
+add_samples_with_envelope_ssse3(float *restrict mix,
+                                const uint8_t *restrict buf,
+                                size_t n_frames,
+                                const float *restrict volumes)
+{
+        size_t n_samples = n_frames * CHANNELS;
+        size_t i;
+
+        for (i = 0; i + 6 <= n_samples; i += 4) {
+                /* One volume for both channels of two frames */
+                __m128 v = _mm_loadl_pi(_mm_setzero_ps(),
+                                        (const __m64 *) (volumes + i / 2));
+                __m128 s = load_samples_ssse3(buf + i * SAMPLE_SIZE);
+                __m128 m = _mm_loadu_ps(mix + i);
+
+                v = _mm_unpacklo_ps(v, v);
+
+                _mm_storeu_ps(mix + i, _mm_add_ps(m, _mm_mul_ps(s, v)));
+        }
+
+        add_samples_with_envelope_scalar(mix + i,
+                                         buf + i * SAMPLE_SIZE,
+                                         (n_samples - i) / CHANNELS,
+                                         volumes + i / CHANNELS);
+}
+
+__attribute__((target("avx2")))
+static void
+add_samples_with_envelope_avx2(float *restrict mix,
+                               const uint8_t *restrict buf,
+                               size_t n_frames,
+                               const float *restrict volumes)
+{
+        size_t n_samples = n_frames * CHANNELS;
+        const __m256i spread = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+        size_t i;
+
+        for (i = 0; i + 10 <= n_samples; i += 8) {
+                /* One volume for both channels of four frames */
+                __m128 v4 = _mm_loadu_ps(volumes + i / 2);
+                __m256 v = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(v4),
+                                                    spread);
+                __m256 s = load_samples_avx2(buf + i * SAMPLE_SIZE);
+                __m256 m = _mm256_loadu_ps(mix + i);
+
+                _mm256_storeu_ps(mix + i,
+                                 _mm256_add_ps(m, _mm256_mul_ps(s, v)));
+        }
+
+        add_samples_with_envelope_ssse3(mix + i,
+                                        buf + i * SAMPLE_SIZE,
+                                        (n_samples - i) / CHANNELS,
+                                        volumes + i / CHANNELS);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static void
+add_samples(float *restrict mix,
+            const uint8_t *restrict buf,
+            size_t n_frames,
+            float volume)
+{
+#if HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2")) {
+                add_samples_avx2(mix, buf, n_frames, volume);
+                return;
+        }
+
+        if (__builtin_cpu_supports("ssse3")) {
+                add_samples_ssse3(mix, buf, n_frames, volume);
+                return;
+        }
+#endif
+
+        add_samples_scalar(mix, buf, n_frames, volume);
+}
+
+static void
+add_samples_with_envelope(float *restrict mix,
+                          const uint8_t *restrict buf,
+                          size_t n_frames,
+                          const float *restrict volumes)
+{
+#if HAVE_X86_SIMD
+        if (__builtin_cpu_supports("avx2")) {
+                add_samples_with_envelope_avx2(mix, buf, n_frames, volumes);
+                return;
+        }
+
+        if (__builtin_cpu_supports("ssse3")) {
+                add_samples_with_envelope_ssse3(mix, buf, n_frames, volumes);
+                return;
+        }
+#endif
+
+        add_samples_with_envelope_scalar(mix, buf, n_frames, volumes);
+}
+
 static bool
-get_samples(struct data *data,
-            double samples[CHANNELS])
+close_running_sound(struct data *data,
+                    struct running_sound *rs)
 {
-        double current_time = data->samples_written / (double) SAMPLE_RATE;
+        bool close_ret;
+
+        if (rs->decoder) {
+                close_ret = free_decoder(rs->decoder);
+                rs->decoder = NULL;
+        } else {
+                close_ret = flt_child_proc_close(&rs->cp);
+                rs->cp = child_proc_init;
+        }
 
+        if (rs->sound == data->music_sound)
+                data->music_sound = NULL;
+
+        flt_list_remove(&rs->link);
+        free_running_sound(rs);
+
+        return close_ret;
+}
+
+/* Mixes up to n_frames frames from all of the running sounds into
+ * data->mix. If a sound ends within the block then the block is cut
+ * short just after it so that the next sound can start on the
+ * following frame. Returns the number of frames mixed or zero on
+ * error.
+ */
+static size_t
+mix_block(struct data *data, size_t n_frames)
+{
         struct running_sound *rs, *tmp;
 
-        for (int i = 0; i < CHANNELS; i++)
-                samples[i] = 0.0;
+        flt_list_for_each(rs, &data->running_sounds, link) {
+                size_t available = fill_buffer(rs, n_frames);
+
+                if (available < n_frames)
+                        n_frames = available + 1;
+        }
+
+        memset(data->mix, 0, n_frames * CHANNELS * sizeof data->mix[0]);
 
         flt_list_for_each_safe(rs, tmp, &data->running_sounds, link) {
-                double sound_samples[CHANNELS];
+                size_t available = MIN((rs->buf_end - rs->buf_start) /
+                                       FRAME_SIZE,
+                                       n_frames);
+                const uint8_t *buf = rs->buf + rs->buf_start;
+
+                if (rs->sound == data->music_sound) {
+                        get_ducking_sounds(data,
+                                           data->samples_written /
+                                           (double) SAMPLE_RATE,
+                                           (data->samples_written +
+                                            available) /
+                                           (double) SAMPLE_RATE);
+
+                        for (size_t i = 0; i < available; i++) {
+                                double sample_time =
+                                        (data->samples_written + i) /
+                                        (double) SAMPLE_RATE;
+
+                                data->envelope[i] =
+                                        rs->sound->volume *
+                                        get_music_volume(data, sample_time);
+                        }
 
-                if (!read_samples(rs, sound_samples)) {
-                        bool close_ret = flt_child_proc_close(&rs->cp);
-                        rs->cp = child_proc_init;
-                        if (!close_ret)
-                                return false;
-                        if (rs->sound == data->music_sound)
-                                data->music_sound = NULL;
-                        flt_list_remove(&rs->link);
-                        free_running_sound(rs);
-                        continue;
+                        add_samples_with_envelope(data->mix,
+                                                  buf,
+                                                  available,
+                                                  data->envelope);
+                } else {
+                        add_samples(data->mix,
+                                    buf,
+                                    available,
+                                    rs->sound->volume);
                 }
 
-                double volume = rs->sound->volume;
-
-                if (rs->sound == data->music_sound)
-                        volume *= get_music_volume(data, current_time);
+                rs->buf_start += available * FRAME_SIZE;
 
-                for (int i = 0; i < CHANNELS; i++)
-                        samples[i] += sound_samples[i] * volume;
+                if (available < n_frames && !close_running_sound(data, rs))
+                        return 0;
         }
 
-        return true;
+        return n_frames;
 }
 
 static bool
-write_samples(const double samples[CHANNELS])
+write_block(struct data *data, size_t n_frames)
 {
-        for (int i = 0; i < CHANNELS; i++) {
-                int value = (samples[i] >= 1.0 ? SAMPLE_MAX_VALUE :
-                             samples[i] <= -1.0 ? -SAMPLE_MAX_VALUE :
-                             round(samples[i] * SAMPLE_MAX_VALUE));
-                for (int j = 0; j < SAMPLE_SIZE; j++) {
-                        if (fputc(value & 0xff, stdout) == EOF) {
-                                fprintf(stderr, "error writing to stdout\n");
-                                return false;
-                        }
+        uint8_t *p = data->out;
 
+        for (size_t i = 0; i < n_frames * CHANNELS; i++) {
+                float sample = data->mix[i];
+                int value = (sample >= SAMPLE_MAX_VALUE ? SAMPLE_MAX_VALUE :
+                             sample <= -SAMPLE_MAX_VALUE ? -SAMPLE_MAX_VALUE :
+                             lroundf(sample));
+
+                for (int j = 0; j < SAMPLE_SIZE; j++) {
+                        *(p++) = value & 0xff;
                         value >>= 8;
                 }
         }
 
+        size_t size = n_frames * FRAME_SIZE;
+
+        if (fwrite(data->out, 1, size, stdout) != size) {
+                fprintf(stderr, "error writing to stdout\n");
+                return false;
+        }
+
         return true;
 }
 
+/* Returns the number of frames before the first frame whose time is
+ * at or after the given time. The time must be after the current
+ * frame.
+ */
+static size_t
+frames_until(const struct data *data, double time)
+{
+        size_t frame = ceil(time * SAMPLE_RATE);
+
+        /* Make sure the result agrees with the floating-point
+         * comparisons used elsewhere.
+         */
+        while (frame > data->samples_written + 1 &&
+               (frame - 1) / (double) SAMPLE_RATE >= time)
+                frame--;
+        while (frame / (double) SAMPLE_RATE < time)
+                frame++;
+
+        return frame - data->samples_written;
+}
+
+/* Gets the number of frames that can be mixed before the set of
+ * running sounds might change.
+ */
+static size_t
+get_block_size(const struct data *data)
+{
+        double current_time = (data->samples_written /
+                               (double) SAMPLE_RATE);
+        size_t n_frames = BUFFER_SIZE;
+
+        if (data->next_sound_link != &data->config->sounds) {
+                const struct sound *next_sound =
+                        flt_container_of(data->next_sound_link,
+                                         struct sound,
+                                         link);
+                size_t frames = frames_until(data, next_sound->start_time);
+
+                n_frames = MIN(n_frames, frames);
+        }
+
+        if (!flt_list_empty(&data->config->music)) {
+                double start_time = data->config->music_start_time;
+                double end_time = data->config->music_end_time;
+
+                if (data->music_sound == NULL && current_time < start_time) {
+                        size_t frames = frames_until(data, start_time);
+
+                        n_frames = MIN(n_frames, frames);
+                }
+
+                if (current_time < end_time) {
+                        size_t frames = frames_until(data, end_time);
+
+                        n_frames = MIN(n_frames, frames);
+                }
+        }
+
+        return n_frames;
+}
+
 static bool
 is_running(const struct data *data)
 {
@@ -359,9 +1156,16 @@ add_sounds(struct data *data)
                 if (next_sound->start_time > current_time)
                         break;
 
-                if (!start_sound(&data->running_sounds,
-                                 next_sound,
-                                 DBL_MAX /* length */)) {
+                if (data->pool) {
+                        /* The sound is always queued by now because
+                         * the lookahead can’t be negative.
+                         */
+                        assert(!flt_list_empty(&data->queued_sounds));
+                        start_decoded_sound(&data->running_sounds,
+                                            &data->queued_sounds);
+                } else if (!start_sound(&data->running_sounds,
+                                        next_sound,
+                                        DBL_MAX /* length */)) {
                         return false;
                 }
 
@@ -371,6 +1175,101 @@ add_sounds(struct data *data)
         return true;
 }
 
+static double
+get_music_length(const struct config *config,
+                 const struct sound *music,
+                 double start_time)
+{
+        if (start_time + music->length > config->music_end_time) {
+                return (config->music_end_time -
+                        start_time +
+                        /* add a sample to make sure we don’t start
+                         * the next sound just for one sample due to
+                         * rounding errors.
+                         */
+                        1.0 / SAMPLE_RATE);
+        }
+
+        return DBL_MAX;
+}
+
+/* Starts decoding the next piece of music, which is expected to
+ * start at start_time.
+ */
+static bool
+queue_next_music(struct data *data, double start_time)
+{
+        const struct sound *music =
+                flt_container_of(data->next_decode_music_link,
+                                 struct sound,
+                                 link);
+
+        if (!queue_decoder(data->pool,
+                           &data->queued_music,
+                           music,
+                           get_music_length(data->config,
+                                            music,
+                                            start_time)))
+                return false;
+
+        /* The next piece starts on the frame after the end of this
+         * one.
+         */
+        data->next_decode_music_time = (start_time +
+                                        music->length +
+                                        1.0 / SAMPLE_RATE);
+
+        data->next_decode_music_link = data->next_decode_music_link->next;
+
+        if (data->next_decode_music_link == &data->config->music) {
+                data->next_decode_music_link =
+                        data->next_decode_music_link->next;
+        }
+
+        return true;
+}
+
+/* Starts decoding all of the sounds that will start within the
+ * lookahead time.
+ */
+static bool
+queue_sounds(struct data *data)
+{
+        const struct config *config = data->config;
+        double horizon = (data->samples_written / (double) SAMPLE_RATE +
+                          config->lookahead);
+
+        while (data->next_decode_sound_link != &config->sounds) {
+                const struct sound *sound =
+                        flt_container_of(data->next_decode_sound_link,
+                                         struct sound,
+                                         link);
+
+                if (sound->start_time > horizon)
+                        break;
+
+                if (!queue_decoder(data->pool,
+                                   &data->queued_sounds,
+                                   sound,
+                                   DBL_MAX /* length */))
+                        return false;
+
+                data->next_decode_sound_link =
+                        data->next_decode_sound_link->next;
+        }
+
+        if (flt_list_empty(&config->music))
+                return true;
+
+        while (data->next_decode_music_time < config->music_end_time &&
+               data->next_decode_music_time <= horizon) {
+                if (!queue_next_music(data, data->next_decode_music_time))
+                        return false;
+        }
+
+        return true;
+}
+
 static bool
 add_music(struct data *data)
 {
@@ -387,26 +1286,38 @@ add_music(struct data *data)
             current_time < data->config->music_start_time)
                 return true;
 
+        if (data->pool) {
+                /* The music might have finished earlier than
+                 * predicted, in which case the next piece needs to
+                 * be started now.
+                 */
+                if (flt_list_empty(&data->queued_music) &&
+                    !queue_next_music(data, current_time))
+                        return false;
+
+                start_decoded_sound(&data->running_sounds,
+                                    &data->queued_music);
+
+                struct running_sound *rs =
+                        flt_container_of(data->running_sounds.prev,
+                                         struct running_sound,
+                                         link);
+
+                data->music_sound = rs->sound;
+
+                return true;
+        }
+
         const struct sound *next_music =
                 flt_container_of(data->next_music_link,
                                  struct sound,
                                  link);
 
-        double length = DBL_MAX;
-
-        if (current_time + next_music->length > data->config->music_end_time) {
-                length = (data->config->music_end_time -
-                          current_time +
-                          /* add a sample to make sure we don’t start
-                           * the next sound just for one sample due to
-                           * rounding errors.
-                           */
-                          1.0 / SAMPLE_RATE);
-        }
-
         if (!start_sound(&data->running_sounds,
                          next_music,
-                         length)) {
+                         get_music_length(data->config,
+                                          next_music,
+                                          current_time))) {
                 return false;
         }
 
@@ -427,13 +1338,33 @@ write_sounds(const struct config *config)
                 .samples_written = 0,
                 .next_sound_link = config->sounds.next,
                 .next_music_link = config->music.next,
+                .next_decode_sound_link = config->sounds.next,
+                .next_decode_music_link = config->music.next,
+                .next_decode_music_time = config->music_start_time,
+                .next_ducking_link = config->sounds.next,
+                .ducking_sounds = FLT_BUFFER_STATIC_INIT,
                 .config = config,
         };
         bool ret = true;
 
         flt_list_init(&data.running_sounds);
+        flt_list_init(&data.queued_sounds);
+        flt_list_init(&data.queued_music);
+
+        /* Decoding ahead isn’t needed when the sounds are cached */
+        if (config->n_decode_threads > 0 && !config->use_pcm_cache) {
+                data.pool = decode_pool_new(config->n_decode_threads);
+
+                if (data.pool == NULL)
+                        return false;
+        }
 
         while (is_running(&data)) {
+                if (data.pool && !queue_sounds(&data)) {
+                        ret = false;
+                        break;
+                }
+
                 if (!add_sounds(&data)) {
                         ret = false;
                         break;
@@ -444,18 +1375,21 @@ write_sounds(const struct config *config)
                         break;
                 }
 
-                double samples[CHANNELS];
+                size_t n_frames = mix_block(&data, get_block_size(&data));
 
-                if (!get_samples(&data, samples) ||
-                    !write_samples(samples)) {
+                if (n_frames == 0 || !write_block(&data, n_frames)) {
                         ret = false;
                         break;
                 }
 
-                data.samples_written++;
+                data.samples_written += n_frames;
         }
 
         free_running_sounds(&data.running_sounds);
+        flt_buffer_destroy(&data.ducking_sounds);
+
+        if (data.pool)
+                decode_pool_free(data.pool);
 
         return ret;
 }
@@ -522,6 +1456,23 @@ parse_time(const char *str, double *value)
                 *value >= 0.0);
 }
 
+static bool
+parse_positive_int(const char *str, int *value_out)
+{
+        errno = 0;
+
+        char *tail;
+
+        long value = strtol(str, &tail, 10);
+
+        if (value <= 0 || value > INT_MAX || errno || *tail)
+                return false;
+
+        *value_out = value;
+
+        return true;
+}
+
 static bool
 process_options(int argc, char **argv, struct config *config)
 {
@@ -530,7 +1481,7 @@ process_options(int argc, char **argv, struct config *config)
         char *tail;
 
         while (true) {
-                switch (getopt(argc, argv, "-s:v:m:S:E:")) {
+                switch (getopt(argc, argv, "-s:v:m:S:E:j:l:c")) {
                 case 's':
                         if (!parse_time(optarg, &sound_template.start_time)) {
                                 fprintf(stderr,
@@ -558,6 +1509,29 @@ process_options(int argc, char **argv, struct config *config)
                         }
                         break;
 
+                case 'j':
+                        if (!parse_positive_int(optarg,
+                                                &config->n_decode_threads)) {
+                                fprintf(stderr,
+                                        "invalid number of threads: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'l':
+                        if (!parse_time(optarg, &config->lookahead)) {
+                                fprintf(stderr,
+                                        "invalid lookahead: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
+
+                case 'c':
+                        config->use_pcm_cache = true;
+                        break;
+
                 case 'v':
                         errno = 0;
 
@@ -624,6 +1598,113 @@ process_options(int argc, char **argv, struct config *config)
         }
 }
 
+static struct pcm_file *
+get_pcm_file(struct config *config, const char *filename)
+{
+        struct pcm_file *file;
+
+        flt_list_for_each(file, &config->pcm_files, link) {
+                if (!strcmp(file->filename, filename))
+                        return file;
+        }
+
+        file = flt_calloc(sizeof *file);
+        file->filename = filename;
+        flt_list_insert(config->pcm_files.prev, &file->link);
+
+        return file;
+}
+
+static void
+finish_pcm_decodes(struct pcm_file **files,
+                   struct flt_pcm_decode *decodes,
+                   int n_decodes)
+{
+        for (int i = 0; i < n_decodes; i++) {
+                files[i]->loaded =
+                        flt_pcm_cache_finish_decode(decodes + i,
+                                                    &files[i]->pcm);
+        }
+}
+
+/* Maps the cached PCM for all of the sounds, decoding the ones that
+ * aren’t in the cache yet several at a time. A sound that can’t be
+ * cached is decoded while mixing instead.
+ */
+static void
+load_pcm_cache(struct config *config)
+{
+        static const struct flt_pcm_format format = {
+                .sample_rate = SAMPLE_RATE,
+                .channels = CHANNELS,
+                .sample_size = SAMPLE_SIZE,
+        };
+        struct flt_list *lists[] = { &config->sounds, &config->music };
+        struct sound *sound;
+
+        for (int i = 0; i < FLT_N_ELEMENTS(lists); i++) {
+                flt_list_for_each(sound, lists[i], link) {
+                        get_pcm_file(config, sound->filename);
+                }
+        }
+
+        int max_decodes = config->n_decode_threads;
+
+        if (max_decodes <= 0)
+                max_decodes = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+        struct pcm_file **files = flt_alloc(max_decodes * sizeof *files);
+        struct flt_pcm_decode *decodes =
+                flt_alloc(max_decodes * sizeof *decodes);
+        int n_decodes = 0;
+        struct pcm_file *file;
+
+        flt_list_for_each(file, &config->pcm_files, link) {
+                file->loaded = flt_pcm_cache_load(file->filename,
+                                                  &format,
+                                                  &file->pcm);
+
+                if (file->loaded ||
+                    !flt_pcm_cache_start_decode(file->filename,
+                                                &format,
+                                                decodes + n_decodes))
+                        continue;
+
+                files[n_decodes++] = file;
+
+                if (n_decodes >= max_decodes) {
+                        finish_pcm_decodes(files, decodes, n_decodes);
+                        n_decodes = 0;
+                }
+        }
+
+        finish_pcm_decodes(files, decodes, n_decodes);
+
+        flt_free(decodes);
+        flt_free(files);
+
+        for (int i = 0; i < FLT_N_ELEMENTS(lists); i++) {
+                flt_list_for_each(sound, lists[i], link) {
+                        file = get_pcm_file(config, sound->filename);
+
+                        if (file->loaded)
+                                sound->pcm = file;
+                }
+        }
+}
+
+static void
+free_pcm_files(struct flt_list *list)
+{
+        struct pcm_file *file, *tmp;
+
+        flt_list_for_each_safe(file, tmp, list, link) {
+                if (file->loaded)
+                        flt_pcm_destroy(&file->pcm);
+                flt_free(file);
+        }
+}
+
 static double
 get_sound_end_time(const struct flt_list *sounds)
 {
@@ -647,10 +1728,13 @@ main(int argc, char **argv)
         struct config config = {
                 .music_start_time = 0.0,
                 .music_end_time = -1.0,
+                .n_decode_threads = 0,
+                .lookahead = DEFAULT_LOOKAHEAD,
         };
 
         flt_list_init(&config.sounds);
         flt_list_init(&config.music);
+        flt_list_init(&config.pcm_files);
 
         int ret = EXIT_SUCCESS;
 
@@ -664,12 +1748,16 @@ main(int argc, char **argv)
 
         sort_sounds(&config.sounds);
 
+        if (config.use_pcm_cache)
+                load_pcm_cache(&config);
+
         if (!write_sounds(&config)) {
                 ret = EXIT_FAILURE;
                 goto out;
         }
 
 out:
+        free_pcm_files(&config.pcm_files);
         free_sounds(&config.sounds);
         free_sounds(&config.music);
 
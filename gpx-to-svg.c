@@ -28,13 +28,24 @@
 
 #define TILE_SIZE 256
 
+/* The points are simplified in chunks of this size so that the memory
+ * used doesn’t depend on the size of the track.
+ */
+#define MAX_PENDING_POINTS 4096
+
 struct config {
         double lat, lon;
         int width, height;
         int zoom;
+        /* Maximum distance in pixels that a simplified line can move */
+        double tolerance;
         const char *output_filename;
 };
 
+struct point {
+        int x, y;
+};
+
 struct data {
         struct config config;
         FILE *output_file;
@@ -42,6 +53,14 @@ struct data {
         int top_y;
         bool is_first;
         bool is_segment_start;
+        /* Points that haven’t been written yet. The first one starts a
+         * segment if pending_is_segment_start is true, otherwise it
+         * continues it and has already been written.
+         */
+        struct point pending[MAX_PENDING_POINTS];
+        bool keep[MAX_PENDING_POINTS];
+        size_t n_pending;
+        bool pending_is_segment_start;
 };
 
 static void
@@ -89,6 +108,127 @@ lat_to_pixel_y(double lat, int zoom)
         return tile * TILE_SIZE + pixel;
 }
 
+static void
+write_point(struct data *data, const struct point *point, bool is_move)
+{
+        if (data->is_first)
+                data->is_first = false;
+        else
+                fputc(' ', data->output_file);
+
+        fprintf(data->output_file,
+                "%c %i %i",
+                is_move ? 'M' : 'L',
+                point->x,
+                point->y);
+}
+
+static double
+distance_to_line(const struct point *point,
+                 const struct point *a,
+                 const struct point *b)
+{
+        double dx = b->x - a->x, dy = b->y - a->y;
+        double px = point->x - a->x, py = point->y - a->y;
+        double length = sqrt(dx * dx + dy * dy);
+
+        if (length == 0.0)
+                return sqrt(px * px + py * py);
+
+        return fabs(px * dy - py * dx) / length;
+}
+
+/* Douglas-Peucker simplification of the points between first and
+ * last, both of which are kept.
+ */
+static void
+simplify_points(struct data *data, size_t first, size_t last)
+{
+        if (last - first < 2)
+                return;
+
+        const struct point *a = data->pending + first;
+        const struct point *b = data->pending + last;
+        double max_distance = -1.0;
+        size_t max_point = first;
+
+        for (size_t i = first + 1; i < last; i++) {
+                double distance = distance_to_line(data->pending + i, a, b);
+
+                if (distance > max_distance) {
+                        max_distance = distance;
+                        max_point = i;
+                }
+        }
+
+        if (max_distance <= data->config.tolerance)
+                return;
+
+        data->keep[max_point] = true;
+
+        simplify_points(data, first, max_point);
+        simplify_points(data, max_point, last);
+}
+
+/* Writes the pending points. If end_segment is false the last point
+ * is kept as the start of the next chunk.
+ */
+static void
+flush_points(struct data *data, bool end_segment)
+{
+        if (data->n_pending <= 0)
+                return;
+
+        size_t last = data->n_pending - 1;
+
+        for (size_t i = 0; i <= last; i++)
+                data->keep[i] = (data->config.tolerance <= 0.0 ||
+                                 i == 0 ||
+                                 i == last);
+
+        simplify_points(data, 0, last);
+
+        if (data->pending_is_segment_start)
+                write_point(data, data->pending + 0, true);
+
+        for (size_t i = 1; i <= last; i++) {
+                if (data->keep[i])
+                        write_point(data, data->pending + i, false);
+        }
+
+        data->pending_is_segment_start = false;
+
+        if (end_segment) {
+                data->n_pending = 0;
+        } else {
+                data->pending[0] = data->pending[last];
+                data->n_pending = 1;
+        }
+}
+
+static void
+add_point(struct data *data, int x, int y)
+{
+        if (data->is_segment_start) {
+                flush_points(data, true);
+                data->pending_is_segment_start = true;
+                data->is_segment_start = false;
+        } else if (data->n_pending > 0) {
+                const struct point *prev = data->pending + data->n_pending - 1;
+
+                /* Skip points that land on the same pixel */
+                if (prev->x == x && prev->y == y)
+                        return;
+
+                if (data->n_pending >= MAX_PENDING_POINTS)
+                        flush_points(data, false);
+        }
+
+        data->pending[data->n_pending].x = x;
+        data->pending[data->n_pending].y = y;
+        data->n_pending++;
+}
+
 static void XMLCALL
 start_element_cb(void *user_data, const XML_Char *name, const XML_Char **atts)
 {
@@ -109,18 +249,7 @@ start_element_cb(void *user_data, const XML_Char *name, const XML_Char **atts)
                 int x = lon_to_pixel_x(lon, data->config.zoom) - data->left_x;
                 int y = lat_to_pixel_y(lat, data->config.zoom) - data->top_y;
 
-                if (data->is_first)
-                        data->is_first = false;
-                else
-                        fputc(' ', data->output_file);
-
-                fprintf(data->output_file,
-                        "%c %i %i",
-                        data->is_segment_start ? 'M' : 'L',
-                        x,
-                        y);
-
-                data->is_segment_start = false;
+                add_point(data, x, y);
         }
 }
 
@@ -195,9 +324,12 @@ process_options(int argc, char **argv, struct config *config)
         config->width = 1920;
         config->height = 1080;
         config->zoom = 17;
+        config->tolerance = 0.5;
 
         while (true) {
-                switch (getopt(argc, argv, "-w:h:z:o:")) {
+                char *tail;
+
+                switch (getopt(argc, argv, "-w:h:z:t:o:")) {
                 case 'w':
                         if (!parse_positive_int(optarg, &config->width)) {
                                 fprintf(stderr,
@@ -222,6 +354,22 @@ process_options(int argc, char **argv, struct config *config)
                                 return false;
                         }
                         break;
+                case 't':
+                        errno = 0;
+
+                        config->tolerance = strtod(optarg, &tail);
+
+                        if (errno ||
+                            (!isnormal(config->tolerance) &&
+                             config->tolerance != 0.0) ||
+                            config->tolerance < 0.0 ||
+                            *tail) {
+                                fprintf(stderr,
+                                        "invalid tolerance: %s\n",
+                                        optarg);
+                                return false;
+                        }
+                        break;
                 case 'o':
                         config->output_filename = optarg;
                         break;
@@ -341,6 +489,8 @@ main(int argc, char **argv)
                 }
         } while (!done);
 
+        flush_points(&data, true);
+
         if (!data.is_first)
                 fputc('\n', data.output_file);
 
@@ -23,18 +23,16 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include <time.h>
-#include <sys/stat.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <sys/types.h>
-#include <dirent.h>
-#include <SDL_image.h>
 #include <SDL.h>
 #include <librsvg/rsvg.h>
 #include <assert.h>
 
 #include "flt-buffer.h"
 #include "flt-parse-stdio.h"
+#include "flootay.h"
 
 /* Tolerance for the timestamp when loading key frames from a scene */
 #define LOAD_KEY_FRAME_TOLERANCE 0.0005
@@ -46,13 +44,82 @@ struct config {
         int default_box_width, default_box_height;
         const char *script_to_load;
         const char *svg_to_load;
+        const char *overlay_script;
 };
 
+#define VIDEO_WIDTH 1920
+#define VIDEO_HEIGHT 1080
+#define IMAGE_SCALE 2
+#define DISPLAY_WIDTH (VIDEO_WIDTH / IMAGE_SCALE)
+#define DISPLAY_HEIGHT (VIDEO_HEIGHT / IMAGE_SCALE)
+/* Number of previous boxes to show */
+#define N_PREVIOUS_BOXES 5
+#define MIN_ALPHA 10
+#define MAX_ALPHA 128
+
+/* The frames are decoded as packed RGB at the display size */
+#define FRAME_STRIDE (DISPLAY_WIDTH * 3)
+#define FRAME_SIZE (FRAME_STRIDE * DISPLAY_HEIGHT)
+/* Number of decoded frames to keep in memory */
+#define RING_SIZE 64
+/* Number of frames in the ring to keep from before the current frame
+ * so that scrolling back a bit doesn’t need a seek.
+ */
+#define RING_BEHIND (RING_SIZE / 4)
+/* Number of frames on either side of the current frame to upload to
+ * textures while the UI is idle.
+ */
+#define PREFETCH_DISTANCE 8
+#define TEXTURE_CACHE_SIZE (PREFETCH_DISTANCE * 2 + 1)
+
 struct frame_data {
         bool has_box;
         SDL_Rect box;
 };
 
+struct frame_texture {
+        SDL_Texture *texture;
+        /* -1 if the texture doesn’t contain a frame */
+        int frame_num;
+};
+
+struct decoder {
+        const struct config *config;
+
+        SDL_Thread *thread;
+        SDL_mutex *mutex;
+        /* Signalled when the wanted frame changes or to quit */
+        SDL_cond *wake_cond;
+        /* Signalled whenever a frame is decoded or end_frame changes */
+        SDL_cond *frame_cond;
+        /* Event pushed in the same situations as frame_cond */
+        Uint32 event_type;
+
+        /* The following members are protected by the mutex */
+        bool quit;
+        /* The frame being shown. The decoder tries to keep the
+         * frames around this in the ring.
+         */
+        int wanted_frame;
+        /* Number of the frame stored in each slot of the ring or -1
+         * if the slot is empty or being written to.
+         */
+        int slot_frames[RING_SIZE];
+        /* Frame number after the last frame that can be decoded.
+         * This starts as the number of frames expected from the time
+         * range and is lowered if ffmpeg stops early.
+         */
+        int end_frame;
+        uint8_t *pixels;
+
+        /* The following members are only used by the thread */
+        uint8_t *scratch;
+        pid_t pid;
+        int read_fd;
+        /* The frame number of the next frame that will be read */
+        int next_frame;
+};
+
 struct data {
         bool should_quit;
 
@@ -64,12 +131,30 @@ struct data {
 
         struct config config;
 
+        bool decoder_inited;
+        struct decoder decoder;
+
         int current_image_num;
-        SDL_Surface *current_image;
+        /* Whether current_texture contains current_image_num yet */
+        bool current_image_loaded;
+        /* One of the textures in texture_cache, or NULL */
         SDL_Texture *current_texture;
 
+        struct frame_texture texture_cache[TEXTURE_CACHE_SIZE];
+
         SDL_Texture *svg_texture;
 
+        /* Live preview of the overlay from a flootay script. This
+         * is rendered at the display size.
+         */
+        struct flootay *flootay;
+        cairo_surface_t *overlay_surface;
+        SDL_Texture *overlay_texture;
+        /* Frame that overlay_surface was rendered for or -1 */
+        int overlay_frame_num;
+        /* Region of overlay_surface that isn’t transparent */
+        cairo_rectangle_int_t overlay_damage;
+
         int default_box_width, default_box_height;
 
         bool drawing_box;
@@ -91,16 +176,6 @@ struct data {
         bool redraw_queued;
 };
 
-#define IMAGES_DIR "key-frames-tmp"
-#define VIDEO_WIDTH 1920
-#define VIDEO_HEIGHT 1080
-#define IMAGE_SCALE 2
-#define DISPLAY_WIDTH (VIDEO_WIDTH / IMAGE_SCALE)
-#define DISPLAY_HEIGHT (VIDEO_HEIGHT / IMAGE_SCALE)
-/* Number of previous boxes to show */
-#define N_PREVIOUS_BOXES 5
-#define MIN_ALPHA 10
-#define MAX_ALPHA 128
 
 static bool
 init_sdl(struct data *data)
@@ -161,75 +236,560 @@ destroy_sdl(struct data *data)
 static void
 free_image(struct data *data)
 {
-        if (data->current_texture) {
-                SDL_DestroyTexture(data->current_texture);
-                data->current_texture = NULL;
-        }
+        for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+                struct frame_texture *ft = data->texture_cache + i;
+
+                if (ft->texture) {
+                        SDL_DestroyTexture(ft->texture);
+                        ft->texture = NULL;
+                }
 
-        if (data->current_image) {
-                SDL_FreeSurface(data->current_image);
-                data->current_image = NULL;
+                ft->frame_num = -1;
         }
 
+        data->current_texture = NULL;
         data->current_image_num = -1;
+        data->current_image_loaded = false;
 }
 
-static SDL_Surface *
-load_image(int image_num)
+static bool
+read_all(int fd, uint8_t *buf, size_t size)
 {
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        while (size > 0) {
+                ssize_t got = read(fd, buf, size);
 
-        flt_buffer_append_printf(&buf,
-                                 "%s/%03i.png",
-                                 IMAGES_DIR,
-                                 image_num + 1);
+                if (got == -1) {
+                        if (errno == EINTR)
+                                continue;
 
-        SDL_Surface *surface = IMG_Load((const char *) buf.data);
+                        fprintf(stderr,
+                                "error reading from ffmpeg: %s\n",
+                                strerror(errno));
+                        return false;
+                }
 
-        if (surface == NULL) {
-                fprintf(stderr,
-                        "%s: %s\n",
-                        (const char *) buf.data,
-                        IMG_GetError());
+                if (got == 0)
+                        return false;
+
+                buf += got;
+                size -= got;
         }
 
-        flt_buffer_destroy(&buf);
+        return true;
+}
+
+static void
+stop_ffmpeg(struct decoder *decoder)
+{
+        if (decoder->read_fd != -1) {
+                close(decoder->read_fd);
+                decoder->read_fd = -1;
+        }
 
-        return surface;
+        if (decoder->pid > 0) {
+                /* ffmpeg is either already finished or it is being
+                 * interrupted to seek elsewhere so the exit status
+                 * isn’t interesting.
+                 */
+                kill(decoder->pid, SIGTERM);
+                waitpid(decoder->pid, NULL, 0 /* options */);
+                decoder->pid = -1;
+        }
+}
+
+static bool
+start_ffmpeg(struct decoder *decoder, int frame_num)
+{
+        const struct config *config = decoder->config;
+        double seek_time = (config->start_time +
+                            frame_num / (double) config->fps);
+
+        /* The arguments are prepared before forking because the
+         * child of a threaded process shouldn’t allocate memory.
+         */
+        struct flt_buffer start_time = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append_printf(&start_time, "%f", seek_time);
+
+        struct flt_buffer end_time = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append_printf(&end_time, "%f", config->end_time);
+
+        struct flt_buffer filter = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append_printf(&filter,
+                                 "fps=%i,"
+                                 "scale=%i:%i,"
+                                 "drawtext=fontfile=Arial.ttf:"
+                                 "text='%%{expr\\:t+%f}':"
+                                 "fontsize=%i:"
+                                 "bordercolor=white:"
+                                 "borderw=%i:"
+                                 "y=%i",
+                                 config->fps,
+                                 DISPLAY_WIDTH,
+                                 DISPLAY_HEIGHT,
+                                 seek_time,
+                                 DISPLAY_HEIGHT / 5,
+                                 DISPLAY_HEIGHT / 180,
+                                 DISPLAY_HEIGHT / 180);
+
+        const char *args[] = {
+                "ffmpeg",
+                "-nostdin",
+                "-loglevel", "error",
+                "-ss", (const char *) start_time.data,
+                "-to", (const char *) end_time.data,
+                "-i", config->video_filename,
+                "-vf", (const char *) filter.data,
+                "-f", "rawvideo",
+                "-pix_fmt", "rgb24",
+                "-",
+                NULL
+        };
+
+        bool ret = false;
+        int pipe_fds[2];
+
+        if (pipe(pipe_fds) == -1) {
+                fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+                goto out;
+        }
+
+        pid_t pid = fork();
+
+        if (pid == -1) {
+                fprintf(stderr, "fork failed: %s\n", strerror(errno));
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                goto out;
+        }
+
+        if (pid == 0) {
+                close(pipe_fds[0]);
+
+                if (dup2(pipe_fds[1], STDOUT_FILENO) != -1) {
+                        close(pipe_fds[1]);
+                        execvp(args[0], (char **) args);
+                }
+
+                _exit(EXIT_FAILURE);
+        }
+
+        close(pipe_fds[1]);
+
+        decoder->pid = pid;
+        decoder->read_fd = pipe_fds[0];
+        decoder->next_frame = frame_num;
+
+        ret = true;
+
+out:
+        flt_buffer_destroy(&filter);
+        flt_buffer_destroy(&end_time);
+        flt_buffer_destroy(&start_time);
+
+        return ret;
 }
 
 static void
-set_image(struct data *data, int image_num)
+notify_frame(struct decoder *decoder)
 {
-        if (image_num == data->current_image_num)
-                return;
+        SDL_CondBroadcast(decoder->frame_cond);
 
-        data->redraw_queued = true;
-        data->layout_dirty = true;
+        if (decoder->event_type != (Uint32) -1) {
+                SDL_Event event = { .type = decoder->event_type };
+                SDL_PushEvent(&event);
+        }
+}
 
-        free_image(data);
+static bool
+is_frame_in_window(const struct decoder *decoder, int frame_num)
+{
+        return (frame_num >= decoder->wanted_frame - RING_BEHIND &&
+                frame_num < decoder->wanted_frame + RING_SIZE - RING_BEHIND);
+}
 
-        if (image_num == -1)
-                return;
+static bool
+is_frame_decoded(const struct decoder *decoder, int frame_num)
+{
+        return decoder->slot_frames[frame_num % RING_SIZE] == frame_num;
+}
 
-        data->current_image = load_image(image_num);
+/* Returns the first frame from the playhead onwards that isn’t in the
+ * ring yet. If all of those are available then it returns the
+ * earliest missing frame before the playhead so that a single seek
+ * can fill them all in. Returns -1 if there is nothing to do.
+ */
+static int
+get_next_missing_frame(const struct decoder *decoder)
+{
+        int end = MIN(decoder->end_frame,
+                      decoder->wanted_frame + RING_SIZE - RING_BEHIND);
 
-        if (data->current_image == NULL)
+        for (int i = decoder->wanted_frame; i < end; i++) {
+                if (!is_frame_decoded(decoder, i))
+                        return i;
+        }
+
+        int start = MAX(0, decoder->wanted_frame - RING_BEHIND);
+
+        for (int i = start; i < decoder->wanted_frame; i++) {
+                if (!is_frame_decoded(decoder, i))
+                        return i;
+        }
+
+        return -1;
+}
+
+/* Called with the mutex locked */
+static void
+decode_next_frame(struct decoder *decoder)
+{
+        int frame_num = decoder->next_frame;
+        int slot = frame_num % RING_SIZE;
+        bool keep = (is_frame_in_window(decoder, frame_num) &&
+                     !is_frame_decoded(decoder, frame_num));
+        uint8_t *dst;
+
+        if (keep) {
+                decoder->slot_frames[slot] = -1;
+                dst = decoder->pixels + slot * (size_t) FRAME_SIZE;
+        } else {
+                /* This frame is only being read to skip ahead or we
+                 * already have it.
+                 */
+                dst = decoder->scratch;
+        }
+
+        SDL_UnlockMutex(decoder->mutex);
+
+        bool ok = read_all(decoder->read_fd, dst, FRAME_SIZE);
+
+        if (!ok)
+                stop_ffmpeg(decoder);
+
+        SDL_LockMutex(decoder->mutex);
+
+        if (!ok) {
+                if (frame_num < decoder->end_frame) {
+                        decoder->end_frame = frame_num;
+                        notify_frame(decoder);
+                }
                 return;
+        }
 
-        data->current_texture =
-                SDL_CreateTextureFromSurface(data->renderer,
-                                             data->current_image);
+        decoder->next_frame++;
 
-        if (data->current_texture == NULL) {
+        if (keep) {
+                decoder->slot_frames[slot] = frame_num;
+
+                if (is_frame_in_window(decoder, frame_num))
+                        notify_frame(decoder);
+        }
+}
+
+static int
+decoder_thread_cb(void *user_data)
+{
+        struct decoder *decoder = user_data;
+
+        SDL_LockMutex(decoder->mutex);
+
+        while (!decoder->quit) {
+                int frame_num = get_next_missing_frame(decoder);
+
+                if (frame_num == -1) {
+                        SDL_CondWait(decoder->wake_cond, decoder->mutex);
+                        continue;
+                }
+
+                /* Restart ffmpeg if the frame is behind it or too
+                 * far ahead to be worth decoding up to.
+                 */
+                if (decoder->read_fd == -1 ||
+                    frame_num < decoder->next_frame ||
+                    frame_num - decoder->next_frame > RING_SIZE) {
+                        SDL_UnlockMutex(decoder->mutex);
+                        stop_ffmpeg(decoder);
+                        bool started = start_ffmpeg(decoder, frame_num);
+                        SDL_LockMutex(decoder->mutex);
+
+                        if (!started) {
+                                decoder->end_frame = frame_num;
+                                notify_frame(decoder);
+                                continue;
+                        }
+                }
+
+                decode_next_frame(decoder);
+        }
+
+        SDL_UnlockMutex(decoder->mutex);
+
+        stop_ffmpeg(decoder);
+
+        return 0;
+}
+
+static bool
+init_decoder(struct decoder *decoder,
+             const struct config *config,
+             int n_frames)
+{
+        decoder->config = config;
+        decoder->quit = false;
+        decoder->wanted_frame = 0;
+        decoder->end_frame = n_frames;
+        decoder->pid = -1;
+        decoder->read_fd = -1;
+        decoder->next_frame = 0;
+
+        for (int i = 0; i < RING_SIZE; i++)
+                decoder->slot_frames[i] = -1;
+
+        decoder->pixels = flt_alloc(RING_SIZE * (size_t) FRAME_SIZE);
+        decoder->scratch = flt_alloc(FRAME_SIZE);
+
+        decoder->event_type = SDL_RegisterEvents(1);
+        decoder->mutex = SDL_CreateMutex();
+        decoder->wake_cond = SDL_CreateCond();
+        decoder->frame_cond = SDL_CreateCond();
+
+        decoder->thread = SDL_CreateThread(decoder_thread_cb,
+                                           "decoder",
+                                           decoder);
+
+        if (decoder->thread == NULL) {
+                fprintf(stderr,
+                        "Failed to create decoder thread: %s\n",
+                        SDL_GetError());
+                SDL_DestroyCond(decoder->frame_cond);
+                SDL_DestroyCond(decoder->wake_cond);
+                SDL_DestroyMutex(decoder->mutex);
+                flt_free(decoder->scratch);
+                flt_free(decoder->pixels);
+                return false;
+        }
+
+        return true;
+}
+
+static void
+destroy_decoder(struct decoder *decoder)
+{
+        SDL_LockMutex(decoder->mutex);
+        decoder->quit = true;
+        SDL_CondSignal(decoder->wake_cond);
+        SDL_UnlockMutex(decoder->mutex);
+
+        SDL_WaitThread(decoder->thread, NULL /* status */);
+
+        SDL_DestroyCond(decoder->frame_cond);
+        SDL_DestroyCond(decoder->wake_cond);
+        SDL_DestroyMutex(decoder->mutex);
+        flt_free(decoder->scratch);
+        flt_free(decoder->pixels);
+}
+
+/* Blocks until the frame is decoded. Returns false if ffmpeg stopped
+ * before reaching it.
+ */
+static bool
+wait_for_frame(struct decoder *decoder, int frame_num)
+{
+        SDL_LockMutex(decoder->mutex);
+
+        while (!is_frame_decoded(decoder, frame_num) &&
+               frame_num < decoder->end_frame)
+                SDL_CondWait(decoder->frame_cond, decoder->mutex);
+
+        bool ret = frame_num < decoder->end_frame;
+
+        SDL_UnlockMutex(decoder->mutex);
+
+        return ret;
+}
+
+static struct frame_texture *
+find_texture(struct data *data, int frame_num)
+{
+        for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+                if (data->texture_cache[i].frame_num == frame_num)
+                        return data->texture_cache + i;
+        }
+
+        return NULL;
+}
+
+/* Returns a texture that can be reused for a new frame. Textures for
+ * frames that are no further than min_distance from the current frame
+ * are kept, as is the texture currently being shown.
+ */
+static struct frame_texture *
+get_free_texture(struct data *data, int min_distance)
+{
+        struct frame_texture *best = NULL;
+        int best_distance = min_distance;
+
+        for (int i = 0; i < TEXTURE_CACHE_SIZE; i++) {
+                struct frame_texture *ft = data->texture_cache + i;
+
+                if (ft->frame_num == -1) {
+                        best = ft;
+                        break;
+                }
+
+                if (ft->texture == data->current_texture)
+                        continue;
+
+                int distance = abs(ft->frame_num - data->current_image_num);
+
+                if (distance > best_distance) {
+                        best = ft;
+                        best_distance = distance;
+                }
+        }
+
+        if (best == NULL || best->texture)
+                return best;
+
+        best->texture = SDL_CreateTexture(data->renderer,
+                                          SDL_PIXELFORMAT_RGB24,
+                                          SDL_TEXTUREACCESS_STREAMING,
+                                          DISPLAY_WIDTH, DISPLAY_HEIGHT);
+
+        if (best->texture == NULL) {
                 fprintf(stderr,
                         "Error creating texture: %s\n",
                         SDL_GetError());
-                free_image(data);
-                return;
+                return NULL;
         }
 
+        return best;
+}
+
+/* Copies a decoded frame into a texture. Called with the decoder
+ * mutex locked.
+ */
+static struct frame_texture *
+upload_frame(struct data *data, int frame_num, int min_distance)
+{
+        const struct decoder *decoder = &data->decoder;
+
+        if (!is_frame_decoded(decoder, frame_num))
+                return NULL;
+
+        struct frame_texture *ft = get_free_texture(data, min_distance);
+
+        if (ft == NULL)
+                return NULL;
+
+        int slot = frame_num % RING_SIZE;
+
+        SDL_UpdateTexture(ft->texture,
+                          NULL, /* rect */
+                          decoder->pixels + slot * (size_t) FRAME_SIZE,
+                          FRAME_STRIDE);
+        ft->frame_num = frame_num;
+
+        return ft;
+}
+
+/* Uploads one of the decoded frames near the current frame to a
+ * texture so that stepping to it doesn’t have to wait. Returns false
+ * if there was nothing to do.
+ */
+static bool
+prefetch_texture(struct data *data)
+{
+        bool ret = false;
+
+        SDL_LockMutex(data->decoder.mutex);
+
+        for (int distance = 1; distance <= PREFETCH_DISTANCE; distance++) {
+                for (int dir = 1; dir >= -1; dir -= 2) {
+                        int frame_num = data->current_image_num +
+                                distance * dir;
+
+                        if (frame_num < 0 ||
+                            frame_num >= data->n_images ||
+                            find_texture(data, frame_num))
+                                continue;
+
+                        if (upload_frame(data, frame_num, distance)) {
+                                ret = true;
+                                goto out;
+                        }
+                }
+        }
+
+out:
+        SDL_UnlockMutex(data->decoder.mutex);
+
+        return ret;
+}
+
+/* Picks up any changes from the decoder thread. This is called
+ * whenever the thread sends an event.
+ */
+static void
+update_from_decoder(struct data *data)
+{
+        struct decoder *decoder = &data->decoder;
+
+        SDL_LockMutex(decoder->mutex);
+
+        /* Frame 0 is always available so there will be at least one
+         * frame.
+         */
+        data->n_images = MAX(1, MIN(data->n_images, decoder->end_frame));
+
+        if (data->current_image_num >= data->n_images) {
+                data->current_image_num = data->n_images - 1;
+                data->current_image_loaded = false;
+                decoder->wanted_frame = data->current_image_num;
+                SDL_CondSignal(decoder->wake_cond);
+        }
+
+        if (!data->current_image_loaded) {
+                int frame_num = data->current_image_num;
+                struct frame_texture *ft = find_texture(data, frame_num);
+
+                if (ft == NULL)
+                        ft = upload_frame(data, frame_num, 0);
+
+                if (ft) {
+                        data->current_texture = ft->texture;
+                        data->current_image_loaded = true;
+                        data->redraw_queued = true;
+                        data->layout_dirty = true;
+                }
+        }
+
+        SDL_UnlockMutex(decoder->mutex);
+}
+
+static void
+set_image(struct data *data, int image_num)
+{
+        if (image_num == data->current_image_num)
+                return;
+
+        data->redraw_queued = true;
+
         data->current_image_num = image_num;
+        data->current_image_loaded = false;
+
+        /* Until the frame is decoded the previous frame will
+         * continue to be shown.
+         */
+        SDL_LockMutex(data->decoder.mutex);
+        data->decoder.wanted_frame = image_num;
+        SDL_CondSignal(data->decoder.wake_cond);
+        SDL_UnlockMutex(data->decoder.mutex);
+
+        update_from_decoder(data);
 }
 
 static void
@@ -596,7 +1156,7 @@ handle_drag_button(struct data *data,
                    const SDL_MouseButtonEvent *event)
 {
         if (event->state == SDL_PRESSED) {
-                if (data->drawing_box || data->current_texture == NULL)
+                if (data->drawing_box || !data->current_image_loaded)
                         return;
 
                 data->drawing_box = true;
@@ -634,7 +1194,7 @@ static void
 handle_center_button(struct data *data,
                      const SDL_MouseButtonEvent *event)
 {
-        if (event->state != SDL_PRESSED || data->current_texture == NULL)
+        if (event->state != SDL_PRESSED || !data->current_image_loaded)
                 return;
 
         ensure_box(data);
@@ -765,6 +1325,11 @@ handle_event(struct data *data,
         case SDL_QUIT:
                 data->should_quit = true;
                 break;
+
+        default:
+                if (event->type == data->decoder.event_type)
+                        update_from_decoder(data);
+                break;
         }
 }
 
@@ -959,193 +1524,241 @@ paint_svg(struct data *data)
 }
 
 static void
-paint(struct data *data)
+free_overlay(struct data *data)
 {
-        data->redraw_queued = false;
-
-        SDL_SetRenderDrawColor(data->renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-        SDL_RenderClear(data->renderer);
-
-        if (data->current_texture)
-                paint_texture(data);
+        if (data->overlay_texture) {
+                SDL_DestroyTexture(data->overlay_texture);
+                data->overlay_texture = NULL;
+        }
 
-        paint_boxes(data);
-        paint_svg(data);
+        if (data->overlay_surface) {
+                cairo_surface_destroy(data->overlay_surface);
+                data->overlay_surface = NULL;
+        }
 
-        SDL_RenderPresent(data->renderer);
+        if (data->flootay) {
+                flootay_free(data->flootay);
+                data->flootay = NULL;
+        }
 }
 
-static void
-run_main_loop(struct data *data)
+static bool
+create_overlay(struct data *data)
 {
-        while (!data->should_quit) {
-                SDL_Event event;
+        data->overlay_surface =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                           DISPLAY_WIDTH,
+                                           DISPLAY_HEIGHT);
 
-                if (data->redraw_queued) {
-                        if (SDL_PollEvent(&event))
-                                handle_event(data, &event);
-                        else
-                                paint(data);
-                } else if (SDL_WaitEvent(&event)) {
-                        handle_event(data, &event);
-                }
+        if (cairo_surface_status(data->overlay_surface) !=
+            CAIRO_STATUS_SUCCESS) {
+                fprintf(stderr, "Error creating overlay surface\n");
+                return false;
         }
-}
 
-static bool
-ensure_images_dir(void)
-{
-        if (mkdir(IMAGES_DIR, 0777) == -1 && errno != EEXIST) {
+        data->overlay_texture = SDL_CreateTexture(data->renderer,
+                                                  SDL_PIXELFORMAT_BGRA32,
+                                                  SDL_TEXTUREACCESS_STREAMING,
+                                                  DISPLAY_WIDTH,
+                                                  DISPLAY_HEIGHT);
+
+        if (data->overlay_texture == NULL) {
                 fprintf(stderr,
-                        "error creating %s: %s\n",
-                        IMAGES_DIR,
-                        strerror(errno));
+                        "Error creating texture: %s\n",
+                        SDL_GetError());
                 return false;
         }
 
+        SDL_SetTextureBlendMode(data->overlay_texture,
+                                get_premultiplied_blend_mode());
+
+        /* New image surfaces are cleared so this makes the whole
+         * texture transparent.
+         */
+        cairo_surface_t *surface = data->overlay_surface;
+
+        SDL_UpdateTexture(data->overlay_texture,
+                          NULL, /* rect */
+                          cairo_image_surface_get_data(surface),
+                          cairo_image_surface_get_stride(surface));
+
+        memset(&data->overlay_damage, 0, sizeof data->overlay_damage);
+
         return true;
 }
 
-static bool
-run_ffmpeg(const struct config *config)
+static void
+clip_to_display(cairo_rectangle_int_t *rect)
 {
-        pid_t pid = fork();
+        int x1 = MAX(rect->x, 0);
+        int y1 = MAX(rect->y, 0);
+        int x2 = MIN(rect->x + rect->width, DISPLAY_WIDTH);
+        int y2 = MIN(rect->y + rect->height, DISPLAY_HEIGHT);
 
-        if (pid == -1) {
-                fprintf(stderr, "fork failed: %s\n", strerror(errno));
-                return false;
+        if (x2 <= x1 || y2 <= y1) {
+                memset(rect, 0, sizeof *rect);
+        } else {
+                rect->x = x1;
+                rect->y = y1;
+                rect->width = x2 - x1;
+                rect->height = y2 - y1;
         }
+}
 
-        if (pid == 0) {
-                struct flt_buffer start_time = FLT_BUFFER_STATIC_INIT;
-
-                flt_buffer_append_printf(&start_time, "%f", config->start_time);
-
-                struct flt_buffer end_time = FLT_BUFFER_STATIC_INIT;
-
-                flt_buffer_append_printf(&end_time, "%f", config->end_time);
-
-                struct flt_buffer filter = FLT_BUFFER_STATIC_INIT;
-
-                flt_buffer_append_printf(&filter,
-                                         "fps=%i,"
-                                         "scale=%i:%i,"
-                                         "drawtext=fontfile=Arial.ttf:"
-                                         "text='%%{expr\\:t+%f}':"
-                                         "fontsize=%i:"
-                                         "bordercolor=white:"
-                                         "borderw=%i:"
-                                         "y=%i",
-                                         config->fps,
-                                         DISPLAY_WIDTH,
-                                         DISPLAY_HEIGHT,
-                                         config->start_time,
-                                         DISPLAY_HEIGHT / 5,
-                                         DISPLAY_HEIGHT / 180,
-                                         DISPLAY_HEIGHT / 180);
-
-                const char *args[] = {
-                        "ffmpeg",
-                        "-ss", (const char *) start_time.data,
-                        "-to", (const char *) end_time.data,
-                        "-i", config->video_filename,
-                        "-vf", (const char *) filter.data,
-                        IMAGES_DIR "/%03d.png",
-                        NULL
-                };
-
-                execvp(args[0], (char **) args);
+static void
+union_rect(cairo_rectangle_int_t *dst, const cairo_rectangle_int_t *src)
+{
+        if (src->width <= 0 || src->height <= 0)
+                return;
 
-                fprintf(stderr,
-                        "exec failed: %s: %s\n",
-                        args[0],
-                        strerror(errno));
+        if (dst->width <= 0 || dst->height <= 0) {
+                *dst = *src;
+                return;
+        }
 
-                exit(EXIT_FAILURE);
+        int x1 = MIN(dst->x, src->x);
+        int y1 = MIN(dst->y, src->y);
+        int x2 = MAX(dst->x + dst->width, src->x + src->width);
+        int y2 = MAX(dst->y + dst->height, src->y + src->height);
 
-                return false;
-        }
+        dst->x = x1;
+        dst->y = y1;
+        dst->width = x2 - x1;
+        dst->height = y2 - y1;
+}
 
-        int status = EXIT_FAILURE;
+static void
+upload_overlay_rect(struct data *data, const cairo_rectangle_int_t *rect)
+{
+        if (rect->width <= 0 || rect->height <= 0)
+                return;
 
-        if (waitpid(pid, &status, 0 /* options */) == -1 ||
-            !WIFEXITED(status) ||
-            WEXITSTATUS(status) != EXIT_SUCCESS) {
-                fprintf(stderr, "ffmpeg failed\n");
-                return false;
-        } else {
-                return true;
-        }
+        cairo_surface_flush(data->overlay_surface);
+
+        int stride = cairo_image_surface_get_stride(data->overlay_surface);
+        const uint8_t *pixels =
+                cairo_image_surface_get_data(data->overlay_surface);
+        SDL_Rect sdl_rect = {
+                .x = rect->x, .y = rect->y,
+                .w = rect->width, .h = rect->height,
+        };
+
+        SDL_UpdateTexture(data->overlay_texture,
+                          &sdl_rect,
+                          pixels + rect->y * stride + rect->x * 4,
+                          stride);
 }
 
-static bool
-count_images(time_t min_time,
-             int *n_images_out)
+/* Renders the overlay for the current frame if it has changed. Only
+ * the region that was drawn in either the previous or the new frame
+ * is cleared and uploaded.
+ */
+static void
+update_overlay(struct data *data)
 {
-        DIR *d = opendir(IMAGES_DIR);
+        if (data->flootay == NULL ||
+            !data->current_image_loaded ||
+            data->overlay_frame_num == data->current_image_num)
+                return;
 
-        if (d == NULL) {
-                fprintf(stderr,
-                        "%s: %s\n",
-                        IMAGES_DIR,
-                        strerror(errno));
-                return false;
+        if (data->overlay_texture == NULL && !create_overlay(data)) {
+                free_overlay(data);
+                return;
         }
 
-        bool ret = true;
-        int n_images = 0;
-        struct dirent *e;
+        cairo_rectangle_int_t old_damage = data->overlay_damage;
+        cairo_t *cr = cairo_create(data->overlay_surface);
+
+        if (old_damage.width > 0) {
+                cairo_save(cr);
+                cairo_rectangle(cr,
+                                old_damage.x, old_damage.y,
+                                old_damage.width, old_damage.height);
+                cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+                cairo_fill(cr);
+                cairo_restore(cr);
+        }
 
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        cairo_scale(cr, 1.0 / IMAGE_SCALE, 1.0 / IMAGE_SCALE);
 
-        while ((e = readdir(d))) {
-                if (e->d_name[0] == '.')
-                        continue;
+        cairo_rectangle_int_t damage = { .width = 0, .height = 0 };
 
-                flt_buffer_set_length(&buf, 0);
-                flt_buffer_append_string(&buf, IMAGES_DIR);
-                flt_buffer_append_c(&buf, '/');
-                flt_buffer_append_string(&buf, e->d_name);
+        switch (flootay_render(data->flootay,
+                               cr,
+                               get_frame_time(data, data->current_image_num))) {
+        case FLOOTAY_RENDER_RESULT_ERROR:
+                fprintf(stderr,
+                        "error rendering overlay: %s\n",
+                        flootay_get_error(data->flootay));
+                cairo_destroy(cr);
+                free_overlay(data);
+                return;
+        case FLOOTAY_RENDER_RESULT_EMPTY:
+                break;
+        case FLOOTAY_RENDER_RESULT_OK:
+                flootay_get_damage(data->flootay, &damage);
+                clip_to_display(&damage);
+                break;
+        }
 
-                struct stat statbuf;
+        cairo_destroy(cr);
 
-                if (stat((const char *) buf.data, &statbuf) == -1) {
-                        fprintf(stderr,
-                                "%s: %s\n",
-                                (const char *) buf.data,
-                                strerror(errno));
-                        ret = false;
-                        break;
-                }
+        cairo_rectangle_int_t upload_rect = old_damage;
 
-                if (statbuf.st_mtime >= min_time)
-                        n_images++;
-        }
+        union_rect(&upload_rect, &damage);
+        upload_overlay_rect(data, &upload_rect);
 
-        flt_buffer_destroy(&buf);
+        data->overlay_damage = damage;
+        data->overlay_frame_num = data->current_image_num;
+}
 
-        if (ret)
-                *n_images_out = n_images;
+static void
+paint_overlay(struct data *data)
+{
+        update_overlay(data);
 
-        return ret;
+        if (data->overlay_texture == NULL)
+                return;
+
+        ensure_layout(data);
+
+        SDL_RenderCopy(data->renderer,
+                       data->overlay_texture,
+                       NULL, /* src_rect */
+                       &data->tex_draw_rect);
 }
 
-static bool
-generate_images(const struct config *config,
-                int *n_images_out)
+static void
+paint(struct data *data)
 {
-        if (!ensure_images_dir())
-                return false;
+        data->redraw_queued = false;
 
-        time_t ffmpeg_run_time = time(NULL);
+        SDL_SetRenderDrawColor(data->renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
+        SDL_RenderClear(data->renderer);
 
-        if (!run_ffmpeg(config))
-                return false;
+        if (data->current_texture)
+                paint_texture(data);
 
-        if (!count_images(ffmpeg_run_time, n_images_out))
-                return false;
+        paint_overlay(data);
+        paint_boxes(data);
+        paint_svg(data);
 
-        return true;
+        SDL_RenderPresent(data->renderer);
+}
+
+static void
+run_main_loop(struct data *data)
+{
+        while (!data->should_quit) {
+                SDL_Event event;
+
+                if (SDL_PollEvent(&event))
+                        handle_event(data, &event);
+                else if (data->redraw_queued)
+                        paint(data);
+                else if (!prefetch_texture(data) && SDL_WaitEvent(&event))
+                        handle_event(data, &event);
+        }
 }
 
 static void
@@ -1318,6 +1931,40 @@ load_script(struct data *data, const char *filename)
         return ret;
 }
 
+static bool
+load_overlay(struct data *data, const char *filename)
+{
+        FILE *file = fopen(filename, "r");
+
+        if (file == NULL) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                return false;
+        }
+
+        const char *last_part = strrchr(filename, '/');
+        char *base_dir = (last_part ?
+                          flt_strndup(filename, last_part - filename) :
+                          NULL);
+
+        data->flootay = flootay_new();
+
+        bool ret = flootay_load_script(data->flootay, base_dir, file);
+
+        if (!ret) {
+                fprintf(stderr,
+                        "%s: %s\n",
+                        filename,
+                        flootay_get_error(data->flootay));
+                flootay_free(data->flootay);
+                data->flootay = NULL;
+        }
+
+        flt_free(base_dir);
+        fclose(file);
+
+        return ret;
+}
+
 static bool
 parse_time(const char *time_str, double *value_out)
 {
@@ -1356,7 +2003,7 @@ static bool
 parse_args(int argc, char **argv, struct config *config)
 {
         while (true) {
-                switch (getopt(argc, argv, "-s:e:r:w:h:l:S:")) {
+                switch (getopt(argc, argv, "-s:e:r:w:h:l:S:p:")) {
                 case 's':
                         if (!parse_time(optarg, &config->start_time))
                                 return false;
@@ -1392,6 +2039,10 @@ parse_args(int argc, char **argv, struct config *config)
                         config->svg_to_load = optarg;
                         break;
 
+                case 'p':
+                        config->overlay_script = optarg;
+                        break;
+
                 case 1:
                         config->video_filename = optarg;
                         break;
@@ -1406,11 +2057,12 @@ parse_args(int argc, char **argv, struct config *config)
 
 done:
         if (config->start_time < 0.0 ||
-            config->end_time < 0.0 ||
+            config->end_time <= config->start_time ||
             config->video_filename == NULL) {
                 fprintf(stderr,
                         "usage: make-key-frames -s <start_time> -e <end_time> "
-                        "[-r <fps>] [-l <script>] <video>\n");
+                        "[-r <fps>] [-l <script>] [-p <script>] "
+                        "<video>\n");
                 return false;
         }
 
@@ -1422,6 +2074,7 @@ main(int argc, char **argv)
 {
         struct data data = {
                 .current_image_num = -1,
+                .overlay_frame_num = -1,
                 .redraw_queued = true,
                 .layout_dirty = true,
 
@@ -1437,15 +2090,32 @@ main(int argc, char **argv)
         if (!parse_args(argc, argv, &data.config))
                 return EXIT_FAILURE;
 
+        for (int i = 0; i < TEXTURE_CACHE_SIZE; i++)
+                data.texture_cache[i].frame_num = -1;
+
         data.default_box_width = data.config.default_box_width;
         data.default_box_height = data.config.default_box_height;
 
-        if (!generate_images(&data.config, &data.n_images)) {
+        data.n_images = lround((data.config.end_time -
+                                data.config.start_time) *
+                               data.config.fps);
+
+        if (data.n_images <= 0) {
+                fprintf(stderr, "no images were found\n");
                 return EXIT_FAILURE;
         }
 
-        if (data.n_images <= 0) {
+        if (!init_decoder(&data.decoder, &data.config, data.n_images))
+                return EXIT_FAILURE;
+
+        data.decoder_inited = true;
+
+        /* Wait for the first frame so that errors from ffmpeg are
+         * reported before opening the window.
+         */
+        if (!wait_for_frame(&data.decoder, 0)) {
                 fprintf(stderr, "no images were found\n");
+                destroy_decoder(&data.decoder);
                 return EXIT_FAILURE;
         }
 
@@ -1466,6 +2136,12 @@ main(int argc, char **argv)
                 goto out;
         }
 
+        if (data.config.overlay_script &&
+            !load_overlay(&data, data.config.overlay_script)) {
+                ret = EXIT_FAILURE;
+                goto out;
+        }
+
         if (!init_sdl(&data)) {
                 ret = EXIT_FAILURE;
                 goto out;
@@ -1483,6 +2159,11 @@ out:
 
         free_image(&data);
         free_svg_texture(&data);
+        free_overlay(&data);
+
+        if (data.decoder_inited)
+                destroy_decoder(&data.decoder);
+
         destroy_sdl(&data);
 
         flt_free(data.frame_data);
@@ -0,0 +1,274 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cairo.h>
+
+#include "flt-tile-pack.h"
+#include "flt-file-error.h"
+#include "flt-buffer.h"
+#include "flt-util.h"
+
+#define DEFAULT_TILE_DIRECTORY "map-tiles"
+#define PACK_FILENAME "tiles.pack"
+
+struct config {
+        const char *tile_directory;
+        const char *output_filename;
+};
+
+static bool
+process_options(int argc, char **argv, struct config *config)
+{
+        config->tile_directory = DEFAULT_TILE_DIRECTORY;
+        config->output_filename = NULL;
+
+        while (true) {
+                switch (getopt(argc, argv, "-d:o:")) {
+                case 'd':
+                        config->tile_directory = optarg;
+                        break;
+
+                case 'o':
+                        config->output_filename = optarg;
+                        break;
+
+                case 1:
+                        fprintf(stderr, "unexpected argument: %s\n", optarg);
+                        return false;
+
+                case -1:
+                        return true;
+
+                default:
+                        fprintf(stderr,
+                                "usage: pack-tiles [-d <tile-directory>] "
+                                "[-o <pack-file>]\n");
+                        return false;
+                }
+        }
+}
+
+static bool
+parse_tile_filename(const char *name,
+                    struct flt_tile_pack_tile *tile)
+{
+        int end = -1;
+
+        return (sscanf(name,
+                       "%d-%d-%d.png%n",
+                       &tile->zoom,
+                       &tile->x,
+                       &tile->y,
+                       &end) == 3 &&
+                end >= 0 &&
+                name[end] == '\0');
+}
+
+/* Fills the buffer with an array of struct flt_tile_pack_tile for
+ * every PNG tile in the directory.
+ */
+static bool
+find_tiles(const char *dir_name,
+           struct flt_buffer *tiles)
+{
+        DIR *dir = opendir(dir_name);
+
+        if (dir == NULL) {
+                fprintf(stderr, "%s: %s\n", dir_name, strerror(errno));
+                return false;
+        }
+
+        struct dirent *entry;
+
+        while ((entry = readdir(dir))) {
+                struct flt_tile_pack_tile tile;
+
+                if (parse_tile_filename(entry->d_name, &tile))
+                        flt_buffer_append(tiles, &tile, sizeof tile);
+        }
+
+        closedir(dir);
+
+        return true;
+}
+
+static bool
+load_tile_cb(const struct flt_tile_pack_tile *tile,
+             uint8_t *data,
+             void *user_data,
+             struct flt_error **error)
+{
+        const struct config *config = user_data;
+        struct flt_buffer filename = FLT_BUFFER_STATIC_INIT;
+
+        flt_buffer_append_printf(&filename,
+                                 "%s/%i-%i-%i.png",
+                                 config->tile_directory,
+                                 tile->zoom,
+                                 tile->x, tile->y);
+
+        cairo_surface_t *png =
+                cairo_image_surface_create_from_png((char *) filename.data);
+        cairo_status_t status = cairo_surface_status(png);
+        bool ret = true;
+
+        if (status != CAIRO_STATUS_SUCCESS) {
+                flt_set_error(error,
+                              &flt_tile_pack_error,
+                              FLT_TILE_PACK_ERROR_INVALID,
+                              "%s: %s",
+                              (char *) filename.data,
+                              cairo_status_to_string(status));
+                ret = false;
+        } else if (cairo_image_surface_get_width(png) !=
+                   FLT_TILE_PACK_TILE_SIZE ||
+                   cairo_image_surface_get_height(png) !=
+                   FLT_TILE_PACK_TILE_SIZE) {
+                flt_set_error(error,
+                              &flt_tile_pack_error,
+                              FLT_TILE_PACK_ERROR_INVALID,
+                              "%s: tile is not %ix%i",
+                              (char *) filename.data,
+                              FLT_TILE_PACK_TILE_SIZE,
+                              FLT_TILE_PACK_TILE_SIZE);
+                ret = false;
+        } else {
+                /* Painting the PNG onto the pack’s buffer converts
+                 * whatever format it was decoded to into ARGB32.
+                 */
+                cairo_surface_t *surface =
+                        cairo_image_surface_create_for_data
+                        (data,
+                         CAIRO_FORMAT_ARGB32,
+                         FLT_TILE_PACK_TILE_SIZE,
+                         FLT_TILE_PACK_TILE_SIZE,
+                         FLT_TILE_PACK_STRIDE);
+                cairo_t *cr = cairo_create(surface);
+
+                cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+                cairo_set_source_surface(cr, png, 0.0, 0.0);
+                cairo_paint(cr);
+                cairo_destroy(cr);
+
+                cairo_surface_flush(surface);
+                cairo_surface_destroy(surface);
+        }
+
+        cairo_surface_destroy(png);
+        flt_buffer_destroy(&filename);
+
+        return ret;
+}
+
+static bool
+write_pack(const struct config *config,
+           const char *filename,
+           const struct flt_buffer *tiles)
+{
+        /* The pack is written to a temporary file and then renamed
+         * so that a renderer running at the same time never sees a
+         * partially written pack.
+         */
+        char *tmp_filename = flt_strconcat(filename, ".XXXXXX", NULL);
+        int fd = flt_create_temp_file(tmp_filename);
+        FILE *out;
+
+        if (fd == -1 || (out = fdopen(fd, "wb")) == NULL) {
+                fprintf(stderr, "%s: %s\n", tmp_filename, strerror(errno));
+                if (fd != -1) {
+                        close(fd);
+                        unlink(tmp_filename);
+                }
+                flt_free(tmp_filename);
+                return false;
+        }
+
+        struct flt_error *error = NULL;
+        bool ret = flt_tile_pack_write(out,
+                                       tiles->length /
+                                       sizeof (struct flt_tile_pack_tile),
+                                       (const struct flt_tile_pack_tile *)
+                                       tiles->data,
+                                       load_tile_cb,
+                                       (void *) config,
+                                       &error);
+
+        if (!ret) {
+                fprintf(stderr, "%s\n", error->message);
+                flt_error_free(error);
+        }
+
+        if (fclose(out) == EOF && ret) {
+                fprintf(stderr, "%s: %s\n", tmp_filename, strerror(errno));
+                ret = false;
+        }
+
+        if (ret && rename(tmp_filename, filename) == -1) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                ret = false;
+        }
+
+        if (!ret)
+                unlink(tmp_filename);
+
+        flt_free(tmp_filename);
+
+        return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct config config;
+
+        if (!process_options(argc, argv, &config))
+                return EXIT_FAILURE;
+
+        char *default_filename = NULL;
+        const char *filename = config.output_filename;
+
+        if (filename == NULL) {
+                default_filename = flt_strconcat(config.tile_directory,
+                                                 "/" PACK_FILENAME,
+                                                 NULL);
+                filename = default_filename;
+        }
+
+        struct flt_buffer tiles = FLT_BUFFER_STATIC_INIT;
+        int ret = EXIT_SUCCESS;
+
+        if (!find_tiles(config.tile_directory, &tiles) ||
+            !write_pack(&config, filename, &tiles))
+                ret = EXIT_FAILURE;
+        else
+                printf("%zu tiles packed into %s\n",
+                       tiles.length / sizeof (struct flt_tile_pack_tile),
+                       filename);
+
+        flt_buffer_destroy(&tiles);
+        flt_free(default_filename);
+
+        return ret;
+}
@@ -25,19 +25,31 @@
 
 #include "flt-gpx.h"
 #include "flt-list.h"
+#include "flt-buffer.h"
 #include "flt-get-video-length.h"
 
 struct video {
         struct flt_list link;
         const char *filename;
         double length;
+        int index;
+};
+
+struct photo {
+        const struct flt_gpx_point *point;
+        /* Index of the point, used for the filename */
+        size_t index;
+        const struct video *video;
+        double offset;
 };
 
 struct config {
         const char *gpx_filename;
         double gpx_offset;
         struct flt_list videos;
+        int n_videos;
         double photo_distance;
+        bool batch;
 };
 
 static void
@@ -105,58 +117,162 @@ print_timestamp(double timestamp)
 }
 
 static bool
-print_photos(const struct config *config,
-             const struct flt_gpx_point *points,
-             size_t n_points)
+find_photos(const struct config *config,
+            const struct flt_gpx_point *points,
+            size_t n_points,
+            struct flt_buffer *photos)
 {
         if (n_points < 1)
                 return true;
 
-        printf("set -eux\n");
-
         float last_distance = points[0].distance;
 
         for (size_t i = 0; i < n_points; i++) {
                 const struct flt_gpx_point *point = points + i;
 
-                if (point->distance - last_distance >= config->photo_distance) {
-                        const struct video *video;
-                        double offset;
+                if (point->distance - last_distance < config->photo_distance)
+                        continue;
+
+                struct photo photo = {
+                        .point = point,
+                        .index = i,
+                };
+
+                if (!find_video(config,
+                                point->time,
+                                &photo.video,
+                                &photo.offset)) {
+                        fprintf(stderr,
+                                "couldn’t find video for offset %f\n",
+                                point->time);
+                        return false;
+                }
 
-                        if (!find_video(config, point->time, &video, &offset)) {
-                                fprintf(stderr,
-                                        "couldn’t find video for offset %f\n",
-                                        point->time);
-                                return false;
-                        }
+                flt_buffer_append(photos, &photo, sizeof photo);
 
-                        printf("ffmpeg -ss %f -i \"%s\" "
-                               "-frames 1 "
-                               "photo-%04zu.jpg\n",
-                               offset,
-                               video->filename,
-                               i);
+                last_distance = point->distance;
+        }
 
-                        printf("exiftool -overwrite_original -alldates=\"");
+        return true;
+}
 
-                        print_timestamp(point->time);
+/* Prints the exiftool arguments for the photo, each followed by the
+ * separator. The date is quoted if the separator is a space.
+ */
+static void
+print_exif_args(const struct photo *photo, char separator)
+{
+        bool quote = separator == ' ';
 
-                        printf("\" "
-                               "-GPSLatitude=%f "
-                               "-GPSLongitude=%f ",
-                               point->lat,
-                               point->lon);
+        printf("-alldates=%s", quote ? "\"" : "");
 
-                        if (point->course >= 0.0)
-                                printf("-GPSImgDirection=%f ", point->course);
+        print_timestamp(photo->point->time);
 
-                        printf("photo-%04zu.jpg\n", i);
+        printf("%s%c"
+               "-GPSLatitude=%f%c"
+               "-GPSLongitude=%f%c",
+               quote ? "\"" : "", separator,
+               photo->point->lat, separator,
+               photo->point->lon, separator);
 
-                        last_distance = point->distance;
-                }
+        if (photo->point->course >= 0.0) {
+                printf("-GPSImgDirection=%f%c",
+                       photo->point->course,
+                       separator);
         }
 
-        return true;
+        printf("photo-%04zu.jpg\n", photo->index);
+}
+
+static void
+print_photos(const struct photo *photos, size_t n_photos)
+{
+        printf("set -eux\n");
+
+        for (size_t i = 0; i < n_photos; i++) {
+                const struct photo *photo = photos + i;
+
+                printf("ffmpeg -ss %f -i \"%s\" "
+                       "-frames 1 "
+                       "photo-%04zu.jpg\n",
+                       photo->offset,
+                       photo->video->filename,
+                       photo->index);
+
+                printf("exiftool -overwrite_original ");
+                print_exif_args(photo, ' ');
+        }
+}
+
+static void
+print_batch_extract(const struct photo *photos, size_t n_photos)
+{
+        const struct video *video = photos[0].video;
+
+        /* Selects the first frame at or after each offset. On the
+         * first frame prev_pts is NAN so the comparison is false.
+         */
+        printf("ffmpeg -nostdin -i \"%s\" -vf 'select=", video->filename);
+
+        for (size_t i = 0; i < n_photos; i++) {
+                if (i > 0)
+                        fputc('+', stdout);
+
+                printf("gte(t\\,%f)*not(gte(prev_pts*TB\\,%f))",
+                       photos[i].offset,
+                       photos[i].offset);
+        }
+
+        printf("' -vsync 0 photo-tmp-%i-%%04d.jpg &\n"
+               "pids=\"$pids $!\"\n",
+               video->index);
+}
+
+/* Extracts all of the photos from each video in a single decoding
+ * pass, with the videos decoded in parallel. The EXIF tags are then
+ * written by a single exiftool process.
+ */
+static void
+print_photos_batch(const struct photo *photos, size_t n_photos)
+{
+        printf("set -eux\n"
+               "pids=\"\"\n");
+
+        for (size_t start = 0, end; start < n_photos; start = end) {
+                for (end = start + 1;
+                     end < n_photos &&
+                             photos[end].video == photos[start].video;
+                     end++);
+
+                print_batch_extract(photos + start, end - start);
+        }
+
+        printf("for pid in $pids; do wait \"$pid\"; done\n");
+
+        int frame_num = 1;
+
+        for (size_t i = 0; i < n_photos; i++) {
+                if (i > 0 && photos[i].video != photos[i - 1].video)
+                        frame_num = 1;
+
+                printf("mv photo-tmp-%i-%04i.jpg photo-%04zu.jpg\n",
+                       photos[i].video->index,
+                       frame_num++,
+                       photos[i].index);
+        }
+
+        if (n_photos < 1)
+                return;
+
+        printf("exiftool -@ - <<'EOF'\n");
+
+        for (size_t i = 0; i < n_photos; i++) {
+                printf("-overwrite_original\n");
+                print_exif_args(photos + i, '\n');
+                printf("-execute\n");
+        }
+
+        printf("EOF\n");
 }
 
 static bool
@@ -171,6 +287,7 @@ parse_video(struct config *config, const char *filename)
 
         video->filename = filename;
         video->length = length;
+        video->index = config->n_videos++;
 
         flt_list_insert(config->videos.prev, &video->link);
 
@@ -185,10 +302,12 @@ process_options(int argc, char **argv, struct config *config)
         config->gpx_filename = NULL;
         config->gpx_offset = 0.0;
         config->photo_distance = 3.0;
+        config->batch = false;
+        config->n_videos = 0;
         flt_list_init(&config->videos);
 
         while (true) {
-                switch (getopt(argc, argv, "-g:o:d:")) {
+                switch (getopt(argc, argv, "-g:o:d:b")) {
                 case 1:
                         if (!parse_video(config, optarg))
                                 goto error;
@@ -229,6 +348,10 @@ process_options(int argc, char **argv, struct config *config)
                         }
                         break;
 
+                case 'b':
+                        config->batch = true;
+                        break;
+
                 case -1:
                         goto done;
 
@@ -242,6 +365,7 @@ done:
             flt_list_empty(&config->videos)) {
                 fprintf(stderr,
                         "usage: photos "
+                        "[-b] "
                         "[-o <gpx_offset>] "
                         "-g <gpx_file> "
                         "<video_file>… \n");
@@ -265,7 +389,7 @@ main(int argc, char **argv)
 
         int ret = EXIT_SUCCESS;
         struct flt_error *error = NULL;
-        struct flt_gpx_point *points;
+        const struct flt_gpx_point *points;
         size_t n_points;
 
         if (!flt_gpx_parse(config.gpx_filename,
@@ -276,10 +400,23 @@ main(int argc, char **argv)
                 flt_error_free(error);
                 ret = EXIT_FAILURE;
         } else {
-                if (!print_photos(&config, points, n_points))
+                struct flt_buffer photos = FLT_BUFFER_STATIC_INIT;
+
+                if (!find_photos(&config, points, n_points, &photos)) {
                         ret = EXIT_FAILURE;
+                } else {
+                        size_t n_photos = photos.length / sizeof (struct photo);
+
+                        if (config.batch)
+                                print_photos_batch((void *) photos.data,
+                                                   n_photos);
+                        else
+                                print_photos((void *) photos.data, n_photos);
+                }
+
+                flt_buffer_destroy(&photos);
 
-                flt_free(points);
+                flt_gpx_free_points(points);
         }
 
         destroy_config(&config);
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
+#include <string.h>
 
 #include "flt-gpx.h"
 
@@ -55,7 +56,7 @@ parse_coordinate(const char *arg, struct config *config)
 
         errno = 0;
         char *tail;
-        *value_out = strtod(optarg, &tail);
+        *value_out = strtod(arg, &tail);
 
         if (errno ||
             (!isnormal(*value_out) && *value_out != 0.0) ||
@@ -65,7 +66,7 @@ parse_coordinate(const char *arg, struct config *config)
                 fprintf(stderr,
                         "invalid %s: %s\n",
                         part,
-                        optarg);
+                        arg);
                 return false;
         }
 
@@ -98,45 +99,18 @@ process_options(int argc, char **argv, struct config *config)
         }
 
 done:
-        if (config->lat == DBL_MAX ||
-            config->lon == DBL_MAX ||
+        /* If no position is given then they are read from stdin */
+        if ((config->lat == DBL_MAX) != (config->lon == DBL_MAX) ||
             config->gpx_filename == NULL) {
                 fprintf(stderr,
                         "usage: pos-to-time -g <gpx_file> "
-                        "<latitude> <longitude>\n");
+                        "[<latitude> <longitude>]\n");
                 return false;
         }
 
         return true;
 }
 
-static int
-find_best_point(const struct flt_gpx_point *points,
-                size_t n_points,
-                double lat,
-                double lon)
-{
-        size_t best_point = 0;
-        double best_distance = DBL_MAX;
-
-        struct flt_gpx_point target_point = {
-                .lat = lat,
-                .lon = lon,
-        };
-
-        for (size_t i = 0; i < n_points; i++) {
-                double distance = flt_gpx_point_distance_between(points + i,
-                                                                 &target_point);
-
-                if (distance < best_distance) {
-                        best_point = i;
-                        best_distance = distance;
-                }
-        }
-
-        return best_point;
-}
-
 static void
 print_best_point(const struct flt_gpx_point *point,
                  double lat,
@@ -174,6 +148,78 @@ print_best_point(const struct flt_gpx_point *point,
         printf("Z\n");
 }
 
+static void
+print_position(const struct flt_gpx_index *index,
+               const struct flt_gpx_point *points,
+               double lat,
+               double lon)
+{
+        size_t point = flt_gpx_index_find_nearest(index, lat, lon);
+
+        print_best_point(points + point, lat, lon);
+}
+
+static bool
+parse_position_line(char *line, double *lat_out, double *lon_out)
+{
+        struct config config = {
+                .lat = DBL_MAX,
+                .lon = DBL_MAX,
+        };
+        char *saveptr;
+
+        for (char *part = strtok_r(line, " \t\n\r,", &saveptr);
+             part;
+             part = strtok_r(NULL, " \t\n\r,", &saveptr)) {
+                if (!parse_coordinate(part, &config))
+                        return false;
+        }
+
+        if (config.lon == DBL_MAX) {
+                fprintf(stderr, "expected a latitude and a longitude\n");
+                return false;
+        }
+
+        *lat_out = config.lat;
+        *lon_out = config.lon;
+
+        return true;
+}
+
+/* Reads a position from each line of stdin so that the GPX file only
+ * has to be loaded once for many positions. The output is flushed
+ * after each answer so that the tool can be kept running as a
+ * coprocess. Blank lines are ignored. Every other line gets an answer
+ * on stdout: either the best point and its time on two lines, or a
+ * single line starting with “error:”. The details of the error are
+ * written to stderr.
+ */
+static bool
+process_stdin(const struct flt_gpx_index *index,
+              const struct flt_gpx_point *points)
+{
+        bool ret = true;
+        char line[512];
+
+        while (fgets(line, sizeof line, stdin)) {
+                double lat, lon;
+
+                if (line[strspn(line, " \t\n\r")] == '\0')
+                        continue;
+
+                if (parse_position_line(line, &lat, &lon)) {
+                        print_position(index, points, lat, lon);
+                } else {
+                        printf("error: invalid position\n");
+                        ret = false;
+                }
+
+                fflush(stdout);
+        }
+
+        return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -183,7 +229,7 @@ main(int argc, char **argv)
                 return EXIT_FAILURE;
 
         struct flt_error *error = NULL;
-        struct flt_gpx_point *points;
+        const struct flt_gpx_point *points;
         size_t n_points;
 
         if (!flt_gpx_parse(config.gpx_filename,
@@ -203,10 +249,22 @@ main(int argc, char **argv)
                         config.gpx_filename);
                 ret = EXIT_FAILURE;
         } else {
-                int point = find_best_point(points, n_points,
-                                            config.lat, config.lon);
-                print_best_point(points + point, config.lat, config.lon);
+                struct flt_gpx_index *index =
+                        flt_gpx_index_new(points, n_points);
+
+                if (config.lat == DBL_MAX) {
+                        if (!process_stdin(index, points))
+                                ret = EXIT_FAILURE;
+                } else {
+                        print_position(index,
+                                       points,
+                                       config.lat, config.lon);
+                }
+
+                flt_gpx_index_free(index);
         }
 
+        flt_gpx_free_points(points);
+
         return ret;
 }
@@ -16,13 +16,22 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* For F_GETPIPE_SZ */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <signal.h>
 
 #include "flt-buffer.h"
@@ -30,28 +39,65 @@
 #include "flt-child-proc.h"
 #include "flt-list.h"
 
+/* How often the pipes are sampled when writing stats */
+#define SAMPLE_INTERVAL_MS 5
+
+struct config {
+        /* File to write the time and pipe stats to, or NULL */
+        const char *stats_file;
+};
+
 struct proc_input {
         struct flt_list link;
 
         struct flt_child_proc cp;
+
+        bool is_ffmpeg;
+
+        /* Copy of the read end of the pipe that is kept open in order
+         * to see how full it is, or -1 if the stats aren’t enabled.
+         */
+        int sample_fd;
+
+        /* Number of times the pipe was sampled while both ends were
+         * open and how many of those times it was full or empty.
+         */
+        int n_samples;
+        int n_full_samples;
+        int n_empty_samples;
+
+        double end_time;
+        struct rusage usage;
 };
 
-static struct flt_child_proc *
+static double
+get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct proc_input *
 add_child_proc(struct flt_list *list)
 {
-        struct proc_input *pi = flt_alloc(sizeof *pi);
+        struct proc_input *pi = flt_calloc(sizeof *pi);
 
         static const struct flt_child_proc cp_init = FLT_CHILD_PROC_INIT;
 
         pi->cp = cp_init;
+        pi->sample_fd = -1;
 
         flt_list_insert(list->prev, &pi->link);
 
-        return &pi->cp;
+        return pi;
 }
 
 static bool
-add_input_arg(struct flt_list *proc_inputs,
+add_input_arg(const struct config *config,
+              struct flt_list *proc_inputs,
               struct flt_buffer *buf,
               const char *arg)
 {
@@ -60,13 +106,27 @@ add_input_arg(struct flt_list *proc_inputs,
         if (*arg == '|') {
                 static const char *const proc_args[] = { NULL };
 
-                struct flt_child_proc *cp = add_child_proc(proc_inputs);
+                struct proc_input *pi = add_child_proc(proc_inputs);
+                struct flt_child_proc *cp = &pi->cp;
 
                 ret = flt_child_proc_open(NULL,
                                           arg + 1,
                                           proc_args,
                                           cp);
 
+                if (ret && config->stats_file) {
+                        pi->sample_fd = fcntl(cp->read_fd,
+                                              F_DUPFD_CLOEXEC,
+                                              0);
+
+                        if (pi->sample_fd == -1) {
+                                fprintf(stderr,
+                                        "dup failed: %s\n",
+                                        strerror(errno));
+                                ret = false;
+                        }
+                }
+
                 struct flt_buffer str_buf = FLT_BUFFER_STATIC_INIT;
 
                 flt_buffer_append_printf(&str_buf, "pipe:%i", cp->read_fd);
@@ -81,7 +141,8 @@ add_input_arg(struct flt_list *proc_inputs,
 }
 
 static bool
-get_speedy_args(int argc,
+get_speedy_args(const struct config *config,
+                int argc,
                 char * const *argv,
                 struct flt_list *proc_inputs,
                 struct flt_buffer *buf)
@@ -94,7 +155,10 @@ get_speedy_args(int argc,
                 const char *arg = argv[i];
 
                 if (is_input) {
-                        if (!add_input_arg(proc_inputs, buf, arg)) {
+                        if (!add_input_arg(config,
+                                           proc_inputs,
+                                           buf,
+                                           arg)) {
                                 ret = false;
                                 break;
                         }
@@ -147,10 +211,11 @@ run_ffmpeg(struct flt_buffer *args,
                 pi->cp.read_fd = -1;
         }
 
-        struct flt_child_proc *ffmpeg_proc = add_child_proc(proc_inputs);
+        struct proc_input *ffmpeg_proc = add_child_proc(proc_inputs);
 
-        ffmpeg_proc->pid = pid;
-        ffmpeg_proc->program_name = flt_strdup(argv[0]);
+        ffmpeg_proc->is_ffmpeg = true;
+        ffmpeg_proc->cp.pid = pid;
+        ffmpeg_proc->cp.program_name = flt_strdup(argv[0]);
 
         return true;
 }
@@ -181,15 +246,76 @@ finish_child(struct proc_input *pi, int status)
         }
 }
 
+static void
+close_sample_fds(struct flt_list *proc_inputs)
+{
+        struct proc_input *pi;
+
+        flt_list_for_each(pi, proc_inputs, link) {
+                if (pi->sample_fd != -1) {
+                        close(pi->sample_fd);
+                        pi->sample_fd = -1;
+                }
+        }
+}
+
+static void
+sample_pipes(struct flt_list *proc_inputs)
+{
+        struct proc_input *pi;
+
+        flt_list_for_each(pi, proc_inputs, link) {
+                /* Once the writer has exited the pipe only tells us
+                 * how quickly ffmpeg reads the rest.
+                 */
+                if (pi->sample_fd == -1 || pi->cp.pid == (pid_t) -1)
+                        continue;
+
+                int pipe_size = fcntl(pi->sample_fd, F_GETPIPE_SZ);
+                int n_bytes;
+
+                if (pipe_size == -1 ||
+                    ioctl(pi->sample_fd, FIONREAD, &n_bytes) == -1)
+                        continue;
+
+                pi->n_samples++;
+
+                /* A full pipe means the writer is blocked waiting for
+                 * ffmpeg and an empty one means ffmpeg is waiting for
+                 * the writer.
+                 */
+                if (n_bytes == 0)
+                        pi->n_empty_samples++;
+                else if (n_bytes + PIPE_BUF > pipe_size)
+                        pi->n_full_samples++;
+        }
+
+        struct timespec interval = {
+                .tv_sec = 0,
+                .tv_nsec = SAMPLE_INTERVAL_MS * 1000000L,
+        };
+
+        nanosleep(&interval, NULL);
+}
+
 static bool
-wait_for_children(struct flt_list *proc_inputs)
+wait_for_children(const struct config *config,
+                  struct flt_list *proc_inputs)
 {
+        /* When the stats are enabled the pipes are sampled in
+         * between polling for the children.
+         */
+        int options = config->stats_file ? WNOHANG : 0;
+
         while (has_child(proc_inputs)) {
                 int status = EXIT_FAILURE;
+                struct rusage usage;
 
-                pid_t pid = wait(&status);
+                pid_t pid = wait4(-1, &status, options, &usage);
 
-                if (pid == -1) {
+                if (pid == 0) {
+                        sample_pipes(proc_inputs);
+                } else if (pid == -1) {
                         fprintf(stderr,
                                 "waitpid failed: %s\n",
                                 strerror(errno));
@@ -199,6 +325,17 @@ wait_for_children(struct flt_list *proc_inputs)
 
                         flt_list_for_each(pi, proc_inputs, link) {
                                 if (pi->cp.pid == pid) {
+                                        pi->end_time = get_time();
+                                        pi->usage = usage;
+
+                                        /* The copies of the pipes
+                                         * would stop the writers
+                                         * noticing that ffmpeg has
+                                         * gone.
+                                         */
+                                        if (pi->is_ffmpeg)
+                                                close_sample_fds(proc_inputs);
+
                                         if (!finish_child(pi, status))
                                                 return false;
                                         break;
@@ -229,6 +366,9 @@ close_proc_inputs(struct flt_list *list)
         bool ret = true;
 
         flt_list_for_each_safe(pi, tmp, list, link) {
+                if (pi->sample_fd != -1)
+                        close(pi->sample_fd);
+
                 if (!flt_child_proc_close(&pi->cp))
                         ret = false;
 
@@ -249,14 +389,100 @@ kill_children(struct flt_list *proc_inputs)
         }
 }
 
+static double
+get_cpu_time(const struct timeval *tv)
+{
+        return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static bool
+write_stats(const char *filename,
+            double start_time,
+            struct flt_list *proc_inputs)
+{
+        FILE *out = fopen(filename, "w");
+
+        if (out == NULL) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                return false;
+        }
+
+        fputs("# program\telapsed\tuser\tsystem\t"
+              "samples\tfull\tempty\n",
+              out);
+
+        struct proc_input *pi;
+
+        flt_list_for_each(pi, proc_inputs, link) {
+                fprintf(out,
+                        "%s\t%.3f\t%.3f\t%.3f",
+                        pi->cp.program_name,
+                        pi->end_time - start_time,
+                        get_cpu_time(&pi->usage.ru_utime),
+                        get_cpu_time(&pi->usage.ru_stime));
+
+                if (pi->is_ffmpeg || pi->n_samples <= 0) {
+                        fputs("\t0\t-\t-\n", out);
+                } else {
+                        fprintf(out,
+                                "\t%i\t%.3f\t%.3f\n",
+                                pi->n_samples,
+                                pi->n_full_samples /
+                                (double) pi->n_samples,
+                                pi->n_empty_samples /
+                                (double) pi->n_samples);
+                }
+        }
+
+        bool ret = true;
+
+        if (fclose(out) == EOF) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                ret = false;
+        }
+
+        return ret;
+}
+
+static bool
+process_options(int argc, char **argv, struct config *config)
+{
+        config->stats_file = NULL;
+
+        while (true) {
+                /* Stop at the first non-option so that the options
+                 * for ffmpeg are left alone.
+                 */
+                switch (getopt(argc, argv, "+s:")) {
+                case 's':
+                        config->stats_file = optarg;
+                        break;
+
+                case -1:
+                        if (optind >= argc)
+                                goto error;
+                        return true;
+
+                default:
+                        goto error;
+                }
+        }
+
+error:
+        fprintf(stderr,
+                "usage: run-ffmpeg [-s <stats-file>] <exe> [args]…\n");
+        return false;
+}
+
 int
 main(int argc, char **argv)
 {
-        if (argc < 2) {
-                fprintf(stderr,
-                        "usage: run-ffmpeg <exe> [args]…\n");
+        struct config config;
+
+        if (!process_options(argc, argv, &config))
                 return EXIT_FAILURE;
-        }
+
+        double start_time = get_time();
 
         struct flt_buffer args = FLT_BUFFER_STATIC_INIT;
 
@@ -266,7 +492,8 @@ main(int argc, char **argv)
 
         flt_list_init(&proc_inputs);
 
-        if (!get_speedy_args(argc - 1, argv + 1,
+        if (!get_speedy_args(&config,
+                             argc - optind, argv + optind,
                              &proc_inputs,
                              &args)) {
                 ret = EXIT_FAILURE;
@@ -278,9 +505,14 @@ main(int argc, char **argv)
                 goto out;
         }
 
-        if (!wait_for_children(&proc_inputs)) {
+        if (!wait_for_children(&config, &proc_inputs)) {
                 ret = EXIT_FAILURE;
                 kill_children(&proc_inputs);
+        } else if (config.stats_file &&
+                   !write_stats(config.stats_file,
+                                start_time,
+                                &proc_inputs)) {
+                ret = EXIT_FAILURE;
         }
 
 out:
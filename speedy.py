@@ -17,6 +17,9 @@
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 import collections
+import copy
+import hashlib
+import math
 import re
 import sys
 import subprocess
@@ -36,6 +39,13 @@ class Video:
         self.script = []
         self.filter = []
         self.use_gpx = not raw_video.is_proc and not raw_video.is_image
+        # Number of the overlay-*.flt script for the video
+        self.overlay_num = None
+        # When a long video is split into several segments, the number
+        # of the piece and the time in the overlay script that it
+        # starts at
+        self.piece_num = None
+        self.overlay_start = 0
 
     def end_time_or_length(self):
         if self.end_time is None:
@@ -46,6 +56,11 @@ class Video:
     def length(self):
         return self.end_time_or_length() - self.start_time
 
+    # Gets the script that writes the overlay for only this piece of
+    # the video
+    def piece_script_filename(self):
+        return "overlay-{}-{}.sh".format(self.overlay_num, self.piece_num)
+
 class RawVideo:
     def __init__(self, filename, length=None):
         self.filename = filename
@@ -58,13 +73,10 @@ class RawVideo:
         if self.is_proc or self.is_image:
             self.length = self
         else:
-            self.video_info = get_video_info(filename)
-            self.length = float(self.video_info['format']['duration'])
-            for stream in self.video_info['streams']:
-                if 'width' in stream:
-                    self.width = int(stream['width'])
-                    self.height = int(stream['height'])
-                    break
+            info = probe_cache.get(filename)
+            self.length = info.duration
+            self.width = info.width
+            self.height = info.height
 
 class Script:
     def __init__(self):
@@ -91,6 +103,16 @@ class Script:
         self.text_color = None
         self.map_trace = None
         self.map_trace_color = None
+        self.map_scale = None
+        self.segments = False
+        # Maximum length in seconds of the segments that a video is
+        # split into, or None to make one segment per video
+        self.segment_length = None
+        # libx264 already uses several threads for each segment
+        self.segment_jobs = max(1, (os.cpu_count() or 1) // 4)
+        # DRM render node to use for VAAPI, or None to do everything
+        # on the CPU
+        self.vaapi_device = None
 
 Svg = collections.namedtuple('Svg', ['video',
                                      'filename',
@@ -107,6 +129,14 @@ VideoSpeed = collections.namedtuple('VideoSpeed', ['length', 'speed'])
 # Filename can be None if silence should be played
 SoundClip = collections.namedtuple('SoundClip', ['filename', 'length'])
 ScoreDiff = collections.namedtuple('ScoreDiff', ['video', 'time', 'diff'])
+# output_offset is the time in the final film that the segment starts
+Segment = collections.namedtuple('Segment', ['videos',
+                                             'video_speeds',
+                                             'output_offset'])
+# The parts of the ffprobe output that speedy needs. The width and
+# height are None if the file has no video.
+MediaInfo = collections.namedtuple('MediaInfo',
+                                   ['duration', 'width', 'height'])
 
 TIME_RE = re.compile(r'(?:([0-9]+):)?([0-9]+)(\.[0-9]+)?')
 GOPRO_FILENAME_RE = re.compile(r'(?P<camera_type>G[HX])'
@@ -116,7 +146,21 @@ GOPRO_FILENAME_RE = re.compile(r'(?P<camera_type>G[HX])'
 
 FPS = 30
 
-OVERLAY_FILTER = "overlay=eof_action=pass"
+# flootay outputs premultiplied YUV so that ffmpeg doesn’t need to
+# convert the overlay from RGB before blending it
+OVERLAY_PIXEL_FORMAT = "yuva420p"
+OVERLAY_FILTER = "overlay=eof_action=pass:alpha=premultiplied"
+# With VAAPI the main overlay is uploaded to the GPU. flootay’s
+# premultiplied BGRA is cairo’s own format so it needs no conversion
+# and overlay_vaapi blends it as premultiplied.
+VAAPI_OVERLAY_PIXEL_FORMAT = "bgra"
+VAAPI_OVERLAY_FILTER = "overlay_vaapi=eof_action=pass"
+DEFAULT_VAAPI_DEVICE = "/dev/dri/renderD128"
+
+PROBE_CACHE_FILENAME = ".flootay-probe"
+
+# Quoted strings in flootay scripts that might be filenames
+QUOTED_STRING_RE = re.compile(r'"((?:[^"\\]|\\.)*)"')
 
 class ParseError(Exception):
     pass
@@ -179,6 +223,11 @@ def parse_script(infile):
     text_color_re = re.compile(r'text_color\s+(?P<color>.*)')
     map_trace_re = re.compile(r'map_trace\s+(?P<filename>\S+)\s*$')
     map_trace_color_re = re.compile(r'map_trace_color\s+(?P<color>\S+)\s*$')
+    map_scale_re = re.compile(r'map_scale\s+(?P<scale>[0-9]+(?:\.[0-9]+)?)$')
+    segments_re = re.compile(r'segments(?:\s+'
+                             r'(?P<length>[0-9]+(?:\.[0-9]+)?))?$')
+    segment_jobs_re = re.compile(r'segment_jobs\s+(?P<jobs>[0-9]+)$')
+    vaapi_re = re.compile(r'vaapi(?:\s+(?P<device>\S+))?\s*$')
 
     raw_videos = {}
     script = Script()
@@ -420,6 +469,28 @@ def parse_script(infile):
             script.map_trace_color = md.group('color')
             continue
 
+        md = map_scale_re.match(line)
+        if md:
+            script.map_scale = md.group('scale')
+            continue
+
+        md = segments_re.match(line)
+        if md:
+            script.segments = True
+            if md.group('length'):
+                script.segment_length = float(md.group('length'))
+            continue
+
+        md = segment_jobs_re.match(line)
+        if md:
+            script.segment_jobs = max(1, int(md.group('jobs')))
+            continue
+
+        md = vaapi_re.match(line)
+        if md:
+            script.vaapi_device = md.group('device') or DEFAULT_VAAPI_DEVICE
+            continue
+
         md = video_re.match(line)
 
         filename = md.group('filename')
@@ -468,24 +539,119 @@ def get_sound_mode(script, video_speeds):
 
     return "silence"
 
-def get_video_info(filename):
-    with subprocess.Popen(["ffprobe",
-                           "-i", filename,
-                           "-show_entries", "format=duration:stream",
-                           "-v", "quiet",
-                           "-of", "json"],
-                          stdout=subprocess.PIPE) as p:
-        info = json.load(p.stdout)
-
-    return info
-
-def get_sound_length(filename):
+def probe_media(filename):
     s = subprocess.check_output(["ffprobe",
                                  "-i", filename,
-                                 "-show_entries", "format=duration",
+                                 "-show_entries",
+                                 "format=duration:stream=width,height",
                                  "-v", "quiet",
-                                 "-of", "csv=p=0"])
-    return float(s)
+                                 "-of", "json"])
+    info = json.loads(s)
+    width = None
+    height = None
+
+    for stream in info.get('streams', []):
+        if 'width' in stream:
+            width = int(stream['width'])
+            height = int(stream['height'])
+            break
+
+    return MediaInfo(float(info['format']['duration']), width, height)
+
+# Remembers the ffprobe results between runs. There is a cache file
+# in each directory that contains media files. The entries are
+# invalidated when the size or modification time of a file changes.
+class ProbeCache:
+    def __init__(self):
+        self.dirs = {}
+        self.changed_dirs = set()
+
+    def _load_dir(self, dirname):
+        try:
+            return self.dirs[dirname]
+        except KeyError:
+            pass
+
+        entries = {}
+
+        try:
+            with open(os.path.join(dirname, PROBE_CACHE_FILENAME),
+                      "rt",
+                      encoding="utf-8") as f:
+                for line in f:
+                    parts = line.rstrip("\n").split("\t")
+
+                    if len(parts) != 6:
+                        continue
+
+                    try:
+                        info = MediaInfo(float(parts[3]),
+                                         int(parts[4]) or None,
+                                         int(parts[5]) or None)
+                        entries[parts[0]] = (int(parts[1]),
+                                             int(parts[2]),
+                                             info)
+                    except ValueError:
+                        continue
+        except FileNotFoundError:
+            pass
+
+        self.dirs[dirname] = entries
+
+        return entries
+
+    def get(self, filename):
+        try:
+            st = os.stat(filename)
+        except OSError:
+            return probe_media(filename)
+
+        dirname, basename = os.path.split(os.path.abspath(filename))
+        entries = self._load_dir(dirname)
+        entry = entries.get(basename)
+
+        if (entry is not None and
+            entry[0] == st.st_size and
+            entry[1] == st.st_mtime_ns):
+            return entry[2]
+
+        info = probe_media(filename)
+
+        if "\t" not in basename and "\n" not in basename:
+            entries[basename] = (st.st_size, st.st_mtime_ns, info)
+            self.changed_dirs.add(dirname)
+
+        return info
+
+    def save(self):
+        for dirname in self.changed_dirs:
+            filename = os.path.join(dirname, PROBE_CACHE_FILENAME)
+            tmp_filename = "{}.tmp{}".format(filename, os.getpid())
+
+            try:
+                with open(tmp_filename, "wt", encoding="utf-8") as f:
+                    for basename, entry in sorted(self.dirs[dirname].items()):
+                        size, mtime, info = entry
+                        print("\t".join([basename,
+                                         str(size),
+                                         str(mtime),
+                                         repr(info.duration),
+                                         str(info.width or 0),
+                                         str(info.height or 0)]),
+                              file=f)
+
+                os.replace(tmp_filename, filename)
+            except OSError:
+                # The cache is only an optimisation so it doesn’t
+                # matter if it can’t be written
+                pass
+
+        self.changed_dirs.clear()
+
+probe_cache = ProbeCache()
+
+def get_sound_length(filename):
+    return probe_cache.get(filename).duration
 
 def get_videos_length(videos):
     total_length = 0
@@ -677,10 +843,20 @@ def get_ffmpeg_filter(script,
             input_names[i] = "[sv{}]".format(i)
 
         if len(video.script) > 0:
-            if overlay_input is None:
+            if overlay_input is None and video.piece_num is not None:
+                # Shift the timestamps so that the filter renders the
+                # part of the script for the piece
+                parts.append("{0}setpts=PTS+{1}/TB,"
+                             "flootay=filename=overlay-{2}.flt,"
+                             "setpts=PTS-{1}/TB[ov{3}];".format(
+                                 input_names[i],
+                                 video.overlay_start,
+                                 video.overlay_num,
+                                 i))
+            elif overlay_input is None:
                 parts.append("{}flootay=filename=overlay-{}.flt[ov{}];".format(
                     input_names[i],
-                    i,
+                    video.overlay_num,
                     i))
             else:
                 parts.append("{}[{}]{}[ov{}];".format(
@@ -730,16 +906,77 @@ def get_silent_source(duration):
             "sample_rate=48000:"
             f"d={duration}"]
 
-def get_ffmpeg_command(script, video_filename, video_speeds):
+def get_main_overlay_pixel_format(script):
+    if script.vaapi_device is None:
+        return OVERLAY_PIXEL_FORMAT
+    else:
+        return VAAPI_OVERLAY_PIXEL_FORMAT
+
+def get_encoder_args(script):
+    if script.vaapi_device is not None:
+        args = ["-r", "30",
+                "-c:v", "h264_vaapi"]
+
+        if script.twitter:
+            args.extend(["-profile:v", "main",
+                         "-qp", "24"])
+        elif script.instagram:
+            args.extend(["-profile:v", "main",
+                         "-g", "72",
+                         "-b:v", "3500k",
+                         "-maxrate", "3500k",
+                         "-bufsize", "3500k"])
+        else:
+            args.extend(["-profile:v", "high",
+                         "-bf", "2",
+                         "-g", "30",
+                         "-qp", "18"])
+
+        return args
+
+    args = ["-r", "30",
+            "-c:v", "libx264",
+            "-pix_fmt", "yuv420p"]
+
+    if script.twitter:
+        args.extend(["-profile:v", "main",
+                     "-crf", "24"])
+    elif script.instagram:
+        args.extend(["-profile:v", "main",
+                     "-level:v", "3.0",
+                     "-x264-params", "scenecut=0:open_gop=0:min-keyint=72:keyint=72:ref=4",
+                     "-crf", "23",
+                     "-maxrate", "3500k",
+                     "-bufsize", "3500k",
+                     "-r", "30"])
+    else:
+        args.extend(["-profile:v", "high",
+                     "-bf", "2",
+                     "-g", "30",
+                     "-crf", "18"])
+
+    return args
+
+def get_ffmpeg_command(script,
+                       video_filename,
+                       video_speeds,
+                       sound_mode,
+                       overlay_filename="overlay.flt"):
+    if script.vaapi_device is None:
+        hw_args = []
+    else:
+        hw_args = ["-init_hw_device",
+                   "vaapi=va:{}".format(script.vaapi_device),
+                   "-filter_hw_device", "va"]
+
     input_args = (["ffmpeg"] +
+                  hw_args +
                   sum((get_ffmpeg_input_args(script, video)
                        for video in script.videos),
                       []))
 
     next_input = len(script.videos)
 
-    sound_mode = get_sound_mode(script, video_speeds)
-
     has_flootay = check_ffmpeg_has_flootay()
 
     if has_flootay:
@@ -747,16 +984,22 @@ def get_ffmpeg_command(script, video_filename, video_speeds):
     else:
         first_overlay_input = next_input
 
-        for video_num, video in enumerate(script.videos):
+        for video in script.videos:
             if len(video.script) == 0:
                 continue
 
+            if video.piece_num is None:
+                overlay_script = "overlay-{}.flt".format(video.overlay_num)
+            else:
+                overlay_script = video.piece_script_filename()
+
             input_args.extend(["-f", "rawvideo",
-                               "-pixel_format", "rgba",
+                               "-pixel_format", OVERLAY_PIXEL_FORMAT,
                                "-video_size", "{}x{}".format(script.width,
                                                              script.height),
                                "-framerate", "30",
-                               "-i", "|./overlay-{}.flt".format(video_num)])
+                               "-i",
+                               "|./" + overlay_script])
             next_input += 1
 
     sound_input = next_input
@@ -778,18 +1021,34 @@ def get_ffmpeg_command(script, video_filename, video_speeds):
             next_input += 1
 
     if has_flootay:
-        overlay_filter = "[outv]flootay=filename=overlay.flt[overoutv]"
+        overlay_filter = "[outv]flootay=filename={}".format(overlay_filename)
+
+        # The filter blends on the CPU so only the encoding is done
+        # on the GPU
+        if script.vaapi_device is not None:
+            overlay_filter += ",format=nv12,hwupload"
+
+        overlay_filter += "[overoutv]"
     else:
         flootay_input = next_input
         next_input += 1
         input_args.extend(["-f", "rawvideo",
-                           "-pixel_format", "rgba",
+                           "-pixel_format",
+                           get_main_overlay_pixel_format(script),
                            "-video_size", "{}x{}".format(script.width,
                                                          script.height),
                            "-framerate", "30",
-                           "-i", "|./overlay.flt"])
-        overlay_filter = "[outv][{}]{}[overoutv]".format(flootay_input,
-                                                         OVERLAY_FILTER)
+                           "-i", "|./" + overlay_filename])
+
+        if script.vaapi_device is None:
+            overlay_filter = "[outv][{}]{}[overoutv]".format(flootay_input,
+                                                             OVERLAY_FILTER)
+        else:
+            overlay_filter = ("[outv]format=nv12,hwupload[hwv];"
+                              "[{}]hwupload[hwov];"
+                              "[hwv][hwov]{}[overoutv]".format(
+                                  flootay_input,
+                                  VAAPI_OVERLAY_FILTER))
 
     filter = (get_ffmpeg_filter(script,
                                 sound_mode,
@@ -809,30 +1068,250 @@ def get_ffmpeg_command(script, video_filename, video_speeds):
     elif sound_mode == "silence":
         args.append("-an")
 
-    args.extend(["-r", "30",
-                 "-c:v", "libx264",
-                 "-pix_fmt", "yuv420p"])
+    args.extend(get_encoder_args(script))
 
-    if script.twitter:
-        args.extend(["-profile:v", "main",
-                     "-crf", "24"])
-    elif script.instagram:
-        args.extend(["-profile:v", "main",
-                     "-level:v", "3.0",
-                     "-x264-params", "scenecut=0:open_gop=0:min-keyint=72:keyint=72:ref=4",
-                     "-crf", "23",
-                     "-maxrate", "3500k",
-                     "-bufsize", "3500k",
-                     "-r", "30"])
+    args.append(video_filename)
+
+    return args
+
+def get_segment_speeds(video_speeds, start, end):
+    segment_speeds = []
+    output_offset = 0
+    pos = 0
+
+    for vs in video_speeds:
+        part_start = max(pos, start)
+        part_end = min(pos + vs.length, end)
+
+        if part_end > part_start:
+            segment_speeds.append(VideoSpeed(part_end - part_start, vs.speed))
+
+        if pos < start:
+            output_offset += (min(pos + vs.length, start) - pos) * vs.speed
+
+        pos += vs.length
+
+    return segment_speeds, output_offset
+
+# Splits a video into pieces of about segment_length seconds. Each
+# piece is a copy of the video trimmed to its part and renders only
+# its part of the overlay script. The cuts are on frame boundaries and
+# a short remainder is added to the last piece.
+def split_video(video, segment_length):
+    length = video.length()
+
+    if (segment_length is None or
+        video.raw_video.is_proc or
+        video.raw_video.is_image):
+        return [video]
+
+    n_pieces = max(1, round(length / segment_length))
+
+    if n_pieces <= 1:
+        return [video]
+
+    pieces = []
+
+    for piece_num in range(n_pieces):
+        start = round(piece_num * segment_length * FPS) / FPS
+
+        if piece_num < n_pieces - 1:
+            end = round((piece_num + 1) * segment_length * FPS) / FPS
+        else:
+            end = length
+
+        piece = copy.copy(video)
+        piece.start_time = video.start_time + start
+        piece.end_time = video.start_time + end
+        piece.piece_num = piece_num
+        piece.overlay_start = start
+        pieces.append(piece)
+
+    return pieces
+
+# Splits the film into one segment per video, or per piece of a video
+# if a segment length is given. Each segment can be rendered and
+# encoded independently and then joined without re-encoding.
+def get_segments(script, video_speeds):
+    segments = []
+    input_pos = 0
+
+    for video in script.videos:
+        for piece in split_video(video, script.segment_length):
+            length = piece.length()
+            segment_speeds, output_offset = get_segment_speeds(video_speeds,
+                                                               input_pos,
+                                                               input_pos +
+                                                               length)
+            segments.append(Segment([piece], segment_speeds, output_offset))
+            input_pos += length
+
+    return segments
+
+def write_piece_script(video):
+    filename = video.piece_script_filename()
+
+    with open(filename, "wt", encoding="utf-8") as f:
+        print("#!/bin/sh\n"
+              "exec {} -f{} -s {} -e {} overlay-{}.flt".format(
+                  shlex.quote(flootay_proc),
+                  OVERLAY_PIXEL_FORMAT,
+                  video.overlay_start,
+                  video.overlay_start + video.length(),
+                  video.overlay_num),
+              file=f)
+
+    os.chmod(filename, 0o775)
+
+    return filename
+
+def add_file_to_hash(h, filename):
+    st = os.stat(filename)
+    h.update(json.dumps([os.path.abspath(filename),
+                         st.st_size,
+                         st.st_mtime_ns]).encode("utf-8"))
+
+# Gets a hash of everything that affects the output of a segment so
+# that it only needs to be rebuilt if the hash changes. Files are
+# identified by their size and modification time except for the
+# overlay scripts which are hashed by their contents.
+def get_segment_hash(args, script_filenames):
+    h = hashlib.sha256()
+    h.update(json.dumps(args).encode("utf-8"))
+
+    filenames = set([flootay_proc])
+
+    for filename in script_filenames:
+        with open(filename, "rb") as f:
+            contents = f.read()
+
+        h.update(contents)
+
+        for md in QUOTED_STRING_RE.finditer(contents.decode("utf-8")):
+            filenames.add(md.group(1))
+
+    # The last argument is the output file
+    filenames.update(args[:-1])
+
+    for filename in sorted(filenames):
+        if os.path.isfile(filename):
+            add_file_to_hash(h, filename)
+
+    return h.hexdigest()
+
+def write_segments(script, video_speeds, run_ffmpeg):
+    segments = get_segments(script, video_speeds)
+    sound_mode = get_sound_mode(script, video_speeds)
+    segment_scripts = []
+
+    if sound_mode == "generate":
+        # The sound is generated for the whole film when the
+        # segments are joined
+        segment_sound_mode = "silence"
     else:
-        args.extend(["-profile:v", "high",
-                     "-bf", "2",
-                     "-g", "30",
-                     "-crf", "18"])
+        segment_sound_mode = sound_mode
+
+    with open("segments.txt", "wt", encoding="utf-8") as segments_file:
+        for segment_num, segment in enumerate(segments):
+            segment_script = copy.copy(script)
+            segment_script.videos = segment.videos
+            length = sum(vs.length * vs.speed for vs in segment.video_speeds)
+
+            overlay_filename = "overlay-segment-{}.flt".format(segment_num)
+
+            with open(overlay_filename, "wt", encoding="utf-8") as f:
+                print(main_overlay_header, file=f)
+                write_score_script(f,
+                                   script,
+                                   video_speeds,
+                                   segment.output_offset,
+                                   length)
+                write_svg_script(f,
+                                 script,
+                                 video_speeds,
+                                 segment.output_offset,
+                                 length)
+
+            os.chmod(overlay_filename, 0o775)
+
+            segment_filename = "segment-{}.mp4".format(segment_num)
+            args = get_ffmpeg_command(segment_script,
+                                      segment_filename,
+                                      segment.video_speeds,
+                                      segment_sound_mode,
+                                      overlay_filename)
+            args.insert(1, "-y")
+
+            print("file {}".format(shlex.quote(segment_filename)),
+                  file=segments_file)
+
+            script_filenames = [overlay_filename]
+            for video in segment.videos:
+                if len(video.script) > 0:
+                    script_filenames.append("overlay-{}.flt".format(
+                        video.overlay_num))
+                    if video.piece_num is not None:
+                        script_filenames.append(write_piece_script(video))
+
+            segment_hash = get_segment_hash(args, script_filenames)
+            hash_filename = "segment-{}.hash".format(segment_num)
+
+            try:
+                with open(hash_filename, "rt", encoding="utf-8") as f:
+                    old_hash = f.read().strip()
+            except FileNotFoundError:
+                old_hash = None
+
+            if old_hash == segment_hash and os.path.exists(segment_filename):
+                continue
+
+            filename = "segment-{}.sh".format(segment_num)
+
+            # The hash is only written once the segment is complete
+            with open(filename, "wt", encoding="utf-8") as f:
+                print("#!/bin/sh\n"
+                      "set -e\n"
+                      "rm -f {0}\n"
+                      "{1}\n"
+                      "echo {2} > {0}".format(
+                          shlex.quote(hash_filename),
+                          " ".join(shlex.quote(arg)
+                                   for arg in [run_ffmpeg] + args),
+                          segment_hash),
+                      file=f)
+
+            os.chmod(filename, 0o775)
+            segment_scripts.append(filename)
+
+    print("set -eu")
+
+    if len(segment_scripts) > 0:
+        print("printf '%s\\0' {} | xargs -0 -n 1 -P {} sh".format(
+            " ".join(shlex.quote(s) for s in segment_scripts),
+            script.segment_jobs))
+
+    args = [run_ffmpeg, "ffmpeg",
+            "-y",
+            "-f", "concat",
+            "-safe", "0",
+            "-i", "segments.txt"]
+
+    if sound_mode == "generate":
+        args.extend(["-ar", "48000",
+                     "-ac", "2",
+                     "-channel_layout", "stereo",
+                     "-f", "s24le",
+                     "-c:a", "pcm_s24le",
+                     "-i", "|./sound.sh",
+                     "-map", "0:v",
+                     "-map", "1:a",
+                     "-c:v", "copy"])
+    else:
+        args.extend(["-c", "copy"])
 
     args.append(video_filename)
 
-    return args
+    print(" ".join(shlex.quote(arg) for arg in args))
 
 def write_sound_script(f, total_video_time, sound_clips):
     dirname = os.path.dirname(sys.argv[0])
@@ -862,10 +1341,15 @@ def write_sound_script(f, total_video_time, sound_clips):
 
     print("", file=f)
 
-def write_score_script(f, script, video_speeds):
+# The offset and length can be used to write the part of the script
+# for one segment with times relative to the start of the segment
+def write_score_script(f, script, video_speeds, offset=0, length=None):
     if len(script.scores) <= 0:
         return
 
+    if length is None:
+        length = sum(vs.length * vs.speed for vs in video_speeds)
+
     print("score {", file=f)
 
     if script.text_color is not None:
@@ -873,28 +1357,50 @@ def write_score_script(f, script, video_speeds):
               file=f)
 
     value = 0
+    has_start = offset <= 0
 
     for score in script.scores:
-        value += score.diff
         time = get_output_time(script.videos,
                                video_speeds,
                                score.video.raw_video,
-                               score.time)
-        print("        key_frame {} {{ v {} }}".format(time, value),
-              file=f)
+                               score.time) - offset
+
+        if time >= length:
+            break
 
-    end_time = sum(vs.length * vs.speed for vs in video_speeds)
+        if time > 0 and not has_start:
+            print("        key_frame 0 {{ v {} }}".format(value),
+                  file=f)
+
+        value += score.diff
+
+        if time >= 0:
+            print("        key_frame {} {{ v {} }}".format(time, value),
+                  file=f)
+            has_start = True
 
-    print("        key_frame {} {{ v {} }}\n".format(end_time, value) +
+    if not has_start:
+        print("        key_frame 0 {{ v {} }}".format(value),
+              file=f)
+
+    print("        key_frame {} {{ v {} }}\n".format(length, value) +
           "}\n",
           file=f)
 
-def write_svg_script(f, script, video_speeds):
+def write_svg_script(f, script, video_speeds, offset=0, length=None):
     for svg in script.svgs:
         start_time = get_output_time(script.videos,
                                      video_speeds,
                                      svg.video.raw_video,
-                                     svg.start_time)
+                                     svg.start_time) - offset
+        end_time = start_time + svg.length
+
+        if length is not None:
+            start_time = max(start_time, 0)
+            end_time = min(end_time, length)
+
+            if end_time <= start_time:
+                continue
 
         print(("svg {{\n"
                "        file \"{}\"\n"
@@ -904,7 +1410,7 @@ def write_svg_script(f, script, video_speeds):
                               start_time,
                               script.width,
                               script.height,
-                              start_time + svg.length),
+                              end_time),
               file=f)
 
 def filename_sort_key(filename):
@@ -1002,6 +1508,8 @@ def get_speed_script_for_video(script,
             if script.map_trace_color:
                 parts.append("                trace_color "
                              f"{script.map_trace_color}\n")
+        if script.map_scale:
+            parts.append(f"                scale {script.map_scale}\n")
         parts.append("        }\n")
 
     timestamp = gpx_offset[0] + video.start_time
@@ -1132,22 +1640,31 @@ if script.show_time:
 flootay_proc = os.path.join(os.path.dirname(sys.argv[0]),
                             "build",
                             "flootay")
-flootay_header = (("#!{}\n"
-                   "\n"
-                   "video_width {}\n"
-                   "video_height {}\n").format(flootay_proc,
-                                               script.width, script.height) +
-                  "\n".join(script.extra_script) +
-                  "\n")
+def get_flootay_header(script, pixel_format):
+    return (("#!{} -f{}\n"
+             "\n"
+             "video_width {}\n"
+             "video_height {}\n").format(flootay_proc,
+                                         pixel_format,
+                                         script.width, script.height) +
+            "\n".join(script.extra_script) +
+            "\n")
+
+# The overlays for individual videos are always blended on the CPU
+flootay_header = get_flootay_header(script, OVERLAY_PIXEL_FORMAT)
+main_overlay_header = get_flootay_header(script,
+                                         get_main_overlay_pixel_format(script))
 
 with open("overlay.flt", "wt", encoding="utf-8") as f:
-    print(flootay_header, file=f)
+    print(main_overlay_header, file=f)
     write_score_script(f, script, video_speeds)
     write_svg_script(f, script, video_speeds)
 
 os.chmod("overlay.flt", 0o775)
 
 for video_num, video in enumerate(script.videos):
+    video.overlay_num = video_num
+
     if len(video.script) == 0:
         continue
 
@@ -1160,10 +1677,17 @@ for video_num, video in enumerate(script.videos):
 if script.background_sound:
     generate_background_sound(script)
 
-print(os.path.join(os.path.dirname(sys.argv[0]),
-                   "build",
-                   "run-ffmpeg"),
-      " ".join(shlex.quote(arg)
-               for arg in get_ffmpeg_command(script,
-                                             video_filename,
-                                             video_speeds)))
+probe_cache.save()
+
+run_ffmpeg = os.path.join(os.path.dirname(sys.argv[0]),
+                          "build",
+                          "run-ffmpeg")
+
+if script.segments:
+    write_segments(script, video_speeds, run_ffmpeg)
+else:
+    args = get_ffmpeg_command(script,
+                              video_filename,
+                              video_speeds,
+                              get_sound_mode(script, video_speeds))
+    print(run_ffmpeg, " ".join(shlex.quote(arg) for arg in args))
@@ -0,0 +1,639 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <cairo.h>
+
+#include "flt-composite.h"
+#include "flootay.h"
+#include "test-temp-dir.h"
+
+#define WIDTH 37
+#define HEIGHT 23
+/* Border around the region that must not be touched */
+#define BORDER 2
+#define UNTOUCHED 0x42
+
+static uint32_t
+random_pixel(void)
+{
+        int a = rand() % 256;
+
+        /* Use more transparent and opaque pixels because they take
+         * different paths.
+         */
+        if (rand() % 4 == 0)
+                a = 0;
+        else if (rand() % 4 == 0)
+                a = 255;
+
+        uint32_t pixel = (uint32_t) a << 24;
+
+        for (int i = 0; i < 3; i++)
+                pixel |= (rand() % (a + 1)) << (i * 8);
+
+        return pixel;
+}
+
+static void
+fill_source(uint32_t *src, int n_pixels)
+{
+        for (int i = 0; i < n_pixels; i++)
+                src[i] = random_pixel();
+}
+
+static bool
+check_value(const char *what, int x, int y, int got, double expected)
+{
+        if (fabs(got - expected) > 1.0) {
+                fprintf(stderr,
+                        "%s at %i,%i: got %i, expected %f\n",
+                        what, x, y, got, expected);
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+test_rgba(bool swap_rb)
+{
+        uint32_t src[WIDTH * HEIGHT];
+        int stride = (WIDTH + BORDER * 2) * 4;
+        uint8_t *dst = malloc(stride * (HEIGHT + BORDER * 2));
+        uint8_t *orig = malloc(stride * (HEIGHT + BORDER * 2));
+        bool ret = true;
+
+        fill_source(src, WIDTH * HEIGHT);
+
+        for (int i = 0; i < stride * (HEIGHT + BORDER * 2); i++)
+                orig[i] = rand() % 256;
+
+        memcpy(dst, orig, stride * (HEIGHT + BORDER * 2));
+
+        flt_composite_rgba(dst + BORDER * stride + BORDER * 4, stride,
+                           (const uint8_t *) src, WIDTH * 4,
+                           WIDTH, HEIGHT,
+                           swap_rb);
+
+        for (int y = 0; y < HEIGHT + BORDER * 2; y++) {
+                for (int x = 0; x < WIDTH + BORDER * 2; x++) {
+                        const uint8_t *d = dst + y * stride + x * 4;
+                        const uint8_t *o = orig + y * stride + x * 4;
+                        int sx = x - BORDER, sy = y - BORDER;
+
+                        if (sx < 0 || sx >= WIDTH || sy < 0 || sy >= HEIGHT) {
+                                if (memcmp(d, o, 4)) {
+                                        fprintf(stderr,
+                                                "pixel outside region "
+                                                "modified at %i,%i\n",
+                                                x, y);
+                                        ret = false;
+                                }
+                                continue;
+                        }
+
+                        uint32_t pixel = src[sy * WIDTH + sx];
+                        double a = (pixel >> 24) / 255.0;
+                        int s[4] = {
+                                (pixel >> 16) & 0xff,
+                                (pixel >> 8) & 0xff,
+                                pixel & 0xff,
+                                pixel >> 24,
+                        };
+
+                        if (swap_rb) {
+                                int tmp = s[0];
+                                s[0] = s[2];
+                                s[2] = tmp;
+                        }
+
+                        for (int i = 0; i < 4; i++) {
+                                if (!check_value("rgba", x, y,
+                                                 d[i],
+                                                 s[i] + o[i] * (1.0 - a)))
+                                        ret = false;
+                        }
+                }
+        }
+
+        free(orig);
+        free(dst);
+
+        return ret;
+}
+
+static const double
+yuv_coefficients[][2] = {
+        [FLT_COMPOSITE_COLORSPACE_BT601] = { 0.299, 0.114 },
+        [FLT_COMPOSITE_COLORSPACE_BT709] = { 0.2126, 0.0722 },
+};
+
+/* Calculates the premultiplied Y, U and V of an average colour */
+static void
+get_yuv(enum flt_composite_colorspace colorspace,
+        const double rgba[4],
+        double yuv[3])
+{
+        double kr = yuv_coefficients[colorspace][0];
+        double kb = yuv_coefficients[colorspace][1];
+        double kg = 1.0 - kr - kb;
+        double y = kr * rgba[0] + kg * rgba[1] + kb * rgba[2];
+
+        yuv[0] = 16.0 * rgba[3] / 255.0 + y * 219.0 / 255.0;
+        yuv[1] = (128.0 * rgba[3] / 255.0 +
+                  (rgba[2] - y) / (2.0 * (1.0 - kb)) * 224.0 / 255.0);
+        yuv[2] = (128.0 * rgba[3] / 255.0 +
+                  (rgba[0] - y) / (2.0 * (1.0 - kr)) * 224.0 / 255.0);
+}
+
+static void
+get_block_average(const uint32_t *src,
+                  int x, int y,
+                  int width, int height,
+                  double rgba[4])
+{
+        int n_pixels = 0;
+
+        for (int i = 0; i < 4; i++)
+                rgba[i] = 0.0;
+
+        for (int dy = 0; dy < 2 && y + dy < height; dy++) {
+                for (int dx = 0; dx < 2 && x + dx < width; dx++) {
+                        uint32_t pixel = src[(y + dy) * width + x + dx];
+
+                        rgba[0] += (pixel >> 16) & 0xff;
+                        rgba[1] += (pixel >> 8) & 0xff;
+                        rgba[2] += pixel & 0xff;
+                        rgba[3] += pixel >> 24;
+                        n_pixels++;
+                }
+        }
+
+        for (int i = 0; i < 4; i++)
+                rgba[i] /= n_pixels;
+}
+
+static bool
+test_yuv(enum flt_composite_colorspace colorspace)
+{
+        /* The region is at an even offset with odd dimensions as if
+         * it was at the bottom-right edge of the frame.
+         */
+        const int frame_width = WIDTH + BORDER;
+        const int frame_height = HEIGHT + BORDER;
+        const int chroma_width = (frame_width + 1) / 2;
+        const int chroma_height = (frame_height + 1) / 2;
+        uint32_t src[WIDTH * HEIGHT];
+        uint8_t *planes[3], *orig[3];
+        int strides[3] = { frame_width, chroma_width, chroma_width };
+        int sizes[3] = {
+                frame_width * frame_height,
+                chroma_width * chroma_height,
+                chroma_width * chroma_height,
+        };
+        bool ret = true;
+
+        fill_source(src, WIDTH * HEIGHT);
+
+        for (int i = 0; i < 3; i++) {
+                planes[i] = malloc(sizes[i]);
+                orig[i] = malloc(sizes[i]);
+
+                for (int j = 0; j < sizes[i]; j++)
+                        orig[i][j] = 16 + rand() % 220;
+
+                memcpy(planes[i], orig[i], sizes[i]);
+        }
+
+        flt_composite_yuv420p(planes, strides,
+                              colorspace,
+                              (const uint8_t *) src, WIDTH * 4,
+                              BORDER, BORDER,
+                              WIDTH, HEIGHT);
+
+        for (int y = 0; y < frame_height; y++) {
+                for (int x = 0; x < frame_width; x++) {
+                        int sx = x - BORDER, sy = y - BORDER;
+                        int got = planes[0][y * strides[0] + x];
+                        int o = orig[0][y * strides[0] + x];
+
+                        if (sx < 0 || sy < 0) {
+                                if (got != o) {
+                                        fprintf(stderr,
+                                                "luma outside region "
+                                                "modified at %i,%i\n",
+                                                x, y);
+                                        ret = false;
+                                }
+                                continue;
+                        }
+
+                        double rgba[4];
+                        double yuv[3];
+
+                        get_block_average(src + sy * WIDTH + sx,
+                                          0, 0, 1, 1,
+                                          rgba);
+                        get_yuv(colorspace, rgba, yuv);
+
+                        if (!check_value("luma", x, y,
+                                         got,
+                                         yuv[0] +
+                                         o * (1.0 - rgba[3] / 255.0)))
+                                ret = false;
+                }
+        }
+
+        for (int y = 0; y < chroma_height; y++) {
+                for (int x = 0; x < chroma_width; x++) {
+                        int sx = x * 2 - BORDER, sy = y * 2 - BORDER;
+                        double rgba[4];
+                        double yuv[3];
+
+                        if (sx >= 0 && sy >= 0) {
+                                get_block_average(src, sx, sy,
+                                                  WIDTH, HEIGHT,
+                                                  rgba);
+                                get_yuv(colorspace, rgba, yuv);
+                        }
+
+                        for (int i = 1; i < 3; i++) {
+                                int got = planes[i][y * strides[i] + x];
+                                int o = orig[i][y * strides[i] + x];
+
+                                if (sx < 0 || sy < 0) {
+                                        if (got != o) {
+                                                fprintf(stderr,
+                                                        "chroma outside "
+                                                        "region modified at "
+                                                        "%i,%i\n",
+                                                        x, y);
+                                                ret = false;
+                                        }
+                                        continue;
+                                }
+
+                                if (!check_value("chroma", x, y,
+                                                 got,
+                                                 yuv[i] +
+                                                 o * (1.0 - rgba[3] / 255.0)))
+                                        ret = false;
+                        }
+                }
+        }
+
+        for (int i = 0; i < 3; i++) {
+                free(planes[i]);
+                free(orig[i]);
+        }
+
+        return ret;
+}
+
+static bool
+test_yuva(void)
+{
+        const int chroma_width = (WIDTH + 1) / 2;
+        const int chroma_height = (HEIGHT + 1) / 2;
+        uint32_t src[WIDTH * HEIGHT];
+        uint8_t *planes[4];
+        int strides[4] = { WIDTH, chroma_width, chroma_width, WIDTH };
+        int sizes[4] = {
+                WIDTH * HEIGHT,
+                chroma_width * chroma_height,
+                chroma_width * chroma_height,
+                WIDTH * HEIGHT,
+        };
+        bool ret = true;
+
+        fill_source(src, WIDTH * HEIGHT);
+
+        for (int i = 0; i < 4; i++) {
+                planes[i] = malloc(sizes[i]);
+                memset(planes[i], UNTOUCHED, sizes[i]);
+        }
+
+        flt_composite_to_yuva420p(planes, strides,
+                                  FLT_COMPOSITE_COLORSPACE_BT601,
+                                  (const uint8_t *) src, WIDTH * 4,
+                                  WIDTH, HEIGHT);
+
+        for (int y = 0; y < HEIGHT; y++) {
+                for (int x = 0; x < WIDTH; x++) {
+                        double rgba[4];
+                        double yuv[3];
+
+                        get_block_average(src + y * WIDTH + x,
+                                          0, 0, 1, 1,
+                                          rgba);
+                        get_yuv(FLT_COMPOSITE_COLORSPACE_BT601, rgba, yuv);
+
+                        if (!check_value("luma", x, y,
+                                         planes[0][y * strides[0] + x],
+                                         yuv[0]) ||
+                            !check_value("alpha", x, y,
+                                         planes[3][y * strides[3] + x],
+                                         rgba[3]))
+                                ret = false;
+                }
+        }
+
+        for (int y = 0; y < chroma_height; y++) {
+                for (int x = 0; x < chroma_width; x++) {
+                        double rgba[4];
+                        double yuv[3];
+
+                        get_block_average(src, x * 2, y * 2,
+                                          WIDTH, HEIGHT,
+                                          rgba);
+                        get_yuv(FLT_COMPOSITE_COLORSPACE_BT601, rgba, yuv);
+
+                        for (int i = 1; i < 3; i++) {
+                                int got = planes[i][y * strides[i] + x];
+
+                                if (!check_value("chroma", x, y,
+                                                 got,
+                                                 yuv[i] +
+                                                 128.0 *
+                                                 (1.0 - rgba[3] / 255.0)))
+                                        ret = false;
+                        }
+                }
+        }
+
+        for (int i = 0; i < 4; i++)
+                free(planes[i]);
+
+        return ret;
+}
+
+/* The map fails to render because there are no tiles and the URL
+ * doesn’t exist, but only after the red rectangle has been drawn. The
+ * next frame draws two small rectangles whose damage covers where the
+ * red one was.
+ */
+static const char
+failing_script[] =
+        "map_url_base \"file:///nonexistent\"\n"
+        "rectangle {\n"
+        "        color 0xff0000\n"
+        "        key_frame 0 { x1 20 y1 20 x2 40 y2 40 }\n"
+        "        key_frame 1 { }\n"
+        "}\n"
+        "gpx {\n"
+        "        file \"track.gpx\"\n"
+        "        map { }\n"
+        "        key_frame 0 { timestamp 1000000000 }\n"
+        "        key_frame 1 { timestamp 1000000001 }\n"
+        "}\n"
+        "rectangle {\n"
+        "        key_frame 2 { x1 0 y1 0 x2 4 y2 4 }\n"
+        "        key_frame 3 { }\n"
+        "}\n"
+        "rectangle {\n"
+        "        key_frame 2 { x1 60 y1 60 x2 64 y2 64 }\n"
+        "        key_frame 3 { }\n"
+        "}\n";
+
+#define FAILING_SIZE 64
+/* A pixel inside the red rectangle but outside the later ones */
+#define STALE_X 30
+#define STALE_Y 30
+
+static bool
+write_failing_gpx(void)
+{
+        FILE *out = fopen("track.gpx", "w");
+
+        if (out == NULL)
+                return false;
+
+        fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+              "<gpx version=\"1.1\" creator=\"test-composite\" "
+              "xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+              "<trk><trkseg>\n",
+              out);
+
+        for (int i = 0; i < 4; i++) {
+                /* 2001-09-09T01:46:40Z is 1000000000 */
+                fprintf(out,
+                        "<trkpt lat=\"%.7f\" lon=\"%.7f\">"
+                        "<ele>170</ele>"
+                        "<time>2001-09-09T01:46:%02iZ</time>"
+                        "</trkpt>\n",
+                        45.7 + i * 5e-5,
+                        4.8 + i * 7e-5,
+                        40 + i);
+        }
+
+        fputs("</trkseg></trk></gpx>\n", out);
+
+        bool ret = !ferror(out);
+
+        return fclose(out) != EOF && ret;
+}
+
+static struct flootay *
+load_failing_script(void)
+{
+        struct flootay *flootay = flootay_new();
+        FILE *file = tmpfile();
+
+        if (file == NULL) {
+                flootay_free(flootay);
+                return NULL;
+        }
+
+        fputs(failing_script, file);
+        rewind(file);
+
+        bool ret = flootay_load_script(flootay, NULL, file);
+
+        fclose(file);
+
+        if (!ret) {
+                fprintf(stderr, "%s\n", flootay_get_error(flootay));
+                flootay_free(flootay);
+                return NULL;
+        }
+
+        return flootay;
+}
+
+static bool
+test_failed_frame(struct flootay_context *context)
+{
+        uint8_t *pixels = calloc(FAILING_SIZE * FAILING_SIZE, 4);
+        struct flootay_frame frame = {
+                .format = FLOOTAY_PIXEL_FORMAT_BGRA,
+                .width = FAILING_SIZE,
+                .height = FAILING_SIZE,
+                .planes = { pixels },
+                .strides = { FAILING_SIZE * 4 },
+        };
+        bool ret = true;
+
+        if (flootay_context_render_frame(context, &frame, 0.5) !=
+            FLOOTAY_RENDER_RESULT_ERROR) {
+                fprintf(stderr, "frame with a missing map didn’t fail\n");
+                ret = false;
+        } else if (flootay_context_render_frame(context, &frame, 2.5) !=
+                   FLOOTAY_RENDER_RESULT_OK) {
+                fprintf(stderr,
+                        "frame after a failed frame: %s\n",
+                        flootay_context_get_error(context));
+                ret = false;
+        } else {
+                const uint8_t *p = pixels +
+                        (STALE_Y * FAILING_SIZE + STALE_X) * 4;
+
+                if (p[0] || p[1] || p[2] || p[3]) {
+                        fprintf(stderr,
+                                "failed frame left pixels in the frame\n");
+                        ret = false;
+                }
+        }
+
+        free(pixels);
+
+        return ret;
+}
+
+static bool
+check_batch_surface(const struct flootay_batch_frame *frame,
+                    cairo_surface_t *surface,
+                    void *user_data)
+{
+        bool *ret = user_data;
+        const uint8_t *data = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+        uint32_t pixel = *(const uint32_t *) (data +
+                                              STALE_Y * stride +
+                                              STALE_X * 4);
+
+        if (pixel != 0) {
+                fprintf(stderr, "failed batch left pixels in the surface\n");
+                *ret = false;
+        }
+
+        return true;
+}
+
+static bool
+test_failed_batch(struct flootay_context *context)
+{
+        bool ret = true;
+
+        if (flootay_context_render_batch(context,
+                                         FAILING_SIZE, FAILING_SIZE,
+                                         0.5, /* start_time */
+                                         30.0, /* frame_rate */
+                                         1, /* n_frames */
+                                         check_batch_surface,
+                                         &ret)) {
+                fprintf(stderr, "batch with a missing map didn’t fail\n");
+                return false;
+        }
+
+        if (!flootay_context_render_batch(context,
+                                          FAILING_SIZE, FAILING_SIZE,
+                                          2.5, /* start_time */
+                                          30.0, /* frame_rate */
+                                          1, /* n_frames */
+                                          check_batch_surface,
+                                          &ret)) {
+                fprintf(stderr,
+                        "batch after a failed batch: %s\n",
+                        flootay_context_get_error(context));
+                return false;
+        }
+
+        return ret;
+}
+
+static bool
+run_failed_render_tests(void *user_data)
+{
+        if (!write_failing_gpx())
+                return false;
+
+        struct flootay *flootay = load_failing_script();
+
+        if (flootay == NULL)
+                return false;
+
+        bool ret = true;
+
+        /* Each test uses its own context so that the surface starts
+         * clean.
+         */
+        struct flootay_context *context = flootay_context_new(flootay);
+
+        if (!test_failed_frame(context))
+                ret = false;
+
+        flootay_context_free(context);
+
+        context = flootay_context_new(flootay);
+
+        if (!test_failed_batch(context))
+                ret = false;
+
+        flootay_context_free(context);
+
+        flootay_free(flootay);
+
+        return ret;
+}
+
+static bool
+test_failed_render(void)
+{
+        return test_temp_dir_run("flootay-test",
+                                 run_failed_render_tests,
+                                 NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+        int ret = EXIT_SUCCESS;
+
+        srand(42);
+
+        if (!test_rgba(false) || !test_rgba(true))
+                ret = EXIT_FAILURE;
+
+        if (!test_yuv(FLT_COMPOSITE_COLORSPACE_BT601) ||
+            !test_yuv(FLT_COMPOSITE_COLORSPACE_BT709))
+                ret = EXIT_FAILURE;
+
+        if (!test_yuva())
+                ret = EXIT_FAILURE;
+
+        if (!test_failed_render())
+                ret = EXIT_FAILURE;
+
+        return ret;
+}
@@ -22,9 +22,11 @@
 #include <assert.h>
 #include <strings.h>
 #include <limits.h>
+#include <time.h>
 
 #include "flt-lexer.h"
 #include "flt-list.h"
+#include "flt-buffer.h"
 
 struct load_data {
         struct flt_source source;
@@ -405,11 +407,235 @@ run_fail_check(const struct fail_check *check)
         return ret;
 }
 
+static bool
+check_keywords(void)
+{
+        bool ret = true;
+
+        for (unsigned i = 1; i < FLT_LEXER_N_KEYWORDS; i++) {
+                struct flt_lexer *lexer = flt_lexer_new_from_memory("", 0);
+                const char *name = flt_lexer_get_symbol_name(lexer, i);
+                struct flt_lexer *name_lexer =
+                        flt_lexer_new_from_memory(name, strlen(name));
+                const struct flt_lexer_token *token =
+                        flt_lexer_get_token(name_lexer, NULL);
+
+                if (token->type != FLT_LEXER_TOKEN_TYPE_SYMBOL ||
+                    token->symbol_value != i) {
+                        fprintf(stderr,
+                                "Keyword “%s” was not recognised\n",
+                                name);
+                        ret = false;
+                }
+
+                flt_lexer_free(name_lexer);
+                flt_lexer_free(lexer);
+        }
+
+        /* Symbols that aren’t keywords should get their own number */
+        static const char not_keywords[] = "keyframe xx y1 colour x5 svgs";
+        struct flt_lexer *lexer =
+                flt_lexer_new_from_memory(not_keywords,
+                                          sizeof not_keywords - 1);
+
+        while (true) {
+                const struct flt_lexer_token *token =
+                        flt_lexer_get_token(lexer, NULL);
+
+                if (token->type == FLT_LEXER_TOKEN_TYPE_EOF)
+                        break;
+
+                assert(token->type == FLT_LEXER_TOKEN_TYPE_SYMBOL);
+
+                const char *name =
+                        flt_lexer_get_symbol_name(lexer, token->symbol_value);
+                bool is_keyword = token->symbol_value < FLT_LEXER_N_KEYWORDS;
+
+                if (is_keyword != !strcmp(name, "y1")) {
+                        fprintf(stderr,
+                                "Symbol “%s” was wrongly matched\n",
+                                name);
+                        ret = false;
+                }
+        }
+
+        flt_lexer_free(lexer);
+
+        return ret;
+}
+
+static void
+generate_script(struct flt_buffer *buf,
+                int n_key_frames)
+{
+        flt_buffer_append_string(buf,
+                                 "# Generated script\n"
+                                 "svg {\n"
+                                 "        file \"face.svg\"\n");
+
+        for (int i = 0; i < n_key_frames; i++) {
+                flt_buffer_append_printf(buf,
+                                         "        key_frame %i:%02i.%03i "
+                                         "{ x1 %i y1 -%i x2 %i y2 %i }\n",
+                                         i / 60000,
+                                         i / 1000 % 60,
+                                         i % 1000,
+                                         i,
+                                         i * 3,
+                                         i + 0x10,
+                                         i * 7);
+        }
+
+        flt_buffer_append_string(buf, "}\n");
+}
+
+static bool
+tokens_equal(const struct flt_lexer_token *a,
+             const struct flt_lexer_token *b)
+{
+        if (a->type != b->type)
+                return false;
+
+        switch (a->type) {
+        case FLT_LEXER_TOKEN_TYPE_NUMBER:
+                return a->number_value == b->number_value;
+        case FLT_LEXER_TOKEN_TYPE_FLOAT:
+                return (a->number_value == b->number_value &&
+                        a->fraction == b->fraction);
+        case FLT_LEXER_TOKEN_TYPE_SYMBOL:
+                return a->symbol_value == b->symbol_value;
+        case FLT_LEXER_TOKEN_TYPE_STRING:
+                return !strcmp(a->string_value, b->string_value);
+        default:
+                return true;
+        }
+}
+
+/* Checks that reading the script through a source gives the same
+ * tokens as reading it directly from memory. The script is larger
+ * than the lexer’s buffer so some tokens will be split across reads.
+ */
+static bool
+check_source_matches_memory(void)
+{
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        bool ret = true;
+
+        generate_script(&buf, 1000);
+
+        struct load_data data = {
+                .source = {
+                        .read_source = read_source_cb,
+                },
+                .data = (const char *) buf.data,
+                .pos = 0,
+                .size = buf.length,
+        };
+        struct flt_lexer *source_lexer = flt_lexer_new(&data.source);
+        struct flt_lexer *memory_lexer =
+                flt_lexer_new_from_memory(buf.data, buf.length);
+
+        while (true) {
+                const struct flt_lexer_token *a =
+                        flt_lexer_get_token(source_lexer, NULL);
+                const struct flt_lexer_token *b =
+                        flt_lexer_get_token(memory_lexer, NULL);
+
+                if (!tokens_equal(a, b) ||
+                    flt_lexer_get_line_num(source_lexer) !=
+                    flt_lexer_get_line_num(memory_lexer)) {
+                        fprintf(stderr,
+                                "Token mismatch on line %i\n",
+                                flt_lexer_get_line_num(memory_lexer));
+                        ret = false;
+                        break;
+                }
+
+                if (a->type == FLT_LEXER_TOKEN_TYPE_EOF)
+                        break;
+        }
+
+        flt_lexer_free(memory_lexer);
+        flt_lexer_free(source_lexer);
+
+        flt_buffer_destroy(&buf);
+
+        return ret;
+}
+
+static double
+get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+count_tokens(struct flt_lexer *lexer)
+{
+        size_t n_tokens = 0;
+
+        while (flt_lexer_get_token(lexer, NULL)->type !=
+               FLT_LEXER_TOKEN_TYPE_EOF)
+                n_tokens++;
+
+        flt_lexer_free(lexer);
+
+        return n_tokens;
+}
+
+/* Measures the throughput of lexing a large generated script. This
+ * is only run when “-b” is passed on the command line.
+ */
+static void
+run_benchmark(void)
+{
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+
+        generate_script(&buf, 200000);
+
+        struct load_data data = {
+                .source = {
+                        .read_source = read_source_cb,
+                },
+                .data = (const char *) buf.data,
+                .pos = 0,
+                .size = buf.length,
+        };
+
+        double start = get_time();
+        size_t n_tokens = count_tokens(flt_lexer_new(&data.source));
+        double source_time = get_time() - start;
+
+        start = get_time();
+        count_tokens(flt_lexer_new_from_memory(buf.data, buf.length));
+        double memory_time = get_time() - start;
+
+        double megabytes = buf.length / (1024.0 * 1024.0);
+
+        printf("%.1f MiB, %zu tokens\n"
+               "source: %.3fs (%.1f MiB/s)\n"
+               "memory: %.3fs (%.1f MiB/s)\n",
+               megabytes, n_tokens,
+               source_time, megabytes / source_time,
+               memory_time, megabytes / memory_time);
+
+        flt_buffer_destroy(&buf);
+}
+
 int
 main(int argc, char **argv)
 {
         int ret = EXIT_SUCCESS;
 
+        if (argc > 1 && !strcmp(argv[1], "-b")) {
+                run_benchmark();
+                return EXIT_SUCCESS;
+        }
+
         for (unsigned i = 0; i < FLT_N_ELEMENTS(fail_checks); i++) {
                 if (!run_fail_check(fail_checks + i))
                         ret = EXIT_FAILURE;
@@ -420,5 +646,11 @@ main(int argc, char **argv)
                         ret = EXIT_FAILURE;
         }
 
+        if (!check_keywords())
+                ret = EXIT_FAILURE;
+
+        if (!check_source_matches_memory())
+                ret = EXIT_FAILURE;
+
         return ret;
 }
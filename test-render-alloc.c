@@ -0,0 +1,304 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cairo.h>
+
+#include "flt-scene.h"
+#include "flt-renderer.h"
+#include "flt-parse-stdio.h"
+#include "flt-util.h"
+#include "test-temp-dir.h"
+
+#define FPS 30
+#define N_FRAMES (FPS * 4)
+#define N_GPX_POINTS 8
+#define MAP_ZOOM 17
+#define GPX_LAT 45.7
+#define GPX_LON 4.8
+
+/* Uses every object type. Once each frame has been rendered once,
+ * rendering it again should be served entirely from the caches and
+ * the renderer’s own state without any allocations.
+ */
+static const char
+test_script[] =
+        "video_width 640\n"
+        "video_height 360\n"
+        "map_url_base \"file:///nonexistent\"\n"
+        "rectangle {\n"
+        "        color 0xff0000\n"
+        "        key_frame 0 { x1 10 y1 20 x2 30 y2 40 }\n"
+        "        key_frame 4 { x2 300 }\n"
+        "}\n"
+        "svg {\n"
+        "        file \"shape.svg\"\n"
+        "        key_frame 0 { x1 0 y1 0 x2 64 y2 64 }\n"
+        "        key_frame 4 { x1 100 x2 164 }\n"
+        "}\n"
+        "score {\n"
+        "        label \"Score\" top right\n"
+        "        key_frame 0 { v 3 }\n"
+        "        key_frame 2 { v 4 }\n"
+        "        key_frame 4 { v 4 }\n"
+        "}\n"
+        "time {\n"
+        "        bottom left\n"
+        "        key_frame 0 { time 10 }\n"
+        "        key_frame 4 { time 14 }\n"
+        "}\n"
+        "curve {\n"
+        "        color \"blue\"\n"
+        "        key_frame 0 {\n"
+        "                x1 0 y1 0 x2 10 y2 10 x3 20 y3 0 x4 30 y4 10\n"
+        "                t 0\n"
+        "        }\n"
+        "        key_frame 4 { t 1 }\n"
+        "}\n"
+        "text {\n"
+        "        text \"héllo\" middle\n"
+        "        key_frame 0 { }\n"
+        "        key_frame 4 { }\n"
+        "}\n"
+        "gpx {\n"
+        "        file \"track.gpx\"\n"
+        "        speed { }\n"
+        "        elevation { }\n"
+        "        distance { }\n"
+        "        map { }\n"
+        "        key_frame 0 { timestamp 1000000000 }\n"
+        "        key_frame 4 { timestamp 1000000004 }\n"
+        "}\n";
+
+static bool
+write_file(const char *filename, const char *contents)
+{
+        FILE *out = fopen(filename, "w");
+
+        if (out == NULL)
+                return false;
+
+        fputs(contents, out);
+
+        bool ret = !ferror(out);
+
+        return fclose(out) != EOF && ret;
+}
+
+static bool
+write_gpx(void)
+{
+        FILE *out = fopen("track.gpx", "w");
+
+        if (out == NULL)
+                return false;
+
+        fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+              "<gpx version=\"1.1\" creator=\"test-render-alloc\" "
+              "xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+              "<trk><trkseg>\n",
+              out);
+
+        for (int i = 0; i < N_GPX_POINTS; i++) {
+                /* 2001-09-09T01:46:40Z is 1000000000 */
+                fprintf(out,
+                        "<trkpt lat=\"%.7f\" lon=\"%.7f\">"
+                        "<ele>%i</ele>"
+                        "<time>2001-09-09T01:46:%02iZ</time>"
+                        "<speed>%i</speed>"
+                        "</trkpt>\n",
+                        GPX_LAT + i * 5e-5,
+                        GPX_LON + i * 7e-5,
+                        170 + i,
+                        40 + i,
+                        5 + i);
+        }
+
+        fputs("</trkseg></trk></gpx>\n", out);
+
+        bool ret = !ferror(out);
+
+        return fclose(out) != EOF && ret;
+}
+
+/* Writes the tiles around the GPX trace straight into the tile cache
+ * directory so that the map never needs the network.
+ */
+static bool
+write_map_tiles(void)
+{
+        double n = 1 << MAP_ZOOM;
+        double lat_rad = GPX_LAT * M_PI / 180.0;
+        int tile_x = floor((GPX_LON + 180.0) / 360.0 * n);
+        int tile_y = floor((1.0 - asinh(tan(lat_rad)) / M_PI) / 2.0 * n);
+
+        if (mkdir("map-tiles", 0777) == -1)
+                return false;
+
+        cairo_surface_t *surface =
+                cairo_image_surface_create(CAIRO_FORMAT_RGB24, 256, 256);
+        bool ret = true;
+
+        for (int y = tile_y - 2; y <= tile_y + 2 && ret; y++) {
+                for (int x = tile_x - 2; x <= tile_x + 2; x++) {
+                        char filename[64];
+
+                        snprintf(filename, sizeof filename,
+                                 "map-tiles/%i-%i-%i.png",
+                                 MAP_ZOOM, x, y);
+
+                        if (cairo_surface_write_to_png(surface, filename) !=
+                            CAIRO_STATUS_SUCCESS) {
+                                ret = false;
+                                break;
+                        }
+                }
+        }
+
+        cairo_surface_destroy(surface);
+
+        return ret;
+}
+
+static struct flt_scene *
+load_scene(void)
+{
+        struct flt_scene *scene = flt_scene_new();
+        struct flt_error *error = NULL;
+        FILE *file = tmpfile();
+
+        assert(file);
+        fputs(test_script, file);
+        rewind(file);
+
+        bool ret = flt_parse_stdio(scene, NULL, file, &error);
+
+        fclose(file);
+
+        if (!ret) {
+                fprintf(stderr, "%s\n", error->message);
+                flt_error_free(error);
+                flt_scene_free(scene);
+                return NULL;
+        }
+
+        return scene;
+}
+
+static bool
+render_frames(struct flt_renderer *renderer,
+              cairo_surface_t *surface)
+{
+        for (int frame = 0; frame < N_FRAMES; frame++) {
+                cairo_t *cr = cairo_create(surface);
+                struct flt_error *error = NULL;
+                enum flt_renderer_result res =
+                        flt_renderer_render(renderer,
+                                            cr,
+                                            frame / (double) FPS,
+                                            &error);
+
+                cairo_destroy(cr);
+
+                if (res == FLT_RENDERER_RESULT_ERROR) {
+                        fprintf(stderr,
+                                "frame %i: %s\n",
+                                frame,
+                                error->message);
+                        flt_error_free(error);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static void
+count_alloc_cb(size_t size, void *user_data)
+{
+        size_t *n_allocations = user_data;
+
+        (*n_allocations)++;
+}
+
+static bool
+run_test(void *user_data)
+{
+        if (!write_file("shape.svg",
+                        "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                        "width=\"64\" height=\"64\">"
+                        "<rect x=\"4\" y=\"4\" width=\"56\" height=\"56\" "
+                        "fill=\"#204080\"/></svg>\n") ||
+            !write_gpx() ||
+            !write_map_tiles()) {
+                fprintf(stderr, "error writing test files\n");
+                return false;
+        }
+
+        struct flt_scene *scene = load_scene();
+
+        if (scene == NULL)
+                return false;
+
+        struct flt_renderer *renderer = flt_renderer_new(scene);
+        cairo_surface_t *surface =
+                cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                           scene->video_width,
+                                           scene->video_height);
+        bool ret = true;
+
+        /* The first pass fills the caches */
+        if (!render_frames(renderer, surface)) {
+                ret = false;
+        } else {
+                size_t n_allocations = 0;
+
+                flt_set_alloc_hook(count_alloc_cb, &n_allocations);
+                ret = render_frames(renderer, surface);
+                flt_set_alloc_hook(NULL, NULL);
+
+                if (ret && n_allocations > 0) {
+                        fprintf(stderr,
+                                "rendering %i warm frames made %zu "
+                                "allocations\n",
+                                N_FRAMES,
+                                n_allocations);
+                        ret = false;
+                }
+        }
+
+        cairo_surface_destroy(surface);
+        flt_renderer_free(renderer);
+        flt_scene_free(scene);
+
+        return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+        bool ret = test_temp_dir_run("flootay-test", run_test, NULL);
+
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,186 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "flt-scene.h"
+#include "flt-scene-binary.h"
+#include "flt-parse-stdio.h"
+#include "flt-util.h"
+
+static const char
+test_script[] =
+        "video_width 1280\n"
+        "video_height 720\n"
+        "map_url_base \"https://example.com/\"\n"
+        "rectangle {\n"
+        "        color 0xff0000\n"
+        "        key_frame 1 { x1 1 y1 2 x2 3 y2 4 }\n"
+        "        key_frame 2 { x2 30 }\n"
+        "}\n"
+        "score {\n"
+        "        label \"Score\" top right\n"
+        "        key_frame 0 { v 3 }\n"
+        "        key_frame 5 { v 4 }\n"
+        "}\n"
+        "time {\n"
+        "        bottom left\n"
+        "        key_frame 0 { time 10 }\n"
+        "        key_frame 10 { time 20 }\n"
+        "}\n"
+        "curve {\n"
+        "        color \"blue\"\n"
+        "        key_frame 1 {\n"
+        "                x1 0 y1 0 x2 10 y2 10 x3 20 y3 0 x4 30 y4 10\n"
+        "                t 0\n"
+        "        }\n"
+        "        key_frame 2 { t 1 stroke_width 3.5 }\n"
+        "}\n"
+        "text {\n"
+        "        text \"héllo\" middle\n"
+        "        key_frame 1 { }\n"
+        "        key_frame 3 { }\n"
+        "}\n";
+
+static FILE *
+open_data(const void *data,
+          size_t size)
+{
+        FILE *file = tmpfile();
+
+        assert(file);
+        assert(fwrite(data, 1, size, file) == size);
+        rewind(file);
+
+        return file;
+}
+
+static struct flt_scene *
+load_scene(FILE *file)
+{
+        struct flt_scene *scene = flt_scene_new();
+        struct flt_error *error = NULL;
+
+        if (!flt_parse_stdio(scene, NULL, file, &error)) {
+                fprintf(stderr, "%s\n", error->message);
+                flt_error_free(error);
+                flt_scene_free(scene);
+                return NULL;
+        }
+
+        return scene;
+}
+
+static char *
+compile_scene(const struct flt_scene *scene,
+              size_t *size_out)
+{
+        char *data = NULL;
+        FILE *out = open_memstream(&data, size_out);
+
+        assert(out);
+        assert(flt_scene_binary_write(scene, out, NULL));
+        fclose(out);
+
+        return data;
+}
+
+static bool
+check_truncated(const char *data,
+                size_t size)
+{
+        bool ret = true;
+
+        /* Every prefix of the file should fail to load cleanly */
+        for (size_t length = 0; length < size; length++) {
+                struct flt_scene *scene = flt_scene_new();
+                struct flt_error *error = NULL;
+
+                if (flt_scene_binary_load(scene, data, length, &error)) {
+                        fprintf(stderr,
+                                "truncated scene of length %zu loaded\n",
+                                length);
+                        ret = false;
+                } else {
+                        flt_error_free(error);
+                }
+
+                flt_scene_free(scene);
+        }
+
+        return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+        int ret = EXIT_SUCCESS;
+
+        FILE *script_file = open_data(test_script, sizeof test_script - 1);
+        struct flt_scene *scene = load_scene(script_file);
+
+        fclose(script_file);
+
+        if (scene == NULL)
+                return EXIT_FAILURE;
+
+        size_t compiled_size;
+        char *compiled = compile_scene(scene, &compiled_size);
+
+        flt_scene_free(scene);
+
+        assert(flt_scene_binary_detect(compiled, compiled_size));
+
+        FILE *compiled_file = open_data(compiled, compiled_size);
+        struct flt_scene *loaded = load_scene(compiled_file);
+
+        fclose(compiled_file);
+
+        if (loaded == NULL) {
+                ret = EXIT_FAILURE;
+        } else {
+                assert(loaded->video_width == 1280);
+                assert(loaded->video_height == 720);
+                assert(!strcmp(loaded->map_url_base, "https://example.com/"));
+                assert(loaded->n_objects == 5);
+                assert(loaded->n_timed_objects == 5);
+
+                size_t recompiled_size;
+                char *recompiled = compile_scene(loaded, &recompiled_size);
+
+                if (recompiled_size != compiled_size ||
+                    memcmp(recompiled, compiled, compiled_size)) {
+                        fprintf(stderr,
+                                "loaded scene doesn’t match the original\n");
+                        ret = EXIT_FAILURE;
+                }
+
+                free(recompiled);
+                flt_scene_free(loaded);
+        }
+
+        if (!check_truncated(compiled, compiled_size))
+                ret = EXIT_FAILURE;
+
+        free(compiled);
+
+        return ret;
+}
@@ -0,0 +1,79 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* For mkdtemp and nftw */
+#define _XOPEN_SOURCE 700
+
+#include "test-temp-dir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "flt-util.h"
+
+static int
+remove_cb(const char *path,
+          const struct stat *sb,
+          int typeflag,
+          struct FTW *ftwbuf)
+{
+        remove(path);
+
+        return 0;
+}
+
+bool
+test_temp_dir_run(const char *prefix,
+                  bool (* func)(void *user_data),
+                  void *user_data)
+{
+        char *dir = flt_strconcat("/tmp/", prefix, "-XXXXXX", NULL);
+        int old_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        bool ret = false;
+
+        if (old_dir == -1) {
+                fprintf(stderr, "couldn’t open the current directory: %s\n",
+                        strerror(errno));
+        } else if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+                fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+                rmdir(dir);
+        } else {
+                ret = func(user_data);
+
+                if (fchdir(old_dir) == -1) {
+                        fprintf(stderr,
+                                "couldn’t return to the old directory: %s\n",
+                                strerror(errno));
+                        ret = false;
+                }
+
+                nftw(dir, remove_cb, 16, FTW_DEPTH | FTW_PHYS);
+        }
+
+        if (old_dir != -1)
+                close(old_dir);
+
+        flt_free(dir);
+
+        return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_TEMP_DIR_H
+#define TEST_TEMP_DIR_H
+
+#include <stdbool.h>
+
+/* Creates a directory in /tmp named after the prefix, changes into it
+ * and calls func. Afterwards the previous working directory is
+ * restored and the directory is removed with everything in it. The
+ * tests use this because the map renderer looks for its tiles in the
+ * current directory. Returns false if the directory can’t be entered
+ * or if func returns false.
+ */
+bool
+test_temp_dir_run(const char *prefix,
+                  bool (* func)(void *user_data),
+                  void *user_data);
+
+#endif /* TEST_TEMP_DIR_H */
@@ -0,0 +1,190 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flt-trace.h"
+#include "flt-buffer.h"
+#include "flt-util.h"
+
+#define DEEP_NESTING 200000
+
+static const char
+feature[] =
+        "{\"type\": \"Feature\","
+        " \"properties\": {\"status\": \"done\"},"
+        " \"geometry\": {\"type\": \"LineString\","
+        " \"coordinates\": [[4.8, 45.7], [4.9, 45.8]]}}";
+
+static struct flt_trace *
+parse_data(const char *data,
+           size_t length,
+           struct flt_error **error)
+{
+        char filename[] = "/tmp/flootay-test-XXXXXX";
+        int fd = mkstemp(filename);
+
+        if (fd == -1) {
+                perror("mkstemp");
+                exit(EXIT_FAILURE);
+        }
+
+        FILE *out = fdopen(fd, "w");
+
+        if (out == NULL ||
+            fwrite(data, 1, length, out) != length ||
+            fclose(out) == EOF) {
+                perror(filename);
+                unlink(filename);
+                exit(EXIT_FAILURE);
+        }
+
+        struct flt_trace *trace = flt_trace_parse(filename, error);
+
+        unlink(filename);
+
+        return trace;
+}
+
+/* Builds a trace with a member that has depth nested arrays before
+ * the features.
+ */
+static void
+make_nested_trace(struct flt_buffer *buf,
+                  int depth)
+{
+        flt_buffer_append_string(buf, "{\"nested\": ");
+
+        for (int i = 0; i < depth; i++)
+                flt_buffer_append_c(buf, '[');
+        for (int i = 0; i < depth; i++)
+                flt_buffer_append_c(buf, ']');
+
+        flt_buffer_append_printf(buf, ", \"features\": [%s]}", feature);
+}
+
+static bool
+test_valid(void)
+{
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        struct flt_error *error = NULL;
+
+        /* Nesting that a real file might plausibly have is fine */
+        make_nested_trace(&buf, 32);
+
+        struct flt_trace *trace = parse_data((const char *) buf.data,
+                                             buf.length,
+                                             &error);
+        bool ret = true;
+
+        flt_buffer_destroy(&buf);
+
+        if (trace == NULL) {
+                fprintf(stderr, "valid trace: %s\n", error->message);
+                flt_error_free(error);
+                return false;
+        }
+
+        if (trace->n_segments != 1 ||
+            trace->segments[0].status != FLT_TRACE_SEGMENT_STATUS_DONE ||
+            trace->segments[0].n_points != 2) {
+                fprintf(stderr, "valid trace parsed incorrectly\n");
+                ret = false;
+        }
+
+        flt_trace_free(trace);
+
+        return ret;
+}
+
+static bool
+check_too_deep(const char *what,
+               const char *data,
+               size_t length)
+{
+        struct flt_error *error = NULL;
+        struct flt_trace *trace = parse_data(data, length, &error);
+
+        if (trace) {
+                fprintf(stderr, "%s: deeply nested trace loaded\n", what);
+                flt_trace_free(trace);
+                return false;
+        }
+
+        bool ret = strstr(error->message, "nesting too deep") != NULL;
+
+        if (!ret)
+                fprintf(stderr, "%s: unexpected error: %s\n",
+                        what, error->message);
+
+        flt_error_free(error);
+
+        return ret;
+}
+
+static bool
+test_too_deep(void)
+{
+        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
+        bool ret = true;
+
+        make_nested_trace(&buf, DEEP_NESTING);
+
+        if (!check_too_deep("skipped member",
+                            (const char *) buf.data,
+                            buf.length))
+                ret = false;
+
+        /* Unclosed arrays should fail at the limit rather than at
+         * the end of the file.
+         */
+        flt_buffer_set_length(&buf, 0);
+        flt_buffer_append_string(&buf, "{\"features\": [{\"geometry\": "
+                                 "{\"type\": \"Point\", "
+                                 "\"coordinates\": [");
+
+        for (int i = 0; i < DEEP_NESTING; i++)
+                flt_buffer_append_c(&buf, '[');
+
+        if (!check_too_deep("coordinates",
+                            (const char *) buf.data,
+                            buf.length))
+                ret = false;
+
+        flt_buffer_destroy(&buf);
+
+        return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+        int ret = EXIT_SUCCESS;
+
+        if (!test_valid())
+                ret = EXIT_FAILURE;
+
+        if (!test_too_deep())
+                ret = EXIT_FAILURE;
+
+        return ret;
+}
@@ -0,0 +1,227 @@
+/*
+ * Flootay – a video overlay generator
+ * Copyright (C) 2022  Neil Roberts
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "flt-unpremultiply.h"
+
+/* Enough pixels for every valid combination of alpha and component */
+#define N_PIXELS (256 * 257 / 2)
+
+/* Number of random pixels that the implementations are compared on */
+#define N_RANDOM_PIXELS 4099
+
+static uint32_t
+make_pixel(int a, int c, int i)
+{
+        /* Use a different component value for each channel so that
+         * swapped channels would be noticed.
+         */
+        int r = c;
+        int g = (c + i) % (a + 1);
+        int b = (c + i * 7) % (a + 1);
+
+        return ((uint32_t) a << 24) | (r << 16) | (g << 8) | b;
+}
+
+static bool
+check_pixel(int pos, uint32_t pixel, const uint8_t *out)
+{
+        uint8_t a = pixel >> 24;
+        uint8_t expected[4] = {
+                (pixel >> 16) & 0xff,
+                (pixel >> 8) & 0xff,
+                pixel & 0xff,
+                a,
+        };
+
+        if (a > 0) {
+                for (int i = 0; i < 3; i++)
+                        expected[i] = expected[i] * 255 / a;
+        }
+
+        for (int i = 0; i < 4; i++) {
+                if (out[i] != expected[i]) {
+                        fprintf(stderr,
+                                "pixel %i: 0x%08x converted to "
+                                "%02x%02x%02x%02x, expected "
+                                "%02x%02x%02x%02x\n",
+                                pos,
+                                pixel,
+                                out[0], out[1], out[2], out[3],
+                                expected[0], expected[1],
+                                expected[2], expected[3]);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+typedef void (* row_func)(const uint32_t *src, uint8_t *dst, int width);
+
+static bool
+check_width(const char *name,
+            row_func row,
+            const uint32_t *pixels,
+            int width)
+{
+        /* Allocate an extra pixel to check that nothing is written
+         * past the end of the row.
+         */
+        uint8_t *out = malloc((width + 1) * 4);
+        bool ret = true;
+
+        for (int i = 0; i < 4; i++)
+                out[width * 4 + i] = 0x42;
+
+        row(pixels, out, width);
+
+        for (int i = 0; i < width; i++) {
+                if (!check_pixel(i, pixels[i], out + i * 4)) {
+                        fprintf(stderr, "%s: width %i\n", name, width);
+                        ret = false;
+                        break;
+                }
+        }
+
+        for (int i = 0; i < 4; i++) {
+                if (out[width * 4 + i] != 0x42) {
+                        fprintf(stderr,
+                                "%s: conversion of width %i wrote past the "
+                                "end of the row\n",
+                                name,
+                                width);
+                        ret = false;
+                        break;
+                }
+        }
+
+        free(out);
+
+        return ret;
+}
+
+static bool
+check_row_func(const char *name,
+               row_func row,
+               const uint32_t *pixels,
+               int n_pixels)
+{
+        bool ret = true;
+
+        if (!check_width(name, row, pixels, n_pixels))
+                ret = false;
+
+        /* Try all of the small widths to test the leftover pixels
+         * that don’t fill a vector.
+         */
+        for (int width = 0; width < 32; width++) {
+                if (!check_width(name, row, pixels + n_pixels - 32, width))
+                        ret = false;
+        }
+
+        return ret;
+}
+
+/* Compares an implementation with the scalar one on the same pixels,
+ * including ones that aren’t validly premultiplied and at every
+ * offset into a vector.
+ */
+static bool
+compare_with_scalar(const struct flt_unpremultiply_impl *scalar,
+                    const struct flt_unpremultiply_impl *impl)
+{
+        uint32_t *pixels = malloc(N_RANDOM_PIXELS * sizeof *pixels);
+        uint8_t *expected = malloc(N_RANDOM_PIXELS * 4);
+        uint8_t *out = malloc(N_RANDOM_PIXELS * 4);
+        uint32_t state = 1;
+        bool ret = true;
+
+        for (int i = 0; i < N_RANDOM_PIXELS; i++) {
+                state = state * 1103515245 + 12345;
+                pixels[i] = state ^ (state >> 16);
+        }
+
+        for (int start = 0; start < 8 && ret; start++) {
+                int width = N_RANDOM_PIXELS - start;
+
+                scalar->row(pixels + start, expected, width);
+                impl->row(pixels + start, out, width);
+
+                for (int i = 0; i < width; i++) {
+                        if (memcmp(expected + i * 4, out + i * 4, 4)) {
+                                fprintf(stderr,
+                                        "%s: pixel 0x%08x differs from "
+                                        "the scalar version\n",
+                                        impl->name,
+                                        pixels[start + i]);
+                                ret = false;
+                                break;
+                        }
+                }
+        }
+
+        free(out);
+        free(expected);
+        free(pixels);
+
+        return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+        uint32_t *pixels = malloc(N_PIXELS * sizeof *pixels);
+        int n_pixels = 0;
+        int ret = EXIT_SUCCESS;
+
+        for (int a = 0; a < 256; a++) {
+                for (int c = 0; c <= a; c++) {
+                        pixels[n_pixels] = make_pixel(a, c, n_pixels);
+                        n_pixels++;
+                }
+        }
+
+        if (!check_row_func("flt_unpremultiply_row",
+                            flt_unpremultiply_row,
+                            pixels,
+                            n_pixels))
+                ret = EXIT_FAILURE;
+
+        struct flt_unpremultiply_impl impls[FLT_UNPREMULTIPLY_MAX_IMPLS];
+        int n_impls = flt_unpremultiply_get_impls(impls);
+
+        for (int i = 0; i < n_impls; i++) {
+                if (!check_row_func(impls[i].name,
+                                    impls[i].row,
+                                    pixels,
+                                    n_pixels))
+                        ret = EXIT_FAILURE;
+
+                if (i > 0 && !compare_with_scalar(impls + 0, impls + i))
+                        ret = EXIT_FAILURE;
+        }
+
+        free(pixels);
+
+        return ret;
+}
@@ -25,8 +25,8 @@
 #include <float.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <glob.h>
 
-#include "flt-child-proc.h"
 #include "flt-buffer.h"
 #include "flt-parse-time.h"
 #include "flt-get-video-length.h"
@@ -34,11 +34,47 @@
 #include "flt-lexer.h"
 #include "flt-list.h"
 
-struct config {
+struct query {
         int video_num, video_part;
         double timestamp;
 };
 
+struct config {
+        struct query query;
+};
+
+struct video_offset {
+        int video_num;
+        int part;
+        double offset;
+        char *gpx_filename;
+};
+
+struct gpx_file {
+        char *filename;
+        const struct flt_gpx_point *points;
+        size_t n_points;
+};
+
+struct part_length {
+        int video_num;
+        int part;
+        double length;
+};
+
+/* Everything that is loaded to answer a query is kept here so that it
+ * won’t be loaded again for the next query.
+ */
+struct cache {
+        bool scripts_loaded;
+        /* struct video_offset, in the order they were found */
+        struct flt_buffer video_offsets;
+        /* struct gpx_file */
+        struct flt_buffer gpx_files;
+        /* struct part_length */
+        struct flt_buffer part_lengths;
+};
+
 static int
 extract_digits(const char *digits, int n_digits)
 {
@@ -51,7 +87,7 @@ extract_digits(const char *digits, int n_digits)
 }
 
 static bool
-parse_video_filename(struct config *config, const char *filename)
+parse_video_filename(struct query *query, const char *filename)
 {
         const char *p = filename;
 
@@ -69,8 +105,8 @@ parse_video_filename(struct config *config, const char *filename)
         if (strcmp(p, ".MP4"))
                 goto error;
 
-        config->video_part = extract_digits(filename + 2, 2);
-        config->video_num = extract_digits(filename + 4, 4);
+        query->video_part = extract_digits(filename + 2, 2);
+        query->video_num = extract_digits(filename + 4, 4);
 
         return true;
 
@@ -159,22 +195,24 @@ parse_timestamp(const char *str, double *timestamp_out)
 static bool
 process_options(int argc, char **argv, struct config *config)
 {
-        config->video_num = -1;
-        config->video_part = -1;
-        config->timestamp = DBL_MAX;
+        struct query *query = &config->query;
+
+        query->video_num = -1;
+        query->video_part = -1;
+        query->timestamp = DBL_MAX;
 
         while (true) {
                 char ch;
                 switch ((ch = getopt(argc, argv, "-"))) {
                 case 1:
-                        if (config->video_num < 0) {
-                                if (!parse_video_filename(config, optarg))
+                        if (query->video_num < 0) {
+                                if (!parse_video_filename(query, optarg))
                                         return false;
-                        } else if (config->timestamp != DBL_MAX) {
+                        } else if (query->timestamp != DBL_MAX) {
                                 fprintf(stderr, "extra argument: %s\n", optarg);
                                 return false;
                         } else if (!parse_timestamp(optarg,
-                                                    &config->timestamp)) {
+                                                    &query->timestamp)) {
                                 return false;
                         }
                         break;
@@ -188,12 +226,12 @@ process_options(int argc, char **argv, struct config *config)
         }
 
 done:
-        if (config->timestamp == DBL_MAX ||
-            config->video_part < 0) {
+        /* If no video is given then the queries are read from stdin */
+        if ((query->timestamp == DBL_MAX) != (query->video_part < 0)) {
                 fprintf(stderr,
                         "usage: time-to-pos "
-                        "<video_file> "
-                        "<timestamp>\n");
+                        "[<video_file> "
+                        "<timestamp>]\n");
                 return false;
         }
 
@@ -216,199 +254,304 @@ parse_time_with_length(const char *time_str,
 
         flt_free(time_str_copy);
 
-        if (ret)
+        if (!ret)
                 flt_error_free(error);
 
         return ret;
 }
 
+static const char *
+skip_spaces(const char *p)
+{
+        while (*p == ' ')
+                p++;
+
+        return p;
+}
+
 static bool
-parse_video_offset_output(const char *output,
-                          int *part_out,
-                          double *offset_out,
-                          char **gpx_file_out)
+is_digit(char ch)
 {
-        errno = 0;
-        char *tail;
+        return ch >= '0' && ch <= '9';
+}
 
-        unsigned long part = strtoul(output, &tail, 10);
+/* Parses a line like:
+ * gpx_offset GH010001.MP4 12.5 2022-09-20T10:21:01Z [gpx_file]
+ * Returns false if the line isn’t a gpx_offset.
+ */
+static bool
+parse_video_offset_line(const char *line, struct video_offset *offset_out)
+{
+        static const char command[] = "gpx_offset ";
 
-        if (errno || *tail != ' ' || part >= 100)
+        if (strncmp(line, command, sizeof command - 1))
                 return false;
 
-        double offset = strtod(tail, &tail);
+        const char *p = skip_spaces(line + sizeof command - 1);
 
-        if (errno ||
-            (!isnormal(offset) && offset != 0.0) ||
-            offset < 0.0)
+        if (p[0] != 'G' || p[1] != 'H')
                 return false;
 
-        while (*tail == ' ')
-                tail++;
+        for (int i = 2; i < 8; i++) {
+                if (!is_digit(p[i]))
+                        return false;
+        }
+
+        if (strncmp(p + 8, ".MP4 ", 5))
+                return false;
+
+        int video_num = extract_digits(p + 4, 4);
+        int part = extract_digits(p + 2, 2);
 
-        const char *time_str = tail;
+        p = skip_spaces(p + 13);
 
-        tail = strchr(time_str, ' ');
+        const char *offset_str = p;
 
-        if (tail == NULL)
+        if (!is_digit(*p))
                 return false;
 
-        double timestamp;
+        while (is_digit(*p))
+                p++;
+
+        if (*p == '.') {
+                p++;
+
+                if (!is_digit(*p))
+                        return false;
+
+                while (is_digit(*p))
+                        p++;
+        }
+
+        if (*p != ' ')
+                return false;
 
-        if (!parse_time_with_length(time_str, tail - time_str, &timestamp))
+        double offset = strtod(offset_str, NULL);
+
+        const char *time_str = skip_spaces(p);
+        const char *time_end = time_str + strcspn(time_str, " ");
+
+        if (time_end == time_str)
                 return false;
 
-        const char *filename = tail + 1;
+        const char *filename = skip_spaces(time_end);
+        const char *filename_end = filename + strcspn(filename, " ");
+
+        if (*skip_spaces(filename_end))
+                return false;
 
-        tail = strchr(filename, '\n');
+        double timestamp;
 
-        if (tail == NULL)
+        if (!parse_time_with_length(time_str, time_end - time_str, &timestamp))
                 return false;
 
-        if (tail > filename)
-                *gpx_file_out = flt_strndup(filename, tail - filename);
-        else
-                *gpx_file_out = flt_strdup("speed.gpx");
+        if (filename_end > filename) {
+                offset_out->gpx_filename =
+                        flt_strndup(filename, filename_end - filename);
+        } else {
+                offset_out->gpx_filename = flt_strdup("speed.gpx");
+        }
 
-        *part_out = part;
-        *offset_out = timestamp - offset;
+        offset_out->video_num = video_num;
+        offset_out->part = part;
+        offset_out->offset = timestamp - offset;
 
         return true;
 }
 
-static bool
-get_video_offset(int video_num,
-                 int *part_out,
-                 double *offset_out,
-                 char **gpx_file)
+static void
+load_video_offsets_from_file(struct cache *cache, const char *filename)
 {
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
-
-        flt_buffer_append_printf(&buf,
-                                 "sed -rn -e "
-                                 "'s/^gpx_offset +GH([0-9]{2})%04d\\.MP4 +"
-                                 "([0-9]+(\\.[0-9]+)?) +"
-                                 "([^ ]+) *"
-                                 "([^ ]*) *$/"
-                                 "\\1 \\2 \\4 \\5/p' "
-                                 "*.script | "
-                                 "head -n 1",
-                                 video_num);
-
-        const char *const args[] = {
-                "-c", (const char *) buf.data, NULL
-        };
+        FILE *f = fopen(filename, "r");
 
-        char *output = flt_child_proc_get_output(NULL, /* source_dir */
-                                                 "bash",
-                                                 args);
+        if (f == NULL) {
+                fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+                return;
+        }
 
-        flt_buffer_destroy(&buf);
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t got;
 
-        if (output == NULL)
-                return false;
+        while ((got = getline(&line, &line_size, f)) != -1) {
+                if (got > 0 && line[got - 1] == '\n')
+                        line[got - 1] = '\0';
 
-        bool ret = true;
+                struct video_offset offset;
 
-        if (*output == '\0') {
-                fprintf(stderr,
-                        "no output received when trying to get gpx offset\n");
-                ret = false;
-        } else if (!parse_video_offset_output(output,
-                                              part_out,
-                                              offset_out,
-                                              gpx_file)) {
-                fprintf(stderr,
-                        "invalid output received when trying to get gpx "
-                        "offset:\n"
-                        "%s",
-                        output);
+                if (parse_video_offset_line(line, &offset)) {
+                        flt_buffer_append(&cache->video_offsets,
+                                          &offset,
+                                          sizeof offset);
+                }
+        }
 
-                int output_len = strlen(output);
+        free(line);
+        fclose(f);
+}
 
-                if (output_len > 0 && output[output_len - 1] != '\n')
-                        fputc('\n', stdout);
+static void
+load_video_offsets(struct cache *cache)
+{
+        glob_t glob_buf;
 
-                ret = false;
+        cache->scripts_loaded = true;
+
+        if (glob("*.script", 0, NULL, &glob_buf) == 0) {
+                for (size_t i = 0; i < glob_buf.gl_pathc; i++) {
+                        load_video_offsets_from_file(cache,
+                                                     glob_buf.gl_pathv[i]);
+                }
+
+                globfree(&glob_buf);
         }
+}
 
-        flt_free(output);
+static const struct video_offset *
+get_video_offset(struct cache *cache, int video_num)
+{
+        if (!cache->scripts_loaded)
+                load_video_offsets(cache);
 
-        return ret;
+        const struct video_offset *offsets =
+                (const struct video_offset *) cache->video_offsets.data;
+        size_t n_offsets = cache->video_offsets.length / sizeof *offsets;
+
+        /* The first gpx_offset found for the video wins */
+        for (size_t i = 0; i < n_offsets; i++) {
+                if (offsets[i].video_num == video_num)
+                        return offsets + i;
+        }
+
+        fprintf(stderr,
+                "no gpx_offset found for GHxx%04i.MP4 "
+                "in *.script\n",
+                video_num);
+
+        return NULL;
 }
 
 static bool
-get_part_lengths(int video_num,
+get_part_length(struct cache *cache,
+                int video_num,
+                int part,
+                double *length_out)
+{
+        const struct part_length *lengths =
+                (const struct part_length *) cache->part_lengths.data;
+        size_t n_lengths = cache->part_lengths.length / sizeof *lengths;
+
+        for (size_t i = 0; i < n_lengths; i++) {
+                if (lengths[i].video_num == video_num &&
+                    lengths[i].part == part) {
+                        *length_out = lengths[i].length;
+                        return true;
+                }
+        }
+
+        char filename[16];
+
+        snprintf(filename, sizeof filename, "GH%02i%04i.MP4", part, video_num);
+
+        struct part_length length = {
+                .video_num = video_num,
+                .part = part,
+        };
+
+        if (!flt_get_video_length(filename, &length.length))
+                return false;
+
+        flt_buffer_append(&cache->part_lengths, &length, sizeof length);
+
+        *length_out = length.length;
+
+        return true;
+}
+
+static bool
+get_part_lengths(struct cache *cache,
+                 int video_num,
                  int first_part,
                  int n_parts,
                  double *part_lengths_out)
 {
         double part_lengths = 0.0;
-        bool ret = true;
-
-        struct flt_buffer buf = FLT_BUFFER_STATIC_INIT;
 
         for (int i = 0; i < n_parts; i++) {
-                flt_buffer_set_length(&buf, 0);
-
-                flt_buffer_append_printf(&buf,
-                                         "GH%02i%04i.MP4",
-                                         first_part + i,
-                                         video_num);
-
                 double video_length;
 
-                if (!flt_get_video_length((const char *) buf.data,
-                                          &video_length)) {
-                        ret = false;
-                        break;
-                }
+                if (!get_part_length(cache,
+                                     video_num,
+                                     first_part + i,
+                                     &video_length))
+                        return false;
 
                 part_lengths += video_length;
         }
 
-        flt_buffer_destroy(&buf);
-
-        if (ret)
-                *part_lengths_out = part_lengths;
+        *part_lengths_out = part_lengths;
 
-        return ret;
+        return true;
 }
 
-static bool
-get_pos_from_gpx(const char *gpx_filename,
-                 double timestamp,
-                 double *lat_out, double *lon_out)
+static const struct gpx_file *
+get_gpx_file(struct cache *cache, const char *filename)
 {
+        const struct gpx_file *files =
+                (const struct gpx_file *) cache->gpx_files.data;
+        size_t n_files = cache->gpx_files.length / sizeof *files;
+
+        for (size_t i = 0; i < n_files; i++) {
+                if (!strcmp(files[i].filename, filename))
+                        return files + i;
+        }
+
         struct flt_error *error = NULL;
-        struct flt_gpx_point *points;
-        size_t n_points;
+        struct gpx_file file;
 
-        if (!flt_gpx_parse(gpx_filename,
-                           &points,
-                           &n_points,
+        if (!flt_gpx_parse(filename,
+                           &file.points,
+                           &file.n_points,
                            &error)) {
                 fprintf(stderr, "%s\n", error->message);
                 flt_error_free(error);
-                return false;
+                return NULL;
         }
 
-        bool ret = true;
+        file.filename = flt_strdup(filename);
+
+        flt_buffer_append(&cache->gpx_files, &file, sizeof file);
+
+        return ((const struct gpx_file *) cache->gpx_files.data) + n_files;
+}
+
+static bool
+get_pos_from_gpx(struct cache *cache,
+                 const char *gpx_filename,
+                 double timestamp,
+                 double *lat_out, double *lon_out)
+{
+        const struct gpx_file *file = get_gpx_file(cache, gpx_filename);
+
+        if (file == NULL)
+                return false;
+
         struct flt_gpx_data data;
 
-        if (!flt_gpx_find_data(points, n_points, timestamp, &data)) {
+        if (!flt_gpx_find_data(file->points,
+                               file->n_points,
+                               timestamp,
+                               &data)) {
                 fprintf(stderr,
                         "couldn’t find data for timestamp %f\n",
                         timestamp);
-                ret = false;
-        } else {
-                *lat_out = data.lat;
-                *lon_out = data.lon;
+                return false;
         }
 
-        flt_free(points);
+        *lat_out = data.lat;
+        *lon_out = data.lon;
 
-        return ret;
+        return true;
 }
 
 static void
@@ -453,65 +596,148 @@ print_url(double lat, double lon)
         printf("https://osm.org/go/%s?layers=C&m\n", code);
 }
 
-int
-main(int argc, char **argv)
+static bool
+run_query(struct cache *cache, const struct query *query)
 {
-        struct config config;
-
-        if (!process_options(argc, argv, &config))
-                return EXIT_FAILURE;
-
-        int video_offset_part;
-        double timestamp;
-        char *gpx_filename = NULL;
-        int ret = EXIT_SUCCESS;
+        const struct video_offset *video_offset =
+                get_video_offset(cache, query->video_num);
 
-        if (!get_video_offset(config.video_num,
-                              &video_offset_part,
-                              &timestamp,
-                              &gpx_filename)) {
-                ret = EXIT_FAILURE;
-                goto out;
-        }
+        if (video_offset == NULL)
+                return false;
 
-        if (video_offset_part > config.video_part) {
+        if (video_offset->part > query->video_part) {
                 fprintf(stderr,
                         "gpx_offset video part (%i) "
                         "is less than chosen video (%i)\n",
-                        video_offset_part,
-                        config.video_part);
-                ret = EXIT_FAILURE;
-                goto out;
+                        video_offset->part,
+                        query->video_part);
+                return false;
         }
 
         double part_lengths;
 
-        if (!get_part_lengths(config.video_num,
-                              video_offset_part,
-                              config.video_part - video_offset_part,
-                              &part_lengths)) {
-                ret = EXIT_FAILURE;
-                goto out;
-        }
+        if (!get_part_lengths(cache,
+                              query->video_num,
+                              video_offset->part,
+                              query->video_part - video_offset->part,
+                              &part_lengths))
+                return false;
 
-        timestamp += part_lengths;
+        double timestamp = video_offset->offset + part_lengths;
 
         double lat, lon;
 
-        if (!get_pos_from_gpx(gpx_filename,
-                              timestamp + config.timestamp,
-                              &lat, &lon)) {
-                ret = EXIT_FAILURE;
-                goto out;
-        }
+        if (!get_pos_from_gpx(cache,
+                              video_offset->gpx_filename,
+                              timestamp + query->timestamp,
+                              &lat, &lon))
+                return false;
 
         printf("%f,%f\n",
                lat, lon);
 
         print_url(lat, lon);
 
-out:
-        flt_free(gpx_filename);
+        return true;
+}
+
+static bool
+parse_query_line(char *line, struct query *query)
+{
+        char *saveptr;
+        const char *filename = strtok_r(line, " \t\n\r", &saveptr);
+        const char *timestamp = strtok_r(NULL, " \t\n\r", &saveptr);
+
+        if (timestamp == NULL || strtok_r(NULL, " \t\n\r", &saveptr)) {
+                fprintf(stderr, "expected a video file and a timestamp\n");
+                return false;
+        }
+
+        return (parse_video_filename(query, filename) &&
+                parse_timestamp(timestamp, &query->timestamp));
+}
+
+/* Reads a video and a timestamp from each line of stdin. The scripts,
+ * GPX files and video lengths are only loaded once for all of the
+ * queries. The output is flushed after each answer so that the tool
+ * can be kept running as a coprocess. Blank lines are ignored. Every
+ * other line gets an answer on stdout: either the coordinates and the
+ * URL on two lines, or a single line starting with “error:”. The
+ * details of the error are written to stderr.
+ */
+static bool
+process_stdin(struct cache *cache)
+{
+        bool ret = true;
+        char line[512];
+
+        while (fgets(line, sizeof line, stdin)) {
+                struct query query;
+
+                if (line[strspn(line, " \t\n\r")] == '\0')
+                        continue;
+
+                if (!parse_query_line(line, &query)) {
+                        printf("error: invalid query\n");
+                        ret = false;
+                } else if (!run_query(cache, &query)) {
+                        printf("error: no position found\n");
+                        ret = false;
+                }
+
+                fflush(stdout);
+        }
+
+        return ret;
+}
+
+static void
+destroy_cache(struct cache *cache)
+{
+        struct video_offset *offsets =
+                (struct video_offset *) cache->video_offsets.data;
+        size_t n_offsets = cache->video_offsets.length / sizeof *offsets;
+
+        for (size_t i = 0; i < n_offsets; i++)
+                flt_free(offsets[i].gpx_filename);
+
+        struct gpx_file *files = (struct gpx_file *) cache->gpx_files.data;
+        size_t n_files = cache->gpx_files.length / sizeof *files;
+
+        for (size_t i = 0; i < n_files; i++) {
+                flt_free(files[i].filename);
+                flt_gpx_free_points(files[i].points);
+        }
+
+        flt_buffer_destroy(&cache->video_offsets);
+        flt_buffer_destroy(&cache->gpx_files);
+        flt_buffer_destroy(&cache->part_lengths);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct config config;
+
+        if (!process_options(argc, argv, &config))
+                return EXIT_FAILURE;
+
+        struct cache cache = {
+                .scripts_loaded = false,
+                .video_offsets = FLT_BUFFER_STATIC_INIT,
+                .gpx_files = FLT_BUFFER_STATIC_INIT,
+                .part_lengths = FLT_BUFFER_STATIC_INIT,
+        };
+        int ret = EXIT_SUCCESS;
+
+        if (config.query.video_num < 0) {
+                if (!process_stdin(&cache))
+                        ret = EXIT_FAILURE;
+        } else if (!run_query(&cache, &config.query)) {
+                ret = EXIT_FAILURE;
+        }
+
+        destroy_cache(&cache);
 
         return ret;
 }